@@ -1,9 +1,22 @@
 #!/bin/sh
 
-CXX="g++ -std=c++17"
+CXX="g++ -std=c++17 -pthread"
 
 OUTDIR=bin
 SRCDIR=src
 
+CORE_SOURCES=`ls ${SRCDIR}/*/*.cpp | grep -v "^${SRCDIR}/bench/" | grep -v "/main.cpp$"`
+
 mkdir -p ${OUTDIR}
-${CXX} -o ${OUTDIR}/fabr -I${SRCDIR} ${SRCDIR}/*/*.cpp
+${CXX} -o ${OUTDIR}/fabr -I${SRCDIR} ${CORE_SOURCES} ${SRCDIR}/driver/main.cpp
+${CXX} -O2 -o ${OUTDIR}/digest-bench -I${SRCDIR} ${CORE_SOURCES} ${SRCDIR}/bench/DigestBench.cpp
+${CXX} -O2 -o ${OUTDIR}/file-bench -I${SRCDIR} ${CORE_SOURCES} ${SRCDIR}/bench/FileBench.cpp
+${CXX} -O2 -o ${OUTDIR}/core-bench -I${SRCDIR} ${CORE_SOURCES} ${SRCDIR}/bench/CoreBench.cpp
+${CXX} -O2 -o ${OUTDIR}/gen-tree -I${SRCDIR} ${SRCDIR}/bench/TreeGenerator.cpp ${SRCDIR}/bench/GenTree.cpp
+${CXX} -O2 -o ${OUTDIR}/scale-bench -I${SRCDIR} ${SRCDIR}/bench/TreeGenerator.cpp ${SRCDIR}/bench/ScaleBench.cpp
+
+# Self-checks: configured target collapsing, the build log, the digest cache,
+# the dependency index, build timeline analysis, module scheduling, and every
+# digest kernel against the BLAKE3 test vectors
+${OUTDIR}/core-bench --verify || exit 1
+${OUTDIR}/digest-bench --verify || exit 1
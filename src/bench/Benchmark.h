@@ -0,0 +1,203 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_BENCH_BENCHMARK_H
+#define FABR_BENCH_BENCHMARK_H
+
+#include <chrono>
+#include <functional>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace fabr {
+
+/**
+ * Minimal timing harness for the micro-benchmarks. Runs fn once to warm up,
+ * then repeatedly until at least minTime has elapsed.
+ * @return the mean wall-clock time per iteration, in nanoseconds.
+ */
+inline double measure( const std::function<void()> &fn,
+        std::chrono::milliseconds minTime = std::chrono::milliseconds(200) ) {
+    typedef std::chrono::steady_clock clock;
+    fn();
+    uint64_t iterations = 0;
+    clock::time_point start = clock::now(), now;
+    do {
+        fn();
+        iterations++;
+        now = clock::now();
+    } while( now - start < minTime );
+    return std::chrono::duration<double, std::nano>(now - start).count() / iterations;
+}
+
+/**
+ * @return throughput in MB/s (10^6 bytes/second) for processing bytes in
+ * the given number of nanoseconds.
+ */
+inline double throughput( uint64_t bytes, double nanos ) {
+    return bytes * 1000.0 / nanos;
+}
+
+/**
+ * A fresh directory under /tmp, removed along with everything in it when
+ * the object goes out of scope.
+ */
+class TempDir {
+private:
+    std::string path;
+
+public:
+    /**
+     * @param name prefix for the directory name, e.g. the program name.
+     */
+    explicit TempDir( const char *name ) {
+        std::string pattern = std::string("/tmp/") + name + "-XXXXXX";
+        if( ::mkdtemp(&pattern[0]) == nullptr ) {
+            perror("mkdtemp");
+        } else {
+            path = pattern;
+        }
+    }
+    ~TempDir() {
+        if( !path.empty() ) {
+            ::nftw(path.c_str(), []( const char *file, const struct stat *, int, struct FTW * ) {
+                return ::remove(file);
+            }, 16, FTW_DEPTH|FTW_PHYS);
+        }
+    }
+    TempDir( const TempDir & ) = delete;
+
+    /**
+     * @return false if the directory couldn't be created (already reported).
+     */
+    bool isValid() const {
+        return !path.empty();
+    }
+
+    const std::string &str() const {
+        return path;
+    }
+};
+
+/**
+ * Collects the outcome of a --verify self-check: check(condition, what)
+ * reports each failure to stderr as "<program>: <subject>: <what>".
+ */
+class Verifier {
+private:
+    std::string prefix;
+    bool ok = true;
+
+public:
+    Verifier( const char *program, const char *subject ) :
+        prefix(std::string(program) + ": " + subject + ": ") { }
+
+    void operator()( bool condition, const char *what ) {
+        if( !condition ) {
+            fprintf(stderr, "%s%s\n", prefix.c_str(), what);
+            ok = false;
+        }
+    }
+
+    /**
+     * @return true if every check so far has passed.
+     */
+    bool passed() const {
+        return ok;
+    }
+};
+
+/**
+ * Collects named results and writes them out as JSON, in the order they
+ * were added, with a fixed set of keys and precision so that runs can be
+ * compared mechanically.
+ */
+class BenchmarkReport {
+private:
+    struct Result {
+        std::string name;
+        uint64_t ops;
+        double nanos;
+        uint64_t bytes;
+    };
+    std::vector<Result> results;
+    std::string filter;
+    int runs;
+
+public:
+    /**
+     * @param filter only run benchmarks whose name contains this string.
+     * @param runs number of times to measure each benchmark; the fastest
+     * run is reported, as it's the one least disturbed by other activity.
+     */
+    explicit BenchmarkReport( const std::string &filter = std::string(), int runs = 3 ) :
+        filter(filter), runs(runs) { }
+
+    /**
+     * Measure fn, which performs ops operations (processing bytes bytes in
+     * total, if that's meaningful), and record the result under name.
+     * Skipped if the name doesn't match the filter.
+     */
+    void run( const std::string &name, uint64_t ops, const std::function<void()> &fn,
+              uint64_t bytes = 0 ) {
+        if( name.find(filter) == std::string::npos ) {
+            return;
+        }
+        double best = 0;
+        for( int i = 0; i < runs; i++ ) {
+            double nanos = measure(fn);
+            if( i == 0 || nanos < best ) {
+                best = nanos;
+            }
+        }
+        results.push_back(Result{name, ops, best, bytes});
+        fprintf(stderr, "%-40s %12.1f ns/op\n", name.c_str(), best / ops);
+    }
+
+    /**
+     * Record a result timed by the caller, e.g. for end-to-end runs that
+     * can't simply be repeated.
+     */
+    void record( const std::string &name, uint64_t ops, double nanos ) {
+        results.push_back(Result{name, ops, nanos, 0});
+        fprintf(stderr, "%-40s %12.1f ns/op\n", name.c_str(), nanos / ops);
+    }
+
+    void write( FILE *out ) const {
+        fprintf(out, "{\n  \"benchmarks\": [");
+        for( size_t i = 0; i < results.size(); i++ ) {
+            const Result &result = results[i];
+            fprintf(out, "%s\n    { \"name\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f",
+                    i == 0 ? "" : ",", result.name.c_str(), (unsigned long long)result.ops,
+                    result.nanos / result.ops);
+            if( result.bytes != 0 ) {
+                fprintf(out, ", \"mb_per_s\": %.1f", throughput(result.bytes, result.nanos));
+            }
+            fprintf(out, " }");
+        }
+        fprintf(out, "\n  ]\n}\n");
+    }
+};
+
+}
+
+#endif /* !FABR_BENCH_BENCHMARK_H */
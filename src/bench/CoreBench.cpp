@@ -0,0 +1,819 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench/Benchmark.h"
+#include "model/BuildRule.h"
+#include "model/ConfiguredTargetSet.h"
+#include "model/DependencyIndex.h"
+#include "model/Symbol.h"
+#include "support/Buffer.h"
+#include "support/BuildLog.h"
+#include "support/BuildTimeline.h"
+#include "support/DependencyQueue.h"
+#include "support/DigestCache.h"
+#include "support/File.h"
+#include "support/IncludeScanner.h"
+#include "support/ModuleDependencies.h"
+#include "support/ModuleScheduler.h"
+#include "support/Path.h"
+#include "support/PathRef.h"
+#include "support/StatCache.h"
+
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace fabr;
+
+/**
+ * Micro-benchmarks for the core support and model data structures:
+ * symbol interning, path handling, the dependency queue, file reads,
+ * property lookups, configured target collapsing and include scanning.
+ * Progress goes to stderr, and the results to stdout as JSON (see
+ * BenchmarkReport), so that runs can be compared by script.
+ *
+ * With --verify, instead checks the behaviour of structures and file formats
+ * that nothing in the build exercises yet, exiting non-zero on any failure.
+ *
+ * Usage: core-bench [name-filter]
+ *        core-bench --verify
+ */
+
+/* Keep the optimizer from discarding benchmark results */
+static volatile uint64_t sink;
+
+static std::vector<std::string> makeNames( const char *prefix, size_t count ) {
+    std::vector<std::string> names;
+    for( size_t i = 0; i < count; i++ ) {
+        names.push_back(prefix + std::to_string(i * 7919));
+    }
+    return names;
+}
+
+static void benchSymbols( BenchmarkReport &report ) {
+    const size_t COUNT = 1000;
+    std::vector<std::string> names = makeNames("symbol_", COUNT);
+    for( auto &name : names ) {
+        SymbolRef::get(name);
+    }
+    report.run("symbol/get-existing", COUNT, [&]() {
+        for( auto &name : names ) {
+            sink += (uintptr_t)SymbolRef::get(name).data();
+        }
+    });
+
+    /* Symbols are never freed, so each new string adds to the pool */
+    uint64_t next = 0;
+    report.run("symbol/get-new", COUNT, [&]() {
+        char buf[32];
+        for( size_t i = 0; i < COUNT; i++ ) {
+            int len = snprintf(buf, sizeof(buf), "new_%llu", (unsigned long long)next++);
+            sink += (uintptr_t)SymbolRef::get(buf, len).data();
+        }
+    });
+}
+
+static void benchPaths( BenchmarkReport &report ) {
+    const size_t COUNT = 1000;
+    std::vector<std::string> clean, messy;
+    for( size_t i = 0; i < COUNT; i++ ) {
+        std::string n = std::to_string(i);
+        clean.push_back("/home/user/src/project/module" + n + "/src/file" + n + ".cpp");
+        messy.push_back("/home//user/./src/project/module" + n + "/../module" + n + "/src/./file" + n + ".cpp");
+    }
+    report.run("path/construct-clean", COUNT, [&]() {
+        for( auto &name : clean ) {
+            sink += Path(name).str().size();
+        }
+    });
+    report.run("path/construct-normalise", COUNT, [&]() {
+        for( auto &name : messy ) {
+            sink += Path(name).str().size();
+        }
+    });
+
+    std::vector<std::string> components = makeNames("dir", 8);
+    report.run("path/push_back", components.size() * COUNT, [&]() {
+        for( size_t i = 0; i < COUNT; i++ ) {
+            Path path("/home/user/src");
+            for( auto &component : components ) {
+                path.push_back(component);
+            }
+            sink += path.str().size();
+        }
+    });
+
+    for( auto &name : clean ) {
+        PathRef ref(name);
+    }
+    report.run("pathref/construct-existing", COUNT, [&]() {
+        for( auto &name : clean ) {
+            sink += PathRef(name).hash();
+        }
+    });
+}
+
+/**
+ * Queue a synthetic graph of count jobs, where job i depends on the jobs
+ * returned by deps(i) (all less than i), then drain it in the order the
+ * queue makes jobs runnable.
+ */
+static void drainGraph( size_t count, const std::function<std::vector<int>(int)> &deps ) {
+    DependencyQueue<int> queue;
+    for( size_t i = 0; i < count; i++ ) {
+        std::vector<int> d = deps(i);
+        queue.queueJob(i, d.begin(), d.end());
+    }
+    while( queue.hasRunnable() ) {
+        int job = queue.dequeueJob();
+        queue.jobCompleted(job);
+        sink += job;
+    }
+    if( !queue.empty() ) {
+        fprintf(stderr, "core-bench: dependency queue stalled with %zu jobs left\n", queue.size());
+        exit(1);
+    }
+}
+
+static void benchDependencyQueue( BenchmarkReport &report ) {
+    const size_t COUNT = 10000;
+    report.run("depqueue/independent", COUNT, [&]() {
+        drainGraph(COUNT, []( int ) { return std::vector<int>(); });
+    });
+    report.run("depqueue/chain", COUNT, [&]() {
+        drainGraph(COUNT, []( int i ) { return i == 0 ? std::vector<int>() : std::vector<int>{i - 1}; });
+    });
+    /* Layers of 100 jobs, each depending on 4 jobs in the previous layer */
+    report.run("depqueue/layered", COUNT, [&]() {
+        drainGraph(COUNT, []( int i ) {
+            std::vector<int> deps;
+            int layer = i / 100;
+            if( layer > 0 ) {
+                for( int k = 0; k < 4; k++ ) {
+                    deps.push_back((layer - 1) * 100 + (i * 31 + k * 17) % 100);
+                }
+            }
+            return deps;
+        });
+    });
+}
+
+static uint64_t scan( const Buffer &buffer ) {
+    uint64_t sum = 0;
+    const char *p = buffer.data();
+    for( size_t i = 0; i < buffer.size(); i += 4096 ) {
+        sum += p[i];
+    }
+    return sum;
+}
+
+static void benchFiles( BenchmarkReport &report ) {
+    TempDir dir("core-bench");
+    if( !dir.isValid() ) {
+        exit(1);
+    }
+    const size_t NEVER = (size_t)-1;
+    File::ReadPolicy readPolicy, mmapPolicy;
+    readPolicy.mmapThreshold = NEVER;
+    mmapPolicy.mmapThreshold = 0;
+    mmapPolicy.populateLimit = 0;
+    mmapPolicy.hugePageThreshold = NEVER;
+    struct { const char *name; const File::ReadPolicy *policy; } policies[] = {
+        { "read", &readPolicy }, { "mmap", &mmapPolicy }
+    };
+
+    for( size_t size : { (size_t)4*1024, (size_t)64*1024, (size_t)1024*1024 } ) {
+        std::string path = dir.str() + "/f" + std::to_string(size);
+        {
+            std::vector<char> data(size, 'x');
+            File file = File::create(path);
+            for( size_t done = 0; done < size; ) {
+                done += file.write(data.data() + done, size - done);
+            }
+        }
+        for( auto &policy : policies ) {
+            File::setReadPolicy(*policy.policy);
+            report.run(std::string("file/getBuffer-") + policy.name + "-" + std::to_string(size / 1024) + "k",
+                    1, [&]() {
+                sink += scan(*File::getBuffer(path));
+            }, size);
+        }
+        File::setReadPolicy(File::ReadPolicy());
+        ::unlink(path.c_str());
+    }
+}
+
+static void benchProperties( BenchmarkReport &report ) {
+    const size_t COUNT = 64;
+    std::vector<std::string> names = makeNames("property.", COUNT);
+    std::vector<SymbolRef> keys, missing;
+    PropertySet properties;
+    for( auto &name : names ) {
+        keys.push_back(SymbolRef::get(name));
+        missing.push_back(SymbolRef::get(name + ".missing"));
+        properties[keys.back()] = SymbolRef::get("value");
+    }
+    report.run("propertyset/find-hit", COUNT, [&]() {
+        for( SymbolRef key : keys ) {
+            sink += properties.find(key) != properties.end();
+        }
+    });
+    report.run("propertyset/find-miss", COUNT, [&]() {
+        for( SymbolRef key : missing ) {
+            sink += properties.find(key) != properties.end();
+        }
+    });
+    report.run("propertyset/find-by-name", COUNT, [&]() {
+        for( auto &name : names ) {
+            sink += properties.find(SymbolRef::get(name)) != properties.end();
+        }
+    });
+}
+
+/**
+ * @return the tag sets for a target requested under every combination of
+ * compilers and optimisation levels.
+ */
+static std::vector<PropertySet> makeConfigurations( size_t compilers, size_t levels ) {
+    SymbolRef cc = SymbolRef::get("cc"), opt = SymbolRef::get("opt");
+    std::vector<PropertySet> configurations;
+    for( size_t c = 0; c < compilers; c++ ) {
+        for( size_t o = 0; o < levels; o++ ) {
+            PropertySet tags;
+            tags[cc] = SymbolRef::get("cc" + std::to_string(c));
+            tags[opt] = SymbolRef::get("O" + std::to_string(o));
+            configurations.push_back(tags);
+        }
+    }
+    return configurations;
+}
+
+static void benchConfigurations( BenchmarkReport &report ) {
+    const size_t COMPILERS = 4, LEVELS = 16;
+    std::vector<PropertySet> configurations = makeConfigurations(COMPILERS, LEVELS);
+    SymbolRef target = SymbolRef::get("//lib:foo");
+    BuildRule rule(SymbolRef::get("cc_library"));
+    rule.addUsedProperty(SymbolRef::get("cc"));
+    ConfiguredTargetSet set;
+    report.run("configured/get-collapsed", configurations.size(), [&]() {
+        for( auto &tags : configurations ) {
+            sink += (uintptr_t)set.get(BuildTarget(target, tags), &rule);
+        }
+    });
+}
+
+/**
+ * Check that configurations a rule can't tell apart share a node, and that
+ * the nodes are split again once the rule reads a property they differ in.
+ */
+static bool verifyConfigurations() {
+    const size_t COMPILERS = 2, LEVELS = 4;
+    std::vector<PropertySet> configurations = makeConfigurations(COMPILERS, LEVELS);
+    SymbolRef target = SymbolRef::get("//lib:foo");
+    BuildRule rule(SymbolRef::get("cc_library"));
+    ConfiguredTargetSet set;
+    Verifier check("core-bench", "configured targets");
+
+    rule.getProperty(configurations[0], SymbolRef::get("cc"));
+    std::vector<ConfiguredTarget *> first;
+    for( auto &tags : configurations ) {
+        first.push_back(set.get(BuildTarget(target, tags), &rule));
+    }
+    check(set.size() == COMPILERS, "not collapsed to one node per compiler");
+    check(set.getRequestCount() == configurations.size(), "requests lost while collapsing");
+    check(first[0] == first[LEVELS - 1] && first[0] != first[LEVELS], "wrong configurations collapsed");
+
+    /* Reading opt makes every configuration distinct */
+    rule.getProperty(configurations[0], SymbolRef::get("opt"));
+    ConfiguredTarget *node = set.get(BuildTarget(target, configurations[0]), &rule);
+    check(set.size() == configurations.size(), "not split after reading a new property");
+    check(set.getRequestCount() == configurations.size(), "requests lost while splitting");
+    check(node == first[0], "split didn't keep the analysed node for its own configuration");
+    check(node->getAliases().size() == 1, "split left other configurations on the analysed node");
+    for( size_t i = 1; i < configurations.size(); i++ ) {
+        ConfiguredTarget *split = set.get(BuildTarget(target, configurations[i]), &rule);
+        check(split->getTarget().getTags() == configurations[i] && split->getAliases().size() == 1,
+              "split node doesn't match its configuration");
+    }
+    return check.passed();
+}
+
+/**
+ * Check the build log's recovery from a torn record at the end, its
+ * compaction, lookups by label, and two writers (as when a client builds
+ * in-process while the server is busy) appending and compacting the same
+ * log.
+ */
+static bool verifyBuildLog() {
+    TempDir dir("core-bench");
+    if( !dir.isValid() ) {
+        return false;
+    }
+    Path file = Path(dir.str()) + "log";
+    Verifier check("core-bench", "build log");
+    auto entry = []( int action, int64_t start ) {
+        BuildLog::Entry entry;
+        std::string name = std::to_string(action);
+        entry.action = Digest::of(name.data(), name.size());
+        entry.start = start;
+        entry.end = start + 1;
+        entry.outputs.push_back(Digest::of(&start, sizeof(start)));
+        return entry;
+    };
+    auto has = [&]( BuildLog &log, int action, int64_t start ) {
+        BuildLog::Entry expected = entry(action, start), found;
+        return log.lookup(expected.action, found) && found.start == start &&
+               found.outputs == expected.outputs;
+    };
+    auto hasAll = [&]( BuildLog &log, int first, int last, int64_t start ) {
+        bool all = true;
+        for( int i = first; i < last; i++ ) {
+            all = all && has(log, i, start);
+        }
+        return all;
+    };
+
+    {
+        BuildLog log(file);
+        for( int i = 0; i < 10; i++ ) {
+            log.append(entry(i, 1));
+        }
+        log.append(entry(99, 1));
+    }
+    /* Cut the last record short, as if the writer crashed */
+    struct stat st;
+    check(::stat(file.str().c_str(), &st) == 0 && ::truncate(file.str().c_str(), st.st_size - 8) == 0,
+          "couldn't tear the last record");
+    {
+        BuildLog log(file);
+        check(hasAll(log, 0, 10, 1), "records before a torn one lost");
+        check(!has(log, 99, 1), "torn record read");
+        log.append(entry(10, 1));
+    }
+    {
+        BuildLog log(file);
+        check(hasAll(log, 0, 11, 1), "record appended after a torn one lost");
+        for( int i = 0; i < 5; i++ ) {
+            log.append(entry(i, 2));
+        }
+        log.compact();
+        check(hasAll(log, 0, 5, 2) && hasAll(log, 5, 11, 1), "wrong records after compaction");
+    }
+    {
+        BuildLog log(file);
+        check(hasAll(log, 0, 5, 2) && hasAll(log, 5, 11, 1), "wrong records after reloading a compacted log");
+    }
+
+    {
+        /* Each sees the other's records once it has written, and neither's
+         * compaction loses the other's.
+         */
+        BuildLog first(file), second(file);
+        first.append(entry(100, 3));
+        first.flush();
+        second.append(entry(200, 3));
+        second.flush();
+        check(has(second, 100, 3), "other writer's record not picked up");
+        first.append(entry(101, 3));
+        first.compact();
+        check(has(first, 200, 3), "other writer's record lost by compaction");
+        second.append(entry(201, 3));
+        second.flush();
+        check(has(second, 101, 3), "compacted log not picked up");
+    }
+    {
+        BuildLog log(file);
+        check(hasAll(log, 100, 102, 3) && hasAll(log, 200, 202, 3) && hasAll(log, 0, 5, 2),
+              "records lost between two writers");
+    }
+
+    {
+        /* A target's actions change digest as its inputs do; the label
+         * finds the latest, before and after compaction.
+         */
+        BuildLog log(file);
+        BuildLog::Entry old = entry(300, 4), current = entry(301, 5), other = entry(302, 6);
+        old.label = current.label = "//lib:foo";
+        other.label = "//lib:bar";
+        log.append(old);
+        log.append(other);
+        log.compact();
+        log.append(current);
+        BuildLog::Entry found;
+        check(log.lookupLabel("//lib:foo", found) && found.action == current.action,
+              "label doesn't find its latest action");
+        log.compact();
+        check(log.lookupLabel("//lib:foo", found) && found.action == current.action &&
+              log.lookupLabel("//lib:bar", found) && found.action == other.action,
+              "labels lost by compaction");
+        /* The old action runs again, now for another target */
+        old.label = "//lib:baz";
+        log.append(old);
+        log.compact();
+        check(!log.lookupLabel("//lib:nothing", found), "found a label never recorded");
+    }
+    {
+        BuildLog log(file);
+        BuildLog::Entry found;
+        check(log.lookupLabel("//lib:foo", found) && found.action == entry(301, 5).action &&
+              log.lookupLabel("//lib:baz", found) && found.action == entry(300, 4).action &&
+              log.lookupLabel("//lib:bar", found) && found.action == entry(302, 6).action,
+              "wrong labels after reloading a compacted log");
+    }
+
+    return check.passed();
+}
+
+/**
+ * Check that digest cache entries survive a save and reload (and are still
+ * found by the same cache after its save), that racily clean files are
+ * never trusted or kept, that entries not used in a session are pruned by
+ * its save, and that a damaged cache file is ignored and replaced.
+ */
+static bool verifyDigestCache() {
+    TempDir dir("core-bench");
+    if( !dir.isValid() ) {
+        return false;
+    }
+    Path file = Path(dir.str()) + "digests";
+    Verifier check("core-bench", "digest cache");
+    const int64_t START = (int64_t)1600000000 * 1000000000;
+    auto info = []( uint64_t ino, int64_t age ) {
+        StatInfo info;
+        info.mode = S_IFREG | 0644;
+        info.dev = 1;
+        info.ino = ino;
+        info.size = ino * 100;
+        info.mtime = info.ctime = START - age;
+        return info;
+    };
+    auto digestOf = []( uint64_t ino ) {
+        return Digest::of(&ino, sizeof(ino));
+    };
+    auto has = []( DigestCache &cache, const StatInfo &info, const Digest &expected ) {
+        Digest digest;
+        return cache.lookup(info, digest) && digest == expected;
+    };
+    const int64_t OLD = 3600 * (int64_t)1000000000;
+    const int64_t RECENT = DigestCache::RACY_WINDOW / 2;
+
+    StatInfo a = info(1, OLD), b = info(2, OLD), racy = info(3, RECENT), changed = info(4, OLD);
+    changed.ctime = START - RECENT;
+    {
+        DigestCache cache(file, START);
+        check(cache.isRacy(racy) && cache.isRacy(changed) && !cache.isRacy(a), "wrong racy window");
+        cache.store(a, digestOf(1));
+        cache.store(b, digestOf(2));
+        cache.store(racy, digestOf(3));
+        cache.store(changed, digestOf(4));
+        check(has(cache, a, digestOf(1)), "stored entry not found");
+        check(!has(cache, racy, digestOf(3)) && !has(cache, changed, digestOf(4)), "racy entry trusted");
+        cache.save();
+        check(has(cache, a, digestOf(1)) && has(cache, b, digestOf(2)), "entries lost switching to the saved file");
+    }
+    {
+        DigestCache cache(file, START + OLD);
+        check(has(cache, a, digestOf(1)), "saved entry not found");
+        check(!has(cache, info(3, OLD + RECENT), digestOf(3)), "racy entry persisted");
+        StatInfo modified = a;
+        modified.size++;
+        check(!has(cache, modified, digestOf(1)), "entry found for a modified file");
+        /* b isn't used this time, so should go */
+        cache.save();
+    }
+    {
+        DigestCache cache(file, START + OLD);
+        check(!has(cache, b, digestOf(2)), "unused entry not pruned");
+        check(has(cache, a, digestOf(1)), "used entry pruned");
+    }
+    {
+        /* A session that used nothing keeps everything */
+        DigestCache cache(file, START + OLD);
+        cache.save();
+    }
+    {
+        DigestCache cache(file, START + OLD);
+        check(has(cache, a, digestOf(1)), "entry dropped by a session that used nothing");
+    }
+
+    struct stat st;
+    check(::stat(file.str().c_str(), &st) == 0 && ::truncate(file.str().c_str(), st.st_size - 1) == 0,
+          "couldn't damage the cache file");
+    {
+        DigestCache cache(file, START + OLD);
+        check(!has(cache, a, digestOf(1)), "damaged cache file used");
+        cache.store(b, digestOf(2));
+        cache.save();
+    }
+    {
+        DigestCache cache(file, START + OLD);
+        check(has(cache, b, digestOf(2)), "damaged cache file not replaced");
+    }
+
+    return check.passed();
+}
+
+/**
+ * Check that the dependency index reads back what it wrote, and that any
+ * truncation of the serialization is rejected, leaving the index empty.
+ */
+static bool verifyDependencyIndex() {
+    Verifier check("core-bench", "dependency index");
+    auto sym = []( const char *name ) {
+        return SymbolRef::get(name);
+    };
+    auto affected = []( const DependencyIndex &index, SymbolRef changed ) {
+        std::vector<std::string> names;
+        for( SymbolRef target : index.getAffected({changed}) ) {
+            names.push_back(target.data());
+        }
+        std::sort(names.begin(), names.end());
+        return names;
+    };
+    using Names = std::vector<std::string>;
+
+    DependencyIndex index;
+    index.define(sym("//a:lib"), sym("/src/a/BUILD"), { sym("/src/a/a.cc"), sym("//b:lib") });
+    index.define(sym("//b:lib"), sym("/src/b/BUILD"), { sym("/src/b/b.h") });
+    index.define(sym("//a:bin"), sym("/src/a/BUILD"), { sym("//a:lib") });
+    index.define(sym("//b:gen"), SymbolRef(), {});
+    std::string data;
+    index.write(data);
+
+    DependencyIndex copy;
+    const char *p = data.data();
+    check(copy.read(p, data.data() + data.size()) && p == data.data() + data.size(), "couldn't read back");
+    check(copy.size() == index.size(), "wrong number of targets read back");
+    check(affected(copy, sym("/src/b/b.h")) == Names{"//a:bin", "//a:lib", "//b:lib"} &&
+          affected(copy, sym("/src/a/a.cc")) == Names{"//a:bin", "//a:lib"} &&
+          affected(copy, sym("//b:gen")) == Names{"//b:gen"}, "wrong edges read back");
+    copy.removeScript(sym("/src/a/BUILD"));
+    check(affected(copy, sym("/src/b/b.h")) == Names{"//b:lib"} && copy.size() == 2,
+          "script ownership not read back");
+
+    for( size_t length = 0; length < data.size(); length++ ) {
+        DependencyIndex truncated;
+        p = data.data();
+        if( truncated.read(p, data.data() + length) || truncated.size() != 0 ) {
+            check(false, "truncated serialization accepted");
+            break;
+        }
+    }
+    return check.passed();
+}
+
+/**
+ * Check BuildTimeline's analysis of a small hand-built build: a then c
+ * (which waited for a) alongside b then d, plus e, which never ran.
+ */
+static bool verifyBuildTimeline() {
+    Verifier check("core-bench", "build timeline");
+    const int64_t TENTH = 100000000;
+    BuildTimeline timeline;
+    auto action = [&]( const char *name, int64_t start, int64_t end ) {
+        BuildTimeline::ActionId id = timeline.addAction(name);
+        if( start != -1 ) {
+            timeline.started(id, start * TENTH);
+            timeline.finished(id, end * TENTH);
+        }
+        return id;
+    };
+    BuildTimeline::ActionId a = action("a", 0, 10), b = action("b", 0, 4);
+    BuildTimeline::ActionId c = action("c", 12, 20), d = action("d", 4, 6), e = action("e", -1, -1);
+    timeline.addDependency(c, a);
+    timeline.addDependency(d, b);
+    timeline.addDependency(e, c);
+
+    BuildTimeline::Report report = timeline.analyse(2);
+    check(report.wallTime == 20 * TENTH && report.actionTime == 24 * TENTH && report.longestPath == 18 * TENTH,
+          "wrong wall time, action time or longest path");
+    check(report.parallelism > 1.199 && report.parallelism < 1.201, "wrong parallelism");
+    check(report.criticalPath.size() == 2 &&
+          report.criticalPath[0].id == a && report.criticalPath[0].wait == 0 &&
+          report.criticalPath[1].id == c && report.criticalPath[1].wait == 2 * TENTH, "wrong critical path");
+    /* b and d have slack, so only a and c delay completion */
+    check(report.delays.size() == 2 && report.delays[0].id == a && report.delays[0].delay == 10 * TENTH &&
+          report.delays[1].id == c && report.delays[1].delay == 8 * TENTH, "wrong delays");
+
+    std::ostringstream out;
+    timeline.print(out, report, 1);
+    std::string text = out.str();
+    for( const char *line : { "Wall time 2.000s, 2.400s in actions, longest dependency chain 1.800s\n",
+                              "Average parallelism 1.20 of 2 jobs\n", "Critical path (2 actions):\n",
+                              "  0.800s  (waited 0.200s)  c\n", "  1.000s  of 1.000s  a\n" } ) {
+        check(text.find(line) != std::string::npos, "report missing from the printed summary");
+    }
+    check(text.find("of 0.800s  c") == std::string::npos, "printed summary not limited");
+    return check.passed();
+}
+
+/**
+ * Check that P1689 rules survive a write and read, and that malformed
+ * documents are rejected; that ModuleScheduler builds a module's BMI
+ * before its importers but lets them compile alongside the provider's
+ * code generation; that an import cycle stalls it; and that it reports
+ * modules provided twice or not at all.
+ */
+static bool verifyModules() {
+    Verifier check("core-bench", "module scheduling");
+    typedef ModuleScheduler::Task Task;
+    auto rule = []( const char *source, std::vector<const char *> provides,
+                    std::vector<const char *> imports ) {
+        ModuleDependencies rule;
+        rule.primaryOutput = source;
+        for( const char *name : provides ) {
+            rule.provided.emplace_back();
+            rule.provided.back().logicalName = name;
+        }
+        for( const char *name : imports ) {
+            rule.required.emplace_back();
+            rule.required.back().logicalName = name;
+        }
+        return rule;
+    };
+    auto same = []( const ModuleDependencies &a, const ModuleDependencies &b ) {
+        if( a.primaryOutput != b.primaryOutput || a.provided.size() != b.provided.size() ||
+                a.required.size() != b.required.size() ) {
+            return false;
+        }
+        for( size_t i = 0; i < a.provided.size(); i++ ) {
+            if( a.provided[i].logicalName != b.provided[i].logicalName ||
+                    a.provided[i].sourcePath != b.provided[i].sourcePath ||
+                    a.provided[i].isInterface != b.provided[i].isInterface ) {
+                return false;
+            }
+        }
+        for( size_t i = 0; i < a.required.size(); i++ ) {
+            if( a.required[i].logicalName != b.required[i].logicalName ||
+                    a.required[i].sourcePath != b.required[i].sourcePath ||
+                    a.required[i].lookupMethod != b.required[i].lookupMethod ) {
+                return false;
+            }
+        }
+        return true;
+    };
+    /* Run everything runnable at once, each task taking one round, and
+     * return the round each task ran in.
+     */
+    auto run = []( ModuleScheduler &scheduler, const std::vector<ModuleDependencies> &rules ) {
+        for( const ModuleDependencies &rule : rules ) {
+            scheduler.addUnit(rule.primaryOutput);
+        }
+        std::map<Task, int> rounds;
+        for( int round = 0; scheduler.hasRunnable(); round++ ) {
+            std::vector<Task> running;
+            while( scheduler.hasRunnable() ) {
+                running.push_back(scheduler.dequeue());
+            }
+            for( const Task &task : running ) {
+                rounds[task] = round;
+                if( task.kind == Task::SCAN ) {
+                    scheduler.scanned(task.unit, rules[task.unit]);
+                } else {
+                    scheduler.completed(task);
+                }
+            }
+        }
+        return rounds;
+    };
+    auto hasError = []( const ModuleScheduler &scheduler, const char *message ) {
+        for( const std::string &error : scheduler.getErrors() ) {
+            if( error.find(message) != std::string::npos ) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    /* The provider comes last, so its importers are held back until it's
+     * been scanned.
+     */
+    std::vector<ModuleDependencies> rules = {
+        rule("app.cpp", {}, {"core"}), rule("util.cpp", {}, {"core"}), rule("core.cppm", {"core"}, {}) };
+    rules[2].provided.emplace_back();
+    rules[2].provided.back().logicalName = "core:detail";
+    rules[2].provided.back().sourcePath = "src/core \"d\u00e9tail\".cpp";
+    rules[2].provided.back().isInterface = false;
+    rules[0].required.emplace_back();
+    rules[0].required.back().logicalName = "<vector>";
+    rules[0].required.back().sourcePath = "/usr/include/c++/vector";
+    rules[0].required.back().lookupMethod = ModuleDependencies::INCLUDE_ANGLE;
+
+    std::ostringstream out;
+    ModuleDependencies::writeP1689(out, rules);
+    std::vector<ModuleDependencies> parsed;
+    std::string error;
+    check(ModuleDependencies::readP1689(out.str(), parsed, error) && parsed.size() == rules.size() &&
+          same(parsed[0], rules[0]) && same(parsed[1], rules[1]) && same(parsed[2], rules[2]),
+          "P1689 rules changed by writing and reading them");
+    for( const char *json : {
+            "{ \"version\": 1, \"rules\": [ { \"provides\": { \"logical-name\": \"core\" } } ] }",
+            "{ \"version\": 1, \"rules\": [ { \"requires\": [ { \"logical-name\": 1 } ] } ] }",
+            "{ \"version\": 1, \"rules\": [ { \"primary-output\": \"\\ud800.o\" } ] }" } ) {
+        std::vector<ModuleDependencies> rejected;
+        check(!ModuleDependencies::readP1689(json, rejected, error), "malformed P1689 document accepted");
+    }
+
+    {
+        ModuleScheduler scheduler;
+        std::map<Task, int> rounds = run(scheduler, parsed);
+        check(scheduler.isFinished() && scheduler.getErrors().empty(), "modules not all built");
+        check(rounds.count(Task{ Task::PRECOMPILE, 2 }) && rounds.count(Task{ Task::COMPILE, 0 }) &&
+              rounds[Task{ Task::PRECOMPILE, 2 }] < rounds[Task{ Task::COMPILE, 0 }] &&
+              rounds[Task{ Task::PRECOMPILE, 2 }] < rounds[Task{ Task::COMPILE, 1 }],
+              "importer compiled before the module's BMI was built");
+        check(rounds[Task{ Task::COMPILE, 0 }] == rounds[Task{ Task::COMPILE, 2 }] &&
+              rounds[Task{ Task::COMPILE, 1 }] == rounds[Task{ Task::COMPILE, 2 }],
+              "importers didn't compile alongside the module's code generation");
+    }
+    {
+        ModuleScheduler scheduler;
+        run(scheduler, { rule("a.cppm", {"a"}, {"b"}), rule("b.cppm", {"b"}, {"a"}) });
+        check(scheduler.isStalled(), "import cycle didn't stall the scheduler");
+    }
+    {
+        ModuleScheduler scheduler;
+        run(scheduler, { rule("x.cppm", {"dup"}, {"missing"}), rule("y.cppm", {"dup"}, {}) });
+        check(hasError(scheduler, "x.cppm: no unit provides module 'missing'"), "missing module not reported");
+        check(hasError(scheduler, "y.cppm: module 'dup' is also provided by x.cppm"),
+              "module provided twice not reported");
+    }
+    return check.passed();
+}
+
+/**
+ * A plausible C++ source: a block of includes, then code with comments and
+ * string literals.
+ */
+static std::string makeSource( size_t size ) {
+    std::string source = "/* Copyright header */\n#ifndef SOURCE_H\n#define SOURCE_H\n";
+    for( int i = 0; i < 30; i++ ) {
+        source += i % 3 == 0 ? "#include <system" + std::to_string(i) + ".h>\n" :
+                  "#include \"project/header" + std::to_string(i) + ".h\"\n";
+    }
+    while( source.size() < size ) {
+        source += "/**\n * Does something useful.\n */\n"
+                  "int function( int argument, const char *name ) {\n"
+                  "    // Explain the tricky bit\n"
+                  "    if( argument > 0 ) {\n"
+                  "        printf(\"%s: value /* not a comment */ %d\\n\", name, argument);\n"
+                  "    }\n"
+                  "    return argument * 2;\n"
+                  "}\n\n";
+    }
+    return source + "#endif\n";
+}
+
+static void benchIncludeScanner( BenchmarkReport &report ) {
+    for( size_t size : { (size_t)4*1024, (size_t)64*1024, (size_t)1024*1024 } ) {
+        std::string source = makeSource(size);
+        report.run("includescan/scan-" + std::to_string(size / 1024) + "k", 1, [&]() {
+            sink += IncludeScanner::scan(source.data(), source.size()).size();
+        }, source.size());
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    if( argc > 1 && strcmp(argv[1], "--verify") == 0 ) {
+        bool ok = verifyConfigurations();
+        ok = verifyBuildLog() && ok;
+        ok = verifyDigestCache() && ok;
+        ok = verifyDependencyIndex() && ok;
+        ok = verifyBuildTimeline() && ok;
+        ok = verifyModules() && ok;
+        return ok ? 0 : 1;
+    }
+
+    BenchmarkReport report(argc > 1 ? argv[1] : "");
+    benchSymbols(report);
+    benchPaths(report);
+    benchDependencyQueue(report);
+    benchFiles(report);
+    benchProperties(report);
+    benchConfigurations(report);
+    benchIncludeScanner(report);
+    report.write(stdout);
+    return 0;
+}
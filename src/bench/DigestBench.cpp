@@ -0,0 +1,306 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench/Benchmark.h"
+#include "support/Buffer.h"
+#include "support/Digest.h"
+#include "support/DigestEngine.h"
+#include "support/DigestKernel.h"
+#include "support/File.h"
+#include "support/ThreadPool.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace fabr;
+
+/**
+ * Digest throughput benchmark. For each kernel supported by this CPU,
+ * reports single-threaded and tree-parallel throughput over a range of
+ * input sizes, for both heap memory and an mmapped file (as returned by
+ * File::getBuffer).
+ *
+ * With --verify, instead checks every kernel against the BLAKE3 test
+ * vectors, exiting non-zero on any mismatch.
+ *
+ * With --engine, instead compares the DigestEngine backends (io_uring,
+ * where available, and the pread fallback) over the files named in the
+ * given list, one per line ("-" for stdin). The files are evicted from the
+ * page cache before each run, so this measures reading from the device.
+ *
+ * Usage: digest-bench [max-size-in-MiB]
+ *        digest-bench --verify
+ *        digest-bench --engine <file-list>
+ */
+
+static const size_t SIZES[] = { 1024, 16*1024, 256*1024, 4*1024*1024, 64*1024*1024, 1024*1024*1024 };
+
+static void report( const char *kernel, const char *mode, const char *source, size_t size, double nanos ) {
+    printf("%-9s %-8s %-5s %11zu %10.1f MB/s\n", kernel, mode, source, size, throughput(size, nanos));
+}
+
+/**
+ * Write size bytes of data to a temporary file and map it back in through
+ * File::getBuffer.
+ */
+static std::unique_ptr<Buffer> getMappedBuffer( const uint8_t *data, size_t size ) {
+    char name[] = "/tmp/digest-bench-XXXXXX";
+    File file(mkstemp(name));
+    if( !file ) {
+        throw std::system_error(errno, std::system_category());
+    }
+    unlink(name);
+    for( size_t done = 0; done < size; ) {
+        done += file.write((char *)data + done, size - done);
+    }
+    return file.getBuffer();
+}
+
+/**
+ * The hashes from the official BLAKE3 test vectors (test_vectors.json),
+ * where the input is the given number of bytes counting up from 0 mod 251.
+ */
+static const struct {
+    size_t length;
+    const char *hash;
+} TEST_VECTORS[] = {
+    {      0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262" },
+    {      1, "2d3adedff11b61f14c886e35afa036736dcd87a74d27b5c1510225d0f592e213" },
+    {   1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11" },
+    {   1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7" },
+    {   1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444" },
+    {   2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a" },
+    {   2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030" },
+    {   3072, "b98cb0ff3623be03326b373de6b9095218513e64f1ee2edd2525c7ad1e5cffd2" },
+    {   3073, "7124b49501012f81cc7f11ca069ec9226cecb8a2c850cfe644e327d22d3e1cd3" },
+    {   4096, "015094013f57a5277b59d8475c0501042c0b642e531b0a1c8f58d2163229e969" },
+    {   4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995" },
+    {   5120, "9cadc15fed8b5d854562b26a9536d9707cadeda9b143978f319ab34230535833" },
+    {   5121, "628bd2cb2004694adaab7bbd778a25df25c47b9d4155a55f8fbd79f2fe154cff" },
+    {   6144, "3e2e5b74e048f3add6d21faab3f83aa44d3b2278afb83b80b3c35164ebeca205" },
+    {   6145, "f1323a8631446cc50536a9f705ee5cb619424d46887f3c376c695b70e0f0507f" },
+    {   7168, "61da957ec2499a95d6b8023e2b0e604ec7f6b50e80a9678b89d2628e99ada77a" },
+    {   7169, "a003fc7a51754a9b3c7fae0367ab3d782dccf28855a03d435f8cfe74605e7817" },
+    {   8192, "aae792484c8efe4f19e2ca7d371d8c467ffb10748d8a5a1ae579948f718a2a63" },
+    {   8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b" },
+    {  16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4" },
+    {  31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47" },
+    { 102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085" },
+    /* Not an official vector, but large enough to be hashed in parallel */
+    { 4195329, "5e854331c8e64ba0cd85e209bffff9c882575fd2e24ada0ca34fa7afbc1a4eb6" },
+};
+
+/**
+ * Check every supported kernel against the test vectors, hashing each input
+ * in one call, in parallel, and in small pieces that straddle the block and
+ * chunk boundaries.
+ * @return true if all of them match.
+ */
+static bool verifyKernels() {
+    size_t largest = 0;
+    for( auto &vector : TEST_VECTORS ) {
+        largest = std::max(largest, vector.length);
+    }
+    std::vector<uint8_t> input(largest);
+    for( size_t i = 0; i < largest; i++ ) {
+        input[i] = (uint8_t)(i % 251);
+    }
+
+    ThreadPool &pool = ThreadPool::getDefault();
+    const DigestKernel *kernels[8];
+    size_t numKernels = getDigestKernels(kernels, 8);
+    bool ok = true;
+    for( size_t k = 0; k < numKernels; k++ ) {
+        setDigestKernel(kernels[k]->name);
+        for( auto &vector : TEST_VECTORS ) {
+            Hasher whole, parallel, pieces;
+            whole.update(input.data(), vector.length);
+            parallel.update(input.data(), vector.length, pool);
+            for( size_t done = 0; done < vector.length; ) {
+                size_t length = std::min(vector.length - done, (size_t)97);
+                pieces.update(input.data() + done, length);
+                done += length;
+            }
+            const char *modes[] = { "whole", "parallel", "pieces" };
+            std::string results[] = { whole.finish().str(), parallel.finish().str(), pieces.finish().str() };
+            for( int m = 0; m < 3; m++ ) {
+                if( results[m] != vector.hash ) {
+                    fprintf(stderr, "digest-bench: %s kernel (%s) gave %s for %zu bytes, expected %s\n",
+                            kernels[k]->name, modes[m], results[m].c_str(), vector.length, vector.hash);
+                    ok = false;
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+/**
+ * Drop the given files' pages from the page cache, so they have to be read
+ * from the device again. Only clean pages can be dropped, so the files
+ * shouldn't have been written recently.
+ */
+static void evict( const std::vector<Path> &paths ) {
+    for( const Path &path : paths ) {
+        int fd = ::open(path.str().c_str(), O_RDONLY|O_CLOEXEC);
+        if( fd != -1 ) {
+#ifdef POSIX_FADV_DONTNEED
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+            ::close(fd);
+        }
+    }
+}
+
+static int benchEngine( const char *listFile ) {
+    std::ifstream listStream;
+    if( strcmp(listFile, "-") != 0 ) {
+        listStream.open(listFile);
+        if( !listStream ) {
+            perror(listFile);
+            return 1;
+        }
+    }
+    std::istream &in = strcmp(listFile, "-") == 0 ? std::cin : listStream;
+    std::vector<Path> paths;
+    uint64_t bytes = 0;
+    std::string line;
+    while( std::getline(in, line) ) {
+        struct stat st;
+        if( !line.empty() && ::stat(line.c_str(), &st) == 0 && S_ISREG(st.st_mode) ) {
+            paths.push_back(Path(line));
+            bytes += st.st_size;
+        }
+    }
+    if( paths.empty() ) {
+        fprintf(stderr, "digest-bench: no readable files in %s\n", listFile);
+        return 1;
+    }
+    printf("# %zu files, %llu bytes\n", paths.size(), (unsigned long long)bytes);
+
+    const int RUNS = 3;
+    std::vector<FileDigest> expected;
+    for( bool allowAsync : { true, false } ) {
+        DigestEngine engine(DigestEngine::DEFAULT_BUFFER_SIZE, DigestEngine::DEFAULT_QUEUE_DEPTH, allowAsync);
+        if( allowAsync && !engine.isAsync() ) {
+            printf("# io_uring not available\n");
+            continue;
+        }
+        const char *name = engine.isAsync() ? "io_uring" : "pread";
+        for( bool cold : { true, false } ) {
+            double best = 0;
+            for( int i = 0; i < RUNS; i++ ) {
+                if( cold ) {
+                    evict(paths);
+                }
+                typedef std::chrono::steady_clock clock;
+                clock::time_point start = clock::now();
+                std::vector<FileDigest> results = engine.digest(paths);
+                double nanos = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+                if( i == 0 || nanos < best ) {
+                    best = nanos;
+                }
+                /* Both backends must agree, or the comparison is meaningless */
+                if( expected.empty() ) {
+                    expected = std::move(results);
+                } else {
+                    for( size_t f = 0; f < paths.size(); f++ ) {
+                        if( results[f].error != expected[f].error || results[f].digest != expected[f].digest ) {
+                            fprintf(stderr, "digest-bench: %s gave a different result for %s\n", name,
+                                    paths[f].str().c_str());
+                            return 1;
+                        }
+                    }
+                }
+            }
+            printf("%-9s %-5s %10.1f MB/s %10.0f files/s\n", name, cold ? "cold" : "warm",
+                    throughput(bytes, best), paths.size() * 1e9 / best);
+        }
+    }
+    return 0;
+}
+
+int main( int argc, char *argv[] ) {
+    if( argc > 1 && strcmp(argv[1], "--verify") == 0 ) {
+        return verifyKernels() ? 0 : 1;
+    }
+    if( argc > 1 && strcmp(argv[1], "--engine") == 0 ) {
+        if( argc != 3 ) {
+            fprintf(stderr, "Usage: digest-bench --engine <file-list>\n");
+            return 1;
+        }
+        return benchEngine(argv[2]);
+    }
+
+    size_t maxSize = 256*1024*1024;
+    if( argc > 1 ) {
+        maxSize = (size_t)atol(argv[1]) * 1024 * 1024;
+    }
+
+    size_t largest = 0;
+    for( size_t size : SIZES ) {
+        if( size <= maxSize ) {
+            largest = size;
+        }
+    }
+    std::vector<uint8_t> heap(largest);
+    for( size_t i=0; i<largest; i++ ) {
+        heap[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+    std::unique_ptr<Buffer> mapped = getMappedBuffer(heap.data(), largest);
+
+    ThreadPool &pool = ThreadPool::getDefault();
+    printf("# %u threads\n", pool.getConcurrency());
+
+    const DigestKernel *kernels[8];
+    size_t numKernels = getDigestKernels(kernels, 8);
+    for( size_t k=0; k<numKernels; k++ ) {
+        setDigestKernel(kernels[k]->name);
+        for( size_t size : SIZES ) {
+            if( size > largest ) {
+                break;
+            }
+            const uint8_t *sources[] = { heap.data(), (const uint8_t *)mapped->data() };
+            const char *sourceNames[] = { "heap", "mmap" };
+            for( int s=0; s<2; s++ ) {
+                const uint8_t *data = sources[s];
+                double serial = measure([&]() {
+                    Hasher hasher;
+                    hasher.update(data, size);
+                    hasher.finish();
+                });
+                report(kernels[k]->name, "serial", sourceNames[s], size, serial);
+                double parallel = measure([&]() {
+                    Hasher hasher;
+                    hasher.update(data, size, pool);
+                    hasher.finish();
+                });
+                report(kernels[k]->name, "parallel", sourceNames[s], size, parallel);
+            }
+        }
+    }
+    return 0;
+}
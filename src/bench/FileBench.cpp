@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench/Benchmark.h"
+#include "support/Buffer.h"
+#include "support/File.h"
+#include "support/ReadAhead.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+using namespace fabr;
+
+/**
+ * File read benchmark, for tuning File::ReadPolicy. For a range of file
+ * sizes, compares read(), plain mmap, MAP_POPULATE and madvise, scanning
+ * every byte of each buffer. Also compares reading a batch of small files
+ * in turn against ReadAhead.
+ *
+ * Note the files are written by the benchmark, so are normally in the page
+ * cache; this measures the syscall and page fault overhead rather than the
+ * device. Drop caches between runs (as root) to measure cold reads.
+ *
+ * Usage: file-bench [directory]
+ */
+
+static const size_t SIZES[] = { 1024, 4*1024, 16*1024, 64*1024, 256*1024, 1024*1024, 16*1024*1024, 64*1024*1024 };
+
+/** Number of files of each size, so each run covers a similar amount of data */
+static size_t countFor( size_t size ) {
+    size_t count = (64*1024*1024) / size;
+    return count > 1000 ? 1000 : count < 1 ? 1 : count;
+}
+
+struct Strategy {
+    const char *name;
+    File::ReadPolicy policy;
+    File::Access access;
+};
+
+static std::vector<Strategy> getStrategies() {
+    const size_t NEVER = (size_t)-1;
+    File::ReadPolicy read, mmap, populate, advise;
+    read.mmapThreshold = NEVER;
+    mmap.mmapThreshold = 0;
+    mmap.populateLimit = 0;
+    mmap.hugePageThreshold = NEVER;
+    populate.mmapThreshold = 0;
+    populate.populateLimit = NEVER;
+    populate.hugePageThreshold = NEVER;
+    advise.mmapThreshold = 0;
+    advise.populateLimit = 0;
+    advise.hugePageThreshold = NEVER;
+    return {
+        { "read", read, File::SEQUENTIAL },
+        { "mmap", mmap, File::RANDOM },
+        { "populate", populate, File::SEQUENTIAL },
+        { "madvise", advise, File::SEQUENTIAL },
+        { "default", File::ReadPolicy(), File::SEQUENTIAL }
+    };
+}
+
+/**
+ * Touch every page (and sum every word) so that mapping costs are counted.
+ */
+static uint64_t scan( const Buffer &buffer ) {
+    uint64_t sum = 0;
+    const char *p = buffer.data();
+    size_t n = buffer.size() / sizeof(uint64_t);
+    for( size_t i=0; i<n; i++ ) {
+        uint64_t word;
+        memcpy(&word, p + i*sizeof(uint64_t), sizeof(word));
+        sum += word;
+    }
+    return sum;
+}
+
+static std::vector<Path> createFiles( const Path &dir, size_t size, size_t count ) {
+    std::vector<char> data(size);
+    for( size_t i=0; i<size; i++ ) {
+        data[i] = (char)(i * 131);
+    }
+    std::vector<Path> paths;
+    for( size_t i=0; i<count; i++ ) {
+        Path path = dir + ("f" + std::to_string(size) + "_" + std::to_string(i));
+        ::unlink(path.str().c_str());
+        File file = File::create(path.str());
+        for( size_t done = 0; done < size; ) {
+            done += file.write(data.data() + done, size - done);
+        }
+        paths.push_back(path);
+    }
+    return paths;
+}
+
+static void removeFiles( const std::vector<Path> &paths ) {
+    for( auto &path : paths ) {
+        ::unlink(path.str().c_str());
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    char tmpl[] = "/tmp/file-bench-XXXXXX";
+    Path dir;
+    if( argc > 1 ) {
+        dir = Path(argv[1]);
+    } else if( ::mkdtemp(tmpl) != nullptr ) {
+        dir = Path(tmpl);
+    } else {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    volatile uint64_t sink = 0;
+    std::vector<Strategy> strategies = getStrategies();
+    for( size_t size : SIZES ) {
+        size_t count = countFor(size);
+        std::vector<Path> paths = createFiles(dir, size, count);
+        for( auto &strategy : strategies ) {
+            File::setReadPolicy(strategy.policy);
+            double nanos = measure([&]() {
+                for( auto &path : paths ) {
+                    sink += scan(*File::getBuffer(path.str(), strategy.access));
+                }
+            });
+            printf("%-9s %10zu x %-5zu %10.1f MB/s %10.0f files/s\n", strategy.name, size, count,
+                    throughput(size * count, nanos), count * 1e9 / nanos);
+        }
+        File::setReadPolicy(File::ReadPolicy());
+        if( size <= 64*1024 ) {
+            double nanos = measure([&]() {
+                ReadAhead reader(paths);
+                while( reader.hasNext() ) {
+                    sink += scan(*reader.next());
+                }
+            });
+            printf("%-9s %10zu x %-5zu %10.1f MB/s %10.0f files/s\n", "readahead", size, count,
+                    throughput(size * count, nanos), count * 1e9 / nanos);
+        }
+        removeFiles(paths);
+    }
+    if( argc <= 1 ) {
+        ::rmdir(tmpl);
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench/TreeGenerator.h"
+
+#include <sys/stat.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <system_error>
+
+using namespace fabr;
+
+/**
+ * Generate a synthetic source tree (see TreeGenerator).
+ *
+ * Usage: gen-tree [options] <directory>
+ */
+
+static void printUsage() {
+    fprintf(stderr,
+            "Usage: gen-tree [options] <directory>\n"
+            "  --targets=<n>     Total number of targets (1000)\n"
+            "  --per-package=<n> Targets per BUILD file (10)\n"
+            "  --depth=<n>       Depth of the package hierarchy (3)\n"
+            "  --sources=<n>     Source files per target (2)\n"
+            "  --fan-out=<n>     Dependencies per target (4)\n"
+            "  --fan-in=<pct>    Percentage of targets depending on the root target (50)\n"
+            "  --glob=<pct>      Percentage of targets using a glob for their sources (50)\n"
+            "  --seed=<n>        Random seed (1)\n");
+}
+
+int main( int argc, char *argv[] ) {
+    static const struct option options[] = {
+        { "targets", required_argument, nullptr, 't' },
+        { "per-package", required_argument, nullptr, 'p' },
+        { "depth", required_argument, nullptr, 'd' },
+        { "sources", required_argument, nullptr, 's' },
+        { "fan-out", required_argument, nullptr, 'o' },
+        { "fan-in", required_argument, nullptr, 'i' },
+        { "glob", required_argument, nullptr, 'g' },
+        { "seed", required_argument, nullptr, 'r' },
+        { nullptr, 0, nullptr, 0 }
+    };
+    TreeGenerator::Params params;
+    int opt;
+    while( (opt = getopt_long(argc, argv, "", options, nullptr)) != -1 ) {
+        unsigned long value = optarg ? strtoul(optarg, nullptr, 10) : 0;
+        switch( opt ) {
+        case 't': params.targets = value; break;
+        case 'p': params.targetsPerPackage = value; break;
+        case 'd': params.depth = value; break;
+        case 's': params.sourcesPerTarget = value; break;
+        case 'o': params.fanOut = value; break;
+        case 'i': params.rootFanIn = value; break;
+        case 'g': params.globPercent = value; break;
+        case 'r': params.seed = value; break;
+        default:
+            printUsage();
+            return 1;
+        }
+    }
+    if( optind != argc - 1 || params.targets == 0 || params.targetsPerPackage == 0 ||
+            params.sourcesPerTarget == 0 ) {
+        printUsage();
+        return 1;
+    }
+
+    const char *root = argv[optind];
+    if( ::mkdir(root, 0777) == -1 && errno != EEXIST ) {
+        perror(root);
+        return 1;
+    }
+    try {
+        TreeGenerator::Result result = TreeGenerator(params).generate(root);
+        printf("%zu targets in %zu packages, %zu files\n", params.targets, result.packages, result.files);
+        printf("root header: %s\nleaf source: %s\n", result.rootHeader.c_str(), result.leafSource.c_str());
+    } catch( const std::system_error &e ) {
+        fprintf(stderr, "gen-tree: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench/Benchmark.h"
+#include "bench/TreeGenerator.h"
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <system_error>
+
+using namespace fabr;
+
+/**
+ * End-to-end scaling benchmark. For synthetic trees of 1k, 10k, 100k and
+ * 1M targets (see TreeGenerator), times a fabr build from a cold start
+ * (no cached build state), a no-op rebuild, a rebuild after editing one
+ * leaf source, and a rebuild after editing the header of the root target
+ * that half the tree depends on. Each is the best of a few runs. Results
+ * go to stdout as JSON (see BenchmarkReport).
+ *
+ * Note the trees are written by the benchmark, so are in the page cache;
+ * "cold" refers to fabr's own state, not the OS's. Until fabr has an
+ * executor the edit scenarios only measure the up-to-date check, as
+ * nothing is rebuilt.
+ *
+ * Usage: scale-bench [max-targets [fabr-binary [directory]]]
+ */
+
+static const size_t SIZES[] = { 1000, 10000, 100000, 1000000 };
+
+/** Runs of each scenario; the fastest is reported */
+static const int RUNS = 3;
+
+static int removeEntry( const char *path, const struct stat *, int, struct FTW * ) {
+    return ::remove(path);
+}
+
+static void removeTree( const std::string &path ) {
+    ::nftw(path.c_str(), removeEntry, 64, FTW_DEPTH|FTW_PHYS);
+}
+
+static void appendLine( const std::string &path ) {
+    FILE *f = fopen(path.c_str(), "a");
+    if( f == nullptr || fputs("// edited\n", f) == EOF || fclose(f) != 0 ) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+/**
+ * Run fabr --no-server (bypassing any server) in the given directory.
+ * @return the wall-clock time taken, in nanoseconds.
+ */
+static double runBuild( const std::string &fabr, const std::string &dir ) {
+    typedef std::chrono::steady_clock clock;
+    clock::time_point start = clock::now();
+    pid_t pid = ::fork();
+    if( pid == -1 ) {
+        throw std::system_error(errno, std::system_category());
+    } else if( pid == 0 ) {
+        ::unsetenv("FABR_BUILD_ROOT");
+        ::unsetenv("FABR_SOURCE_ROOT");
+        if( ::chdir(dir.c_str()) == 0 ) {
+            ::execl(fabr.c_str(), fabr.c_str(), "--no-server", (char *)nullptr);
+        }
+        perror(fabr.c_str());
+        ::_exit(127);
+    }
+    int status;
+    while( ::waitpid(pid, &status, 0) == -1 ) {
+        if( errno != EINTR ) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
+    double nanos = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+        fprintf(stderr, "scale-bench: build failed in %s\n", dir.c_str());
+        exit(1);
+    }
+    return nanos;
+}
+
+/**
+ * @return the best time of RUNS builds, calling prepare before each.
+ */
+template<class Fn>
+static double bestOf( const std::string &fabr, const std::string &dir, Fn prepare ) {
+    double best = 0;
+    for( int i = 0; i < RUNS; i++ ) {
+        prepare();
+        double nanos = runBuild(fabr, dir);
+        if( i == 0 || nanos < best ) {
+            best = nanos;
+        }
+    }
+    return best;
+}
+
+static std::string getDefaultFabr() {
+    char buf[4096];
+    ssize_t len = ::readlink("/proc/self/exe", buf, sizeof(buf) - 1);
+    if( len <= 0 ) {
+        return "fabr";
+    }
+    std::string self(buf, len);
+    return self.substr(0, self.rfind('/') + 1) + "fabr";
+}
+
+int main( int argc, char *argv[] ) {
+    size_t maxTargets = argc > 1 ? strtoul(argv[1], nullptr, 10) : 1000000;
+    /* The builds run in the tree, so a relative path wouldn't resolve there */
+    std::string fabrArg = argc > 2 ? argv[2] : getDefaultFabr();
+    char *fabrPath = ::realpath(fabrArg.c_str(), nullptr);
+    if( fabrPath == nullptr ) {
+        perror(fabrArg.c_str());
+        return 1;
+    }
+    std::string fabr = fabrPath;
+    free(fabrPath);
+    char tmpl[] = "/tmp/scale-bench-XXXXXX";
+    std::string base;
+    if( argc > 3 ) {
+        base = argv[3];
+    } else if( ::mkdtemp(tmpl) != nullptr ) {
+        base = tmpl;
+    } else {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    BenchmarkReport report;
+    try {
+        for( size_t size : SIZES ) {
+            if( size > maxTargets ) {
+                break;
+            }
+            std::string root = base + "/t" + std::to_string(size);
+            ::mkdir(root.c_str(), 0777);
+            TreeGenerator::Params params;
+            params.targets = size;
+            /* Keep the packages per directory roughly constant as the tree grows */
+            params.depth = size >= 100000 ? 4 : size >= 10000 ? 3 : 2;
+            typedef std::chrono::steady_clock clock;
+            clock::time_point start = clock::now();
+            TreeGenerator::Result tree = TreeGenerator(params).generate(root);
+            fprintf(stderr, "generated %zu targets (%zu files) in %.1fs\n", size, tree.files,
+                    std::chrono::duration<double>(clock::now() - start).count());
+
+            std::string name = "scale/" + std::to_string(size) + "/";
+            std::string cache = root + "/.build";
+            /* The cache directory marks the build root, so must be there for
+             * the build state to be saved at all */
+            report.record(name + "cold", 1, bestOf(fabr, root, [&]() {
+                removeTree(cache);
+                if( ::mkdir(cache.c_str(), 0777) == -1 ) {
+                    throw std::system_error(errno, std::system_category());
+                }
+            }));
+            report.record(name + "noop", 1, bestOf(fabr, root, []() { }));
+            report.record(name + "edit-leaf", 1, bestOf(fabr, root, [&]() { appendLine(tree.leafSource); }));
+            report.record(name + "edit-root-header", 1, bestOf(fabr, root, [&]() { appendLine(tree.rootHeader); }));
+            removeTree(root);
+        }
+    } catch( const std::system_error &e ) {
+        fprintf(stderr, "scale-bench: %s\n", e.what());
+        return 1;
+    }
+    if( argc <= 3 ) {
+        ::rmdir(tmpl);
+    }
+    fprintf(stderr, "note: there is no executor yet, so the edit-* results are only the "
+            "up-to-date check\n");
+    report.write(stdout);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bench/TreeGenerator.h"
+#include "driver/Constants.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <set>
+#include <system_error>
+#include <vector>
+
+namespace fabr {
+
+namespace {
+
+void makeDirectories( const std::string &path ) {
+    for( size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1) ) {
+        std::string prefix = path.substr(0, pos);
+        if( ::mkdir(prefix.c_str(), 0777) == -1 && errno != EEXIST ) {
+            throw std::system_error(errno, std::system_category());
+        }
+        if( pos == std::string::npos ) {
+            break;
+        }
+    }
+}
+
+void writeFile( const std::string &path, const std::string &content ) {
+    FILE *f = fopen(path.c_str(), "w");
+    if( f == nullptr ) {
+        throw std::system_error(errno, std::system_category());
+    }
+    bool ok = fwrite(content.data(), 1, content.size(), f) == content.size();
+    if( fclose(f) != 0 || !ok ) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+std::string targetName( size_t target ) {
+    return "lib" + std::to_string(target);
+}
+
+}
+
+uint64_t TreeGenerator::random() {
+    /* xorshift64*, which is plenty for picking dependencies */
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ull;
+}
+
+unsigned TreeGenerator::getBranching() const {
+    size_t packages = (params.targets + params.targetsPerPackage - 1) / params.targetsPerPackage;
+    unsigned branching = (unsigned)ceil(pow((double)packages, 1.0 / std::max(1u, params.depth)));
+    return std::max(2u, branching);
+}
+
+/**
+ * Package n lives at the path given by the digits of n in base branching,
+ * so packages fill the hierarchy breadth-first.
+ */
+std::string TreeGenerator::getPackagePath( size_t package ) const {
+    unsigned branching = getBranching();
+    std::string path;
+    for( unsigned level = 0; level < params.depth; level++ ) {
+        path = "/d" + std::to_string(package % branching) + path;
+        package /= branching;
+    }
+    return path;
+}
+
+TreeGenerator::Result TreeGenerator::generate( const std::string &root ) {
+    Result result;
+    size_t packages = (params.targets + params.targetsPerPackage - 1) / params.targetsPerPackage;
+    result.packages = packages;
+
+    writeFile(root + "/" BUILD_FILENAME, "");
+    result.files++;
+    std::set<std::string> directories;
+
+    for( size_t package = 0; package < packages; package++ ) {
+        std::string packagePath = getPackagePath(package);
+        std::string dir = root + packagePath;
+        /* Make sure every level has a BUILD file, so discovery finds them */
+        for( size_t pos = packagePath.find('/', 1); pos != std::string::npos; pos = packagePath.find('/', pos + 1) ) {
+            std::string parent = root + packagePath.substr(0, pos);
+            if( directories.insert(parent).second ) {
+                makeDirectories(parent);
+                writeFile(parent + "/" BUILD_FILENAME, "");
+                result.files++;
+            }
+        }
+        makeDirectories(dir);
+        directories.insert(dir);
+
+        std::string build;
+        size_t first = package * params.targetsPerPackage;
+        size_t last = std::min(params.targets, first + params.targetsPerPackage);
+        for( size_t target = first; target < last; target++ ) {
+            std::string name = targetName(target);
+            std::set<size_t> deps;
+            if( target > 0 ) {
+                if( random() % 100 < params.rootFanIn ) {
+                    deps.insert(0);
+                }
+                for( unsigned i = 0; i < params.fanOut; i++ ) {
+                    /* Prefer nearby targets, as real trees do */
+                    size_t range = (random() & 1) ? std::min(target, params.targetsPerPackage * 4) : target;
+                    deps.insert(target - 1 - random() % range);
+                }
+            }
+
+            std::string header = name + "/" + name + ".h";
+            makeDirectories(dir + "/" + name);
+            writeFile(dir + "/" + header, "#pragma once\nint " + name + "_fn(int);\n");
+            result.files++;
+            if( target == 0 ) {
+                result.rootHeader = dir + "/" + header;
+            }
+
+            std::string includes = "#include \"" + name + ".h\"\n";
+            for( size_t dep : deps ) {
+                includes += "#include \"" + getPackagePath(dep / params.targetsPerPackage).substr(1) + "/" +
+                    targetName(dep) + "/" + targetName(dep) + ".h\"\n";
+            }
+            std::vector<std::string> sources;
+            for( unsigned i = 0; i < params.sourcesPerTarget; i++ ) {
+                std::string source = name + "/" + name + "_" + std::to_string(i) + ".cpp";
+                std::string fn = i == 0 ? name + "_fn" : name + "_fn" + std::to_string(i);
+                writeFile(dir + "/" + source, includes + "int " + fn + "(int x) { return x + " +
+                          std::to_string(target) + "; }\n");
+                result.files++;
+                sources.push_back(source);
+            }
+            if( target == params.targets - 1 ) {
+                result.leafSource = dir + "/" + sources[0];
+            }
+
+            build += "library " + name + " {\n inputs:\n";
+            if( random() % 100 < params.globPercent ) {
+                build += "  " + name + "/*.cpp\n";
+            } else {
+                for( auto &source : sources ) {
+                    build += "  " + source + "\n";
+                }
+            }
+            build += "  " + header + "\n";
+            for( size_t dep : deps ) {
+                build += "  " + targetName(dep) + "\n";
+            }
+            build += "}\n\n";
+        }
+        writeFile(dir + "/" BUILD_FILENAME, build);
+        result.files++;
+    }
+    return result;
+}
+
+}
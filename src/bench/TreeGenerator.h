@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_BENCH_TREEGENERATOR_H
+#define FABR_BENCH_TREEGENERATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace fabr {
+
+/**
+ * Writes a synthetic source tree for scaling tests: a hierarchy of
+ * package directories, each with a BUILD file declaring a number of
+ * library targets. Every target has a header and a few tiny sources (so
+ * that its actions are trivial), and depends on a random selection of
+ * earlier targets, which its sources #include. A proportion of targets
+ * also depend on a single root target, whose header therefore has a very
+ * high fan-in.
+ *
+ * The output is entirely determined by the parameters (including the
+ * seed), so the same tree can be regenerated anywhere.
+ */
+class TreeGenerator {
+public:
+    struct Params {
+        /** Total number of targets */
+        size_t targets = 1000;
+        /** Targets declared in each BUILD file */
+        size_t targetsPerPackage = 10;
+        /** Depth of the package directory hierarchy */
+        unsigned depth = 3;
+        /** Source files per target */
+        unsigned sourcesPerTarget = 2;
+        /** Number of direct dependencies of each target (fan-out) */
+        unsigned fanOut = 4;
+        /** Percentage of targets that depend on the root target (fan-in) */
+        unsigned rootFanIn = 50;
+        /** Percentage of targets that list their sources with a glob */
+        unsigned globPercent = 50;
+        uint64_t seed = 1;
+    };
+
+    struct Result {
+        size_t packages = 0;
+        size_t files = 0;
+        /** Header of the root target, included (directly) by rootFanIn% of targets */
+        std::string rootHeader;
+        /** A source of a target which nothing depends on */
+        std::string leafSource;
+    };
+
+private:
+    Params params;
+    uint64_t state;
+
+    uint64_t random();
+    std::string getPackagePath( size_t package ) const;
+    unsigned getBranching() const;
+
+public:
+    explicit TreeGenerator( const Params &params ) : params(params), state(params.seed != 0 ? params.seed : 1) { }
+
+    /**
+     * Generate the tree under root, which must exist.
+     * @throw std::system_error if a file can't be written.
+     */
+    Result generate( const std::string &root );
+};
+
+}
+
+#endif /* !FABR_BENCH_TREEGENERATOR_H */
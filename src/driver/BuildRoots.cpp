@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "driver/BuildRoots.h"
+#include "driver/Constants.h"
+#include "support/DirCache.h"
+#include "support/StatCache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY
+#endif
+
+namespace fabr {
+
+namespace {
+
+/**
+ * @return true if path is dir or one of its parents.
+ */
+bool isWithin( const Path &dir, const Path &path ) {
+    const std::string &d = dir.str(), &p = path.str();
+    return !p.empty() && d.compare(0, p.size(), p) == 0 &&
+        (d.size() == p.size() || d[p.size()] == '/' || p.back() == '/');
+}
+
+/**
+ * Check for roots recorded in the environment by an enclosing invocation.
+ */
+bool fromEnvironment( const Path &start, BuildRoots &roots ) {
+    const char *buildRoot = ::getenv(BUILD_ROOT_ENV);
+    const char *sourceRoot = ::getenv(BUILD_SOURCEROOT_ENV);
+    if( buildRoot == nullptr || sourceRoot == nullptr ) {
+        return false;
+    }
+    roots.buildRoot = Path(buildRoot);
+    roots.sourceRoot = Path(sourceRoot);
+    if( roots.hasBuildRoot() && isWithin(start, roots.buildRoot) ) {
+        /* Make sure the build hasn't been removed in the meantime */
+        return DirCache::statAt(AT_FDCWD, (roots.buildRoot + BUILD_CACHEDIR).str().c_str()).isDirectory();
+    }
+    /* Without a build root the walk went all the way up to /, so the
+     * source root is the topmost BUILD above anywhere within it.
+     */
+    return !roots.hasBuildRoot() && roots.hasSourceRoot() && isWithin(start, roots.sourceRoot);
+}
+
+}
+
+std::string BuildRoots::getRelativeBuildRoot( const Path &dir ) const {
+    std::string result;
+    Path path = dir;
+    while( path.str().size() > buildRoot.str().size() && path.hasComponents() ) {
+        path.pop_back();
+        result += "../";
+    }
+    return result;
+}
+
+BuildRoots BuildRoots::find( const Path &start ) {
+    BuildRoots roots;
+    if( fromEnvironment(start, roots) ) {
+        return roots;
+    }
+    roots = BuildRoots();
+
+    int fd = ::open(start.str().c_str(), O_PATH|O_DIRECTORY|O_CLOEXEC);
+    Path dir = start;
+    while( fd != -1 ) {
+        /* The topmost BUILD file wins: a directory without one in the
+         * middle of the tree doesn't end it, as scripts may be at any depth.
+         */
+        if( DirCache::statAt(fd, BUILD_FILENAME).isFile() ) {
+            roots.sourceRoot = dir;
+        }
+        if( DirCache::statAt(fd, BUILD_CACHEDIR).isDirectory() ) {
+            roots.buildRoot = dir;
+            break;
+        }
+        if( !dir.hasComponents() ) {
+            break;
+        }
+        int parent = ::openat(fd, "..", O_PATH|O_DIRECTORY|O_CLOEXEC);
+        ::close(fd);
+        fd = parent;
+        dir.pop_back();
+    }
+    if( fd != -1 ) {
+        ::close(fd);
+    }
+
+    ::setenv(BUILD_ROOT_ENV, roots.buildRoot.str().c_str(), 1);
+    ::setenv(BUILD_SOURCEROOT_ENV, roots.sourceRoot.str().c_str(), 1);
+    return roots;
+}
+
+}
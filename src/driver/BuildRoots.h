@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_DRIVER_BUILDROOTS_H
+#define FABR_DRIVER_BUILDROOTS_H
+
+#include "support/Path.h"
+
+namespace fabr {
+
+/**
+ * The source and build roots enclosing a directory.
+ *
+ * Discovery walks up from the starting directory using fd-relative
+ * fstatat on each ancestor, until it reaches a build root (a directory
+ * containing BUILD_CACHEDIR) or the filesystem root. The source root is
+ * the topmost directory on the way with a BUILD file, since build scripts
+ * may be at any depth. The result is exported in the environment, so that
+ * nested invocations (e.g. from a build command) whose working directory
+ * is within one of the roots can skip the walk altogether.
+ */
+struct BuildRoots {
+    /** The enclosing build root, or empty if there isn't an existing build */
+    Path buildRoot;
+    /** The top of the enclosing source tree, or empty if not in one */
+    Path sourceRoot;
+
+    bool hasBuildRoot() const {
+        return !buildRoot.isEmpty();
+    }
+    bool hasSourceRoot() const {
+        return !sourceRoot.isEmpty();
+    }
+
+    /**
+     * @return the relative path (e.g. "../../") from dir up to the build
+     * root, or an empty string if dir is the build root. dir must be the
+     * build root or a directory under it.
+     */
+    std::string getRelativeBuildRoot( const Path &dir ) const;
+
+    /**
+     * Find the roots enclosing the given absolute directory.
+     */
+    static BuildRoots find( const Path &start );
+
+    /**
+     * Find the roots enclosing the current directory.
+     */
+    static BuildRoots find() {
+        return find(Path::getCurrentDir());
+    }
+};
+
+}
+
+#endif /* !FABR_DRIVER_BUILDROOTS_H */
@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "driver/BuildRoots.h"
+#include "driver/BuildServer.h"
+#include "driver/Constants.h"
+#include "driver/Driver.h"
+#include "driver/Options.h"
+#include "driver/ServerConnection.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <vector>
+
+extern char **environ;
+
+namespace fabr {
+
+/**
+ * Temporarily adopts the client's standard fds, working directory and
+ * environment, restoring the server's own on destruction.
+ */
+class ClientContext {
+private:
+    int savedFds[3] = { -1, -1, -1 };
+    int savedCwd = -1;
+    bool valid;
+    char **savedEnviron;
+    std::vector<std::string> env;
+    std::vector<char *> envp;
+
+public:
+    ClientContext( const int fds[3], const std::string &cwd, std::vector<std::string> &&environment ) :
+        savedEnviron(environ), env(std::move(environment)) {
+        std::cout.flush();
+        std::cerr.flush();
+        for( int i=0; i<3; i++ ) {
+            savedFds[i] = ::dup(i);
+            ::dup2(fds[i], i);
+        }
+
+        savedCwd = ::open(".", O_RDONLY|O_DIRECTORY);
+        valid = savedCwd != -1 && ::chdir(cwd.c_str()) == 0;
+
+        for( auto &var : env ) {
+            envp.push_back(var.data());
+        }
+        envp.push_back(nullptr);
+        environ = envp.data();
+    }
+
+    /**
+     * @return false if we couldn't change to the client's working directory.
+     */
+    bool isValid() const {
+        return valid;
+    }
+
+    ~ClientContext() {
+        environ = savedEnviron;
+        if( savedCwd != -1 ) {
+            if( ::fchdir(savedCwd) == -1 ) {
+                /* Can't recover from this: we'd be serving the wrong tree */
+                ::abort();
+            }
+            ::close(savedCwd);
+        }
+        std::cout.flush();
+        std::cerr.flush();
+        for( int i=0; i<3; i++ ) {
+            if( savedFds[i] != -1 ) {
+                ::dup2(savedFds[i], i);
+                ::close(savedFds[i]);
+            }
+        }
+    }
+};
+
+BuildServer::~BuildServer() {
+    if( listenFd != -1 ) {
+        ::close(listenFd);
+        ::unlink((root + BUILD_SERVERSOCKET).str().c_str());
+    }
+}
+
+void BuildServer::handle( ServerConnection &conn ) {
+    uint32_t magic;
+    std::string version;
+    if( !conn.readUint32(magic) || magic != ServerConnection::Magic ||
+            !conn.readString(version) ) {
+        return;
+    }
+    if( version != ServerConnection::getVersion() ) {
+        conn.writeUint32(ServerConnection::REJECT);
+        return;
+    }
+    if( !conn.writeUint32(ServerConnection::ACCEPT) ) {
+        return;
+    }
+
+    int fds[3];
+    std::string cwd;
+    std::vector<std::string> args, env;
+    if( !conn.receiveFds(fds, 3) ) {
+        return;
+    }
+    bool ok = conn.readString(cwd) && conn.readStrings(args) && conn.readStrings(env);
+
+    ExitCode status = ExitCode::EXITCODE_SYSTEM;
+    if( ok ) {
+        std::vector<char *> argv;
+        for( auto &arg : args ) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+
+        ClientContext context(fds, cwd, std::move(env));
+        try {
+            Options options;
+            if( !context.isValid() ) {
+                std::cerr << PACKAGE_NAME << ": build server unable to access " << cwd << "\n";
+            } else if( (status = options.parse(argv.size() - 1, argv.data())) == ExitCode::EXITCODE_OK ) {
+                status = driver.build(options);
+            }
+        } catch( const std::exception &e ) {
+            /* Whatever went wrong, it's the client's build that failed, not the server */
+            std::cerr << PACKAGE_NAME << ": " << e.what() << "\n";
+            status = ExitCode::EXITCODE_SYSTEM;
+        }
+    }
+    for( int i=0; i<3; i++ ) {
+        ::close(fds[i]);
+    }
+    conn.writeUint32((uint32_t)status);
+}
+
+ExitCode BuildServer::run() {
+    /* Clients going away mid-build must not take the server with them */
+    ::signal(SIGPIPE, SIG_IGN);
+
+    /* We're long-lived, so track changes rather than rescanning each time */
+    driver.enableChangeJournal();
+
+    Path cacheDir = root + BUILD_CACHEDIR;
+    if( ::mkdir(cacheDir.str().c_str(), 0777) == -1 && errno != EEXIST ) {
+        throw std::system_error(errno, std::system_category());
+    }
+
+    std::string socketPath = (root + BUILD_SERVERSOCKET).str();
+    if( ServerConnection::connect(socketPath).isValid() ) {
+        std::cerr << PACKAGE_NAME << ": build server already running for " << root.str() << "\n";
+        return ExitCode::EXITCODE_USER;
+    }
+    /* Any existing socket is stale at this point */
+    ::unlink(socketPath.c_str());
+
+    struct sockaddr_un addr;
+    if( socketPath.size() >= sizeof(addr.sun_path) ) {
+        std::cerr << PACKAGE_NAME << ": build root path too long for server socket\n";
+        return ExitCode::EXITCODE_USER;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if( listenFd == -1 ||
+            ::bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+            ::listen(listenFd, 16) == -1 ) {
+        throw std::system_error(errno, std::system_category());
+    }
+
+    while( true ) {
+        struct pollfd pfd = { listenFd, POLLIN, 0 };
+        int ready = ::poll(&pfd, 1, BUILD_SERVER_IDLE_TIMEOUT * 1000);
+        if( ready == 0 ) {
+            break; /* Idle timeout */
+        } else if( ready == -1 ) {
+            if( errno == EINTR )
+                continue;
+            throw std::system_error(errno, std::system_category());
+        }
+
+        /* Only serve our own user: the socket's permissions are whatever the
+         * cache directory's are, and a client could otherwise make us build
+         * (and run rules) with our privileges. Nor can a client that stops
+         * responding be allowed to block everyone else.
+         */
+        ServerConnection conn(::accept(listenFd, nullptr, nullptr));
+        if( conn.isValid() && conn.isPeerSameUser() &&
+                conn.setTimeout(BUILD_SERVER_REQUEST_TIMEOUT) ) {
+            handle(conn);
+        }
+    }
+    return ExitCode::EXITCODE_OK;
+}
+
+bool BuildClient::forward( int argc, char *argv[], ExitCode &status ) {
+    if( ::getenv(BUILD_NOSERVER_ENV) != nullptr ) {
+        return false;
+    }
+
+    /* Look for a server socket in the enclosing build root. Connect by
+     * relative path to stay within the sun_path size limit.
+     */
+    Path cwd = Path::getCurrentDir();
+    BuildRoots roots = BuildRoots::find(cwd);
+    ServerConnection conn;
+    if( roots.hasBuildRoot() && roots.buildRoot.exists(BUILD_SERVERSOCKET) ) {
+        conn = ServerConnection::connect(roots.getRelativeBuildRoot(cwd) + BUILD_SERVERSOCKET);
+    }
+    if( !conn.isValid() ) {
+        return false;
+    }
+
+    /* Don't trust a socket owned by someone else, and don't wait forever on
+     * a wedged server: either way we can still build in-process.
+     */
+    if( !conn.isPeerSameUser() || !conn.setTimeout(BUILD_SERVER_REQUEST_TIMEOUT) ) {
+        return false;
+    }
+    uint32_t response;
+    if( !conn.writeUint32(ServerConnection::Magic) ||
+            !conn.writeString(ServerConnection::getVersion()) ) {
+        return false;
+    }
+    if( !conn.readUint32(response) ) {
+        if( errno == EAGAIN || errno == EWOULDBLOCK ) {
+            std::cerr << PACKAGE_NAME << ": build server busy or not responding, building in-process\n";
+        }
+        return false;
+    } else if( response != ServerConnection::ACCEPT ) {
+        return false;
+    }
+
+    /* From here on, the server owns the build; if it goes away we report
+     * failure rather than silently running the build a second time.
+     */
+    std::vector<std::string> args(argv, argv + argc);
+    std::vector<std::string> env;
+    for( char **p = environ; *p != nullptr; p++ ) {
+        env.push_back(*p);
+    }
+    static const int fds[3] = { 0, 1, 2 };
+    uint32_t result;
+    if( conn.sendFds(fds, 3) &&
+            conn.writeString(cwd.str()) &&
+            conn.writeStrings(args) && conn.writeStrings(env) &&
+            conn.setTimeout(0) && conn.readUint32(result) ) {
+        status = (ExitCode)result;
+    } else {
+        std::cerr << PACKAGE_NAME << ": lost connection to build server\n";
+        status = ExitCode::EXITCODE_SYSTEM;
+    }
+    return true;
+}
+
+}
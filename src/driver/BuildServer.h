@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_DRIVER_BUILDSERVER_H
+#define FABR_DRIVER_BUILDSERVER_H
+
+#include <string>
+
+#include "driver/ExitCode.h"
+#include "support/Path.h"
+
+namespace fabr {
+
+class Driver;
+class ServerConnection;
+
+/**
+ * Persistent build server. This keeps a Driver (and with it the resolved
+ * model and any caches) resident between builds, and services build requests
+ * forwarded by BuildClient over a Unix socket in the build root.
+ *
+ * Requests are handled one at a time. For the duration of a request the server
+ * adopts the client's stdin/stdout/stderr (passed over the socket), working
+ * directory and environment, so output goes straight to the client's terminal
+ * and the build behaves exactly as it would have in-process. Only clients
+ * running as the same user are served.
+ */
+class BuildServer {
+private:
+    Driver &driver;
+    Path root;
+    int listenFd = -1;
+
+    /**
+     * Service a single client connection.
+     */
+    void handle( ServerConnection &conn );
+
+public:
+    /**
+     * @param driver the driver used to run builds.
+     * @param root the build root directory to serve.
+     */
+    BuildServer( Driver &driver, const Path &root ) : driver(driver), root(root) { }
+    ~BuildServer();
+
+    /**
+     * Listen for and service requests until the server has been idle for
+     * BUILD_SERVER_IDLE_TIMEOUT seconds.
+     */
+    ExitCode run();
+};
+
+/**
+ * Thin client side of the build server.
+ */
+class BuildClient {
+public:
+    /**
+     * Forward the invocation to a build server for the enclosing build root,
+     * if one is running and is the same version as us.
+     * @param status set to the exit status of the build, if forwarded.
+     * @return true if the request was handled by a server, or false if
+     * the caller should run the build in-process.
+     */
+    static bool forward( int argc, char *argv[], ExitCode &status );
+};
+
+}
+
+#endif /* !FABR_DRIVER_BUILDSERVER_H */
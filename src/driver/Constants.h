@@ -42,4 +42,50 @@
  */
 #define BUILD_CACHEDMODEL ".build/model"
 
+/**
+ * Persistent file digest cache (under the build root). Reserved for the
+ * executor, which is what will need file digests; nothing opens it yet.
+ */
+#define BUILD_DIGESTCACHE ".build/digests"
+
+/**
+ * Persistent log of executed actions (under the build root)
+ */
+#define BUILD_BUILDLOG ".build/log"
+
+/**
+ * Socket for the build server, if running (under the build root)
+ */
+#define BUILD_SERVERSOCKET ".build/server.sock"
+
+/**
+ * Time in seconds after which an idle build server exits.
+ */
+#define BUILD_SERVER_IDLE_TIMEOUT (3*60*60)
+
+/**
+ * Time in seconds that either end of a build server connection waits for
+ * the other during the handshake and request, before giving up on it (the
+ * client then builds in-process). Doesn't apply to the build itself.
+ */
+#define BUILD_SERVER_REQUEST_TIMEOUT 10
+
+/**
+ * Time in milliseconds that sources must be quiet for before --watch
+ * starts a rebuild (so that e.g. a multi-file save triggers one build).
+ */
+#define BUILD_WATCH_SETTLE_TIME 100
+
+/**
+ * Environment variable which, if set, disables use of the build server.
+ */
+#define BUILD_NOSERVER_ENV "FABR_NO_SERVER"
+
+/**
+ * Environment variables recording the build and source roots found by
+ * the outermost invocation, for use by nested invocations.
+ */
+#define BUILD_ROOT_ENV "FABR_BUILD_ROOT"
+#define BUILD_SOURCEROOT_ENV "FABR_SOURCE_ROOT"
+
 #endif /* !FABR_DRIVER_CONSTANTS_H */
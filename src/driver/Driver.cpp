@@ -15,42 +15,155 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "driver/BuildRoots.h"
+#include "driver/BuildServer.h"
 #include "driver/Constants.h"
 #include "driver/Driver.h"
 #include "driver/Options.h"
 
 #include "model/BuildModel.h"
+#include "model/ShardPlanner.h"
 
+#include "support/BuildLog.h"
+#include "support/ChangeJournal.h"
+#include "support/DirCache.h"
+#include "support/Metrics.h"
 #include "support/Path.h"
+#include "support/StatCache.h"
+#include "support/Trace.h"
+
+#include <iostream>
 
 namespace fabr {
 
-bool findRoots( BuildModel &model ) {
-    /* Walk up the directory tree from the current directory */
-    Path path = Path::getCurrentDir();
-    Path topSourceDir;
-    do {
-        if( path.isFile(BUILD_CACHEDMODEL) ) {
-            /* Done, load the serialized model */
-            model.load(path + BUILD_CACHEDMODEL);
-            return true;
-        }
-        if( path.isFile(BUILD_FILENAME) ) {
-            topSourceDir = path;
+/**
+ * @return the given file name made absolute relative to dir, with any "."
+ * and ".." components resolved lexically (the file may no longer exist).
+ */
+static std::string absolutePath(const Path &dir, std::string_view file) {
+    std::vector<std::string_view> components;
+    std::string base = file.empty() || file[0] != '/' ? dir.str() : std::string();
+    auto split = [&](std::string_view str) {
+        while( !str.empty() ) {
+            size_t end = str.find('/');
+            std::string_view component = str.substr(0, end);
+            if( component == ".." ) {
+                if( !components.empty() ) {
+                    components.pop_back();
+                }
+            } else if( !component.empty() && component != "." ) {
+                components.push_back(component);
+            }
+            str = end == std::string_view::npos ? std::string_view() : str.substr(end + 1);
         }
+    };
+    split(base);
+    split(file);
+    std::string result;
+    for( std::string_view component : components ) {
+        result.push_back('/');
+        result.append(component);
+    }
+    return result.empty() ? "/" : result;
+}
 
-    } while(!path.isRoot());
+Driver::Driver() {
 }
 
+Driver::~Driver() {
+}
 
 ExitCode Driver::run(int argc, char *argv[]) {
     Options options;
 
     ExitCode status = options.parse(argc, argv);
-    if( status != ExitCode::EXITCODE_OK ) {
+    if( status != ExitCode::EXITCODE_OK || options.isHelpOnly() ) {
+        return status;
+    }
+
+    if( options.isServerMode() ) {
+        /* Serve the enclosing build, if there is one */
+        BuildRoots roots = BuildRoots::find();
+        BuildServer server(*this, roots.hasBuildRoot() ? roots.buildRoot : Path::getCurrentDir());
+        return server.run();
+    }
+
+    if( options.isWatchMode() ) {
+        return watch(options);
+    }
+
+    /* If there's a server running for this build, let it do the work */
+    if( !options.isNoServer() && BuildClient::forward(argc, argv, status) ) {
         return status;
     }
 
+    return build(options);
+}
+
+void Driver::enableChangeJournal() {
+    if( !journal ) {
+        journal = std::make_unique<ChangeJournal>();
+    }
+}
+
+ExitCode Driver::watch(const Options &options) {
+    enableChangeJournal();
+    while( true ) {
+        /* A failed build shouldn't end the watch; the next change may fix it */
+        try {
+            build(options);
+        } catch( const std::exception &e ) {
+            std::cerr << PACKAGE_NAME << ": build failed: " << e.what() << "\n";
+        }
+        std::cerr << PACKAGE_NAME << ": waiting for changes...\n";
+        journal->wait(-1);
+        while( journal->wait(BUILD_WATCH_SETTLE_TIME) ) {
+            /* Wait for things to settle down */
+        }
+    }
+}
+
+ExitCode Driver::build(const Options &options) {
+    bool profile = !options.getProfileFile().empty();
+    Options::StatsFormat stats = options.getStatsFormat();
+    Metrics::Snapshot start;
+    if( stats != Options::STATS_NONE ) {
+        start = Metrics::snapshot();
+    }
+    if( profile ) {
+        Trace::setThreadName("main");
+        Trace::start();
+    }
+
+    ExitCode status;
+    try {
+        status = runBuild(options);
+    } catch(...) {
+        Trace::stop();
+        throw;
+    }
+
+    if( profile ) {
+        Trace::stop();
+        try {
+            Trace::write(Path(options.getProfileFile()));
+        } catch( const std::system_error &e ) {
+            std::cerr << PACKAGE_NAME << ": unable to write profile " << options.getProfileFile() <<
+                ": " << e.what() << "\n";
+        }
+    }
+    /* Report just this build's share, as a server accumulates counts */
+    if( stats == Options::STATS_JSON ) {
+        Metrics::writeJson(std::cerr, Metrics::snapshot() - start);
+    } else if( stats == Options::STATS_TEXT ) {
+        Metrics::writeText(std::cerr, Metrics::snapshot() - start);
+    }
+    return status;
+}
+
+ExitCode Driver::runBuild(const Options &options) {
+    Trace::Span span("build", "driver");
+
     /* Locate the top of the source and build trees, and initialize the
      * build model. There's a few cases:
      *   a) we're in an existing build directory - just import the cached model
@@ -59,13 +172,77 @@ ExitCode Driver::run(int argc, char *argv[]) {
      *   c) we're in the source tree - locate top of tree, and setup a new
      *      build model for an in-tree build.
      */
-    BuildModel model;
+    /* Nothing is expected to change underneath us during the build, other
+     * than the outputs we write ourselves. Directory handles can't be
+     * trusted across builds though (directories may have been replaced,
+     * or in server mode the working directory changed).
+     */
+    DirCache::get().clear();
+    StatCache statCache;
+    StatCache::Scope statScope(statCache);
+
+    /* A server keeps the model of the first request; one naming another
+     * source tree needs a model of its own.
+     */
+    Path requestedRoot;
+    if( !options.getSourceRoot().empty() ) {
+        requestedRoot = Path(absolutePath(Path::getCurrentDir(), options.getSourceRoot()));
+    }
+    if( model && !requestedRoot.isEmpty() && requestedRoot.str() != model->getSourceRoot().str() ) {
+        model.reset();
+    }
+
+    if( !model ) {
+        model = std::make_unique<BuildModel>();
+        BuildRoots roots;
+        {
+            Trace::Span span("findRoots", "driver");
+            roots = BuildRoots::find();
+        }
+        buildRoot = roots.buildRoot;
+        if( roots.hasBuildRoot() ) {
+            Trace::Span span("load", "driver");
+            model->load(roots.buildRoot + BUILD_CACHEDMODEL);
+        }
+        if( !requestedRoot.isEmpty() ) {
+            model->setSourceRoot(requestedRoot);
+        } else if( model->getSourceRoot().isEmpty() ) {
+            if( !roots.hasSourceRoot() ) {
+                std::cerr << PACKAGE_NAME << ": no " BUILD_FILENAME " file found in " <<
+                    Path::getCurrentDir().str() << " or any parent directory\n";
+                model.reset();
+                return ExitCode::EXITCODE_NOBUILD;
+            }
+            model->setSourceRoot(roots.sourceRoot);
+        }
+    }
+
+    /* Sources may have changed since the last build, but what was found in
+     * them is still good for the same content.
+     */
+    IncludeScanner &scanner = model->getIncludeScanner();
+    scanner.reset();
+    IncludeScanner::Scope scanScope(scanner);
 
     /* Check all build script files for up-to-date ness, and refresh the model
      * with any that are new or modified. Note we have to check everything even
      * in a limited build because we allow non-local changes to rules.
      */
-    model.ensureUpToDate();
+    {
+        Trace::Span span("ensureUpToDate", "driver");
+        model->ensureUpToDate(journal.get());
+    }
+    if( model->dirty() ) {
+        try {
+            model->save();
+        } catch( const std::system_error &e ) {
+            std::cerr << PACKAGE_NAME << ": unable to save build model: " << e.what() << "\n";
+        }
+    }
+
+    if( options.isAffectedMode() ) {
+        return affected(options, options.getTargets());
+    }
 
     /* Generate the build queue from the requested targets.
      * If targets are contradictory, the result will be as-if
@@ -77,6 +254,57 @@ ExitCode Driver::run(int argc, char *argv[]) {
 
 
     /* Run any post-build actions */
+
+    return ExitCode::EXITCODE_OK;
+}
+
+ExitCode Driver::affected(const Options &options, const std::vector<std::string> &files) {
+    /* With no targets at all, an empty answer would read as "nothing to build" */
+    if( model->getDependencies().size() == 0 ) {
+        std::cerr << PACKAGE_NAME << ": no targets are defined, so affected targets can't be determined\n";
+        return ExitCode::EXITCODE_NOTARGET;
+    }
+
+    /* The model names files by absolute path */
+    Path cwd = Path::getCurrentDir();
+    std::vector<std::string> changed;
+    changed.reserve(files.size());
+    for( const std::string &file : files ) {
+        changed.push_back(absolutePath(cwd, file));
+    }
+    std::vector<SymbolRef> targets = model->getAffectedTargets(changed);
+
+    if( options.getShardCount() > 1 ) {
+        /* Balance the shards by how long each target took last time, where
+         * known. A target's history is labelled with its name (see BuildLog).
+         * Every shard has to see the same costs to arrive at the same plan,
+         * so they can only come from a log that all the shards were given,
+         * not each one's own history; without one, all targets cost the same.
+         */
+        std::unique_ptr<BuildLog> history;
+        if( !options.getShardCostFile().empty() ) {
+            Path costFile(absolutePath(cwd, options.getShardCostFile()));
+            if( !costFile.isFile() ) {
+                std::cerr << PACKAGE_NAME << ": shard cost file '" << options.getShardCostFile() << "' not found\n";
+                return ExitCode::EXITCODE_USER;
+            }
+            history = std::make_unique<BuildLog>(costFile);
+        }
+        ShardPlanner planner(options.getShardCount(), [&](SymbolRef target) {
+            BuildLog::Entry entry;
+            if( history && history->lookupLabel(std::string_view(target.data(), target.length()), entry) ) {
+                return (entry.end - entry.start) / 1e9;
+            }
+            return 0.0;
+        });
+        targets = planner.select(targets, options.getShardIndex());
+    }
+
+    for( SymbolRef target : targets ) {
+        std::cout << target.data() << "\n";
+    }
+    std::cout.flush();
+    return ExitCode::EXITCODE_OK;
 }
 
 }
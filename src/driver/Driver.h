@@ -18,15 +18,73 @@
 #ifndef FABR_DRIVER_DRIVER_H
 #define FABR_DRIVER_DRIVER_H
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "driver/ExitCode.h"
+#include "support/Path.h"
 
 namespace fabr {
 
+class BuildModel;
+class ChangeJournal;
+class Options;
+
 class Driver {
+private:
+    /**
+     * The build model. This is retained between builds, so that a build
+     * server only has to refresh it rather than reload it each time.
+     */
+    std::unique_ptr<BuildModel> model;
+
+    /**
+     * The build root the model belongs to, or empty if there isn't one yet.
+     */
+    Path buildRoot;
+
+    /**
+     * Records source changes between builds, if we're long-running.
+     */
+    std::unique_ptr<ChangeJournal> journal;
+
+    /**
+     * Build repeatedly, waiting for changes between builds.
+     */
+    ExitCode watch(const Options &options);
+
+    /**
+     * The body of build(), without the profiling wrapper.
+     */
+    ExitCode runBuild(const Options &options);
+
+    /**
+     * Print the targets affected by changes to the given files (fabr
+     * --affected), or just this shard's share of them.
+     */
+    ExitCode affected(const Options &options, const std::vector<std::string> &files);
+
 public:
-    Driver() { }
+    Driver();
+    ~Driver();
 
+    /**
+     * Main entry point: parse the command line, and either forward it to a
+     * running build server or run the build in-process.
+     */
     ExitCode run(int argc, char *argv[]);
+
+    /**
+     * Start tracking source changes between builds. This only makes sense
+     * if the driver will be used for multiple builds.
+     */
+    void enableChangeJournal();
+
+    /**
+     * Run a single build in-process with the given (parsed) options.
+     */
+    ExitCode build(const Options &options);
 };
 
 }
@@ -29,6 +29,7 @@ enum class ExitCode {
     EXITCODE_NOBUILD = 2, /* No build files found */
     EXITCODE_BADBUILD = 3,/* Invalid build files */
     EXITCODE_NOTARGET = 4,/* Requested target not in build */
+    EXITCODE_SYSTEM = 5,  /* Unexpected system error */
 };
 
 }
@@ -17,28 +17,84 @@
 
 #include "driver/Options.h"
 
+#include <ctype.h>
+#include <errno.h>
 #include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <iostream>
 
+/* Upper limit on --shard=i/N, well beyond any sensible number of builders */
+#define MAX_SHARDS 4096
+
 namespace fabr {
 
+enum {
+    OPT_SERVER = 0x100,
+    OPT_NOSERVER,
+    OPT_WATCH,
+    OPT_PROFILE,
+    OPT_STATS,
+    OPT_SHARD,
+    OPT_SHARD_COSTS,
+    OPT_AFFECTED,
+};
+
 static const char shortOptions[] = "h";
 static const struct option longOptions[] = {
     { const_cast<char *>("help"), no_argument, nullptr, 'h' },
+    { const_cast<char *>("server"), no_argument, nullptr, OPT_SERVER },
+    { const_cast<char *>("no-server"), no_argument, nullptr, OPT_NOSERVER },
+    { const_cast<char *>("watch"), no_argument, nullptr, OPT_WATCH },
+    { const_cast<char *>("profile"), required_argument, nullptr, OPT_PROFILE },
+    { const_cast<char *>("stats"), optional_argument, nullptr, OPT_STATS },
+    { const_cast<char *>("shard"), required_argument, nullptr, OPT_SHARD },
+    { const_cast<char *>("shard-costs"), required_argument, nullptr, OPT_SHARD_COSTS },
+    { const_cast<char *>("affected"), no_argument, nullptr, OPT_AFFECTED },
     { nullptr, 0, nullptr, 0 }
 };
 
+/**
+ * Parse a decimal number in [1, MAX_SHARDS] at p, without sign or leading
+ * space (which strtoul would otherwise accept).
+ * @return the number, or 0 if there isn't a valid one.
+ */
+static unsigned parseShardNumber( const char *p, char **end ) {
+    if( !isdigit((unsigned char)*p) ) {
+        return 0;
+    }
+    errno = 0;
+    unsigned long value = strtoul(p, end, 10);
+    if( errno != 0 || value > MAX_SHARDS ) {
+        return 0;
+    }
+    return value;
+}
+
 void Options::printUsage() {
     std::cerr
             << "Usage: fabr [options] [targets]\n"
             << "  fabr <target-list>\n"
             << "  fabr init <source-dir>\n"
+            << "  fabr --affected <file-list>\n"
             << "  fabr run <target> [arguments]\n\n"
             << "Options:\n"
             << "  -D<property>=<value>  Set the given property.\n"
             << "  -n                    Dry-run only.\n"
-            << "  -U<property>          Unset the given property.\n";
+            << "  -U<property>          Unset the given property.\n"
+            << "  --server              Run as a build server for the current build root.\n"
+            << "  --no-server           Always build in-process, even if a server is running.\n"
+            << "  --watch               Rebuild the targets whenever their sources change.\n"
+            << "  --profile=<file>      Write a Chrome trace-event profile of the build to file.\n"
+            << "  --stats[=json]        Print internal counters for the build, as text or JSON.\n"
+            << "  --affected            List the targets affected by the given files, instead of\n"
+            << "                        building.\n"
+            << "  --shard=<i>/<n>       With --affected, only list the i'th of n shards of the\n"
+            << "                        targets (from 1).\n"
+            << "  --shard-costs=<log>   Balance shards by the target times in the given build log\n"
+            << "                        (which every shard must be given).\n";
 }
 
 void Options::printHeader() {
@@ -46,16 +102,82 @@ void Options::printHeader() {
 }
 
 ExitCode Options::parse(int argc, char *argv[]) {
+    /* Reset getopt, as the build server parses a fresh argv for each request */
+#if defined(__APPLE__) || defined(__FreeBSD__)
+    optreset = 1;
+    optind = 1;
+#else
+    optind = 0;
+#endif
+
     int opt;
     while( (opt = getopt_long(argc, argv, shortOptions, longOptions, nullptr)) != -1 ) {
         switch(opt) {
         case 'h':
             printUsage();
+            helpOnly = true;
             return ExitCode::EXITCODE_OK;
-
+        case OPT_SERVER:
+            serverMode = true;
+            break;
+        case OPT_NOSERVER:
+            noServer = true;
+            break;
+        case OPT_WATCH:
+            watchMode = true;
+            break;
+        case OPT_PROFILE:
+            profileFile = optarg;
+            break;
+        case OPT_STATS:
+            if( optarg == nullptr || strcmp(optarg, "text") == 0 ) {
+                statsFormat = STATS_TEXT;
+            } else if( strcmp(optarg, "json") == 0 ) {
+                statsFormat = STATS_JSON;
+            } else {
+                std::cerr << "Unknown stats format '" << optarg << "'\n";
+                printUsage();
+                return ExitCode::EXITCODE_USER;
+            }
+            break;
+        case OPT_SHARD: {
+            char *end;
+            unsigned index = parseShardNumber(optarg, &end);
+            unsigned count = 0;
+            if( index != 0 && *end == '/' ) {
+                count = parseShardNumber(end + 1, &end);
+            }
+            if( index == 0 || count == 0 || *end != '\0' || index > count ) {
+                std::cerr << "Invalid shard '" << optarg << "', expected <i>/<n> with 1 <= i <= n <= "
+                          << MAX_SHARDS << "\n";
+                printUsage();
+                return ExitCode::EXITCODE_USER;
+            }
+            shardIndex = index - 1;
+            shardCount = count;
+            break;
         }
+        case OPT_SHARD_COSTS:
+            shardCostFile = optarg;
+            break;
+        case OPT_AFFECTED:
+            affectedMode = true;
+            break;
+        default:
+            printUsage();
+            return ExitCode::EXITCODE_USER;
+        }
+    }
+
+    /* Only the affected listing can be sharded so far */
+    if( (shardCount != 0 || !shardCostFile.empty()) && !affectedMode ) {
+        std::cerr << "--shard and --shard-costs are only supported with --affected\n";
+        printUsage();
+        return ExitCode::EXITCODE_USER;
     }
 
+    targets.assign(argv + optind, argv + argc);
+    return ExitCode::EXITCODE_OK;
 }
 
 }
@@ -29,11 +29,25 @@ namespace fabr {
  * Manages command-line options for the build tool.
  */
 class Options {
+public:
+    enum StatsFormat { STATS_NONE, STATS_TEXT, STATS_JSON };
+
 private:
     std::vector<std::string> targets;
 
     std::string sourceRoot;
     std::string buildRoot;
+    std::string profileFile;
+    StatsFormat statsFormat = STATS_NONE;
+    unsigned shardIndex = 0;
+    unsigned shardCount = 0;
+    std::string shardCostFile;
+
+    bool helpOnly = false;
+    bool serverMode = false;
+    bool noServer = false;
+    bool watchMode = false;
+    bool affectedMode = false;
 
     void printHeader();
     void printUsage();
@@ -53,9 +67,84 @@ public:
         return buildRoot;
     }
 
+    /**
+     * @return the file to write a trace of the build to (--profile), or an
+     * empty string if not profiling.
+     */
+    const std::string &getProfileFile() const {
+        return profileFile;
+    }
+
+    /**
+     * @return the format to print internal counters in after the build
+     * (--stats), or STATS_NONE.
+     */
+    StatsFormat getStatsFormat() const {
+        return statsFormat;
+    }
+
+    /**
+     * @return the number of shards the affected targets are split into
+     * (--shard=i/N), or 0 if they aren't sharded.
+     */
+    unsigned getShardCount() const {
+        return shardCount;
+    }
+
+    /**
+     * @return the shard to list, counting from 0 (i.e. i-1).
+     */
+    unsigned getShardIndex() const {
+        return shardIndex;
+    }
+
+    /**
+     * @return the build log to take target costs from when sharding
+     * (--shard-costs), or an empty string to treat all targets as equal.
+     */
+    const std::string &getShardCostFile() const {
+        return shardCostFile;
+    }
+
     const std::vector<std::string> &getTargets() const {
         return targets;
     }
+
+    /**
+     * @return true if the user only asked for usage information.
+     */
+    bool isHelpOnly() const {
+        return helpOnly;
+    }
+
+    /**
+     * @return true if we should run as a build server (--server).
+     */
+    bool isServerMode() const {
+        return serverMode;
+    }
+
+    /**
+     * @return true if the build must not be forwarded to a build server.
+     */
+    bool isNoServer() const {
+        return noServer;
+    }
+
+    /**
+     * @return true if we should keep rebuilding as sources change (--watch).
+     */
+    bool isWatchMode() const {
+        return watchMode;
+    }
+
+    /**
+     * @return true if we should list the targets affected by the files given
+     * in place of targets, rather than build anything (--affected).
+     */
+    bool isAffectedMode() const {
+        return affectedMode;
+    }
 };
 
 }
@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "driver/Constants.h"
+#include "driver/ServerConnection.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+/* Not available on macOS; SO_NOSIGPIPE is set on the socket instead */
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace fabr {
+
+/* Sanity limit on received string/list sizes, to avoid trying to allocate
+ * garbage lengths from a misbehaving peer.
+ */
+#define MAX_MESSAGE_SIZE (64*1024*1024)
+
+/* Likewise for the number of strings in a list (arguments or environment),
+ * as each costs a std::string up front.
+ */
+#define MAX_STRING_COUNT (64*1024)
+
+ServerConnection::~ServerConnection() {
+    if( fd != -1 ) {
+        ::close(fd);
+    }
+}
+
+ServerConnection &ServerConnection::operator=( ServerConnection &&conn ) {
+    if( this != &conn ) {
+        if( fd != -1 ) {
+            ::close(fd);
+        }
+        fd = conn.fd;
+        conn.fd = -1;
+    }
+    return *this;
+}
+
+bool ServerConnection::writeAll( const void *buf, size_t length ) {
+    const char *p = (const char *)buf;
+    while( length > 0 ) {
+        ssize_t len = ::send(fd, p, length, MSG_NOSIGNAL);
+        if( len == -1 ) {
+            if( errno == EINTR )
+                continue;
+            return false;
+        }
+        p += len;
+        length -= len;
+    }
+    return true;
+}
+
+bool ServerConnection::readAll( void *buf, size_t length ) {
+    char *p = (char *)buf;
+    while( length > 0 ) {
+        ssize_t len = ::recv(fd, p, length, 0);
+        if( len == -1 && errno == EINTR ) {
+            continue;
+        } else if( len <= 0 ) {
+            return false;
+        }
+        p += len;
+        length -= len;
+    }
+    return true;
+}
+
+bool ServerConnection::writeUint32( uint32_t value ) {
+    return writeAll(&value, sizeof(value));
+}
+
+bool ServerConnection::writeString( std::string_view str ) {
+    return writeUint32(str.size()) && writeAll(str.data(), str.size());
+}
+
+bool ServerConnection::writeStrings( const std::vector<std::string> &strs ) {
+    if( !writeUint32(strs.size()) )
+        return false;
+    for( auto &str : strs ) {
+        if( !writeString(str) )
+            return false;
+    }
+    return true;
+}
+
+bool ServerConnection::readUint32( uint32_t &value ) {
+    return readAll(&value, sizeof(value));
+}
+
+bool ServerConnection::readString( std::string &str ) {
+    uint32_t length;
+    if( !readUint32(length) || length > MAX_MESSAGE_SIZE )
+        return false;
+    str.resize(length);
+    return readAll(str.data(), length);
+}
+
+bool ServerConnection::readStrings( std::vector<std::string> &strs ) {
+    uint32_t count;
+    if( !readUint32(count) || count > MAX_STRING_COUNT )
+        return false;
+    strs.resize(count);
+    for( auto &str : strs ) {
+        if( !readString(str) )
+            return false;
+    }
+    return true;
+}
+
+bool ServerConnection::setTimeout( int seconds ) {
+    struct timeval tv = { seconds, 0 };
+    return ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == 0 &&
+           ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == 0;
+}
+
+bool ServerConnection::isPeerSameUser() const {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if( ::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || len != sizeof(cred) ) {
+        return false;
+    }
+    return cred.uid == ::geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return ::getpeereid(fd, &uid, &gid) == 0 && uid == ::geteuid();
+#endif
+}
+
+bool ServerConnection::sendFds( const int *fds, int count ) {
+    char dummy = 0;
+    struct iovec iov = { &dummy, 1 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    ssize_t len;
+    do {
+        len = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while( len == -1 && errno == EINTR );
+    return len == 1;
+}
+
+bool ServerConnection::receiveFds( int *fds, int count ) {
+    char dummy;
+    struct iovec iov = { &dummy, 1 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    ssize_t len;
+    do {
+        len = ::recvmsg(fd, &msg, 0);
+    } while( len == -1 && errno == EINTR );
+    if( len == -1 )
+        return false;
+
+    /* Collect whatever descriptors arrived, even if the message turns out to
+     * be malformed, so that they can be closed rather than leaked.
+     */
+    std::vector<int> received;
+    for( struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg) ) {
+        if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+                cmsg->cmsg_len >= CMSG_LEN(0) ) {
+            size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const unsigned char *data = CMSG_DATA(cmsg);
+            for( size_t i = 0; i < n; i++ ) {
+                int received_fd;
+                memcpy(&received_fd, data + i * sizeof(int), sizeof(int));
+                received.push_back(received_fd);
+            }
+        }
+    }
+
+    if( len != 1 || (msg.msg_flags & MSG_CTRUNC) != 0 || received.size() != (size_t)count ) {
+        for( int received_fd : received ) {
+            ::close(received_fd);
+        }
+        return false;
+    }
+    memcpy(fds, received.data(), sizeof(int) * count);
+    return true;
+}
+
+ServerConnection ServerConnection::connect( const std::string &socketPath ) {
+    struct sockaddr_un addr;
+    if( socketPath.size() >= sizeof(addr.sun_path) ) {
+        return ServerConnection();
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    ServerConnection conn(::socket(AF_UNIX, SOCK_STREAM, 0));
+    if( !conn.isValid() ) {
+        return conn;
+    }
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    ::setsockopt(conn.fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    if( ::connect(conn.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ) {
+        return ServerConnection();
+    }
+    return conn;
+}
+
+const char *ServerConnection::getVersion() {
+    return PACKAGE_NAME " " PACKAGE_VERSION " (" __DATE__ " " __TIME__ ")";
+}
+
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_DRIVER_SERVERCONNECTION_H
+#define FABR_DRIVER_SERVERCONNECTION_H
+
+#include <stdint.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fabr {
+
+/**
+ * One end of a client/server connection over a Unix-domain stream socket,
+ * owning the socket fd. The wire format is deliberately trivial: native-endian
+ * 32-bit integers, and strings as a length followed by the bytes. Both ends
+ * are always the same binary (checked by the version handshake), so there's
+ * no need for anything more portable.
+ *
+ * Unlike File, errors are reported by return value rather than exceptions, as
+ * the peer going away is an expected condition that callers need to handle.
+ */
+class ServerConnection {
+private:
+    int fd;
+
+    bool writeAll( const void *buf, size_t length );
+    bool readAll( void *buf, size_t length );
+
+public:
+    /** Request sent by the client to open a session */
+    static const uint32_t Magic = 0x46414252; /* "FABR" */
+
+    /** Server responses to the handshake */
+    enum Response : uint32_t {
+        ACCEPT = 1,
+        REJECT = 2,
+    };
+
+    explicit ServerConnection( int fd = -1 ) : fd(fd) { }
+    ServerConnection( ServerConnection &&conn ) : fd(conn.fd) {
+        conn.fd = -1;
+    }
+    ServerConnection( const ServerConnection & ) = delete;
+    ~ServerConnection();
+
+    ServerConnection &operator=( ServerConnection &&conn );
+
+    bool isValid() const {
+        return fd != -1;
+    }
+    int getFd() const {
+        return fd;
+    }
+
+    bool writeUint32( uint32_t value );
+    bool writeString( std::string_view str );
+    bool writeStrings( const std::vector<std::string> &strs );
+
+    bool readUint32( uint32_t &value );
+    bool readString( std::string &str );
+    bool readStrings( std::vector<std::string> &strs );
+
+    /**
+     * Limit the time any single send or receive may block for, after which
+     * it fails.
+     * @param seconds the limit, or 0 to wait indefinitely.
+     */
+    bool setTimeout( int seconds );
+
+    /**
+     * @return true if the peer is running as the same user as us, and so
+     * may be trusted with our build (and its file descriptors with us).
+     */
+    bool isPeerSameUser() const;
+
+    /**
+     * Pass the given file descriptors to the peer (SCM_RIGHTS).
+     */
+    bool sendFds( const int *fds, int count );
+
+    /**
+     * Receive exactly count file descriptors sent by sendFds. On failure
+     * (including truncated or unexpected control data) any descriptors that
+     * did arrive are closed.
+     */
+    bool receiveFds( int *fds, int count );
+
+    /**
+     * Connect to the server listening on the given socket path.
+     * @return the connection, which is invalid on failure.
+     */
+    static ServerConnection connect( const std::string &socketPath );
+
+    /**
+     * @return the version string exchanged in the handshake. Client and
+     * server must match exactly, as the server is holding in-memory state
+     * that is only meaningful to the same build of fabr.
+     */
+    static const char *getVersion();
+};
+
+}
+
+#endif /* !FABR_DRIVER_SERVERCONNECTION_H */
@@ -15,19 +15,260 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "driver/Constants.h"
 #include "model/BuildModel.h"
+#include "support/Buffer.h"
+#include "support/ChangeJournal.h"
+#include "support/DirWalker.h"
+#include "support/File.h"
+#include "support/OutputFile.h"
+#include "support/StatCache.h"
+#include "support/Trace.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <mutex>
+#include <unordered_set>
+#include <vector>
+
+/* 'FBMD' */
+#define BUILD_MODEL_MAGIC 0x46424d44
+#define BUILD_MODEL_VERSION 1
 
 namespace fabr {
 
+namespace {
+
+struct ModelHeader {
+    uint32_t magic;
+    uint32_t version;
+};
+
+template<typename T>
+void writeValue( std::string &out, T value ) {
+    out.append((const char *)&value, sizeof(value));
+}
+
+template<typename T>
+bool readValue( const char *&p, const char *end, T &value ) {
+    if( (size_t)(end - p) < sizeof(value) ) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+void writeString( std::string &out, std::string_view str ) {
+    writeValue<uint32_t>(out, str.size());
+    out.append(str.data(), str.size());
+}
+
+bool readString( const char *&p, const char *end, std::string &str ) {
+    uint32_t length;
+    if( !readValue(p, end, length) || length > (size_t)(end - p) ) {
+        return false;
+    }
+    str.assign(p, length);
+    p += length;
+    return true;
+}
+
+}
+
 BuildModel::BuildModel() {
 
 }
 
 void BuildModel::load( const Path &path ) {
+    cacheFile = path;
+    std::unique_ptr<Buffer> content;
+    try {
+        content = File::getBuffer(path.str());
+    } catch( const std::system_error & ) {
+        return;
+    }
+
+    /* Anything we don't recognise is just ignored, and replaced on save */
+    const char *p = content->data(), *end = content->end();
+    ModelHeader header;
+    std::string root, script;
+    uint32_t count;
+    if( !readValue(p, end, header) || header.magic != BUILD_MODEL_MAGIC ||
+            header.version != BUILD_MODEL_VERSION || !readString(p, end, root) ||
+            !readValue(p, end, count) ) {
+        return;
+    }
+    std::map<std::string, int64_t> loaded;
+    for( uint32_t i = 0; i < count; i++ ) {
+        int64_t mtime;
+        if( !readString(p, end, script) || !readValue(p, end, mtime) ) {
+            return;
+        }
+        loaded.emplace(script, mtime);
+    }
+    if( !dependencies.read(p, end) || p != end ) {
+        dependencies.clear();
+        return;
+    }
+    sourceRoot = Path(root);
+    scripts = std::move(loaded);
+    modified = false;
 }
 
-void BuildModel::ensureUpToDate() {
+void BuildModel::save( const Path &path ) const {
+    std::string out;
+    writeValue(out, ModelHeader{ BUILD_MODEL_MAGIC, BUILD_MODEL_VERSION });
+    writeString(out, sourceRoot.str());
+    writeValue<uint32_t>(out, scripts.size());
+    for( auto &it : scripts ) {
+        writeString(out, it.first);
+        writeValue(out, it.second);
+    }
+    dependencies.write(out);
+
+    OutputFile file(path, 0644);
+    file.write(out.data(), out.size());
+    file.commit();
+    modified = false;
+}
+
+void BuildModel::save() const {
+    if( !cacheFile.isEmpty() ) {
+        save(cacheFile);
+    }
+}
+
+void BuildModel::defineTarget( SymbolRef target, std::string_view script, const std::vector<SymbolRef> &inputs ) {
+    dependencies.define(target, SymbolRef::get(script), inputs);
+    modified = true;
+}
+
+std::vector<SymbolRef> BuildModel::getAffectedTargets( const std::vector<std::string> &changed ) const {
+    std::vector<SymbolRef> nodes;
+    nodes.reserve(changed.size());
+    for( const std::string &name : changed ) {
+        nodes.push_back(SymbolRef::get(name));
+    }
+    std::vector<SymbolRef> affected = dependencies.getAffected(nodes);
+    std::sort(affected.begin(), affected.end(), []( SymbolRef a, SymbolRef b ) {
+        return strcmp(a.data(), b.data()) < 0;
+    });
+    return affected;
+}
+
+std::error_code BuildModel::parseBuild( std::string_view file ) {
+    Path path(file);
+    int64_t mtime = path.getModifiedTime();
+    if( mtime == -1 ) {
+        return std::make_error_code(std::errc::no_such_file_or_directory);
+    }
+    /* The script's targets are defined afresh by parsing it */
+    dependencies.removeScript(SymbolRef::get(path.str()));
+    scripts[path.str()] = mtime;
+    modified = true;
+    return std::error_code();
+}
+
+void BuildModel::ensureUpToDate( ChangeJournal *journal ) {
+    ChangeSet changes;
+    if( journal != nullptr ) {
+        changes = journal->takeChanges();
+    }
+
+    std::vector<std::string> stale;
+    if( scripts.empty() && !sourceRoot.isEmpty() ) {
+        stale.push_back((sourceRoot + BUILD_FILENAME).str());
+        if( journal != nullptr ) {
+            journal->watch(sourceRoot);
+        }
+    }
+
+    /* Look for new build scripts, unless the journal can vouch that no
+     * directory has changed since we last looked. That needs every
+     * directory in the tree watched, not just those with scripts, so that
+     * a new script anywhere shows up. A source root without a BUILD file
+     * isn't a source tree at all, so don't go walking it.
+     */
+    bool hasRootScript = !sourceRoot.isEmpty() && sourceRoot.isFile(BUILD_FILENAME);
+    if( hasRootScript && (scripts.empty() || !changes.isComplete()) ) {
+        Trace::Span span("discover", "model");
+        DirWalker walker;
+        walker.exclude("/" BUILD_CACHEDIR);
+        SymbolRef buildFile = SymbolRef::get(BUILD_FILENAME);
+        std::unordered_set<std::string> found(stale.begin(), stale.end());
+        std::mutex lock;
+        if( journal != nullptr ) {
+            journal->watch(sourceRoot);
+        }
+        walker.walk(PathRef(sourceRoot), [&]( PathRef path, DirWalker::EntryType type ) {
+            if( type == DirWalker::DIRECTORY && journal != nullptr ) {
+                /* The journal isn't thread safe */
+                std::lock_guard<std::mutex> guard(lock);
+                journal->watch(path.toPath());
+            } else if( type == DirWalker::FILE && path.basename() == buildFile ) {
+                std::string script = path.str();
+                std::lock_guard<std::mutex> guard(lock);
+                if( scripts.find(script) == scripts.end() && found.insert(script).second ) {
+                    stale.push_back(std::move(script));
+                }
+            }
+        });
+    } else if( hasRootScript ) {
+        /* Every directory is watched, so a new script shows up by name */
+        for( const std::string &path : changes.getPaths() ) {
+            if( Path(path).basename() == BUILD_FILENAME && scripts.find(path) == scripts.end() &&
+                    Path(path).isFile() ) {
+                stale.push_back(path);
+            }
+        }
+    }
+
+    std::vector<std::map<std::string, int64_t>::iterator> check;
+    std::vector<PathRef> prefetch;
+    for( auto it = scripts.begin(); it != scripts.end(); ++it ) {
+        Path path(it->first);
+        /* Watch before checking, so that a change racing with the check is
+         * picked up next time.
+         */
+        if( journal != nullptr ) {
+            journal->watch(Path(path.dirname()));
+        }
+        if( changes.contains(path) ) {
+            check.push_back(it);
+            prefetch.push_back(PathRef(it->first));
+        }
+    }
+
+    /* Stat everything we need up front, in parallel */
+    {
+        Trace::Span span("checkScripts", "model");
+        if( StatCache *cache = StatCache::getCurrent() ) {
+            cache->prefetch(prefetch);
+        }
+        for( auto &it : check ) {
+            if( Path(it->first).getModifiedTime() != it->second ) {
+                stale.push_back(it->first);
+            }
+        }
+    }
+
+    for( auto &script : stale ) {
+        Trace::Span span("parse", "model", Trace::isEnabled() ? SymbolRef::get(script).data() : nullptr);
+        std::error_code error = parseBuild(script);
+        if( error ) {
+            /* Script has been removed, along with its targets */
+            if( scripts.erase(script) > 0 ) {
+                dependencies.removeScript(SymbolRef::get(script));
+                modified = true;
+            }
+        }
+    }
+}
 
+bool BuildModel::dirty() const {
+    return modified;
 }
 
 }
@@ -32,13 +32,23 @@
 #ifndef FABR_MODEL_BUILDMODEL_H
 #define FABR_MODEL_BUILDMODEL_H
 
+#include <stdint.h>
+
+#include <map>
+#include <string>
 #include <system_error>
 #include <string_view>
+#include <vector>
+
+#include "model/ConfiguredTargetSet.h"
+#include "model/DependencyIndex.h"
+#include "support/IncludeScanner.h"
+#include "support/Path.h"
 
 namespace fabr {
 
 class BuildQueue;
-class Path;
+class ChangeJournal;
 
 class BuildModel {
 private:
@@ -48,16 +58,46 @@ private:
     // RulesDictionary rules;
     /** provides the set of actual targets */
     // TargetDictionary targets;
+    /** provides the analysed (target, configuration) nodes */
+    ConfiguredTargetSet configurations;
+    /** dependency edges between targets and files, both ways */
+    DependencyIndex dependencies;
+    /** includes found in source files, kept between builds */
+    IncludeScanner includeScanner;
+
+    /** top of the source tree */
+    Path sourceRoot;
+    /** build scripts that make up the model, and their mtime when parsed */
+    std::map<std::string, int64_t> scripts;
+    /** file the model was loaded from, and is saved back to */
+    Path cacheFile;
+    mutable bool modified = false;
 
 public:
     /************* Initialization and parsing *************/
     BuildModel();
 
+    /**
+     * Set the top of the source tree, which holds the top-level build script.
+     */
+    void setSourceRoot( const Path &root ) {
+        sourceRoot = root;
+    }
+    const Path &getSourceRoot() const {
+        return sourceRoot;
+    }
+
     /**
      * Parse in a single build script file
      */
     std::error_code parseBuild(std::string_view file);
 
+    /**
+     * Define a target from the given script, with its direct inputs (files
+     * by absolute path, or other targets), replacing any earlier definition.
+     */
+    void defineTarget( SymbolRef target, std::string_view script, const std::vector<SymbolRef> &inputs );
+
     /**
      * Set the given named property. If hard, the property is
      * treated as an underivable input regardless of the model
@@ -83,9 +123,12 @@ public:
     /**
      * Check the model itself for up-to-dateness, and (re)parse and resolve
      * any new or modified scripts.
+     * @param journal if non-null, used to skip checking scripts that are known
+     * not to have changed since the last call. The script directories are
+     * added to the journal's watch list.
      * @return error code if any error occurs.
      */
-    void ensureUpToDate();
+    void ensureUpToDate( ChangeJournal *journal = nullptr );
 
     /******************** Operation ***********************/
 
@@ -100,11 +143,42 @@ public:
      */
     bool queueTarget( BuildQueue &queue, std::string_view target );
 
+    /**
+     * @return the set of configured target nodes, where targets requested
+     * under several tag sets share a node wherever their rule can't tell
+     * them apart (once target analysis populates it).
+     */
+    ConfiguredTargetSet &getConfigurations() {
+        return configurations;
+    }
+
+    /**
+     * @return the scanner for rules to find C-family dependencies with.
+     */
+    IncludeScanner &getIncludeScanner() {
+        return includeScanner;
+    }
+
+    /**
+     * @return the dependency edges of the model.
+     */
+    const DependencyIndex &getDependencies() const {
+        return dependencies;
+    }
+
+    /**
+     * @return the targets that depend directly or transitively on any of
+     * the given files (absolute paths) or targets, sorted by name.
+     */
+    std::vector<SymbolRef> getAffectedTargets( const std::vector<std::string> &changed ) const;
+
     /*************** Model cache handling *****************/
 
     /**
      * Load the model from the given file. Note this expects a binary
-     * serialization of the model, not the original scripts.
+     * serialization of the model, not the original scripts. A missing or
+     * unrecognised file is ignored (leaving the model empty), but is still
+     * remembered for save().
      */
     void load(const Path &file);
 
@@ -15,10 +15,199 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "driver/Constants.h"
 #include "model/BuildRule.h"
+#include "model/Planning.h"
+#include "support/Buffer.h"
+#include "support/File.h"
+#include "support/OutputFile.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <system_error>
+#include <unordered_set>
 
 namespace fabr {
 
+namespace {
+
+enum class Language { NONE, C, CXX };
+
+Language getLanguage( SymbolRef name ) {
+    const char *dot = strrchr(name.data(), '.');
+    if( dot == nullptr ) {
+        return Language::NONE;
+    }
+    if( strcmp(dot, ".c") == 0 ) {
+        return Language::C;
+    }
+    if( strcmp(dot, ".cc") == 0 || strcmp(dot, ".cpp") == 0 || strcmp(dot, ".cxx") == 0 ||
+            strcmp(dot, ".c++") == 0 || strcmp(dot, ".C") == 0 ) {
+        return Language::CXX;
+    }
+    return Language::NONE;
+}
+
+void makeDirectory( const Path &dir ) {
+    if( ::mkdir(dir.str().c_str(), 0777) == -1 && errno != EEXIST ) {
+        throw std::system_error(errno, std::system_category());
+    }
+}
+
+/**
+ * @return a directory name for the target, which is readable but can't
+ * collide with another target's.
+ */
+std::string getUnityDirName( SymbolRef target ) {
+    std::string name;
+    for( uint32_t i = 0; i < target.length(); i++ ) {
+        char c = target.data()[i];
+        name.push_back(isalnum((unsigned char)c) || c == '-' || c == '.' ? c : '_');
+    }
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "-%08x",
+             (uint32_t)stableHash(std::string_view(target.data(), target.length())));
+    return name + suffix;
+}
+
+/**
+ * Write the file if its content differs from what is already there, so
+ * that an unchanged batch keeps its timestamp.
+ */
+void updateFile( const Path &path, const std::string &content ) {
+    if( path.isFile() ) {
+        std::unique_ptr<Buffer> existing = File::getBuffer(path.str());
+        if( existing->size() == content.size() && memcmp(existing->data(), content.data(), content.size()) == 0 ) {
+            return;
+        }
+    }
+    OutputFile out(path);
+    out.write(content.data(), content.size());
+    out.commit();
+}
+
+}
+
+SymbolRef BuildRule::getProperty( const PropertySet &tags, SymbolRef property ) {
+    addUsedProperty(property);
+    auto it = tags.find(property);
+    return it == tags.end() ? SymbolRef() : it->second;
+}
+
+void BuildRule::addUsedProperty( SymbolRef property ) {
+    if( usedProperties.insert(property).second ) {
+        generation++;
+    }
+}
+
+PropertySet BuildRule::getRelevantTags( const PropertySet &tags ) const {
+    PropertySet result;
+    /* Both sets are ordered the same way, so walk them in parallel */
+    auto used = usedProperties.begin();
+    for( auto &tag : tags ) {
+        while( used != usedProperties.end() && *used < tag.first ) {
+            ++used;
+        }
+        if( used == usedProperties.end() ) {
+            break;
+        }
+        if( *used == tag.first ) {
+            result.insert(result.end(), tag);
+        }
+    }
+    return result;
+}
 
+IncludeScanner::Dependencies BuildRule::scanIncludes( PathRef source, const IncludePath &paths ) const {
+    if( IncludeScanner *scanner = IncludeScanner::getCurrent() ) {
+        return scanner->scan(source, paths);
+    }
+    IncludeScanner scanner;
+    return scanner.scan(source, paths);
+}
+
+std::vector<BuildRule::CompileUnit> BuildRule::getUnityBatches( const Path &buildRoot, SymbolRef target,
+                                                                const std::vector<PathRef> &sources,
+                                                                const UnityPlanner &planner ) const {
+    std::vector<CompileUnit> result;
+    std::vector<PathRef> c, cxx;
+    for( PathRef source : sources ) {
+        switch( getLanguage(source.basename()) ) {
+        case Language::C:
+            c.push_back(source);
+            break;
+        case Language::CXX:
+            cxx.push_back(source);
+            break;
+        default:
+            result.push_back(CompileUnit{source, {source}});
+            break;
+        }
+    }
+
+    Path dir = buildRoot + BUILD_CACHEDIR + "unity";
+    makeDirectory(dir);
+    dir = dir + getUnityDirName(target);
+    makeDirectory(dir);
+
+    /* Batch files are named after their first member, which is stable
+     * for as long as the batch is.
+     */
+    std::unordered_set<std::string> current;
+    std::string cwd;
+    auto addBatches = [&]( const std::vector<PathRef> &group, const char *extension ) {
+        for( UnityPlanner::Batch &batch : planner.plan(group) ) {
+            if( batch.sources.size() == 1 ) {
+                result.push_back(CompileUnit{batch.sources[0], std::move(batch.sources)});
+                continue;
+            }
+            PathRef first = batch.sources[0];
+            std::string_view stem(first.basename().data(), first.basename().length());
+            stem = stem.substr(0, stem.rfind('.'));
+            char suffix[24];
+            snprintf(suffix, sizeof(suffix), "-%08x%s", (uint32_t)UnityPlanner::hash(first), extension);
+            std::string name = std::string(stem) + suffix;
+            current.insert(name);
+
+            std::string content = "/* Unity batch generated by fabr for ";
+            content.append(target.data(), target.length());
+            content += " - do not edit */\n";
+            for( PathRef source : batch.sources ) {
+                content += "#include \"";
+                if( !source.isAbsolute() ) {
+                    if( cwd.empty() ) {
+                        cwd = Path::getCurrentDir().str() + "/";
+                    }
+                    content += cwd;
+                }
+                source.appendTo(content);
+                content += "\"\n";
+            }
+            Path file = dir + name;
+            updateFile(file, content);
+            result.push_back(CompileUnit{PathRef(file), std::move(batch.sources)});
+        }
+    };
+    addBatches(c, ".c");
+    addBatches(cxx, ".cpp");
+
+    /* Clear out batches from earlier plans */
+    if( DIR *d = opendir(dir.str().c_str()) ) {
+        while( struct dirent *entry = readdir(d) ) {
+            if( entry->d_name[0] != '.' && current.count(entry->d_name) == 0 ) {
+                unlinkat(dirfd(d), entry->d_name, 0);
+            }
+        }
+        closedir(d);
+    }
+    return result;
+}
 
 }
@@ -19,6 +19,11 @@
 #define FABR_MODEL_BUILDRULE_H
 
 #include <list>
+#include <vector>
+
+#include "model/Symbol.h"
+#include "model/UnityPlanner.h"
+#include "support/IncludeScanner.h"
 
 namespace fabr {
 
@@ -26,9 +31,99 @@ namespace fabr {
  * A BuildRule is essentially a transformer that we can attach to a target,
  * and that is responsible for generating the execution tasks need to generate
  * the targets.
+ *
+ * The rule also tracks which properties it has actually read while doing so.
+ * Any two configurations of a target that agree on those properties must
+ * produce identical tasks, which lets us collapse them (see
+ * ConfiguredTargetSet).
  */
 class BuildRule {
+public:
+    /**
+     * A source file to compile, and the sources it stands for.
+     */
+    struct CompileUnit {
+        PathRef source;
+        /** The batch members, if source is a unity batch, or just source */
+        std::vector<PathRef> members;
+
+        bool isUnity() const {
+            return members.size() > 1;
+        }
+    };
+
+private:
+    SymbolRef name;
+
+    /** Properties read by the rule so far */
+    SymbolSet usedProperties;
+
+    /** Incremented whenever usedProperties grows */
+    unsigned generation = 0;
+
+public:
+    BuildRule( SymbolRef name ) : name(name) { }
+
+    SymbolRef getName() const {
+        return name;
+    }
+
+    /**
+     * Look up a property in the given configuration, recording that the
+     * rule depends on it. All property reads made while generating tasks
+     * must go through here (or addUsedProperty) for collapsing to be safe.
+     * @return the property value, or the null symbol if it is not set.
+     */
+    SymbolRef getProperty( const PropertySet &tags, SymbolRef property );
+
+    /**
+     * Record that the rule depends on the given property, without reading it.
+     */
+    void addUsedProperty( SymbolRef property );
+
+    const SymbolSet &getUsedProperties() const {
+        return usedProperties;
+    }
+
+    /**
+     * @return a counter that changes whenever the set of used properties
+     * changes, so that callers can detect stale configuration keys.
+     */
+    unsigned getGeneration() const {
+        return generation;
+    }
+
+    /**
+     * @return the subset of tags that can affect the rule's tasks. Note an
+     * unset property is significant too, and is represented by its absence.
+     */
+    PropertySet getRelevantTags( const PropertySet &tags ) const;
+
+    /**
+     * Find the headers (and modules) that a C-family source file depends
+     * on by scanning it, rather than running the preprocessor. This uses
+     * the current IncludeScanner if there is one, so that headers shared
+     * between sources are only scanned once per build.
+     * @throws system_error if the source can't be read.
+     */
+    IncludeScanner::Dependencies scanIncludes( PathRef source, const IncludePath &paths ) const;
 
+    /**
+     * Group the C and C++ sources of a target into unity batches as planned
+     * by the given planner, and generate a source file for each batch of
+     * more than one in BUILD_CACHEDIR under the build root. A batch's file
+     * is only rewritten when its membership changes, so editing a source
+     * just invalidates the one batch that includes it. Files left over from
+     * earlier plans are removed. Sources in other languages are returned as
+     * units of their own.
+     * Unity builds are not transparent (file-local names and macros are
+     * shared within a batch), so this is for targets that opt in.
+     * @return the units to compile, in name order within each language.
+     * @throws system_error if a batch file can't be written.
+     */
+    std::vector<CompileUnit> getUnityBatches( const Path &buildRoot, SymbolRef target,
+                                              const std::vector<PathRef> &sources,
+                                              const UnityPlanner &planner ) const;
 };
 
 }
@@ -16,8 +16,12 @@
  */
 
 #include "model/BuildTarget.h"
+#include "model/BuildRule.h"
 
 namespace fabr {
 
+BuildTarget BuildTarget::getConfiguration( const BuildRule &rule ) const {
+    return BuildTarget(target, rule.getRelevantTags(tags));
+}
 
 }
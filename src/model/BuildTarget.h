@@ -22,6 +22,8 @@
 
 namespace fabr {
 
+class BuildRule;
+
 /**
  * A BuildTarget consists of a primary target plus a set of forced property
  * tags.
@@ -40,6 +42,23 @@ public:
     const PropertySet &getTags() const {
         return tags;
     }
+
+    /**
+     * @return the target restricted to the tags that can actually affect
+     * the given rule. Targets with equal configurations produce the same
+     * tasks.
+     */
+    BuildTarget getConfiguration( const BuildRule &rule ) const;
+
+    bool operator ==( const BuildTarget &t ) const {
+        return target == t.target && tags == t.tags;
+    }
+    bool operator !=( const BuildTarget &t ) const {
+        return !(*this == t);
+    }
+    bool operator <( const BuildTarget &t ) const {
+        return target < t.target || (target == t.target && tags < t.tags);
+    }
 };
 
 }
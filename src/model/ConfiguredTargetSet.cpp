@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "model/ConfiguredTargetSet.h"
+#include "model/BuildRule.h"
+
+#include <vector>
+
+namespace fabr {
+
+ConfiguredTarget *ConfiguredTargetSet::get( const BuildTarget &target, BuildRule *rule ) {
+    auto gen = generations.find(rule);
+    if( gen == generations.end() ) {
+        generations[rule] = rule->getGeneration();
+    } else if( gen->second != rule->getGeneration() ) {
+        rekey(rule);
+        gen->second = rule->getGeneration();
+    }
+
+    BuildTarget key = target.getConfiguration(*rule);
+    auto it = nodes.find(key);
+    if( it == nodes.end() ) {
+        auto node = std::unique_ptr<ConfiguredTarget>(
+                new ConfiguredTarget(target, rule));
+        it = nodes.emplace(key, std::move(node)).first;
+    }
+    it->second->aliases.insert(target.getTags());
+    return it->second.get();
+}
+
+void ConfiguredTargetSet::rekey( BuildRule *rule ) {
+    std::vector<std::unique_ptr<ConfiguredTarget>> stale;
+    for( auto it = nodes.begin(); it != nodes.end(); ) {
+        if( it->second->rule == rule ) {
+            stale.push_back(std::move(it->second));
+            it = nodes.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for( auto &node : stale ) {
+        SymbolRef base = node->target.getBaseTarget();
+        std::set<PropertySet> aliases = std::move(node->aliases);
+        node->aliases.clear();
+
+        /* The node itself keeps the group containing its representative
+         * configuration (which it was analysed under); any other groups become
+         * new, unanalysed nodes.
+         */
+        BuildTarget key = node->target.getConfiguration(*rule);
+        node->aliases.insert(node->target.getTags());
+        nodes.emplace(key, std::move(node));
+        for( auto &tags : aliases ) {
+            BuildTarget alias(base, tags);
+            BuildTarget aliasKey = alias.getConfiguration(*rule);
+            auto it = nodes.find(aliasKey);
+            if( it == nodes.end() ) {
+                auto split = std::unique_ptr<ConfiguredTarget>(
+                        new ConfiguredTarget(alias, rule));
+                it = nodes.emplace(aliasKey, std::move(split)).first;
+            }
+            it->second->aliases.insert(tags);
+        }
+    }
+}
+
+size_t ConfiguredTargetSet::getRequestCount() const {
+    size_t count = 0;
+    for( auto &node : nodes ) {
+        count += node.second->aliases.size();
+    }
+    return count;
+}
+
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_MODEL_CONFIGUREDTARGETSET_H
+#define FABR_MODEL_CONFIGUREDTARGETSET_H
+
+#include <map>
+#include <memory>
+#include <set>
+
+#include "model/BuildTarget.h"
+
+namespace fabr {
+
+class BuildRule;
+
+/**
+ * A single analysed node in the build graph. Each node stands in for every
+ * requested configuration of the target that its rule cannot distinguish.
+ */
+class ConfiguredTarget {
+private:
+    /** The first configuration requested, used for analysis */
+    BuildTarget target;
+    BuildRule *rule;
+    /** Full tag sets of all configurations collapsed into this node */
+    std::set<PropertySet> aliases;
+
+    ConfiguredTarget( const BuildTarget &target, BuildRule *rule ) :
+        target(target), rule(rule) { }
+
+    friend class ConfiguredTargetSet;
+
+public:
+    const BuildTarget &getTarget() const {
+        return target;
+    }
+    BuildRule *getRule() const {
+        return rule;
+    }
+    const std::set<PropertySet> &getAliases() const {
+        return aliases;
+    }
+};
+
+/**
+ * Maps requested (target, tags) pairs onto shared ConfiguredTarget nodes,
+ * keyed by the tags the target's rule actually reads, so that a library
+ * requested under N tag sets only needs as many nodes (and tasks) as there
+ * are distinct values of the properties it depends on. Note nothing requests
+ * configurations yet, as the build has no analysis phase until there is an
+ * executor; core-bench --verify checks the collapsing in the meantime.
+ *
+ * Rules discover the properties they read during analysis, so a node may be
+ * created under a coarser key than is later known to be correct. Lookups
+ * detect this via BuildRule::getGeneration() and split the affected nodes.
+ */
+class ConfiguredTargetSet {
+private:
+    std::map<BuildTarget, std::unique_ptr<ConfiguredTarget>> nodes;
+    /** Rule generation that the current keys were computed under */
+    std::map<BuildRule *, unsigned> generations;
+
+    /**
+     * Re-key every node belonging to the given rule, splitting any whose
+     * aliases no longer agree on the rule's used properties.
+     */
+    void rekey( BuildRule *rule );
+
+public:
+    ConfiguredTargetSet() { }
+
+    /**
+     * @return the node for the given target configuration, created if
+     * necessary.
+     */
+    ConfiguredTarget *get( const BuildTarget &target, BuildRule *rule );
+
+    /**
+     * @return the number of distinct nodes.
+     */
+    size_t size() const {
+        return nodes.size();
+    }
+
+    /**
+     * @return the number of distinct configurations requested. The
+     * difference from size() is the work saved by collapsing.
+     */
+    size_t getRequestCount() const;
+
+    void clear() {
+        nodes.clear();
+        generations.clear();
+    }
+};
+
+}
+
+#endif /* !FABR_MODEL_CONFIGUREDTARGETSET_H */
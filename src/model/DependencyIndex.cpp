@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "model/DependencyIndex.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <unordered_set>
+
+namespace fabr {
+
+namespace {
+
+void writeU32( std::string &out, uint32_t value ) {
+    out.append((const char *)&value, sizeof(value));
+}
+
+bool readU32( const char *&p, const char *end, uint32_t &value ) {
+    if( (size_t)(end - p) < sizeof(value) ) {
+        return false;
+    }
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+}
+
+void DependencyIndex::addEdge( SymbolRef input, SymbolRef target ) {
+    dependents[input].push_back(target);
+}
+
+void DependencyIndex::removeEdge( SymbolRef input, SymbolRef target ) {
+    auto it = dependents.find(input);
+    if( it != dependents.end() ) {
+        auto &list = it->second;
+        auto found = std::find(list.begin(), list.end(), target);
+        if( found != list.end() ) {
+            *found = list.back();
+            list.pop_back();
+        }
+        if( list.empty() ) {
+            dependents.erase(it);
+        }
+    }
+}
+
+void DependencyIndex::define( SymbolRef target, SymbolRef script, const std::vector<SymbolRef> &inputs ) {
+    remove(target);
+    Target &entry = targets[target];
+    entry.script = script;
+    entry.inputs = inputs;
+    std::sort(entry.inputs.begin(), entry.inputs.end());
+    entry.inputs.erase(std::unique(entry.inputs.begin(), entry.inputs.end()), entry.inputs.end());
+    for( SymbolRef input : entry.inputs ) {
+        addEdge(input, target);
+    }
+    if( script && !std::binary_search(entry.inputs.begin(), entry.inputs.end(), script) ) {
+        addEdge(script, target);
+    }
+    scripts[script].push_back(target);
+}
+
+void DependencyIndex::remove( SymbolRef target ) {
+    auto it = targets.find(target);
+    if( it == targets.end() ) {
+        return;
+    }
+    Target &entry = it->second;
+    for( SymbolRef input : entry.inputs ) {
+        removeEdge(input, target);
+    }
+    if( entry.script && !std::binary_search(entry.inputs.begin(), entry.inputs.end(), entry.script) ) {
+        removeEdge(entry.script, target);
+    }
+    auto defined = scripts.find(entry.script);
+    if( defined != scripts.end() ) {
+        auto &list = defined->second;
+        list.erase(std::find(list.begin(), list.end(), target));
+        if( list.empty() ) {
+            scripts.erase(defined);
+        }
+    }
+    targets.erase(it);
+}
+
+void DependencyIndex::removeScript( SymbolRef script ) {
+    auto it = scripts.find(script);
+    if( it == scripts.end() ) {
+        return;
+    }
+    /* remove() edits the list as it goes */
+    std::vector<SymbolRef> defined = it->second;
+    for( SymbolRef target : defined ) {
+        remove(target);
+    }
+}
+
+const std::vector<SymbolRef> &DependencyIndex::getDependents( SymbolRef node ) const {
+    static const std::vector<SymbolRef> none;
+    auto it = dependents.find(node);
+    return it == dependents.end() ? none : it->second;
+}
+
+std::vector<SymbolRef> DependencyIndex::getAffected( const std::vector<SymbolRef> &changed ) const {
+    std::vector<SymbolRef> result;
+    std::unordered_set<SymbolRef> seen;
+    std::vector<SymbolRef> work;
+    for( SymbolRef node : changed ) {
+        if( seen.insert(node).second ) {
+            work.push_back(node);
+            if( isTarget(node) ) {
+                result.push_back(node);
+            }
+        }
+    }
+    while( !work.empty() ) {
+        SymbolRef node = work.back();
+        work.pop_back();
+        for( SymbolRef target : getDependents(node) ) {
+            if( seen.insert(target).second ) {
+                result.push_back(target);
+                work.push_back(target);
+            }
+        }
+    }
+    return result;
+}
+
+void DependencyIndex::write( std::string &out ) const {
+    /* Each name is written once, and referred to by number thereafter */
+    std::unordered_map<SymbolRef, uint32_t> ids;
+    std::vector<SymbolRef> names;
+    auto id = [&]( SymbolRef sym ) {
+        auto result = ids.emplace(sym, names.size());
+        if( result.second ) {
+            names.push_back(sym);
+        }
+        return result.first->second;
+    };
+    std::string body;
+    writeU32(body, targets.size());
+    for( auto &it : targets ) {
+        writeU32(body, id(it.first));
+        writeU32(body, it.second.script ? id(it.second.script) + 1 : 0);
+        writeU32(body, it.second.inputs.size());
+        for( SymbolRef input : it.second.inputs ) {
+            writeU32(body, id(input));
+        }
+    }
+
+    writeU32(out, names.size());
+    for( SymbolRef name : names ) {
+        writeU32(out, name.length());
+        out.append(name.data(), name.length());
+    }
+    out.append(body);
+}
+
+bool DependencyIndex::read( const char *&p, const char *end ) {
+    clear();
+    uint32_t count;
+    if( !readU32(p, end, count) || count > (size_t)(end - p) / sizeof(uint32_t) ) {
+        return false;
+    }
+    std::vector<SymbolRef> names;
+    names.reserve(count);
+    for( uint32_t i = 0; i < count; i++ ) {
+        uint32_t length;
+        if( !readU32(p, end, length) || length > (size_t)(end - p) ) {
+            clear();
+            return false;
+        }
+        names.push_back(SymbolRef::get(p, length));
+        p += length;
+    }
+
+    uint32_t targetCount;
+    if( !readU32(p, end, targetCount) ) {
+        return false;
+    }
+    std::vector<SymbolRef> inputs;
+    for( uint32_t i = 0; i < targetCount; i++ ) {
+        uint32_t target, script, inputCount;
+        if( !readU32(p, end, target) || !readU32(p, end, script) || !readU32(p, end, inputCount) ||
+                target >= names.size() || script > names.size() ||
+                inputCount > (size_t)(end - p) / sizeof(uint32_t) ) {
+            clear();
+            return false;
+        }
+        inputs.clear();
+        for( uint32_t j = 0; j < inputCount; j++ ) {
+            uint32_t input;
+            if( !readU32(p, end, input) || input >= names.size() ) {
+                clear();
+                return false;
+            }
+            inputs.push_back(names[input]);
+        }
+        define(names[target], script == 0 ? SymbolRef() : names[script - 1], inputs);
+    }
+    return true;
+}
+
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_MODEL_DEPENDENCYINDEX_H
+#define FABR_MODEL_DEPENDENCYINDEX_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "model/Symbol.h"
+
+namespace fabr {
+
+/**
+ * The dependency edges of the model in both directions, so that the set of
+ * targets affected by a change can be found by walking back from the
+ * changed files, in time proportional to what's affected rather than the
+ * size of the model.
+ *
+ * Nodes are named by symbol: files by their absolute path, targets by
+ * their label. A target's inputs may be files or other targets, so both
+ * share the one symbol namespace, which is how the model and the parser
+ * already name them; files aren't PathRefs, as nothing here needs their
+ * components, and a PathRef would intern each path a second time. Each target
+ * also belongs to the build script that defines it, and implicitly depends
+ * on it, so that all of a script's targets can be dropped and redefined
+ * when it's reparsed.
+ */
+class DependencyIndex {
+private:
+    struct Target {
+        SymbolRef script;
+        std::vector<SymbolRef> inputs;
+    };
+
+    std::unordered_map<SymbolRef, Target> targets;
+    /** Reverse edges: node to the targets that depend on it directly */
+    std::unordered_map<SymbolRef, std::vector<SymbolRef>> dependents;
+    /** Targets defined by each script */
+    std::unordered_map<SymbolRef, std::vector<SymbolRef>> scripts;
+
+    void addEdge( SymbolRef input, SymbolRef target );
+    void removeEdge( SymbolRef input, SymbolRef target );
+
+public:
+    DependencyIndex() { }
+
+    /**
+     * Define (or redefine) a target with the given direct inputs, replacing
+     * any previous definition.
+     */
+    void define( SymbolRef target, SymbolRef script, const std::vector<SymbolRef> &inputs );
+
+    /**
+     * Remove a target, if defined.
+     */
+    void remove( SymbolRef target );
+
+    /**
+     * Remove every target defined by the given script.
+     */
+    void removeScript( SymbolRef script );
+
+    /**
+     * @return true if the given node is a defined target.
+     */
+    bool isTarget( SymbolRef node ) const {
+        return targets.find(node) != targets.end();
+    }
+
+    /**
+     * @return the targets that depend directly on the given node.
+     */
+    const std::vector<SymbolRef> &getDependents( SymbolRef node ) const;
+
+    /**
+     * @return every target that depends directly or transitively on any of
+     * the given nodes (including any of the nodes that are themselves
+     * targets), in no particular order.
+     */
+    std::vector<SymbolRef> getAffected( const std::vector<SymbolRef> &changed ) const;
+
+    size_t size() const {
+        return targets.size();
+    }
+
+    void clear() {
+        targets.clear();
+        dependents.clear();
+        scripts.clear();
+    }
+
+    /**
+     * Append a binary serialization of the index to out.
+     */
+    void write( std::string &out ) const;
+
+    /**
+     * Replace the index with the serialization starting at p, advancing p
+     * past it.
+     * @return false (leaving the index empty) if the data is malformed.
+     */
+    bool read( const char *&p, const char *end );
+};
+
+}
+
+#endif /* !FABR_MODEL_DEPENDENCYINDEX_H */
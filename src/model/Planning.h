@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_MODEL_PLANNING_H
+#define FABR_MODEL_PLANNING_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include <string_view>
+
+namespace fabr {
+
+/*
+ * Helpers shared by the planners (ShardPlanner, UnityPlanner). Their plans
+ * have to come out the same on every host and from one run to the next, so
+ * nothing here may depend on the platform or on small changes in the inputs.
+ */
+
+/**
+ * @return a hash of the given string that, unlike std::hash, is the same
+ * everywhere (FNV-1a).
+ */
+inline uint64_t stableHash( std::string_view str ) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for( char c : str ) {
+        h = (h ^ (uint8_t)c) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * @return x with its bits thoroughly mixed (the splitmix64 finaliser), for
+ * deriving independent hashes from one value.
+ */
+inline uint64_t mixHash( uint64_t x ) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Round a cost to the nearest power of two, treating unknown (zero or
+ * negative) costs as 1.
+ */
+inline double quantizeCost( double cost ) {
+    if( !(cost > 0) ) {
+        return 1;
+    }
+    return exp2(round(log2(cost)));
+}
+
+}
+
+#endif /* !FABR_MODEL_PLANNING_H */
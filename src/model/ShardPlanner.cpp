@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "model/Planning.h"
+#include "model/ShardPlanner.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+/* How far over an even share of the cost a shard may go before targets
+ * spill over to their next choice of shard.
+ */
+#define SHARD_BALANCE_SLACK 0.1
+
+/* Number of shards initially ranked for each target */
+#define SHARD_RANK_BATCH 4u
+
+namespace fabr {
+
+uint64_t ShardPlanner::hash( SymbolRef target ) {
+    return stableHash(std::string_view(target.data(), target.length()));
+}
+
+std::unordered_map<SymbolRef, unsigned> ShardPlanner::assign( const std::vector<SymbolRef> &targets ) const {
+    std::unordered_map<SymbolRef, unsigned> result;
+    if( count <= 1 ) {
+        for( SymbolRef target : targets ) {
+            result[target] = 0;
+        }
+        return result;
+    }
+
+    struct Item {
+        SymbolRef target;
+        double cost;
+    };
+    std::vector<Item> items;
+    items.reserve(targets.size());
+    double total = 0;
+    for( SymbolRef target : targets ) {
+        if( result.emplace(target, 0).second ) {
+            double c = quantizeCost(cost ? cost(target) : 1);
+            items.push_back(Item{target, c});
+            total += c;
+        }
+    }
+    /* Every shard has to place targets in the same order, so this can't
+     * depend on symbol addresses.
+     */
+    std::sort(items.begin(), items.end(), []( const Item &a, const Item &b ) {
+        return a.cost > b.cost || (a.cost == b.cost && strcmp(a.target.data(), b.target.data()) < 0);
+    });
+
+    double capacity = total / count * (1 + SHARD_BALANCE_SLACK);
+    std::vector<double> load(count, 0);
+    std::vector<std::pair<uint64_t, unsigned>> ranking(count);
+    for( const Item &item : items ) {
+        uint64_t h = hash(item.target);
+        for( unsigned shard = 0; shard < count; shard++ ) {
+            ranking[shard] = std::make_pair(mixHash(h ^ mixHash(shard + 1)), shard);
+        }
+        /* Nearly every target fits in one of its first few choices, so only
+         * rank as far down as needed, doubling each time we run out.
+         */
+        unsigned chosen = count;
+        unsigned ranked = 0;
+        for( unsigned i = 0; i < count && chosen == count; i++ ) {
+            if( i == ranked ) {
+                ranked = std::min(count, ranked == 0 ? SHARD_RANK_BATCH : ranked * 2);
+                std::partial_sort(ranking.begin() + i, ranking.begin() + ranked, ranking.end(),
+                                  std::greater<std::pair<uint64_t, unsigned>>());
+            }
+            if( load[ranking[i].second] + item.cost <= capacity ) {
+                chosen = ranking[i].second;
+            }
+        }
+        if( chosen == count ) {
+            /* Doesn't fit anywhere (only possible for very large targets) */
+            chosen = std::min_element(load.begin(), load.end()) - load.begin();
+        }
+        load[chosen] += item.cost;
+        result[item.target] = chosen;
+    }
+    return result;
+}
+
+std::vector<SymbolRef> ShardPlanner::select( const std::vector<SymbolRef> &targets, unsigned shard ) const {
+    std::unordered_map<SymbolRef, unsigned> owners = assign(targets);
+    std::vector<SymbolRef> result;
+    for( SymbolRef target : targets ) {
+        if( owners[target] == shard ) {
+            result.push_back(target);
+        }
+    }
+    return result;
+}
+
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_MODEL_SHARDPLANNER_H
+#define FABR_MODEL_SHARDPLANNER_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "model/Symbol.h"
+
+namespace fabr {
+
+/**
+ * Partitions a set of targets between N shards (separate processes or
+ * machines each building part of the same tree), such that every shard
+ * arrives at the same plan independently.
+ *
+ * Targets are placed by rendezvous hashing with bounded loads: each target
+ * ranks the shards by a hash of (target, shard), and is given to the first
+ * shard in its ranking that has room, taking targets in order of
+ * decreasing cost. Shards are allowed a little over an even share of the
+ * total cost, so the split stays balanced while adding or removing a
+ * target only moves a handful of others.
+ *
+ * Costs would normally come from the build history; they're rounded to
+ * powers of two so that small variations between runs don't perturb the
+ * plan, but all shards must still be given the same costs. Since separate
+ * builders each have their own history, that means a copy of one shared
+ * log (see --shard-costs), or else uniform costs.
+ */
+class ShardPlanner {
+public:
+    /** Cost of building a target, in arbitrary units (e.g. seconds) */
+    typedef std::function<double(SymbolRef)> CostFunction;
+
+private:
+    unsigned count;
+    CostFunction cost;
+
+public:
+    /**
+     * @param count number of shards.
+     * @param cost target costs, or null for uniform costs.
+     */
+    ShardPlanner( unsigned count, CostFunction cost = nullptr ) : count(count), cost(cost) { }
+
+    unsigned getCount() const {
+        return count;
+    }
+
+    /**
+     * @return the shard (0 to count-1) for each of the given targets.
+     */
+    std::unordered_map<SymbolRef, unsigned> assign( const std::vector<SymbolRef> &targets ) const;
+
+    /**
+     * @return those of the given targets that belong to the given shard, in
+     * the same order.
+     */
+    std::vector<SymbolRef> select( const std::vector<SymbolRef> &targets, unsigned shard ) const;
+
+    /**
+     * @return a stable hash of the target name, the same on every host.
+     */
+    static uint64_t hash( SymbolRef target );
+};
+
+}
+
+#endif /* !FABR_MODEL_SHARDPLANNER_H */
@@ -16,10 +16,81 @@
  */
 
 #include "model/Symbol.h"
+#include "support/Metrics.h"
+
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
 
 namespace fabr {
 
+/* Symbols are allocated out of chunks of this size. Anything too large
+ * to fit comfortably gets its own allocation.
+ */
+#define SYMBOL_CHUNK_SIZE 65536
+#define SYMBOL_LARGE_SIZE (SYMBOL_CHUNK_SIZE/4)
+
+/* Number of independently locked pools, to reduce contention when
+ * interning from multiple threads.
+ */
+#define SYMBOL_SHARDS 16
+
+namespace {
+
+/**
+ * One shard of the symbol table. Symbols are never freed, so allocation is
+ * just a bump pointer into the current chunk.
+ */
+class SymbolPool {
+public:
+    std::mutex lock;
+    std::unordered_map<std::string_view, Symbol *> symbols;
+    std::vector<char *> chunks;
+    char *next = nullptr;
+    char *end = nullptr;
+
+    void *allocate( size_t size ) {
+        size = (size + alignof(uint32_t) - 1) & ~(alignof(uint32_t) - 1);
+        if( size >= SYMBOL_LARGE_SIZE ) {
+            Metrics::add(Metrics::SYMBOL_ARENA_BYTES, size);
+            char *p = (char *)operator new(size);
+            chunks.push_back(p);
+            return p;
+        }
+        if( next == nullptr || (size_t)(end - next) < size ) {
+            Metrics::add(Metrics::SYMBOL_ARENA_BYTES, SYMBOL_CHUNK_SIZE);
+            next = (char *)operator new(SYMBOL_CHUNK_SIZE);
+            end = next + SYMBOL_CHUNK_SIZE;
+            chunks.push_back(next);
+        }
+        void *p = next;
+        next += size;
+        return p;
+    }
+};
+
+SymbolPool pools[SYMBOL_SHARDS];
 
+}
+
+Symbol *Symbol::get( const char *str, size_t len ) {
+    std::string_view key(str, len);
+    size_t hash = std::hash<std::string_view>()(key);
+    SymbolPool &pool = pools[(hash >> 8) % SYMBOL_SHARDS];
 
+    std::lock_guard<std::mutex> guard(pool.lock);
+    auto it = pool.symbols.find(key);
+    if( it != pool.symbols.end() ) {
+        return it->second;
+    }
+    Metrics::add(Metrics::SYMBOLS_INTERNED);
+    Symbol *sym = (Symbol *)pool.allocate(sizeof(Symbol) + len + 1);
+    sym->length = len;
+    memcpy(sym->bytes, str, len);
+    sym->bytes[len] = '\0';
+    pool.symbols.emplace(std::string_view(sym->bytes, len), sym);
+    return sym;
+}
 
 }
@@ -31,6 +31,10 @@ namespace fabr {
 /**
  * A Symbol is basically a lightweight pooled string. Symbol itself is never
  * used directly (it's just a data container), everything goes through SymbolRef.
+ *
+ * Symbols are immutable and never freed, and the pool is thread-safe, so
+ * SymbolRefs can be freely shared between threads. The string data is always
+ * NUL-terminated.
  */
 class Symbol {
 protected:
@@ -85,6 +89,10 @@ public:
     bool operator !=(const SymbolRef &ref) const {
         return sym != ref.sym;
     }
+    /* Note: ordering is by identity, not lexical */
+    bool operator <(const SymbolRef &ref) const {
+        return sym < ref.sym;
+    }
 
     explicit operator bool() const {
         return sym != nullptr;
@@ -129,6 +137,13 @@ struct less<fabr::SymbolRef> {
         return lhs.sym < rhs.sym;
     }
 };
+
+template<>
+struct hash<fabr::SymbolRef> {
+    size_t operator()( const fabr::SymbolRef &sym ) const {
+        return std::hash<const void *>()(sym.data());
+    }
+};
 }
 
 
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "model/Planning.h"
+#include "model/UnityPlanner.h"
+#include "support/BuildLog.h"
+#include "support/DirCache.h"
+#include "support/StatCache.h"
+
+#include <algorithm>
+#include <string>
+
+/* How far a source's compile time has to be from what its size suggests
+ * before it is costed by time instead.
+ */
+#define UNITY_HISTORY_FACTOR 4
+
+namespace fabr {
+
+namespace {
+
+/**
+ * @return the anchor level of a source: the number of trailing zero bits in
+ * its (mixed) hash, so that each level is half as frequent as the one below.
+ */
+unsigned getLevel( PathRef path ) {
+    uint64_t h = mixHash(UnityPlanner::hash(path));
+    return h == 0 ? 64 : __builtin_ctzll(h);
+}
+
+}
+
+uint64_t UnityPlanner::hash( PathRef path ) {
+    return stableHash(path.str());
+}
+
+std::vector<double> UnityPlanner::getCosts( const std::vector<PathRef> &sources ) const {
+    StatCache *cache = StatCache::getCurrent();
+    std::vector<double> costs;
+    costs.reserve(sources.size());
+    for( PathRef source : sources ) {
+        uint64_t size = cache != nullptr ? cache->get(source).size : DirCache::get().stat(source).size;
+        costs.push_back(size == 0 ? 1 : size);
+    }
+    if( history == nullptr ) {
+        return costs;
+    }
+
+    /* Convert compile times to bytes at the average rate of the sources
+     * that have both, so that the rest can still be costed by size. Times
+     * vary from run to run, and any new history moves the rate, so the
+     * rate is rounded to a power of two, and a source keeps its size as
+     * its cost unless its time says it is far cheaper or dearer than that.
+     * Otherwise timing noise would move costs (and so cuts) throughout the
+     * library.
+     */
+    std::vector<double> times(sources.size(), -1);
+    double knownSize = 0, knownTime = 0;
+    for( size_t i = 0; i < sources.size(); i++ ) {
+        BuildLog::Entry entry;
+        if( history->lookupLabel(sources[i].str(), entry) && entry.end > entry.start ) {
+            times[i] = (entry.end - entry.start) / 1e9;
+            knownSize += costs[i];
+            knownTime += times[i];
+        }
+    }
+    if( knownTime > 0 ) {
+        double rate = quantizeCost(knownSize / knownTime);
+        for( size_t i = 0; i < sources.size(); i++ ) {
+            if( times[i] >= 0 ) {
+                double estimate = quantizeCost(times[i] * rate);
+                if( estimate >= costs[i] * UNITY_HISTORY_FACTOR || estimate * UNITY_HISTORY_FACTOR <= costs[i] ) {
+                    costs[i] = estimate;
+                }
+            }
+        }
+    }
+    return costs;
+}
+
+std::vector<UnityPlanner::Batch> UnityPlanner::plan( const std::vector<PathRef> &sources ) const {
+    std::vector<PathRef> sorted(sources);
+    /* By name rather than identity, so the plan is the same every time */
+    std::sort(sorted.begin(), sorted.end(), []( PathRef a, PathRef b ) {
+        return a.str() < b.str();
+    });
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    std::vector<Batch> result;
+    if( sorted.empty() ) {
+        return result;
+    }
+    std::vector<double> costs = getCosts(sorted);
+    std::vector<unsigned> levels;
+    levels.reserve(sorted.size());
+    double total = 0;
+    for( size_t i = 0; i < sorted.size(); i++ ) {
+        levels.push_back(getLevel(sorted[i]));
+        total += costs[i];
+    }
+
+    double budget = maxCost;
+    if( !(budget > 0) ) {
+        /* Allow a full batch of average sources */
+        double mean = quantizeCost(total / sorted.size());
+        budget = mean * maxSources;
+    }
+    split(sorted, costs, levels, 0, sorted.size(), 65, budget, result);
+    return result;
+}
+
+void UnityPlanner::split( const std::vector<PathRef> &sources, const std::vector<double> &costs,
+                          const std::vector<unsigned> &levels, size_t begin, size_t end, unsigned level,
+                          double budget, std::vector<Batch> &result ) const {
+    double cost = 0;
+    for( size_t i = begin; i < end; i++ ) {
+        cost += costs[i];
+    }
+    if( end - begin == 1 || (end - begin <= maxSources && cost <= budget) ) {
+        Batch batch;
+        batch.sources.assign(sources.begin() + begin, sources.begin() + end);
+        batch.cost = cost;
+        result.push_back(std::move(batch));
+        return;
+    }
+
+    /* Cut before each of the highest-level anchors inside the range. The
+     * first source doesn't count, as a cut there would leave it unchanged.
+     * Every level is below the one that formed the range, so this always
+     * finds at least one cut (level 0 cuts everywhere).
+     */
+    unsigned top = 0;
+    for( size_t i = begin + 1; i < end; i++ ) {
+        if( levels[i] < level ) {
+            top = std::max(top, levels[i]);
+        }
+    }
+    std::vector<size_t> cuts;
+    cuts.push_back(begin);
+    for( size_t i = begin + 1; i < end; i++ ) {
+        if( levels[i] == top ) {
+            cuts.push_back(i);
+        }
+    }
+    cuts.push_back(end);
+
+    /* The pieces are uneven, so join up adjacent ones that fit together
+     * again. This only looks within the range, so it is as stable as the
+     * cuts are.
+     */
+    size_t start = begin;
+    double joined = 0;
+    for( size_t i = 0; i + 1 < cuts.size(); i++ ) {
+        double piece = 0;
+        for( size_t j = cuts[i]; j < cuts[i + 1]; j++ ) {
+            piece += costs[j];
+        }
+        bool fits = cuts[i + 1] - start <= maxSources && joined + piece <= budget;
+        if( !fits && start < cuts[i] ) {
+            split(sources, costs, levels, start, cuts[i], top, budget, result);
+            start = cuts[i];
+            joined = 0;
+        }
+        joined += piece;
+    }
+    split(sources, costs, levels, start, end, top, budget, result);
+}
+
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_MODEL_UNITYPLANNER_H
+#define FABR_MODEL_UNITYPLANNER_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "support/PathRef.h"
+
+namespace fabr {
+
+class BuildLog;
+
+/**
+ * Groups the sources of a library into unity (aka jumbo) batches, each of
+ * which is compiled as a single translation unit that #includes its
+ * members, so that the headers they share are only parsed once per batch
+ * rather than once per source.
+ *
+ * Batches are balanced by cost, which is the size of each source. Given a
+ * build log, a source whose last compile time is far out of line with its
+ * size is costed by that time instead (scaled to the same units, and
+ * rounded to a power of two so that timing noise doesn't move batches).
+ *
+ * The plan has to be stable, since every change of membership invalidates
+ * the whole batch. Sources are sorted by name and cut into runs at
+ * "anchors", chosen by a hash of the name alone; a run that is still too
+ * large is cut again at the next (more frequent) level of anchors, and so
+ * on down to single sources, rejoining adjacent pieces that fit together.
+ * Changing the cost of a source (e.g. by editing it) can therefore only
+ * re-split the run containing it, and adding or removing a source only
+ * affects its immediate neighbours.
+ */
+class UnityPlanner {
+public:
+    struct Batch {
+        /** Member sources, in name order */
+        std::vector<PathRef> sources;
+        double cost = 0;
+    };
+
+private:
+    unsigned maxSources;
+    double maxCost;
+    BuildLog *history = nullptr;
+
+    void split( const std::vector<PathRef> &sources, const std::vector<double> &costs,
+                const std::vector<unsigned> &levels, size_t begin, size_t end, unsigned level,
+                double budget, std::vector<Batch> &result ) const;
+
+public:
+    /**
+     * @param maxSources the most sources to put in one batch.
+     * @param maxCost the most cost (in bytes of source) to put in one
+     * batch, or 0 to derive it from the average cost of the sources
+     * (rounded to a power of two so that it rarely changes).
+     */
+    UnityPlanner( unsigned maxSources = 16, double maxCost = 0 ) :
+        maxSources(maxSources < 1 ? 1 : maxSources), maxCost(maxCost) { }
+
+    /**
+     * Weight sources by their compile times in the given log (which must
+     * outlive the planner), rather than just by size. A compile is found by
+     * its label, the source's absolute path (see BuildLog).
+     */
+    void setHistory( BuildLog *log ) {
+        history = log;
+    }
+
+    unsigned getMaxSources() const {
+        return maxSources;
+    }
+
+    /**
+     * @return the cost of each of the given sources.
+     */
+    std::vector<double> getCosts( const std::vector<PathRef> &sources ) const;
+
+    /**
+     * Partition the given sources into batches. Each source appears in
+     * exactly one batch, and a source too large to share a batch gets one to
+     * itself. All of the sources should be compiled the same way (in
+     * particular, in the same language).
+     * @return the batches, in name order.
+     */
+    std::vector<Batch> plan( const std::vector<PathRef> &sources ) const;
+
+    /**
+     * @return a hash of the path, that is the same everywhere.
+     */
+    static uint64_t hash( PathRef path );
+};
+
+}
+
+#endif /* !FABR_MODEL_UNITYPLANNER_H */
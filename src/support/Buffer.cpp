@@ -16,6 +16,7 @@
  */
 
 #include "support/Buffer.h"
+#include "support/BufferPool.h"
 
 #include <sys/stat.h>
 #include <sys/mman.h>
@@ -25,11 +26,27 @@
 
 namespace fabr {
 
+namespace {
+
+/**
+ * Heap buffer allocated (together with its data) from the BufferPool.
+ */
+class PooledBuffer : public Buffer {
+public:
+    PooledBuffer(char *p, size_t len) : Buffer(p, len) { }
+
+    /* Called by delete after the destructor, to recycle the block */
+    static void operator delete(void *p) {
+        BufferPool::release(p);
+    }
+};
+
+}
+
 std::unique_ptr<Buffer> Buffer::getBuffer(size_t size) {
-    /* Allocate the Buffer object and the actual data in one chunk */
-    size_t total = sizeof(Buffer) + size;
-    void *data = operator new(total);
-    std::unique_ptr<Buffer>(new (data) Buffer(((char *)data)+sizeof(Buffer), size));
+    /* Allocate the Buffer object and the actual data in one block */
+    void *block = BufferPool::allocate(sizeof(PooledBuffer) + size);
+    return std::unique_ptr<Buffer>(new (block) PooledBuffer(((char *)block)+sizeof(PooledBuffer), size));
 }
 
 std::unique_ptr<Buffer> Buffer::getZeroBuffer(size_t size) {
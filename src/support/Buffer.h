@@ -48,7 +48,8 @@ public:
     }
 
     /**
-     * @return a new, uninitialised buffer of the given size.
+     * @return a new, uninitialised buffer of the given size. The memory
+     * comes from the BufferPool, so short-lived buffers are cheap.
      */
     static std::unique_ptr<Buffer> getBuffer( size_t size );
 
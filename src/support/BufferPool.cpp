@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/BufferPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <vector>
+
+/* Number of size classes from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE inclusive */
+#define SIZE_CLASSES 13
+
+/* Class index for blocks allocated directly */
+#define OVERSIZE_CLASS 0xFF
+
+/* Maximum bytes of each size class held in a thread's free list before it
+ * returns half of them to the shared pool.
+ */
+#define THREAD_CACHE_BYTES (2*1024*1024)
+
+/* Maximum blocks of each size class held in a thread's free list */
+#define THREAD_CACHE_MAX_BLOCKS 64
+
+namespace fabr {
+
+static_assert((BufferPool::MIN_BLOCK_SIZE << (SIZE_CLASSES - 1)) == BufferPool::MAX_BLOCK_SIZE,
+        "SIZE_CLASSES doesn't match the block size range");
+
+namespace {
+
+/**
+ * Header at the start of each block. While the block is free, next links
+ * it into a free list.
+ */
+struct BlockHeader {
+    uint32_t sizeClass;
+    BlockHeader *next;
+};
+static_assert(sizeof(BlockHeader) <= BufferPool::HEADER_SIZE, "Block header too large");
+
+struct FreeList {
+    BlockHeader *head = nullptr;
+    size_t count = 0;
+
+    void push( BlockHeader *block ) {
+        block->next = head;
+        head = block;
+        count++;
+    }
+    BlockHeader *pop() {
+        BlockHeader *block = head;
+        head = block->next;
+        count--;
+        return block;
+    }
+};
+
+/**
+ * Per-thread counters. These are only written by the owning thread, but
+ * may be read by any thread collecting stats.
+ */
+struct Counters {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> reused{0};
+    std::atomic<uint64_t> oversize{0};
+    std::atomic<uint64_t> releases{0};
+    std::atomic<int64_t> bytesCached{0};
+
+    static void add( std::atomic<uint64_t> &counter, uint64_t n = 1 ) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static void add( std::atomic<int64_t> &counter, int64_t n ) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+size_t getClassSize( unsigned sizeClass ) {
+    return BufferPool::MIN_BLOCK_SIZE << sizeClass;
+}
+
+unsigned getSizeClass( size_t size ) {
+    unsigned sizeClass = 0;
+    while( getClassSize(sizeClass) < size ) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+size_t getMaxCached( unsigned sizeClass ) {
+    size_t blocks = THREAD_CACHE_BYTES / getClassSize(sizeClass);
+    return blocks < 2 ? 2 : blocks > THREAD_CACHE_MAX_BLOCKS ? THREAD_CACHE_MAX_BLOCKS : blocks;
+}
+
+void freeBlock( BlockHeader *block ) {
+    ::operator delete(block);
+}
+
+/**
+ * Free lists shared between all threads. Note this is never destroyed, as
+ * thread caches may be flushed into it during shutdown.
+ */
+struct ThreadCache;
+
+struct SharedPool {
+    std::mutex lock;
+    FreeList lists[SIZE_CLASSES];
+    /** Live thread caches, for stats */
+    std::vector<ThreadCache *> threads;
+    /** Totals from threads that have exited */
+    BufferPool::Stats retired = {};
+
+    static SharedPool &get() {
+        static SharedPool *pool = new SharedPool();
+        return *pool;
+    }
+};
+
+/**
+ * Per-thread free lists, returned to the shared pool on thread exit.
+ */
+struct ThreadCache {
+    FreeList lists[SIZE_CLASSES];
+    Counters counters;
+
+    ThreadCache() {
+        SharedPool &shared = SharedPool::get();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        shared.threads.push_back(this);
+    }
+
+    /**
+     * Move count blocks of the given class to the shared pool.
+     */
+    void flush( unsigned sizeClass, size_t count ) {
+        SharedPool &shared = SharedPool::get();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        flushLocked(shared, sizeClass, count);
+    }
+    void flushLocked( SharedPool &shared, unsigned sizeClass, size_t count ) {
+        int64_t moved = 0;
+        while( count-- > 0 && lists[sizeClass].head != nullptr ) {
+            shared.lists[sizeClass].push(lists[sizeClass].pop());
+            moved += getClassSize(sizeClass);
+        }
+        Counters::add(counters.bytesCached, -moved);
+        shared.retired.bytesCached += moved;
+    }
+
+    /**
+     * Take up to half a cache's worth of blocks from the shared pool.
+     */
+    void refill( unsigned sizeClass ) {
+        SharedPool &shared = SharedPool::get();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        int64_t moved = 0;
+        for( size_t count = getMaxCached(sizeClass) / 2; count > 0 && shared.lists[sizeClass].head != nullptr; count-- ) {
+            lists[sizeClass].push(shared.lists[sizeClass].pop());
+            moved += getClassSize(sizeClass);
+        }
+        Counters::add(counters.bytesCached, moved);
+        shared.retired.bytesCached -= moved;
+    }
+
+    ~ThreadCache() {
+        SharedPool &shared = SharedPool::get();
+        std::lock_guard<std::mutex> guard(shared.lock);
+        for( unsigned i=0; i<SIZE_CLASSES; i++ ) {
+            flushLocked(shared, i, lists[i].count);
+        }
+        shared.retired.allocations += counters.allocations.load(std::memory_order_relaxed);
+        shared.retired.reused += counters.reused.load(std::memory_order_relaxed);
+        shared.retired.oversize += counters.oversize.load(std::memory_order_relaxed);
+        shared.retired.blocksInUse += counters.allocations.load(std::memory_order_relaxed) -
+                counters.releases.load(std::memory_order_relaxed);
+        shared.threads.erase(std::find(shared.threads.begin(), shared.threads.end(), this));
+    }
+};
+
+thread_local ThreadCache threadCache;
+
+}
+
+void *BufferPool::allocate( size_t size ) {
+    ThreadCache &cache = threadCache;
+    Counters::add(cache.counters.allocations);
+    BlockHeader *block;
+    if( size > MAX_BLOCK_SIZE - HEADER_SIZE ) {
+        Counters::add(cache.counters.oversize);
+        block = (BlockHeader *)::operator new(size + HEADER_SIZE);
+        block->sizeClass = OVERSIZE_CLASS;
+        block->next = (BlockHeader *)(uintptr_t)size;
+    } else {
+        unsigned sizeClass = getSizeClass(size + HEADER_SIZE);
+        FreeList &list = cache.lists[sizeClass];
+        if( list.head == nullptr ) {
+            cache.refill(sizeClass);
+        }
+        if( list.head != nullptr ) {
+            block = list.pop();
+            Counters::add(cache.counters.reused);
+            Counters::add(cache.counters.bytesCached, -(int64_t)getClassSize(sizeClass));
+        } else {
+            block = (BlockHeader *)::operator new(getClassSize(sizeClass));
+        }
+        block->sizeClass = sizeClass;
+        block->next = nullptr;
+    }
+    return ((char *)block) + HEADER_SIZE;
+}
+
+void BufferPool::release( void *p ) {
+    if( p == nullptr ) {
+        return;
+    }
+    BlockHeader *block = (BlockHeader *)(((char *)p) - HEADER_SIZE);
+    ThreadCache &cache = threadCache;
+    Counters::add(cache.counters.releases);
+    if( block->sizeClass == OVERSIZE_CLASS ) {
+        freeBlock(block);
+        return;
+    }
+    unsigned sizeClass = block->sizeClass;
+    FreeList &list = cache.lists[sizeClass];
+    list.push(block);
+    Counters::add(cache.counters.bytesCached, getClassSize(sizeClass));
+    if( list.count > getMaxCached(sizeClass) ) {
+        cache.flush(sizeClass, list.count / 2);
+    }
+}
+
+size_t BufferPool::getSize( void *p ) {
+    BlockHeader *block = (BlockHeader *)(((char *)p) - HEADER_SIZE);
+    if( block->sizeClass == OVERSIZE_CLASS ) {
+        return (size_t)(uintptr_t)block->next;
+    }
+    return getClassSize(block->sizeClass) - HEADER_SIZE;
+}
+
+void BufferPool::trim() {
+    ThreadCache &cache = threadCache;
+    for( unsigned i=0; i<SIZE_CLASSES; i++ ) {
+        while( cache.lists[i].head != nullptr ) {
+            freeBlock(cache.lists[i].pop());
+            Counters::add(cache.counters.bytesCached, -(int64_t)getClassSize(i));
+        }
+    }
+    SharedPool &shared = SharedPool::get();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    for( unsigned i=0; i<SIZE_CLASSES; i++ ) {
+        while( shared.lists[i].head != nullptr ) {
+            freeBlock(shared.lists[i].pop());
+            shared.retired.bytesCached -= getClassSize(i);
+        }
+    }
+}
+
+BufferPool::Stats BufferPool::getStats() {
+    SharedPool &shared = SharedPool::get();
+    std::lock_guard<std::mutex> guard(shared.lock);
+    Stats stats = shared.retired;
+    for( ThreadCache *cache : shared.threads ) {
+        const Counters &counters = cache->counters;
+        stats.allocations += counters.allocations.load(std::memory_order_relaxed);
+        stats.reused += counters.reused.load(std::memory_order_relaxed);
+        stats.oversize += counters.oversize.load(std::memory_order_relaxed);
+        stats.blocksInUse += counters.allocations.load(std::memory_order_relaxed) -
+                counters.releases.load(std::memory_order_relaxed);
+        stats.bytesCached += counters.bytesCached.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_BUFFERPOOL_H
+#define FABR_SUPPORT_BUFFERPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace fabr {
+
+/**
+ * Size-classed allocator for heap Buffers (and anything else that wants
+ * short-lived blocks of memory). Blocks are recycled through a per-thread
+ * free list for each size class, so the common case of allocating and
+ * releasing on the same threads never takes a lock or touches malloc.
+ * Threads whose free lists grow too long return blocks to a shared pool,
+ * from which other threads refill in batches.
+ *
+ * Size classes are powers of 2 from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE;
+ * larger requests go directly to operator new. Memory held by the pool is
+ * never returned to the system (call trim() to do so).
+ */
+class BufferPool {
+public:
+    static const size_t MIN_BLOCK_SIZE = 256;
+    static const size_t MAX_BLOCK_SIZE = 1024*1024;
+    /** Space reserved at the start of each block for the pool */
+    static const size_t HEADER_SIZE = 16;
+
+    struct Stats {
+        /** Total number of allocations */
+        uint64_t allocations;
+        /** Allocations satisfied from a free list */
+        uint64_t reused;
+        /** Allocations too large to pool */
+        uint64_t oversize;
+        /** Blocks currently allocated and not released */
+        uint64_t blocksInUse;
+        /** Bytes held in the free lists */
+        uint64_t bytesCached;
+    };
+
+    /**
+     * @return a block of at least size bytes (not counting the header),
+     * aligned to HEADER_SIZE.
+     */
+    static void *allocate( size_t size );
+
+    /**
+     * Return a block obtained from allocate().
+     */
+    static void release( void *block );
+
+    /**
+     * @return the usable size of the block obtained from allocate().
+     */
+    static size_t getSize( void *block );
+
+    /**
+     * Release the calling thread's and the shared free lists back to the
+     * system.
+     */
+    static void trim();
+
+    static Stats getStats();
+};
+
+}
+
+#endif /* !FABR_SUPPORT_BUFFERPOOL_H */
@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/BuildLog.h"
+#include "support/OutputFile.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+
+/* 'FBLG' and 'FBLI' - also serve to reject files written with the other byte order */
+#define BUILD_LOG_MAGIC 0x46424c47
+#define BUILD_LOG_INDEX_MAGIC 0x46424c49
+#define BUILD_LOG_VERSION 2
+
+/* Appends are buffered until at least this much is pending */
+#define BUILD_LOG_WRITE_SIZE (64*1024)
+
+/* Compact once at least this many records have been appended since the
+ * last compaction, and they're at least as many as the indexed records.
+ */
+#define BUILD_LOG_COMPACT_MIN 4096
+
+/* Sanity limits on outputs and label length per record, to reject corrupt
+ * lengths
+ */
+#define BUILD_LOG_MAX_OUTPUTS 65536
+#define BUILD_LOG_MAX_LABEL 65536
+
+namespace fabr {
+
+namespace {
+
+struct LogHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t reserved;
+};
+
+/**
+ * Fixed part of each record, followed by outputCount output digests and
+ * then labelLength bytes of label.
+ */
+struct RecordHeader {
+    /** Total length of the record, including this header */
+    uint32_t length;
+    /** Checksum of everything after this field */
+    uint32_t checksum;
+    uint8_t action[Digest::SIZE];
+    int64_t start;
+    int64_t end;
+    int64_t cpuTime;
+    uint64_t peakRss;
+    int32_t exitStatus;
+    uint32_t outputCount;
+    uint32_t labelLength;
+};
+
+/**
+ * Followed by count entries keyed by action digest, then labelCount keyed by
+ * label digest, each sorted by key.
+ */
+struct IndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t labelCount;
+    /** Length of the log covered by the index */
+    uint64_t logLength;
+    /** Inode of the log file the index was written for */
+    uint64_t logIno;
+};
+
+struct IndexEntry {
+    uint8_t key[Digest::SIZE];
+    uint64_t offset;
+};
+
+Digest labelDigest( std::string_view label ) {
+    return Digest::of(label.data(), label.size());
+}
+
+const IndexEntry *findEntry( const IndexEntry *begin, const IndexEntry *end, const Digest &key ) {
+    const IndexEntry *it = std::lower_bound(begin, end, key, []( const IndexEntry &e, const Digest &d ) {
+        return memcmp(e.key, d.bytes, Digest::SIZE) < 0;
+    });
+    return it == end || memcmp(it->key, key.bytes, Digest::SIZE) != 0 ? nullptr : it;
+}
+
+uint32_t checksum( const char *data, size_t length ) {
+    /* FNV-1a; this only has to catch torn writes, not adversaries */
+    uint32_t h = 2166136261u;
+    for( size_t i = 0; i < length; i++ ) {
+        h = (h ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return h;
+}
+
+void serialize( const BuildLog::Entry &entry, std::string &out ) {
+    size_t offset = out.size();
+    RecordHeader header;
+    header.length = sizeof(RecordHeader) + entry.outputs.size() * Digest::SIZE + entry.label.size();
+    header.checksum = 0;
+    memcpy(header.action, entry.action.bytes, Digest::SIZE);
+    header.start = entry.start;
+    header.end = entry.end;
+    header.cpuTime = entry.cpuTime;
+    header.peakRss = entry.peakRss;
+    header.exitStatus = entry.exitStatus;
+    header.outputCount = entry.outputs.size();
+    header.labelLength = entry.label.size();
+    out.append((const char *)&header, sizeof(header));
+    for( const Digest &output : entry.outputs ) {
+        out.append((const char *)output.bytes, Digest::SIZE);
+    }
+    out.append(entry.label);
+    uint32_t sum = checksum(out.data() + offset + 8, header.length - 8);
+    memcpy(&out[offset + 4], &sum, sizeof(sum));
+}
+
+/**
+ * Parse and validate the record at p, with at most available bytes.
+ * @return the record length, or 0 if it's truncated or corrupt.
+ */
+size_t parse( const char *p, size_t available, BuildLog::Entry *entry ) {
+    RecordHeader header;
+    if( available < sizeof(header) ) {
+        return 0;
+    }
+    memcpy(&header, p, sizeof(header));
+    if( header.outputCount > BUILD_LOG_MAX_OUTPUTS || header.labelLength > BUILD_LOG_MAX_LABEL ||
+            header.length != sizeof(RecordHeader) + header.outputCount * Digest::SIZE + header.labelLength ||
+            header.length > available || checksum(p + 8, header.length - 8) != header.checksum ) {
+        return 0;
+    }
+    if( entry != nullptr ) {
+        memcpy(entry->action.bytes, header.action, Digest::SIZE);
+        entry->start = header.start;
+        entry->end = header.end;
+        entry->cpuTime = header.cpuTime;
+        entry->peakRss = header.peakRss;
+        entry->exitStatus = header.exitStatus;
+        entry->outputs.resize(header.outputCount);
+        for( uint32_t i = 0; i < header.outputCount; i++ ) {
+            memcpy(entry->outputs[i].bytes, p + sizeof(header) + i * Digest::SIZE, Digest::SIZE);
+        }
+        entry->label.assign(p + sizeof(header) + header.outputCount * Digest::SIZE, header.labelLength);
+    }
+    return header.length;
+}
+
+void *mapFile( const Path &file, size_t &size, uint64_t *ino = nullptr ) {
+    int fd = ::open(file.str().c_str(), O_RDONLY|O_CLOEXEC);
+    if( fd == -1 ) {
+        return nullptr;
+    }
+    void *mapping = nullptr;
+    struct stat st;
+    if( ::fstat(fd, &st) == 0 && st.st_size > 0 ) {
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if( p != MAP_FAILED ) {
+            mapping = p;
+            size = st.st_size;
+            if( ino != nullptr ) {
+                *ino = st.st_ino;
+            }
+        }
+    }
+    ::close(fd);
+    return mapping;
+}
+
+void readAll( int fd, char *p, size_t length, off_t offset ) {
+    while( length > 0 ) {
+        ssize_t n = ::pread(fd, p, length, offset);
+        if( n == -1 && errno == EINTR ) {
+            continue;
+        } else if( n == -1 ) {
+            throw std::system_error(errno, std::system_category());
+        } else if( n == 0 ) {
+            throw std::system_error(EIO, std::system_category());
+        }
+        p += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+void writeAll( int fd, const char *p, size_t length ) {
+    while( length > 0 ) {
+        ssize_t n = ::write(fd, p, length);
+        if( n == -1 && errno == EINTR ) {
+            continue;
+        } else if( n == -1 ) {
+            throw std::system_error(errno, std::system_category());
+        }
+        p += n;
+        length -= n;
+    }
+}
+
+}
+
+/**
+ * Holds the log's file lock (see BuildLog::lockFile) for a scope. The lock
+ * goes away by itself if compaction closes the descriptor.
+ */
+class BuildLog::FileLock {
+private:
+    BuildLog &log;
+public:
+    FileLock( BuildLog &log ) : log(log) {
+        log.lockFile();
+    }
+    ~FileLock() {
+        if( log.fd != -1 ) {
+            ::flock(log.fd, LOCK_UN);
+        }
+    }
+};
+
+BuildLog::BuildLog( const Path &file ) : file(file), indexFile(file.str() + ".index") {
+    load();
+}
+
+BuildLog::~BuildLog() {
+    try {
+        flush();
+    } catch( const std::system_error & ) {
+        /* Nothing we can do; the history is only advisory */
+    }
+    if( fd != -1 ) {
+        ::close(fd);
+    }
+    unload();
+}
+
+void BuildLog::load() {
+    uint64_t ino = 0;
+    logMapping = mapFile(file, logMappingSize, &ino);
+    const LogHeader *header = (const LogHeader *)logMapping;
+    if( logMapping == nullptr || logMappingSize < sizeof(LogHeader) ||
+            header->magic != BUILD_LOG_MAGIC || header->version != BUILD_LOG_VERSION ) {
+        /* Missing or unrecognised; it'll be replaced on the next write */
+        unload();
+        return;
+    }
+    logIno = ino;
+    logLength = sizeof(LogHeader);
+
+    indexMapping = mapFile(indexFile, indexMappingSize);
+    const IndexHeader *index = (const IndexHeader *)indexMapping;
+    if( indexMapping != nullptr && indexMappingSize >= sizeof(IndexHeader) &&
+            index->magic == BUILD_LOG_INDEX_MAGIC && index->version == BUILD_LOG_VERSION &&
+            index->logIno == ino && index->logLength <= logMappingSize &&
+            index->count <= (indexMappingSize - sizeof(IndexHeader)) / sizeof(IndexEntry) &&
+            index->labelCount <= (indexMappingSize - sizeof(IndexHeader)) / sizeof(IndexEntry) - index->count &&
+            indexMappingSize == sizeof(IndexHeader) + (index->count + index->labelCount) * sizeof(IndexEntry) ) {
+        logLength = indexedLength = index->logLength;
+        records = index->count;
+    } else if( indexMapping != nullptr ) {
+        ::munmap(indexMapping, indexMappingSize);
+        indexMapping = nullptr;
+        indexMappingSize = 0;
+    }
+
+    /* Pick up anything appended since the index was written, stopping at
+     * the first bad record.
+     */
+    const char *base = (const char *)logMapping;
+    Entry entry;
+    while( size_t length = parse(base + logLength, logMappingSize - logLength, &entry) ) {
+        remember(entry);
+        logLength += length;
+        records++;
+    }
+}
+
+void BuildLog::unload() {
+    if( logMapping != nullptr ) {
+        ::munmap(logMapping, logMappingSize);
+    }
+    if( indexMapping != nullptr ) {
+        ::munmap(indexMapping, indexMappingSize);
+    }
+    logMapping = indexMapping = nullptr;
+    logMappingSize = indexMappingSize = 0;
+    logIno = 0;
+    logLength = indexedLength = 0;
+    records = 0;
+    recent.clear();
+    recentLabels.clear();
+}
+
+void BuildLog::remember( const Entry &entry ) {
+    recent[entry.action] = entry;
+    if( !entry.label.empty() ) {
+        recentLabels[labelDigest(entry.label)] = entry.action;
+    }
+}
+
+/**
+ * Re-apply the records not yet written, which are newer than anything in
+ * the file. If count, they're also added to the record count (after a
+ * reload).
+ */
+void BuildLog::applyPending( bool count ) {
+    Entry entry;
+    size_t offset = 0;
+    while( size_t length = parse(pending.data() + offset, pending.size() - offset, &entry) ) {
+        remember(entry);
+        offset += length;
+        if( count ) {
+            records++;
+        }
+    }
+}
+
+/**
+ * Open the log for writing if need be, and take an exclusive lock on it.
+ * Then bring our view of the log up to date with whatever another process
+ * did while we weren't holding the lock: reload if it compacted (replaced
+ * the file) or created the log, read in any records it appended, and drop
+ * a torn record from the end so that new records follow on from the good
+ * ones.
+ */
+void BuildLog::lockFile() {
+    struct stat st;
+    while( true ) {
+        if( fd == -1 ) {
+            fd = ::open(file.str().c_str(), O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+            if( fd == -1 ) {
+                throw std::system_error(errno, std::system_category());
+            }
+        }
+        int result;
+        do {
+            result = ::flock(fd, LOCK_EX);
+        } while( result == -1 && errno == EINTR );
+        if( result == -1 || ::fstat(fd, &st) == -1 ) {
+            throw std::system_error(errno, std::system_category());
+        }
+        struct stat current;
+        if( ::stat(file.str().c_str(), &current) == 0 && current.st_dev == st.st_dev &&
+                current.st_ino == st.st_ino ) {
+            break;
+        }
+        /* Replaced by a compaction since we opened it; the lock on the old
+         * file goes with the descriptor.
+         */
+        ::close(fd);
+        fd = -1;
+    }
+
+    if( logLength == 0 || (uint64_t)st.st_ino != logIno ) {
+        unload();
+        load();
+        applyPending(true);
+    }
+    if( logLength == 0 ) {
+        /* Start afresh if the file is missing or unusable */
+        LogHeader header = { BUILD_LOG_MAGIC, BUILD_LOG_VERSION, 0 };
+        if( ::ftruncate(fd, 0) == -1 ) {
+            throw std::system_error(errno, std::system_category());
+        }
+        writeAll(fd, (const char *)&header, sizeof(header));
+        logIno = st.st_ino;
+        logLength = sizeof(header);
+    } else if( (uint64_t)st.st_size > logLength ) {
+        std::string tail(st.st_size - logLength, '\0');
+        readAll(fd, &tail[0], tail.size(), logLength);
+        Entry entry;
+        size_t offset = 0;
+        while( size_t length = parse(tail.data() + offset, tail.size() - offset, &entry) ) {
+            remember(entry);
+            offset += length;
+            records++;
+        }
+        logLength += offset;
+        if( offset < tail.size() && ::ftruncate(fd, logLength) == -1 ) {
+            throw std::system_error(errno, std::system_category());
+        }
+        applyPending(false);
+    }
+}
+
+const void *BuildLog::findIndexed( const Digest &key, bool label ) const {
+    if( indexMapping == nullptr ) {
+        return nullptr;
+    }
+    const IndexHeader *header = (const IndexHeader *)indexMapping;
+    const IndexEntry *begin = (const IndexEntry *)(header + 1);
+    if( label ) {
+        begin += header->count;
+    }
+    const IndexEntry *it = findEntry(begin, begin + (label ? header->labelCount : header->count), key);
+    if( it == nullptr || it->offset >= indexedLength ) {
+        return nullptr;
+    }
+    return (const char *)logMapping + it->offset;
+}
+
+bool BuildLog::lookupLocked( const Digest &action, Entry &entry ) {
+    auto it = recent.find(action);
+    if( it != recent.end() ) {
+        entry = it->second;
+        return true;
+    }
+    if( const void *record = findIndexed(action, false) ) {
+        const char *p = (const char *)record;
+        return parse(p, (const char *)logMapping + indexedLength - p, &entry) != 0;
+    }
+    return false;
+}
+
+void BuildLog::append( const Entry &entry ) {
+    std::lock_guard<std::mutex> guard(lock);
+    serialize(entry, pending);
+    remember(entry);
+    records++;
+    if( pending.size() >= BUILD_LOG_WRITE_SIZE ) {
+        FileLock fileLock(*this);
+        writePending();
+    }
+}
+
+bool BuildLog::lookup( const Digest &action, Entry &entry ) {
+    std::lock_guard<std::mutex> guard(lock);
+    return lookupLocked(action, entry);
+}
+
+bool BuildLog::lookupLabel( std::string_view label, Entry &entry ) {
+    std::lock_guard<std::mutex> guard(lock);
+    Digest key = labelDigest(label);
+    auto it = recentLabels.find(key);
+    if( it != recentLabels.end() ) {
+        return lookupLocked(it->second, entry) && entry.label == label;
+    }
+    if( const void *record = findIndexed(key, true) ) {
+        /* Unless the action has since run again under another label */
+        const char *p = (const char *)record;
+        return parse(p, (const char *)logMapping + indexedLength - p, &entry) != 0 &&
+               entry.label == label && recent.find(entry.action) == recent.end();
+    }
+    return false;
+}
+
+bool BuildLog::needsCompaction() const {
+    uint64_t indexed = indexMapping == nullptr ? 0 : ((const IndexHeader *)indexMapping)->count;
+    uint64_t appended = records - indexed;
+    return appended >= BUILD_LOG_COMPACT_MIN && appended >= indexed;
+}
+
+/* Called with the file lock held */
+void BuildLog::writePending() {
+    writeAll(fd, pending.data(), pending.size());
+    logLength += pending.size();
+    pending.clear();
+}
+
+void BuildLog::flush() {
+    std::lock_guard<std::mutex> guard(lock);
+    if( !pending.empty() ) {
+        FileLock fileLock(*this);
+        writePending();
+    }
+}
+
+void BuildLog::save() {
+    std::lock_guard<std::mutex> guard(lock);
+    if( pending.empty() && !needsCompaction() ) {
+        return;
+    }
+    FileLock fileLock(*this);
+    writePending();
+    /* Check again, now that we've seen what any other process added */
+    if( needsCompaction() ) {
+        compactLocked();
+    }
+}
+
+void BuildLog::compact() {
+    std::lock_guard<std::mutex> guard(lock);
+    FileLock fileLock(*this);
+    writePending();
+    compactLocked();
+}
+
+/* Called with the file lock held */
+void BuildLog::compactLocked() {
+    /* The latest record for each action: either a record in the indexed
+     * part of the log, or a recent entry.
+     */
+    struct Latest {
+        Digest action;
+        const char *record;
+        const Entry *entry;
+    };
+    const IndexHeader *header = (const IndexHeader *)indexMapping;
+    const IndexEntry *indexed = header == nullptr ? nullptr : (const IndexEntry *)(header + 1);
+    std::vector<Latest> latest;
+    latest.reserve(recent.size() + (header == nullptr ? 0 : header->count));
+    for( uint64_t i = 0; header != nullptr && i < header->count; i++ ) {
+        Digest action;
+        memcpy(action.bytes, indexed[i].key, Digest::SIZE);
+        if( recent.find(action) == recent.end() && indexed[i].offset < indexedLength ) {
+            latest.push_back(Latest{action, (const char *)logMapping + indexed[i].offset, nullptr});
+        }
+    }
+    for( auto &it : recent ) {
+        latest.push_back(Latest{it.first, nullptr, &it.second});
+    }
+    std::sort(latest.begin(), latest.end(), []( const Latest &a, const Latest &b ) {
+        return a.action < b.action;
+    });
+
+    /* The action last recorded under each label */
+    std::unordered_map<Digest, Digest> labels;
+    for( uint64_t i = 0; header != nullptr && i < header->labelCount; i++ ) {
+        const IndexEntry &item = indexed[header->count + i];
+        RecordHeader record;
+        if( item.offset + sizeof(record) <= indexedLength ) {
+            Digest key;
+            memcpy(key.bytes, item.key, Digest::SIZE);
+            memcpy(&record, (const char *)logMapping + item.offset, sizeof(record));
+            memcpy(labels[key].bytes, record.action, Digest::SIZE);
+        }
+    }
+    for( auto &it : recentLabels ) {
+        labels[it.first] = it.second;
+    }
+
+    std::string log, index;
+    LogHeader logHeader = { BUILD_LOG_MAGIC, BUILD_LOG_VERSION, 0 };
+    log.append((const char *)&logHeader, sizeof(logHeader));
+    std::vector<IndexEntry> entries, labelEntries;
+    entries.reserve(latest.size());
+    Entry entry;
+    for( const Latest &item : latest ) {
+        uint64_t offset = log.size();
+        if( item.record != nullptr ) {
+            size_t length = parse(item.record, (const char *)logMapping + indexedLength - item.record, &entry);
+            if( length == 0 ) {
+                continue;
+            }
+            log.append(item.record, length);
+        } else {
+            serialize(*item.entry, log);
+        }
+        const std::string &label = item.record != nullptr ? entry.label : item.entry->label;
+
+        IndexEntry indexEntry;
+        memcpy(indexEntry.key, item.action.bytes, Digest::SIZE);
+        indexEntry.offset = offset;
+        entries.push_back(indexEntry);
+        if( !label.empty() ) {
+            Digest key = labelDigest(label);
+            auto it = labels.find(key);
+            if( it != labels.end() && it->second == item.action ) {
+                memcpy(indexEntry.key, key.bytes, Digest::SIZE);
+                labelEntries.push_back(indexEntry);
+            }
+        }
+    }
+    std::sort(labelEntries.begin(), labelEntries.end(), []( const IndexEntry &a, const IndexEntry &b ) {
+        return memcmp(a.key, b.key, Digest::SIZE) < 0;
+    });
+
+    OutputFile logOut(file, 0644);
+    logOut.write(log.data(), log.size());
+    struct stat st;
+    if( ::fstat(logOut.getFile().getFd(), &st) == -1 ) {
+        throw std::system_error(errno, std::system_category());
+    }
+    IndexHeader indexHeader = { BUILD_LOG_INDEX_MAGIC, BUILD_LOG_VERSION, entries.size(), labelEntries.size(),
+                                log.size(), (uint64_t)st.st_ino };
+    index.append((const char *)&indexHeader, sizeof(indexHeader));
+    index.append((const char *)entries.data(), entries.size() * sizeof(IndexEntry));
+    index.append((const char *)labelEntries.data(), labelEntries.size() * sizeof(IndexEntry));
+    OutputFile indexOut(indexFile, 0644);
+    indexOut.write(index.data(), index.size());
+
+    /* Log first: an index left over from the old log won't match the new
+     * log's inode, so a crash in between just loses the index.
+     */
+    logOut.commit();
+    indexOut.commit();
+
+    if( fd != -1 ) {
+        ::close(fd);
+        fd = -1;
+    }
+    unload();
+    load();
+}
+
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_BUILDLOG_H
+#define FABR_SUPPORT_BUILDLOG_H
+
+#include <stdint.h>
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "support/Digest.h"
+#include "support/Path.h"
+
+namespace fabr {
+
+/**
+ * Persistent history of executed actions, keyed by action digest: when
+ * each last ran, how long it took, what it cost and what it produced.
+ * This gives the scheduler real durations to prioritise by, early cutoff
+ * gets the previous output digests, and admission control real memory
+ * sizes.
+ *
+ * An action's digest changes whenever any of its inputs do, so planners
+ * that want to know how long something took last time (sharding, unity
+ * batching) look it up by label instead. Writers label an action with the
+ * name of the target it builds, or, for a compile of a single source, with
+ * the source's absolute path; lookupLabel() finds the action most
+ * recently recorded under that label.
+ *
+ * The log is an append-only file of variable-length binary records, each
+ * with a length and checksum so that a torn write at the end (from a
+ * crash) is detected and discarded. Appends are buffered and written in
+ * large batches through an O_APPEND descriptor. A separate index file
+ * holds sorted arrays of (action digest, log offset) and (label digest,
+ * log offset) pairs for the log as of the last compaction; both files are
+ * mapped read-only and searched in place, so opening the log only has to
+ * parse the records appended since then.
+ *
+ * Compaction rewrites the log keeping only the latest record for each
+ * action, along with a fresh index. It happens in save() once enough has
+ * been appended since the last one.
+ *
+ * Thread-safe. Another process may be writing the same log (a client
+ * builds in-process when the server is busy), so writes and compaction
+ * hold an exclusive flock on the log file, and first pick up whatever the
+ * other process appended or compacted since we last looked.
+ */
+class BuildLog {
+public:
+    struct Entry {
+        Digest action;
+        /** Start and end times, in nanoseconds since the epoch */
+        int64_t start = 0;
+        int64_t end = 0;
+        /** User plus system CPU time, in nanoseconds */
+        int64_t cpuTime = 0;
+        /** Peak resident set size, in bytes */
+        uint64_t peakRss = 0;
+        int32_t exitStatus = 0;
+        std::vector<Digest> outputs;
+        /** Target name or source path (see above), or empty */
+        std::string label;
+    };
+
+private:
+    Path file;
+    Path indexFile;
+
+    std::mutex lock;
+    /** Log file descriptor for writing, opened on the first write */
+    int fd = -1;
+
+    /* Mapped log and index, as of opening */
+    void *logMapping = nullptr;
+    size_t logMappingSize = 0;
+    void *indexMapping = nullptr;
+    size_t indexMappingSize = 0;
+    /** Inode of the log file as of opening */
+    uint64_t logIno = 0;
+    /** Length of the valid part of the log file (before any torn record) */
+    uint64_t logLength = 0;
+    /** Part of the log covered by the index */
+    uint64_t indexedLength = 0;
+
+    /** Entries not covered by the index (read from the log tail or appended) */
+    std::unordered_map<Digest, Entry> recent;
+    /** Digest of each label in recent, to the action last recorded under it */
+    std::unordered_map<Digest, Digest> recentLabels;
+    /** Records appended but not yet written */
+    std::string pending;
+    /** Total records in the log, including those superseded */
+    uint64_t records = 0;
+
+    class FileLock;
+
+    void load();
+    void unload();
+    void remember( const Entry &entry );
+    void applyPending( bool count );
+    void lockFile();
+    const void *findIndexed( const Digest &key, bool label ) const;
+    bool lookupLocked( const Digest &action, Entry &entry );
+    bool needsCompaction() const;
+    void writePending();
+    void compactLocked();
+
+public:
+    /**
+     * Open the log stored in the given file (which need not exist yet). The
+     * index is kept alongside it, with ".index" appended.
+     */
+    BuildLog( const Path &file );
+    ~BuildLog();
+    BuildLog( const BuildLog & ) = delete;
+
+    /**
+     * Record an execution of an action, superseding any earlier one.
+     */
+    void append( const Entry &entry );
+
+    /**
+     * Look up the most recent execution of the given action.
+     * @return true and fill in entry if there is one.
+     */
+    bool lookup( const Digest &action, Entry &entry );
+
+    /**
+     * Look up the most recent execution of an action with the given label.
+     * @return true and fill in entry if there is one.
+     */
+    bool lookupLabel( std::string_view label, Entry &entry );
+
+    /**
+     * Write out any buffered records.
+     * @throws system_error if the log can't be written.
+     */
+    void flush();
+
+    /**
+     * Flush, then compact the log if enough has been appended since it was
+     * last compacted.
+     * @throws system_error if the log can't be written.
+     */
+    void save();
+
+    /**
+     * Rewrite the log with only the latest record for each action, and
+     * rebuild the index.
+     * @throws system_error if the log can't be written.
+     */
+    void compact();
+};
+
+}
+
+#endif /* !FABR_SUPPORT_BUILDLOG_H */
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/BuildTimeline.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace fabr {
+
+namespace {
+
+std::string formatTime( int64_t nanos ) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3fs", nanos / 1e9);
+    return buf;
+}
+
+}
+
+BuildTimeline::Report BuildTimeline::analyse( unsigned jobs ) const {
+    Report report;
+    report.jobs = jobs;
+
+    int64_t buildStart = -1, buildEnd = -1;
+    ActionId last = 0;
+    for( ActionId id = 0; id < actions.size(); id++ ) {
+        const Action &action = actions[id];
+        if( !action.isComplete() ) {
+            continue;
+        }
+        if( buildStart == -1 || action.start < buildStart ) {
+            buildStart = action.start;
+        }
+        if( buildEnd == -1 || action.end > buildEnd ) {
+            buildEnd = action.end;
+            last = id;
+        }
+        report.actionTime += action.getDuration();
+    }
+    if( buildStart == -1 ) {
+        return report;
+    }
+    report.wallTime = buildEnd - buildStart;
+    report.parallelism = report.wallTime > 0 ? (double)report.actionTime / report.wallTime : 0;
+
+    /* Walk back from the last action to finish, through whichever
+     * dependency finished last (i.e. the one it was actually waiting for).
+     */
+    for( ActionId id = last; ; ) {
+        const Action &action = actions[id];
+        ActionId gate = id;
+        for( ActionId dep : action.dependencies ) {
+            if( actions[dep].isComplete() && (gate == id || actions[dep].end > actions[gate].end) ) {
+                gate = dep;
+            }
+        }
+        int64_t ready = gate == id ? buildStart : actions[gate].end;
+        report.criticalPath.push_back(CriticalAction{id, action.start - ready});
+        if( gate == id ) {
+            break;
+        }
+        id = gate;
+    }
+    std::reverse(report.criticalPath.begin(), report.criticalPath.end());
+
+    /* Topologically order the completed actions, then find the longest
+     * chain ending at (head) and starting after (tail) each action.
+     */
+    size_t count = actions.size();
+    std::vector<std::vector<ActionId>> users(count);
+    std::vector<size_t> pending(count, 0);
+    for( ActionId id = 0; id < count; id++ ) {
+        if( actions[id].isComplete() ) {
+            for( ActionId dep : actions[id].dependencies ) {
+                if( actions[dep].isComplete() ) {
+                    users[dep].push_back(id);
+                    pending[id]++;
+                }
+            }
+        }
+    }
+    std::vector<ActionId> order;
+    for( ActionId id = 0; id < count; id++ ) {
+        if( actions[id].isComplete() && pending[id] == 0 ) {
+            order.push_back(id);
+        }
+    }
+    for( size_t i = 0; i < order.size(); i++ ) {
+        for( ActionId user : users[order[i]] ) {
+            if( --pending[user] == 0 ) {
+                order.push_back(user);
+            }
+        }
+    }
+
+    std::vector<int64_t> head(count, 0), tail(count, 0);
+    for( ActionId id : order ) {
+        int64_t before = 0;
+        for( ActionId dep : actions[id].dependencies ) {
+            if( actions[dep].isComplete() ) {
+                before = std::max(before, head[dep]);
+            }
+        }
+        head[id] = before + actions[id].getDuration();
+        report.longestPath = std::max(report.longestPath, head[id]);
+    }
+    for( auto it = order.rbegin(); it != order.rend(); ++it ) {
+        int64_t after = 0;
+        for( ActionId user : users[*it] ) {
+            after = std::max(after, tail[user] + actions[user].getDuration());
+        }
+        tail[*it] = after;
+    }
+    for( ActionId id : order ) {
+        int64_t slack = report.longestPath - head[id] - tail[id];
+        int64_t delay = actions[id].getDuration() - slack;
+        if( delay > 0 ) {
+            report.delays.push_back(RankedAction{id, delay});
+        }
+    }
+    std::stable_sort(report.delays.begin(), report.delays.end(),
+            []( const RankedAction &a, const RankedAction &b ) { return a.delay > b.delay; });
+    return report;
+}
+
+void BuildTimeline::print( std::ostream &out, const Report &report, size_t limit ) const {
+    out << "Wall time " << formatTime(report.wallTime) << ", " << formatTime(report.actionTime) <<
+        " in actions, longest dependency chain " << formatTime(report.longestPath) << "\n";
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%.2f", report.parallelism);
+    out << "Average parallelism " << buf << " of " << report.jobs << " jobs\n";
+
+    out << "\nCritical path (" << report.criticalPath.size() << " actions):\n";
+    for( const CriticalAction &entry : report.criticalPath ) {
+        const Action &action = actions[entry.id];
+        out << "  " << formatTime(action.getDuration()) << "  (waited " << formatTime(entry.wait) << ")  " <<
+            action.name << "\n";
+    }
+
+    out << "\nActions delaying completion:\n";
+    for( size_t i = 0; i < report.delays.size() && i < limit; i++ ) {
+        const Action &action = actions[report.delays[i].id];
+        out << "  " << formatTime(report.delays[i].delay) << "  of " << formatTime(action.getDuration()) <<
+            "  " << action.name << "\n";
+    }
+}
+
+}
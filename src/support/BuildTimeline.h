@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_BUILDTIMELINE_H
+#define FABR_SUPPORT_BUILDTIMELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace fabr {
+
+/**
+ * Records when each action of a build ran, and what it waited for, so that
+ * afterwards we can explain why the build took as long as it did: the
+ * critical path it actually followed, the parallelism it achieved, and
+ * which actions held up completion the most.
+ *
+ * Not thread-safe; it's expected to be driven by DependencyQueue, which
+ * the caller already synchronizes.
+ */
+class BuildTimeline {
+public:
+    typedef size_t ActionId;
+
+    struct Action {
+        std::string name;
+        /** Actions this one had to wait for */
+        std::vector<ActionId> dependencies;
+        /** Start and end times in nanoseconds, or -1 if not (yet) run */
+        int64_t start = -1;
+        int64_t end = -1;
+
+        bool isComplete() const {
+            return start != -1 && end != -1;
+        }
+        int64_t getDuration() const {
+            return end - start;
+        }
+    };
+
+    struct CriticalAction {
+        ActionId id;
+        /** Time between the action becoming runnable and starting */
+        int64_t wait;
+    };
+
+    struct RankedAction {
+        ActionId id;
+        /**
+         * How much longer the build was (with unlimited parallelism) for
+         * the action taking as long as it did: its duration less its slack.
+         * This is an upper bound on the time saved by making the action
+         * free (e.g. by caching it).
+         */
+        int64_t delay;
+    };
+
+    struct Report {
+        int64_t wallTime = 0;
+        /** Total time spent in actions */
+        int64_t actionTime = 0;
+        /** Length of the longest dependency chain, ignoring scheduling */
+        int64_t longestPath = 0;
+        /** Mean number of actions running at once */
+        double parallelism = 0;
+        unsigned jobs = 0;
+        /** The path actually followed, from first to last action */
+        std::vector<CriticalAction> criticalPath;
+        /** Actions ordered by decreasing delay, omitting those with none */
+        std::vector<RankedAction> delays;
+    };
+
+private:
+    std::vector<Action> actions;
+
+public:
+    ActionId addAction( const std::string &name ) {
+        actions.emplace_back();
+        actions.back().name = name;
+        return actions.size() - 1;
+    }
+
+    /**
+     * Record that from couldn't start until to had finished.
+     */
+    void addDependency( ActionId from, ActionId to ) {
+        actions[from].dependencies.push_back(to);
+    }
+
+    void started( ActionId id, int64_t time ) {
+        actions[id].start = time;
+    }
+    void finished( ActionId id, int64_t time ) {
+        actions[id].end = time;
+    }
+
+    const Action &getAction( ActionId id ) const {
+        return actions[id];
+    }
+    size_t size() const {
+        return actions.size();
+    }
+    void clear() {
+        actions.clear();
+    }
+
+    /**
+     * Analyse the completed actions of a build run with the given number
+     * of parallel jobs.
+     */
+    Report analyse( unsigned jobs ) const;
+
+    /**
+     * Print a human-readable summary of the report, listing at most
+     * limit ranked actions.
+     */
+    void print( std::ostream &out, const Report &report, size_t limit = 10 ) const;
+};
+
+}
+
+#endif /* !FABR_SUPPORT_BUILDTIMELINE_H */
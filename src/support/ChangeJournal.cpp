@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/ChangeJournal.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <system_error>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_ATTRIB|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|IN_DELETE_SELF| \
+        IN_MODIFY|IN_MOVE_SELF|IN_MOVED_FROM|IN_MOVED_TO|IN_ONLYDIR|IN_EXCL_UNLINK)
+#endif
+
+/**
+ * Polling interval (ms) used by wait() when change notification isn't
+ * available.
+ */
+#define FALLBACK_POLL_INTERVAL 1000
+
+namespace fabr {
+
+bool ChangeSet::contains( const Path &path ) const {
+    if( !complete ) {
+        return true;
+    }
+    if( paths.empty() ) {
+        return false;
+    }
+    Path p(path);
+    while( true ) {
+        if( paths.find(p.str()) != paths.end() ) {
+            return true;
+        }
+        if( !p.hasComponents() ) {
+            return false;
+        }
+        p.pop_back();
+    }
+}
+
+ChangeJournal::ChangeJournal() {
+#ifdef __linux__
+    fd = ::inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+#endif
+}
+
+ChangeJournal::~ChangeJournal() {
+    if( fd != -1 ) {
+        ::close(fd);
+    }
+}
+
+void ChangeJournal::watch( const Path &dir ) {
+#ifdef __linux__
+    if( fd == -1 || watchedDirs.find(dir.str()) != watchedDirs.end() ) {
+        return;
+    }
+    int wd = ::inotify_add_watch(fd, dir.str().c_str(), WATCH_MASK);
+    if( wd == -1 ) {
+        /* Typically ENOSPC (out of watches) or the directory has gone away.
+         * Either way we can no longer vouch for the contents.
+         */
+        pending.complete = false;
+        return;
+    }
+    watches[wd] = dir.str();
+    watchedDirs[dir.str()] = wd;
+#else
+    (void)dir;
+#endif
+}
+
+bool ChangeJournal::readEvents() {
+#ifdef __linux__
+    bool any = false;
+    alignas(struct inotify_event) char buf[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+    while( true ) {
+        ssize_t len = ::read(fd, buf, sizeof(buf));
+        if( len == -1 ) {
+            if( errno == EINTR ) {
+                continue;
+            } else if( errno == EAGAIN ) {
+                return any;
+            }
+            throw std::system_error(errno, std::system_category());
+        }
+
+        any = true;
+        for( char *p = buf; p < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if( event->mask & IN_Q_OVERFLOW ) {
+                pending.complete = false;
+                continue;
+            }
+            auto it = watches.find(event->wd);
+            if( it == watches.end() ) {
+                continue;
+            }
+            if( event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED) ) {
+                /* The directory itself is gone; it will be re-watched if it's
+                 * still of interest when the model is next refreshed.
+                 */
+                pending.paths.insert(it->second);
+                if( event->mask & IN_IGNORED ) {
+                    watchedDirs.erase(it->second);
+                    watches.erase(it);
+                }
+            } else if( event->len > 0 ) {
+                pending.paths.insert((Path(it->second) + event->name).str());
+                if( (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE|IN_MOVED_TO)) ) {
+                    /* Nothing is watching the new directory yet, so anything
+                     * created in it since could have been missed.
+                     */
+                    pending.complete = false;
+                }
+            }
+        }
+    }
+#else
+    return false;
+#endif
+}
+
+ChangeSet ChangeJournal::takeChanges() {
+    if( fd != -1 ) {
+        readEvents();
+    }
+    ChangeSet result;
+    std::swap(result, pending);
+    pending.complete = fd != -1;
+    return result;
+}
+
+bool ChangeJournal::wait( int timeout ) {
+    if( fd == -1 ) {
+        /* No notification, so all we can do is poll: an indefinite wait
+         * ends after a while, reporting that things may have changed, while
+         * a bounded one (e.g. waiting for changes to settle) just runs out.
+         */
+        if( timeout == -1 ) {
+            ::usleep(FALLBACK_POLL_INTERVAL * 1000);
+            return true;
+        }
+        ::usleep(timeout * 1000);
+        return false;
+    }
+
+    if( readEvents() ) {
+        return true;
+    }
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int ready;
+    do {
+        ready = ::poll(&pfd, 1, timeout);
+    } while( ready == -1 && errno == EINTR );
+    if( ready == -1 ) {
+        throw std::system_error(errno, std::system_category());
+    }
+    return ready > 0 && readEvents();
+}
+
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_CHANGEJOURNAL_H
+#define FABR_SUPPORT_CHANGEJOURNAL_H
+
+#include <map>
+#include <set>
+#include <string>
+
+#include "support/Path.h"
+
+namespace fabr {
+
+/**
+ * Set of paths known to have changed over some interval. A complete set
+ * accounts for every change in the watched directories; an incomplete one
+ * means changes may have been missed and the caller must fall back to
+ * checking everything.
+ */
+class ChangeSet {
+private:
+    std::set<std::string> paths;
+    bool complete = false;
+
+    friend class ChangeJournal;
+
+public:
+    ChangeSet() { }
+
+    /**
+     * @return true if every change is accounted for.
+     */
+    bool isComplete() const {
+        return complete;
+    }
+
+    /**
+     * @return true if the given path may have changed. This is always true
+     * for an incomplete set, and is also true if any parent directory was
+     * itself created, deleted or moved.
+     */
+    bool contains( const Path &path ) const;
+
+    /**
+     * @return the paths recorded as changed (not including their contents,
+     * for directories).
+     */
+    const std::set<std::string> &getPaths() const {
+        return paths;
+    }
+
+    bool empty() const {
+        return paths.empty();
+    }
+    size_t size() const {
+        return paths.size();
+    }
+};
+
+/**
+ * Records changes to watched directories between builds, so that a
+ * long-running process (the build server, or --watch mode) only has to
+ * check the paths that have actually changed rather than stat everything.
+ *
+ * This uses inotify where available. Directories are watched
+ * non-recursively; newly created subdirectories show up as a change to the
+ * subdirectory itself, which covers everything beneath it, and also make
+ * the change set incomplete, since their contents aren't watched until
+ * the caller gets round to it. If a watch can't
+ * be added (e.g. the user watch limit is exhausted), or the event queue
+ * overflows, the journal reports the next change set as incomplete.
+ *
+ * Not thread safe.
+ */
+class ChangeJournal {
+private:
+    int fd = -1;
+    /** Watch descriptor to watched directory */
+    std::map<int, std::string> watches;
+    /** Watched directory to watch descriptor */
+    std::map<std::string, int> watchedDirs;
+    ChangeSet pending;
+
+    /**
+     * Process any events currently readable from the inotify fd.
+     * @return true if any events were read.
+     */
+    bool readEvents();
+
+public:
+    ChangeJournal();
+    ~ChangeJournal();
+    ChangeJournal( const ChangeJournal & ) = delete;
+
+    /**
+     * @return true if change notification is supported on this platform.
+     * If not, every change set is incomplete.
+     */
+    bool isAvailable() const {
+        return fd != -1;
+    }
+
+    /**
+     * Start watching the given directory (if not already watched). The
+     * directory should be watched before any of its contents are checked, so
+     * that changes racing with the check are not lost.
+     */
+    void watch( const Path &dir );
+
+    /**
+     * @return the number of directories being watched.
+     */
+    size_t getWatchCount() const {
+        return watches.size();
+    }
+
+    /**
+     * Return all changes recorded since the last call, and start recording
+     * afresh. The first change set is always incomplete, as there's no
+     * previous state to compare against.
+     */
+    ChangeSet takeChanges();
+
+    /**
+     * Wait for new changes to arrive.
+     * @param timeout maximum time to wait in milliseconds, or -1 to
+     * wait indefinitely.
+     * @return true if any changes were recorded. Without change
+     * notification, an indefinite wait returns true after a poll interval
+     * (as anything may have changed) and a bounded one returns false.
+     */
+    bool wait( int timeout );
+};
+
+}
+
+#endif /* !FABR_SUPPORT_CHANGEJOURNAL_H */
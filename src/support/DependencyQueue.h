@@ -19,9 +19,17 @@
 #ifndef FABR_SUPPORT_DEPENDENCYQUEUE_H
 #define FABR_SUPPORT_DEPENDENCYQUEUE_H
 
+#include <stddef.h>
+
+#include <functional>
 #include <list>
 #include <set>
 #include <map>
+#include <string>
+
+#include "support/BuildTimeline.h"
+#include "support/Metrics.h"
+#include "support/Trace.h"
 
 namespace fabr {
 
@@ -43,6 +51,7 @@ private:
         T task;
         std::set<Job *> waitList;
         std::list<Job *> usedBy;
+        BuildTimeline::ActionId action = 0;
 
         Job( T task ) : task(task) { }
 
@@ -53,23 +62,50 @@ private:
 
     std::map<T, Job *> queue;
     std::list<Job *> runnable;
+    /** Number of jobs dequeued but not yet completed */
+    size_t running = 0;
+
+    BuildTimeline *timeline = nullptr;
+    std::function<std::string(const T &)> describe;
+
+    void traceCounts() const {
+        if( Trace::isEnabled() ) {
+            Trace::counter("runnable", runnable.size());
+            Trace::counter("running", running);
+        }
+    }
 
     void addDependency( Job *from, Job *to ) {
-        from->waitList.insert(to);
-        to->usedBy.push_back(from);
+        if( from->waitList.insert(to).second ) {
+            to->usedBy.push_back(from);
+            if( timeline != nullptr ) {
+                timeline->addDependency(from->action, to->action);
+            }
+        }
+    }
+
+    Job *newJob( T task ) {
+        Metrics::add(Metrics::QUEUE_QUEUED);
+        Job *job = new Job(task);
+        queue[task] = job;
+        if( timeline != nullptr ) {
+            job->action = timeline->addAction(describe(task));
+        }
+        return job;
     }
 
     void markComplete( Job *job ) {
         for( auto dep : job->usedBy ) {
             dep->waitList.erase(job);
             if( dep->isRunnable() ) {
-                markRunnable(job);
+                markRunnable(dep);
             }
         }
     }
 
     void markRunnable( Job *job ) {
         runnable.push_back(job);
+        traceCounts();
     }
 
     Job *getJob( T task ) const {
@@ -79,7 +115,16 @@ private:
 
 public:
     /** Default constructor */
-    DependencyQueue();
+    DependencyQueue() { }
+
+    /**
+     * Record the timing and dependencies of jobs queued from now on into
+     * the given timeline, naming each with describe(task).
+     */
+    void setTimeline( BuildTimeline *timeline, std::function<std::string(const T &)> describe ) {
+        this->timeline = timeline;
+        this->describe = describe;
+    }
 
     /**
      * Add a job to the queue with no dependencies (immediately runnable). The job
@@ -87,8 +132,7 @@ public:
      * @param task the task to add
      */
     void queueJob( T task ) {
-        Job *job = new Job(task);
-        queue[task] = job;
+        Job *job = newJob(task);
         markRunnable(job);
     }
 
@@ -97,13 +141,16 @@ public:
      * queue.
      * @param task the task to add
      * @param begin,end an iterator range specifying the dependencies of the job.
+     * Dependencies which aren't in the queue (e.g. have already completed)
+     * are ignored.
      */
     template<class Iterator>
     void queueJob( T task, Iterator begin, Iterator end ) {
-        Job *job = new Job(task);
-        queue[task] = job;
+        Job *job = newJob(task);
         while( begin != end ) {
-            addDependency( job, getJob(*begin) );
+            if( Job *dep = getJob(*begin) ) {
+                addDependency( job, dep );
+            }
             ++begin;
         }
         if( job->isRunnable() ) {
@@ -111,13 +158,24 @@ public:
         }
     }
 
-    void addDependency( T fromTask, T toTask ) {
+    /**
+     * Make a queued job wait for another, e.g. when dependencies are only
+     * discovered as other jobs complete. The job must not have been
+     * dequeued yet.
+     * @return false (adding nothing) if either job isn't in the queue, e.g.
+     * because toTask has already completed.
+     */
+    bool addDependency( T fromTask, T toTask ) {
         Job *fromJob = getJob(fromTask);
         Job *toJob = getJob(toTask);
+        if( fromJob == nullptr || toJob == nullptr ) {
+            return false;
+        }
         if( fromJob->isRunnable() ) {
-            runnable.erase(fromJob);
+            runnable.remove(fromJob);
         }
         addDependency( fromJob, toJob );
+        return true;
     }
 
     /**
@@ -127,6 +185,12 @@ public:
     T dequeueJob() {
         Job *job = runnable.front();
         runnable.pop_front();
+        running++;
+        Metrics::add(Metrics::QUEUE_DEQUEUED);
+        traceCounts();
+        if( timeline != nullptr ) {
+            timeline->started(job->action, Trace::now());
+        }
         return job->task;
     }
 
@@ -141,9 +205,15 @@ public:
      */
     void jobCompleted( T task ) {
         Job *job = getJob(task);
+        if( timeline != nullptr ) {
+            timeline->finished(job->action, Trace::now());
+        }
+        running--;
+        Metrics::add(Metrics::QUEUE_COMPLETED);
         markComplete(job);
         queue.erase(task);
         delete job;
+        traceCounts();
     }
 
     /**
@@ -181,6 +251,13 @@ public:
     size_t getRunnableCount() const {
         return runnable.size();
     }
+
+    /**
+     * @return the number of jobs dequeued but not yet completed.
+     */
+    size_t getRunningCount() const {
+        return running;
+    }
 };
 
 }
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/Digest.h"
+#include "support/DigestKernel.h"
+#include "support/ThreadPool.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * Subtrees of up to this many chunks are hashed as a single batch,
+ * leaf chunks first and then each level of parents.
+ */
+#define SUBTREE_BATCH_CHUNKS 64
+
+/**
+ * Inputs smaller than this aren't worth splitting across threads.
+ */
+#define PARALLEL_THRESHOLD (4*1024*1024)
+
+/**
+ * Smallest subtree to hand to a single thread.
+ */
+#define PARALLEL_MIN_SUBTREE (256*1024)
+
+namespace fabr {
+
+const uint32_t DIGEST_IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+const uint8_t DIGEST_MSG_SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+/************************* Portable kernel **************************/
+
+static inline uint32_t rotr( uint32_t w, unsigned c ) {
+    return (w >> c) | (w << (32 - c));
+}
+
+static inline uint32_t load32( const uint8_t *p ) {
+    return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void storeCv( uint8_t *out, const uint32_t cv[8] ) {
+    for( int i=0; i<8; i++ ) {
+        out[4*i] = (uint8_t)cv[i];
+        out[4*i+1] = (uint8_t)(cv[i] >> 8);
+        out[4*i+2] = (uint8_t)(cv[i] >> 16);
+        out[4*i+3] = (uint8_t)(cv[i] >> 24);
+    }
+}
+
+static inline void g( uint32_t *state, int a, int b, int c, int d, uint32_t x, uint32_t y ) {
+    state[a] = state[a] + state[b] + x;
+    state[d] = rotr(state[d] ^ state[a], 16);
+    state[c] = state[c] + state[d];
+    state[b] = rotr(state[b] ^ state[c], 12);
+    state[a] = state[a] + state[b] + y;
+    state[d] = rotr(state[d] ^ state[a], 8);
+    state[c] = state[c] + state[d];
+    state[b] = rotr(state[b] ^ state[c], 7);
+}
+
+/**
+ * The BLAKE3 compression function, updating cv in place.
+ */
+static void compress( uint32_t cv[8], const uint8_t block[DIGEST_BLOCK_LEN], uint8_t blockLength,
+        uint64_t counter, uint8_t flags ) {
+    uint32_t m[16];
+    for( int i=0; i<16; i++ ) {
+        m[i] = load32(block + 4*i);
+    }
+    uint32_t state[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        DIGEST_IV[0], DIGEST_IV[1], DIGEST_IV[2], DIGEST_IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), blockLength, flags
+    };
+    for( int r=0; r<7; r++ ) {
+        const uint8_t *s = DIGEST_MSG_SCHEDULE[r];
+        g(state, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        g(state, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        g(state, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        g(state, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        g(state, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        g(state, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        g(state, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        g(state, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for( int i=0; i<8; i++ ) {
+        cv[i] = state[i] ^ state[i+8];
+    }
+}
+
+void digestHashManyPortable( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    for( size_t j=0; j<count; j++ ) {
+        uint32_t cv[8];
+        memcpy(cv, DIGEST_IV, sizeof(cv));
+        const uint8_t *p = input + j*stride;
+        for( size_t b=0; b<blocks; b++ ) {
+            uint8_t blockFlags = flags | (b == 0 ? flagsStart : 0) | (b == blocks-1 ? flagsEnd : 0);
+            compress(cv, p + b*DIGEST_BLOCK_LEN, DIGEST_BLOCK_LEN,
+                    counter + (incrementCounter ? j : 0), blockFlags);
+        }
+        storeCv(out + j*DIGEST_CV_LEN, cv);
+    }
+}
+
+/************************* Kernel selection *************************/
+
+static const DigestKernel portableKernel = { "portable", 1, digestHashManyPortable };
+#if defined(__x86_64__) || defined(__i386__)
+static const DigestKernel avx512Kernel = { "avx512", 16, digestHashManyAvx512 };
+static const DigestKernel avx2Kernel = { "avx2", 8, digestHashManyAvx2 };
+#endif
+#if defined(__aarch64__)
+static const DigestKernel neonKernel = { "neon", 4, digestHashManyNeon };
+#endif
+
+size_t getDigestKernels( const DigestKernel **kernels, size_t max ) {
+    const DigestKernel *supported[4];
+    size_t count = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx512f") ) {
+        supported[count++] = &avx512Kernel;
+    }
+    if( __builtin_cpu_supports("avx2") ) {
+        supported[count++] = &avx2Kernel;
+    }
+#endif
+#if defined(__aarch64__)
+    supported[count++] = &neonKernel;
+#endif
+    supported[count++] = &portableKernel;
+
+    if( kernels != nullptr ) {
+        for( size_t i=0; i<count && i<max; i++ ) {
+            kernels[i] = supported[i];
+        }
+    }
+    return count;
+}
+
+static const DigestKernel *selectKernel() {
+    const DigestKernel *best;
+    getDigestKernels(&best, 1);
+    return best;
+}
+
+static const DigestKernel *currentKernel = selectKernel();
+
+const DigestKernel &getDigestKernel() {
+    return *currentKernel;
+}
+
+bool setDigestKernel( const char *name ) {
+    const DigestKernel *kernels[4];
+    size_t count = getDigestKernels(kernels, 4);
+    for( size_t i=0; i<count; i++ ) {
+        if( strcmp(kernels[i]->name, name) == 0 ) {
+            currentKernel = kernels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/************************* Tree hashing *****************************/
+
+/**
+ * Compute the (non-root) chaining value of a complete subtree of the given
+ * number of chunks, which must be a power of 2.
+ */
+static void hashSubtree( const uint8_t *input, size_t chunks, uint64_t counter, uint8_t out[DIGEST_CV_LEN] ) {
+    if( chunks > SUBTREE_BATCH_CHUNKS ) {
+        uint8_t children[2*DIGEST_CV_LEN];
+        size_t half = chunks/2;
+        hashSubtree(input, half, counter, children);
+        hashSubtree(input + half*DIGEST_CHUNK_LEN, half, counter + half, children + DIGEST_CV_LEN);
+        currentKernel->hashMany(children, 2*DIGEST_CV_LEN, 1, 1, 0, false, DIGEST_PARENT, 0, 0, out);
+        return;
+    }
+
+    uint8_t cvs[2][SUBTREE_BATCH_CHUNKS*DIGEST_CV_LEN];
+    currentKernel->hashMany(input, DIGEST_CHUNK_LEN, chunks, DIGEST_CHUNK_LEN/DIGEST_BLOCK_LEN,
+            counter, true, 0, DIGEST_CHUNK_START, DIGEST_CHUNK_END, cvs[0]);
+    int level = 0;
+    while( chunks > 1 ) {
+        chunks /= 2;
+        currentKernel->hashMany(cvs[level], 2*DIGEST_CV_LEN, chunks, 1, 0, false,
+                DIGEST_PARENT, 0, 0, cvs[level^1]);
+        level ^= 1;
+    }
+    memcpy(out, cvs[level], DIGEST_CV_LEN);
+}
+
+/**
+ * Combine two chaining values into their parent, in place in left.
+ */
+static void hashParent( uint8_t left[DIGEST_CV_LEN], const uint8_t right[DIGEST_CV_LEN], uint8_t flags ) {
+    uint8_t block[DIGEST_BLOCK_LEN];
+    memcpy(block, left, DIGEST_CV_LEN);
+    memcpy(block + DIGEST_CV_LEN, right, DIGEST_CV_LEN);
+    uint32_t cv[8];
+    memcpy(cv, DIGEST_IV, sizeof(cv));
+    compress(cv, block, DIGEST_BLOCK_LEN, 0, DIGEST_PARENT | flags);
+    storeCv(left, cv);
+}
+
+/**
+ * @return the largest power of 2 <= n (n > 0).
+ */
+static inline uint64_t roundDownPow2( uint64_t n ) {
+    return (uint64_t)1 << (63 - __builtin_clzll(n));
+}
+
+std::string Digest::str() const {
+    static const char hex[] = "0123456789abcdef";
+    std::string result(SIZE*2, '0');
+    for( size_t i=0; i<SIZE; i++ ) {
+        result[2*i] = hex[bytes[i] >> 4];
+        result[2*i+1] = hex[bytes[i] & 0x0F];
+    }
+    return result;
+}
+
+Digest Digest::of( const void *data, size_t length ) {
+    Hasher hasher;
+    if( length >= PARALLEL_THRESHOLD ) {
+        hasher.update(data, length, ThreadPool::getDefault());
+    } else {
+        hasher.update(data, length);
+    }
+    return hasher.finish();
+}
+
+Digest Digest::of( const Buffer &buffer ) {
+    return of(buffer.data(), buffer.size());
+}
+
+void Hasher::reset() {
+    stackSize = 0;
+    memcpy(chunkCv, DIGEST_IV, sizeof(DIGEST_IV));
+    blockLength = 0;
+    blocksCompressed = 0;
+    chunkCounter = 0;
+}
+
+void Hasher::pushSubtree( const uint8_t cv[DIGEST_CV_LEN], uint64_t chunks ) {
+    /* Merge completed subtrees: each trailing zero bit in the new chunk
+     * count (at the granularity of the new subtree) means another pair of
+     * equal-sized subtrees to combine. We only get here when more data is
+     * known to follow, so the root is never merged early.
+     */
+    uint8_t merged[DIGEST_CV_LEN];
+    memcpy(merged, cv, DIGEST_CV_LEN);
+    chunkCounter += chunks;
+    uint64_t total = chunkCounter / chunks;
+    while( (total & 1) == 0 ) {
+        stackSize--;
+        hashParent(cvStack[stackSize], merged, 0);
+        memcpy(merged, cvStack[stackSize], DIGEST_CV_LEN);
+        total >>= 1;
+    }
+    memcpy(cvStack[stackSize++], merged, DIGEST_CV_LEN);
+}
+
+void Hasher::flushChunk() {
+    if( blockLength == DIGEST_BLOCK_LEN &&
+            blocksCompressed == DIGEST_CHUNK_LEN/DIGEST_BLOCK_LEN - 1 ) {
+        compress(chunkCv, block, DIGEST_BLOCK_LEN, chunkCounter, DIGEST_CHUNK_END);
+        uint8_t cv[DIGEST_CV_LEN];
+        storeCv(cv, chunkCv);
+        pushSubtree(cv, 1);
+        memcpy(chunkCv, DIGEST_IV, sizeof(DIGEST_IV));
+        blocksCompressed = 0;
+        blockLength = 0;
+    }
+}
+
+void Hasher::update( const void *data, size_t length ) {
+    const uint8_t *p = (const uint8_t *)data;
+    while( length > 0 ) {
+        flushChunk();
+
+        /* Hash whole subtrees directly from the input where we can. Always
+         * leave at least one byte, as the last chunk has to go through the
+         * chunk state to be finished as the root (or right-most leaf).
+         */
+        if( atChunkBoundary() && length > DIGEST_CHUNK_LEN ) {
+            uint64_t chunks = roundDownPow2((length - 1) / DIGEST_CHUNK_LEN);
+            while( (chunkCounter & (chunks - 1)) != 0 ) {
+                chunks /= 2;
+            }
+            uint8_t cv[DIGEST_CV_LEN];
+            hashSubtree(p, chunks, chunkCounter, cv);
+            pushSubtree(cv, chunks);
+            p += chunks * DIGEST_CHUNK_LEN;
+            length -= chunks * DIGEST_CHUNK_LEN;
+            continue;
+        }
+
+        /* Otherwise go through the chunk state a block at a time. We only
+         * compress a full block once we know more data follows, since the
+         * last block of the last chunk is compressed differently.
+         */
+        if( blockLength == DIGEST_BLOCK_LEN ) {
+            compress(chunkCv, block, DIGEST_BLOCK_LEN, chunkCounter,
+                    blocksCompressed == 0 ? DIGEST_CHUNK_START : 0);
+            blocksCompressed++;
+            blockLength = 0;
+        }
+        size_t take = std::min((size_t)(DIGEST_BLOCK_LEN - blockLength), length);
+        memcpy(block + blockLength, p, take);
+        blockLength += take;
+        p += take;
+        length -= take;
+    }
+}
+
+void Hasher::update( const void *data, size_t length, ThreadPool &pool ) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t threads = pool.getConcurrency();
+    if( threads <= 1 || length < PARALLEL_THRESHOLD ) {
+        update(p, length);
+        return;
+    }
+
+    /* Pick a subtree size that gives each thread a few pieces to balance
+     * the load, but not so small that the overhead dominates.
+     */
+    uint64_t pieceChunks = length / (threads * 4 * DIGEST_CHUNK_LEN);
+    pieceChunks = std::max((uint64_t)PARALLEL_MIN_SUBTREE / DIGEST_CHUNK_LEN,
+            pieceChunks == 0 ? 1 : roundDownPow2(pieceChunks));
+    size_t pieceLength = pieceChunks * DIGEST_CHUNK_LEN;
+
+    /* Get to a boundary the pieces are aligned to, first */
+    if( !atChunkBoundary() ) {
+        size_t inChunk = blocksCompressed * DIGEST_BLOCK_LEN + blockLength;
+        size_t take = std::min(DIGEST_CHUNK_LEN - inChunk, length);
+        update(p, take);
+        p += take;
+        length -= take;
+        if( length == 0 ) {
+            return;
+        }
+        flushChunk();
+    }
+    if( (chunkCounter & (pieceChunks - 1)) != 0 ) {
+        size_t take = std::min((pieceChunks - (chunkCounter & (pieceChunks - 1))) * DIGEST_CHUNK_LEN,
+                (uint64_t)length);
+        update(p, take);
+        p += take;
+        length -= take;
+        if( length == 0 ) {
+            return;
+        }
+        flushChunk();
+    }
+
+    size_t pieces = (length - 1) / pieceLength;
+    if( pieces > 0 ) {
+        std::vector<uint8_t> cvs(pieces * DIGEST_CV_LEN);
+        uint64_t base = chunkCounter;
+        pool.forEach(pieces, [&]( size_t i ) {
+            hashSubtree(p + i*pieceLength, pieceChunks, base + i*pieceChunks, &cvs[i*DIGEST_CV_LEN]);
+        });
+        for( size_t i=0; i<pieces; i++ ) {
+            pushSubtree(&cvs[i*DIGEST_CV_LEN], pieceChunks);
+        }
+        p += pieces * pieceLength;
+        length -= pieces * pieceLength;
+    }
+    update(p, length);
+}
+
+Digest Hasher::finish() const {
+    /* Finish the current chunk, then fold in the stacked subtrees from
+     * right to left. Only the final compression gets the ROOT flag.
+     */
+    uint32_t cv[8];
+    uint8_t lastBlock[DIGEST_BLOCK_LEN];
+    memcpy(cv, chunkCv, sizeof(cv));
+    memset(lastBlock, 0, sizeof(lastBlock));
+    memcpy(lastBlock, block, blockLength);
+    uint8_t flags = DIGEST_CHUNK_END | (blocksCompressed == 0 ? DIGEST_CHUNK_START : 0);
+
+    Digest digest;
+    if( stackSize == 0 ) {
+        compress(cv, lastBlock, blockLength, chunkCounter, flags | DIGEST_ROOT);
+        storeCv(digest.bytes, cv);
+        return digest;
+    }
+    compress(cv, lastBlock, blockLength, chunkCounter, flags);
+    uint8_t right[DIGEST_CV_LEN];
+    storeCv(right, cv);
+    for( unsigned i = stackSize; i > 0; i-- ) {
+        uint8_t parent[DIGEST_CV_LEN];
+        memcpy(parent, cvStack[i-1], DIGEST_CV_LEN);
+        hashParent(parent, right, i == 1 ? DIGEST_ROOT : 0);
+        memcpy(right, parent, DIGEST_CV_LEN);
+    }
+    memcpy(digest.bytes, right, DIGEST_CV_LEN);
+    return digest;
+}
+
+}
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_DIGEST_H
+#define FABR_SUPPORT_DIGEST_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+namespace fabr {
+
+class Buffer;
+class ThreadPool;
+
+/**
+ * 256-bit content digest. The hash function is BLAKE3, which is fast,
+ * cryptographically strong (so digests can safely be used as cache keys),
+ * and tree-structured: the input is hashed in 1KiB chunks that are combined
+ * pairwise, so independent subtrees can be hashed on separate cores and
+ * many chunks can be hashed at once with vector instructions. The vector
+ * kernel (AVX-512, AVX2, NEON or portable) is chosen at runtime.
+ */
+struct Digest {
+    static const size_t SIZE = 32;
+
+    uint8_t bytes[SIZE];
+
+    bool operator ==( const Digest &d ) const {
+        return memcmp(bytes, d.bytes, SIZE) == 0;
+    }
+    bool operator !=( const Digest &d ) const {
+        return memcmp(bytes, d.bytes, SIZE) != 0;
+    }
+    bool operator <( const Digest &d ) const {
+        return memcmp(bytes, d.bytes, SIZE) < 0;
+    }
+
+    /**
+     * @return the digest as a lower-case hex string.
+     */
+    std::string str() const;
+
+    /**
+     * @return the digest of the given data. Large inputs are hashed in
+     * parallel on the default ThreadPool.
+     */
+    static Digest of( const void *data, size_t length );
+    static Digest of( const Buffer &buffer );
+};
+
+/**
+ * Incremental digest computation, for data that arrives in pieces.
+ * The result is identical to Digest::of() over the concatenated data,
+ * regardless of how the data is split between update() calls.
+ */
+class Hasher {
+private:
+    /* Chaining values of completed subtrees, at most one per level */
+    uint8_t cvStack[54][32];
+    unsigned stackSize;
+
+    /* State of the current (incomplete) chunk */
+    uint32_t chunkCv[8];
+    uint8_t block[64];
+    unsigned blockLength;
+    unsigned blocksCompressed;
+    uint64_t chunkCounter;
+
+    /**
+     * Add the chaining value of a complete subtree of the given number of
+     * chunks (a power of 2), which must start at chunkCounter and be aligned
+     * to its own size.
+     */
+    void pushSubtree( const uint8_t cv[32], uint64_t chunks );
+
+    /**
+     * If the current chunk is full, finish it. Only valid when we know
+     * more data follows.
+     */
+    void flushChunk();
+
+    bool atChunkBoundary() const {
+        return blocksCompressed == 0 && blockLength == 0;
+    }
+
+public:
+    Hasher() {
+        reset();
+    }
+
+    /**
+     * Reset the hasher to its initial (no data) state.
+     */
+    void reset();
+
+    /**
+     * Add data to the hash.
+     */
+    void update( const void *data, size_t length );
+
+    /**
+     * Add data to the hash, splitting large inputs into subtrees that are
+     * hashed in parallel on the given pool.
+     */
+    void update( const void *data, size_t length, ThreadPool &pool );
+
+    /**
+     * @return the digest of all data added since the last reset. The
+     * hasher itself is unaffected, so more data may be added afterwards.
+     */
+    Digest finish() const;
+};
+
+}
+
+namespace std {
+template<>
+struct hash<fabr::Digest> {
+    size_t operator()( const fabr::Digest &digest ) const {
+        /* Digests are already uniformly distributed */
+        size_t h;
+        memcpy(&h, digest.bytes, sizeof(h));
+        return h;
+    }
+};
+}
+
+#endif /* !FABR_SUPPORT_DIGEST_H */
@@ -0,0 +1,302 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/DigestCache.h"
+#include "support/Metrics.h"
+#include "support/OutputFile.h"
+#include "support/StatCache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <system_error>
+
+/* 'FDGC' - also serves to reject files written with the other byte order */
+#define DIGEST_CACHE_MAGIC 0x46444743
+#define DIGEST_CACHE_VERSION 1
+
+namespace fabr {
+
+namespace {
+
+struct Header {
+    uint32_t magic;
+    uint32_t version;
+    /** Number of slots in the table; always a power of 2 */
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t reserved;
+};
+
+bool isEmpty( const DigestCache::Record &record ) {
+    return record.dev == 0 && record.ino == 0;
+}
+
+}
+
+size_t DigestCache::KeyHash::operator()( const Key &k ) const {
+    uint64_t h = (k.ino ^ (k.dev << 32 | k.dev >> 32)) * 0x9E3779B97F4A7C15ull;
+    return (size_t)(h ^ (h >> 29));
+}
+
+DigestCache::DigestCache( const Path &file, int64_t startTime ) :
+        file(file), startTime(startTime) {
+    load();
+}
+
+DigestCache::~DigestCache() {
+    unload();
+}
+
+void DigestCache::load() {
+    int fd = ::open(file.str().c_str(), O_RDONLY|O_CLOEXEC);
+    if( fd == -1 ) {
+        return;
+    }
+    struct stat st;
+    if( ::fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header) ) {
+        void *p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if( p != MAP_FAILED ) {
+            mapping = p;
+            mappingSize = st.st_size;
+        }
+    }
+    ::close(fd);
+
+    if( mapping != nullptr ) {
+        /* Anything we don't recognise is just ignored, and replaced on save */
+        const Header *header = (const Header *)mapping;
+        if( header->magic == DIGEST_CACHE_MAGIC && header->version == DIGEST_CACHE_VERSION &&
+                header->capacity != 0 && (header->capacity & (header->capacity - 1)) == 0 &&
+                header->capacity <= (mappingSize - sizeof(Header)) / sizeof(Record) &&
+                mappingSize == sizeof(Header) + header->capacity * sizeof(Record) ) {
+            capacity = header->capacity;
+            table = (const Record *)(header + 1);
+            used = std::vector<std::atomic<uint8_t>>(capacity);
+        } else {
+            unload();
+        }
+    }
+}
+
+void DigestCache::unload() {
+    if( mapping != nullptr ) {
+        ::munmap(mapping, mappingSize);
+        mapping = nullptr;
+        mappingSize = 0;
+    }
+    table = nullptr;
+    capacity = 0;
+    used.clear();
+}
+
+const DigestCache::Record *DigestCache::find( const Key &key ) const {
+    if( table == nullptr ) {
+        return nullptr;
+    }
+    uint64_t mask = capacity - 1;
+    for( uint64_t i = KeyHash()(key) & mask, n = 0; n < capacity; i = (i + 1) & mask, n++ ) {
+        const Record &record = table[i];
+        if( isEmpty(record) ) {
+            break;
+        } else if( record.dev == key.dev && record.ino == key.ino ) {
+            return &record;
+        }
+    }
+    return nullptr;
+}
+
+bool DigestCache::isRacy( const StatInfo &info ) const {
+    int64_t trusted = startTime - RACY_WINDOW;
+    return info.mtime >= trusted || info.ctime >= trusted;
+}
+
+bool DigestCache::lookup( const StatInfo &info, Digest &digest ) {
+    if( !isRacy(info) ) {
+        Key key = { info.dev, info.ino };
+        Record record;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = updates.find(key);
+            if( it != updates.end() ) {
+                record = it->second;
+                found = true;
+            }
+        }
+        if( !found ) {
+            std::shared_lock<std::shared_mutex> mapped(mappingLock);
+            if( const Record *existing = find(key) ) {
+                record = *existing;
+                found = true;
+                /* Keep it, even if stale, as it'll be replaced by a store */
+                used[existing - table].store(1, std::memory_order_relaxed);
+            }
+        }
+        if( found && record.size == info.size &&
+                record.mtime == info.mtime && record.ctime == info.ctime ) {
+            memcpy(digest.bytes, record.digest, Digest::SIZE);
+            Metrics::add(Metrics::DIGESTCACHE_HITS);
+            return true;
+        }
+    }
+    Metrics::add(Metrics::DIGESTCACHE_MISSES);
+    return false;
+}
+
+void DigestCache::store( const StatInfo &info, const Digest &digest ) {
+    if( isRacy(info) || (info.dev == 0 && info.ino == 0) ) {
+        return;
+    }
+    Record record = { info.dev, info.ino, info.size, info.mtime, info.ctime, {} };
+    memcpy(record.digest, digest.bytes, Digest::SIZE);
+
+    Key key = { info.dev, info.ino };
+    {
+        std::shared_lock<std::shared_mutex> mapped(mappingLock);
+        if( const Record *existing = find(key) ) {
+            if( memcmp(existing, &record, sizeof(Record)) == 0 ) {
+                used[existing - table].store(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    updates.insert_or_assign(key, record);
+}
+
+std::vector<FileDigest> DigestCache::digest( const std::vector<Path> &paths, DigestEngine &engine ) {
+    StatCache local;
+    StatCache *stats = StatCache::getCurrent();
+    if( stats == nullptr ) {
+        stats = &local;
+    }
+    std::vector<PathRef> names;
+    names.reserve(paths.size());
+    for( const Path &path : paths ) {
+        names.push_back(PathRef(path));
+    }
+    stats->prefetch(names);
+
+    std::vector<FileDigest> results(paths.size());
+    std::vector<StatInfo> infos(paths.size());
+    std::vector<size_t> missing;
+    std::vector<Path> missingPaths;
+    for( size_t i=0; i<paths.size(); i++ ) {
+        try {
+            infos[i] = stats->get(names[i]);
+        } catch( const std::system_error &e ) {
+            results[i].error = e.code().value();
+            continue;
+        }
+        if( !infos[i].exists() ) {
+            results[i].error = ENOENT;
+        } else if( !lookup(infos[i], results[i].digest) ) {
+            missing.push_back(i);
+            missingPaths.push_back(paths[i]);
+        }
+    }
+
+    if( !missing.empty() ) {
+        std::vector<FileDigest> computed = engine.digest(missingPaths);
+        for( size_t j=0; j<missing.size(); j++ ) {
+            size_t i = missing[j];
+            results[i] = computed[j];
+            if( computed[j].isValid() ) {
+                store(infos[i], computed[j].digest);
+            }
+        }
+    }
+    return results;
+}
+
+void DigestCache::save() {
+    std::lock_guard<std::mutex> guard(lock);
+    std::unique_lock<std::shared_mutex> mapped(mappingLock);
+
+    /* Merge the used part of the existing table with the updates, keeping
+     * the load factor at or below 1/2.
+     */
+    auto isKept = [&]( uint64_t i ) {
+        return !isEmpty(table[i]) && used[i].load(std::memory_order_relaxed) &&
+                updates.find(Key{table[i].dev, table[i].ino}) == updates.end();
+    };
+    uint64_t count = updates.size();
+    uint64_t dropped = 0;
+    for( uint64_t i=0; i<capacity; i++ ) {
+        if( isKept(i) ) {
+            count++;
+        } else if( !isEmpty(table[i]) ) {
+            dropped++;
+        }
+    }
+    if( updates.empty() && (dropped == 0 || count == 0) ) {
+        /* Nothing new, or nothing used at all (which says nothing about
+         * what the next build will need)
+         */
+        return;
+    }
+
+    uint64_t newCapacity = 64;
+    while( newCapacity < count * 2 ) {
+        newCapacity <<= 1;
+    }
+    std::vector<Record> newTable(newCapacity);
+    memset(newTable.data(), 0, newCapacity * sizeof(Record));
+    uint64_t mask = newCapacity - 1;
+    uint64_t newCount = 0;
+    auto insert = [&]( const Record &record ) {
+        uint64_t i = KeyHash()(Key{record.dev, record.ino}) & mask;
+        while( !isEmpty(newTable[i]) ) {
+            i = (i + 1) & mask;
+        }
+        newTable[i] = record;
+        newCount++;
+    };
+    for( uint64_t i=0; i<capacity; i++ ) {
+        if( isKept(i) ) {
+            insert(table[i]);
+        }
+    }
+    for( auto &it : updates ) {
+        insert(it.second);
+    }
+
+    Header header = { DIGEST_CACHE_MAGIC, DIGEST_CACHE_VERSION, newCapacity, newCount, 0 };
+    OutputFile out(file, 0644);
+    out.write((const char *)&header, sizeof(header));
+    out.write((const char *)newTable.data(), newCapacity * sizeof(Record));
+    out.commit();
+
+    /* Switch over to the new file, which now holds everything, and start
+     * a new session
+     */
+    unload();
+    load();
+    updates.clear();
+}
+
+}
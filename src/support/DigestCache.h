@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_DIGESTCACHE_H
+#define FABR_SUPPORT_DIGESTCACHE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "support/Digest.h"
+#include "support/DigestEngine.h"
+#include "support/Path.h"
+
+namespace fabr {
+
+struct StatInfo;
+
+/**
+ * Persistent map from file identity (device, inode, size, mtime, ctime) to
+ * content digest, so that unchanged files don't need to be re-read on each
+ * build.
+ *
+ * The cache file is an open-addressed hash table of fixed-size records
+ * keyed by (device, inode), which is mapped read-only and probed in place;
+ * nothing is parsed up-front, so a lookup costs at most a page fault or two.
+ * New and changed entries are held in memory and written out by save(),
+ * which replaces the file atomically. Only entries that were looked up or
+ * stored since the cache was opened (or last saved) are kept, so files that
+ * have gone away, or are no longer part of the build, drop out rather than
+ * accumulating.
+ * Thread-safe, including save() against concurrent lookups.
+ *
+ * Timestamps are only trusted if they're comfortably older than the start
+ * of the build: a file modified within RACY_WINDOW of the start time (or
+ * during the build) may be changed again without its mtime moving, so its
+ * digest is always recomputed and never persisted.
+ */
+class DigestCache {
+public:
+    /** Timestamp granularity we allow for, in nanoseconds */
+    static const int64_t RACY_WINDOW = 2000000000;
+
+    /**
+     * On-disk entry. An all-zero record is an empty slot.
+     */
+    struct Record {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime;
+        int64_t ctime;
+        uint8_t digest[Digest::SIZE];
+    };
+
+private:
+    struct Key {
+        uint64_t dev;
+        uint64_t ino;
+
+        bool operator==( const Key &k ) const {
+            return dev == k.dev && ino == k.ino;
+        }
+    };
+    struct KeyHash {
+        size_t operator()( const Key &k ) const;
+    };
+
+    Path file;
+    int64_t startTime;
+
+    /* Mapped cache file, if any; only replaced under an exclusive lock */
+    std::shared_mutex mappingLock;
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+    const Record *table = nullptr;
+    uint64_t capacity = 0;
+    /** Which slots of the table have been used this session */
+    std::vector<std::atomic<uint8_t>> used;
+
+    std::mutex lock;
+    std::unordered_map<Key, Record, KeyHash> updates;
+
+    void load();
+    void unload();
+    const Record *find( const Key &key ) const;
+
+public:
+    /**
+     * Open the cache stored in the given file (which need not exist yet).
+     * @param startTime the build start time, in nanoseconds since the epoch.
+     */
+    DigestCache( const Path &file, int64_t startTime );
+    ~DigestCache();
+    DigestCache( const DigestCache & ) = delete;
+
+    /**
+     * @return true if the file is racily clean, i.e. its timestamps are too
+     * close to the start of the build to be trusted.
+     */
+    bool isRacy( const StatInfo &info ) const;
+
+    /**
+     * Look up the digest of the file with the given stat information.
+     * @return true and set digest if there's a trustworthy entry for it.
+     */
+    bool lookup( const StatInfo &info, Digest &digest );
+
+    /**
+     * Record the digest of the file with the given stat information (which
+     * must have been taken before the file was read). Ignored for racy
+     * files.
+     */
+    void store( const StatInfo &info, const Digest &digest );
+
+    /**
+     * Digest all of the given files, using cached digests where possible
+     * and reading the rest through the engine. Stat information comes from
+     * the current StatCache if there is one.
+     * @return the results, in the same order as paths.
+     */
+    std::vector<FileDigest> digest( const std::vector<Path> &paths, DigestEngine &engine );
+
+    /**
+     * Write any new entries back to the cache file, dropping those that
+     * haven't been used since the cache was opened or last saved.
+     * @throws system_error if the file can't be written.
+     */
+    void save();
+};
+
+}
+
+#endif /* !FABR_SUPPORT_DIGESTCACHE_H */
@@ -0,0 +1,549 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/DigestEngine.h"
+#include "support/ThreadPool.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <deque>
+#include <map>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+/**
+ * Maximum number of files open at once in the io_uring pipeline.
+ */
+#define MAX_OPEN_FILES 32
+
+/**
+ * Maximum number of reads in flight for any one file, so that one large
+ * file can't monopolise the buffers.
+ */
+#define MAX_READS_PER_FILE 8
+
+namespace fabr {
+
+class DigestEngine::Backend {
+public:
+    virtual ~Backend() { }
+    virtual void digest( const std::vector<Path> &paths, std::vector<FileDigest> &results ) = 0;
+    virtual bool isAsync() const = 0;
+};
+
+namespace {
+
+/**
+ * Fallback: each file is read sequentially with pread on one of the pool
+ * threads.
+ */
+class PreadBackend : public DigestEngine::Backend {
+private:
+    size_t bufferSize;
+
+public:
+    PreadBackend( size_t bufferSize ) : bufferSize(bufferSize) { }
+
+    void digest( const std::vector<Path> &paths, std::vector<FileDigest> &results ) override {
+        ThreadPool::getDefault().forEach(paths.size(), [&]( size_t i ) {
+            thread_local std::vector<char> buffer;
+            buffer.resize(bufferSize);
+
+            int fd = ::open(paths[i].str().c_str(), O_RDONLY|O_CLOEXEC);
+            if( fd == -1 ) {
+                results[i].error = errno;
+                return;
+            }
+            Hasher hasher;
+            off_t offset = 0;
+            while( true ) {
+                ssize_t len = ::pread(fd, buffer.data(), bufferSize, offset);
+                if( len == -1 && errno == EINTR ) {
+                    continue;
+                } else if( len == -1 ) {
+                    results[i].error = errno;
+                    break;
+                } else if( len == 0 ) {
+                    results[i].digest = hasher.finish();
+                    break;
+                }
+                hasher.update(buffer.data(), len);
+                offset += len;
+            }
+            ::close(fd);
+        });
+    }
+
+    bool isAsync() const override {
+        return false;
+    }
+};
+
+#ifdef HAVE_IO_URING
+
+/**
+ * Minimal io_uring wrapper, using the raw syscalls so that we don't need
+ * liburing.
+ */
+class IoUring {
+private:
+    int fd = -1;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+    size_t sqesSize = 0;
+
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned pendingSubmit = 0;
+
+public:
+    IoUring() { }
+    ~IoUring() {
+        if( sqes != MAP_FAILED ) {
+            ::munmap(sqes, sqesSize);
+        }
+        if( cqRing != MAP_FAILED && cqRing != sqRing ) {
+            ::munmap(cqRing, cqRingSize);
+        }
+        if( sqRing != MAP_FAILED ) {
+            ::munmap(sqRing, sqRingSize);
+        }
+        if( fd != -1 ) {
+            ::close(fd);
+        }
+    }
+
+    /**
+     * @return true if the ring was successfully created.
+     */
+    bool init( unsigned entries ) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd = (int)::syscall(__NR_io_uring_setup, entries, &params);
+        if( fd == -1 ) {
+            return false;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if( singleMmap ) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = ::mmap(nullptr, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                fd, IORING_OFF_SQ_RING);
+        if( sqRing == MAP_FAILED ) {
+            return false;
+        }
+        if( singleMmap ) {
+            cqRing = sqRing;
+        } else {
+            cqRing = ::mmap(nullptr, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                    fd, IORING_OFF_CQ_RING);
+            if( cqRing == MAP_FAILED ) {
+                return false;
+            }
+        }
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe *)::mmap(nullptr, sqesSize, PROT_READ|PROT_WRITE,
+                MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+        if( sqes == MAP_FAILED ) {
+            return false;
+        }
+
+        char *sq = (char *)sqRing;
+        sqHead = (unsigned *)(sq + params.sq_off.head);
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+        char *cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    /**
+     * Register the given buffers for use with fixed reads.
+     * @return true on success.
+     */
+    bool registerBuffers( const struct iovec *iov, unsigned count ) {
+        return ::syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+    }
+
+    /**
+     * @return the next free submission entry (zeroed). The caller must not
+     * have more entries outstanding than the ring size.
+     */
+    struct io_uring_sqe *getSqe() {
+        unsigned tail = *sqTail + pendingSubmit;
+        unsigned idx = tail & *sqMask;
+        struct io_uring_sqe *sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[idx] = idx;
+        pendingSubmit++;
+        return sqe;
+    }
+
+    /**
+     * Submit all entries obtained since the last submit, optionally
+     * waiting for at least waitFor completions.
+     */
+    void submit( unsigned waitFor ) {
+        __atomic_store_n(sqTail, *sqTail + pendingSubmit, __ATOMIC_RELEASE);
+        unsigned toSubmit = pendingSubmit;
+        pendingSubmit = 0;
+        bool wait = waitFor > 0;
+        while( toSubmit > 0 || wait ) {
+            int ret = (int)::syscall(__NR_io_uring_enter, fd, toSubmit, wait ? waitFor : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if( ret == -1 ) {
+                if( errno == EINTR || errno == EAGAIN || errno == EBUSY ) {
+                    continue;
+                }
+                throw std::system_error(errno, std::system_category());
+            }
+            toSubmit -= ret;
+            wait = false;
+        }
+    }
+
+    /**
+     * Call fn(cqe) for each available completion.
+     */
+    template<class Fn>
+    void reap( Fn fn ) {
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        while( head != tail ) {
+            fn(cqes[head & *cqMask]);
+            head++;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+};
+
+/**
+ * io_uring pipeline. The calling thread submits and reaps the reads; the
+ * kernel performs them asynchronously while whatever has completed is
+ * hashed on the thread pool, one task per file so that each file is still
+ * hashed in order.
+ */
+class UringBackend : public DigestEngine::Backend {
+private:
+    struct Slot {
+        char *buffer;
+        struct iovec iov;
+        size_t file;      /* Index into active files */
+        off_t offset;     /* File offset of the buffer */
+        size_t requested; /* Bytes requested */
+        size_t filled;    /* Bytes read so far */
+    };
+
+    struct ActiveFile {
+        size_t index;     /* Index into paths/results */
+        int fd;
+        off_t size;
+        off_t submitOffset = 0;
+        off_t hashOffset = 0;
+        unsigned inFlight = 0;
+        bool failed = false;
+        Hasher hasher;
+        /* Completed reads waiting to be hashed, by offset */
+        std::map<off_t, unsigned> completed;
+        /* Slots hashed by the last hashing pass, to be freed */
+        std::vector<unsigned> hashed;
+    };
+
+    IoUring ring;
+    size_t bufferSize;
+    unsigned depth;
+    char *buffers = nullptr;
+    std::vector<Slot> slots;
+    bool fixedBuffers = false;
+
+    void submitRead( unsigned slotIndex ) {
+        Slot &slot = slots[slotIndex];
+        ActiveFile &file = *files[slot.file];
+        struct io_uring_sqe *sqe = ring.getSqe();
+        if( fixedBuffers ) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->addr = (uint64_t)(slot.buffer + slot.filled);
+            sqe->len = slot.requested - slot.filled;
+            sqe->buf_index = slotIndex;
+        } else {
+            slot.iov.iov_base = slot.buffer + slot.filled;
+            slot.iov.iov_len = slot.requested - slot.filled;
+            sqe->opcode = IORING_OP_READV;
+            sqe->addr = (uint64_t)&slot.iov;
+            sqe->len = 1;
+        }
+        sqe->fd = file.fd;
+        sqe->off = slot.offset + slot.filled;
+        sqe->user_data = slotIndex;
+    }
+
+    std::vector<std::unique_ptr<ActiveFile>> files;
+
+    /**
+     * Hash the completed buffers at the front of the file, up to the first
+     * gap, adding their slots to file.hashed.
+     */
+    void hashContiguous( ActiveFile &file ) {
+        auto it = file.completed.begin();
+        while( it != file.completed.end() && it->first == file.hashOffset ) {
+            Slot &slot = slots[it->second];
+            file.hasher.update(slot.buffer, slot.filled);
+            file.hashOffset += slot.filled;
+            file.hashed.push_back(it->second);
+            it = file.completed.erase(it);
+        }
+    }
+
+public:
+    UringBackend( size_t bufferSize, unsigned depth ) : bufferSize(bufferSize), depth(depth) { }
+
+    ~UringBackend() {
+        if( buffers != nullptr ) {
+            ::free(buffers);
+        }
+    }
+
+    bool init() {
+        if( !ring.init(depth) ) {
+            return false;
+        }
+        if( ::posix_memalign((void **)&buffers, 4096, bufferSize * depth) != 0 ) {
+            buffers = nullptr;
+            return false;
+        }
+        std::vector<struct iovec> iov(depth);
+        slots.resize(depth);
+        for( unsigned i=0; i<depth; i++ ) {
+            slots[i].buffer = buffers + i * bufferSize;
+            iov[i].iov_base = slots[i].buffer;
+            iov[i].iov_len = bufferSize;
+        }
+        /* Registration can fail on RLIMIT_MEMLOCK, in which case we just
+         * use ordinary (slightly slower) reads.
+         */
+        fixedBuffers = ring.registerBuffers(iov.data(), depth);
+        return true;
+    }
+
+    void digest( const std::vector<Path> &paths, std::vector<FileDigest> &results ) override {
+        std::vector<unsigned> freeSlots;
+        for( unsigned i=0; i<depth; i++ ) {
+            freeSlots.push_back(i);
+        }
+        size_t nextPath = 0;
+        size_t openFiles = 0;
+        size_t inFlight = 0;
+        std::vector<ActiveFile *> ready;
+        files.clear();
+
+        auto finishFile = [&]( size_t fileIndex ) {
+            ActiveFile &file = *files[fileIndex];
+            if( !file.failed ) {
+                results[file.index].digest = file.hasher.finish();
+            }
+            for( auto &done : file.completed ) {
+                freeSlots.push_back(done.second);
+            }
+            ::close(file.fd);
+            files[fileIndex].reset();
+            openFiles--;
+        };
+
+        while( nextPath < paths.size() || openFiles > 0 ) {
+            /* Open more files, if we have room */
+            while( openFiles < MAX_OPEN_FILES && nextPath < paths.size() ) {
+                size_t index = nextPath++;
+                int fd = ::open(paths[index].str().c_str(), O_RDONLY|O_CLOEXEC);
+                struct stat st;
+                if( fd == -1 || ::fstat(fd, &st) == -1 ) {
+                    results[index].error = errno;
+                    if( fd != -1 ) {
+                        ::close(fd);
+                    }
+                    continue;
+                }
+                auto file = std::make_unique<ActiveFile>();
+                file->index = index;
+                file->fd = fd;
+                file->size = st.st_size;
+                size_t slot = 0;
+                while( slot < files.size() && files[slot] ) {
+                    slot++;
+                }
+                if( slot == files.size() ) {
+                    files.emplace_back();
+                }
+                files[slot] = std::move(file);
+                openFiles++;
+                if( files[slot]->size == 0 ) {
+                    finishFile(slot);
+                }
+            }
+
+            /* Queue reads round-robin across the open files */
+            bool queued = true;
+            while( queued && !freeSlots.empty() ) {
+                queued = false;
+                for( size_t i=0; i<files.size() && !freeSlots.empty(); i++ ) {
+                    ActiveFile *file = files[i].get();
+                    if( file == nullptr || file->failed || file->submitOffset >= file->size ||
+                            file->inFlight >= MAX_READS_PER_FILE ) {
+                        continue;
+                    }
+                    unsigned slotIndex = freeSlots.back();
+                    freeSlots.pop_back();
+                    Slot &slot = slots[slotIndex];
+                    slot.file = i;
+                    slot.offset = file->submitOffset;
+                    slot.requested = std::min((off_t)bufferSize, file->size - file->submitOffset);
+                    slot.filled = 0;
+                    file->submitOffset += slot.requested;
+                    file->inFlight++;
+                    inFlight++;
+                    submitRead(slotIndex);
+                    queued = true;
+                }
+            }
+            if( inFlight == 0 ) {
+                continue;
+            }
+
+            /* Submit, and wait for something to complete. Waiting for a
+             * batch gives the pool more to hash at once, while leaving plenty
+             * of reads in flight.
+             */
+            ring.submit((unsigned)std::max(inFlight / 4, (size_t)1));
+            ring.reap([&]( struct io_uring_cqe &cqe ) {
+                unsigned slotIndex = (unsigned)cqe.user_data;
+                Slot &slot = slots[slotIndex];
+                ActiveFile &file = *files[slot.file];
+                inFlight--;
+                if( cqe.res < 0 || (cqe.res == 0 && slot.filled < slot.requested) ) {
+                    /* Error, or the file shrank underneath us */
+                    if( !file.failed ) {
+                        file.failed = true;
+                        results[file.index].error = cqe.res < 0 ? -cqe.res : EIO;
+                    }
+                    file.inFlight--;
+                    freeSlots.push_back(slotIndex);
+                    return;
+                }
+                slot.filled += cqe.res;
+                if( slot.filled < slot.requested ) {
+                    /* Short read, ask for the rest */
+                    inFlight++;
+                    submitRead(slotIndex);
+                    return;
+                }
+                file.inFlight--;
+                file.completed[slot.offset] = slotIndex;
+            });
+            /* Push any resubmitted short reads out before hashing */
+            ring.submit(0);
+
+            /* Hash whatever is contiguous, while the kernel carries on reading */
+            ready.clear();
+            for( size_t i=0; i<files.size(); i++ ) {
+                ActiveFile *file = files[i].get();
+                if( file != nullptr && !file->failed && !file->completed.empty() &&
+                        file->completed.begin()->first == file->hashOffset ) {
+                    ready.push_back(file);
+                }
+            }
+            if( ready.size() == 1 ) {
+                hashContiguous(*ready[0]);
+            } else if( !ready.empty() ) {
+                ThreadPool::getDefault().forEach(ready.size(), [&]( size_t i ) {
+                    hashContiguous(*ready[i]);
+                });
+            }
+            for( size_t i=0; i<files.size(); i++ ) {
+                ActiveFile *file = files[i].get();
+                if( file == nullptr ) {
+                    continue;
+                }
+                freeSlots.insert(freeSlots.end(), file->hashed.begin(), file->hashed.end());
+                file->hashed.clear();
+                if( file->inFlight == 0 && (file->failed || file->hashOffset >= file->size) ) {
+                    finishFile(i);
+                }
+            }
+        }
+        files.clear();
+    }
+
+    bool isAsync() const override {
+        return true;
+    }
+};
+
+#endif /* HAVE_IO_URING */
+
+}
+
+DigestEngine::DigestEngine( size_t bufferSize, unsigned queueDepth, bool allowAsync ) {
+#ifdef HAVE_IO_URING
+    if( allowAsync ) {
+        auto uring = std::make_unique<UringBackend>(bufferSize, queueDepth);
+        if( uring->init() ) {
+            backend = std::move(uring);
+            return;
+        }
+    }
+#else
+    (void)queueDepth;
+    (void)allowAsync;
+#endif
+    backend = std::make_unique<PreadBackend>(bufferSize);
+}
+
+DigestEngine::~DigestEngine() {
+}
+
+std::vector<FileDigest> DigestEngine::digest( const std::vector<Path> &paths ) {
+    std::vector<FileDigest> results(paths.size());
+    backend->digest(paths, results);
+    return results;
+}
+
+bool DigestEngine::isAsync() const {
+    return backend->isAsync();
+}
+
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_DIGESTENGINE_H
+#define FABR_SUPPORT_DIGESTENGINE_H
+
+#include <memory>
+#include <vector>
+
+#include "support/Digest.h"
+#include "support/Path.h"
+
+namespace fabr {
+
+/**
+ * Result of digesting a single file.
+ */
+struct FileDigest {
+    Digest digest;
+    /** errno value if the file couldn't be read, otherwise 0 */
+    int error = 0;
+
+    bool isValid() const {
+        return error == 0;
+    }
+};
+
+/**
+ * Computes content digests for large numbers of files, keeping the disk
+ * busy while hashing.
+ *
+ * On Linux this uses an io_uring submission pipeline: reads for many files
+ * (and several reads per file) are kept in flight, into a pool of buffers
+ * registered with the kernel, while completed buffers are hashed on the
+ * thread pool (each file's in order). Where io_uring isn't available (older kernels, seccomp-restricted
+ * containers, other platforms) it falls back to blocking preads from a
+ * thread pool.
+ */
+class DigestEngine {
+public:
+    class Backend;
+
+private:
+    std::unique_ptr<Backend> backend;
+
+public:
+    /** Size of each read buffer */
+    static const size_t DEFAULT_BUFFER_SIZE = 256*1024;
+    /** Number of reads in flight */
+    static const unsigned DEFAULT_QUEUE_DEPTH = 64;
+
+    /**
+     * @param allowAsync if false, always use the pread fallback (e.g. to
+     * compare against it).
+     */
+    DigestEngine( size_t bufferSize = DEFAULT_BUFFER_SIZE,
+            unsigned queueDepth = DEFAULT_QUEUE_DEPTH, bool allowAsync = true );
+    ~DigestEngine();
+    DigestEngine( const DigestEngine & ) = delete;
+
+    /**
+     * Digest all of the given files.
+     * @return the results, in the same order as paths.
+     */
+    std::vector<FileDigest> digest( const std::vector<Path> &paths );
+
+    /**
+     * @return true if we're using io_uring, false if using the fallback.
+     */
+    bool isAsync() const;
+};
+
+}
+
+#endif /* !FABR_SUPPORT_DIGESTENGINE_H */
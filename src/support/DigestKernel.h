@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_DIGESTKERNEL_H
+#define FABR_SUPPORT_DIGESTKERNEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * Internals of the BLAKE3 implementation behind Digest, shared between the
+ * portable code and the vectorised kernels. Nothing outside of the Digest
+ * implementation (and benchmarks) should need this.
+ */
+
+/* BLAKE3 parameters. See https://github.com/BLAKE3-team/BLAKE3-specs */
+#define DIGEST_BLOCK_LEN 64
+#define DIGEST_CHUNK_LEN 1024
+#define DIGEST_CV_LEN 32
+
+#define DIGEST_CHUNK_START (1 << 0)
+#define DIGEST_CHUNK_END   (1 << 1)
+#define DIGEST_PARENT      (1 << 2)
+#define DIGEST_ROOT        (1 << 3)
+
+namespace fabr {
+
+extern const uint32_t DIGEST_IV[8];
+extern const uint8_t DIGEST_MSG_SCHEDULE[7][16];
+
+/**
+ * Hash count equally-spaced inputs in parallel. Input j starts at
+ * input + j*stride and consists of blocks full blocks, which are compressed
+ * in sequence starting from the IV. The first block also gets flagsStart,
+ * and the last flagsEnd. The counter for input j is counter (+ j, if
+ * incrementCounter). The resulting chaining values are written to
+ * out + j*DIGEST_CV_LEN in little-endian byte order.
+ *
+ * Hashing whole chunks is blocks=16 with CHUNK_START/CHUNK_END, and
+ * hashing parent nodes is blocks=1 with PARENT.
+ */
+typedef void (*DigestHashManyFn)( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out );
+
+/**
+ * A hashMany implementation for a particular instruction set.
+ */
+struct DigestKernel {
+    const char *name;
+    /** Number of inputs processed per vector */
+    unsigned degree;
+    DigestHashManyFn hashMany;
+};
+
+void digestHashManyPortable( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out );
+
+#if defined(__x86_64__) || defined(__i386__)
+void digestHashManyAvx2( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out );
+void digestHashManyAvx512( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out );
+#endif
+
+#if defined(__aarch64__)
+void digestHashManyNeon( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out );
+#endif
+
+/**
+ * @return the number of kernels supported by the current CPU, and fill in
+ * kernels (if non-null) with them, best first.
+ */
+size_t getDigestKernels( const DigestKernel **kernels, size_t max );
+
+/**
+ * @return the kernel currently used by Digest. This is the best supported
+ * kernel unless overridden.
+ */
+const DigestKernel &getDigestKernel();
+
+/**
+ * Select the kernel to use by name (e.g. for benchmarking).
+ * @return false if there's no such supported kernel.
+ */
+bool setDigestKernel( const char *name );
+
+}
+
+#endif /* !FABR_SUPPORT_DIGESTKERNEL_H */
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Vectorised BLAKE3 kernel for AArch64, hashing 4 inputs at once (one per
+ * 32-bit lane). NEON is mandatory on AArch64, so no runtime check is needed.
+ */
+
+#if defined(__aarch64__)
+
+#include "support/DigestKernel.h"
+
+#include <string.h>
+#include <arm_neon.h>
+
+namespace fabr {
+
+#define ROTRN(x, c) vsriq_n_u32(vshlq_n_u32((x), 32 - (c)), (x), (c))
+
+#define G128(a, b, c, d, x, y) \
+    v[a] = vaddq_u32(vaddq_u32(v[a], v[b]), (x)); \
+    v[d] = ROTRN(veorq_u32(v[d], v[a]), 16); \
+    v[c] = vaddq_u32(v[c], v[d]); \
+    v[b] = ROTRN(veorq_u32(v[b], v[c]), 12); \
+    v[a] = vaddq_u32(vaddq_u32(v[a], v[b]), (y)); \
+    v[d] = ROTRN(veorq_u32(v[d], v[a]), 8); \
+    v[c] = vaddq_u32(v[c], v[d]); \
+    v[b] = ROTRN(veorq_u32(v[b], v[c]), 7)
+
+static void hash4( const uint8_t *input, size_t stride, size_t blocks, uint64_t counter,
+        bool incrementCounter, uint8_t flags, uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    uint32_t counterLow[4], counterHigh[4];
+    for( int j=0; j<4; j++ ) {
+        uint64_t c = counter + (incrementCounter ? j : 0);
+        counterLow[j] = (uint32_t)c;
+        counterHigh[j] = (uint32_t)(c >> 32);
+    }
+
+    uint32x4_t h[8];
+    for( int i=0; i<8; i++ ) {
+        h[i] = vdupq_n_u32(DIGEST_IV[i]);
+    }
+    for( size_t b=0; b<blocks; b++ ) {
+        /* Load one block from each input, and transpose so that each vector
+         * holds the same message word from every input.
+         */
+        uint32_t words[16][4];
+        for( int j=0; j<4; j++ ) {
+            const uint8_t *p = input + j*stride + b*DIGEST_BLOCK_LEN;
+            for( int w=0; w<16; w++ ) {
+                memcpy(&words[w][j], p + 4*w, 4);
+            }
+        }
+        uint32x4_t m[16];
+        for( int w=0; w<16; w++ ) {
+            m[w] = vld1q_u32(words[w]);
+        }
+        uint8_t blockFlags = flags | (b == 0 ? flagsStart : 0) | (b == blocks-1 ? flagsEnd : 0);
+        uint32x4_t v[16] = {
+            h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+            vdupq_n_u32(DIGEST_IV[0]), vdupq_n_u32(DIGEST_IV[1]),
+            vdupq_n_u32(DIGEST_IV[2]), vdupq_n_u32(DIGEST_IV[3]),
+            vld1q_u32(counterLow), vld1q_u32(counterHigh),
+            vdupq_n_u32(DIGEST_BLOCK_LEN), vdupq_n_u32(blockFlags)
+        };
+        for( int r=0; r<7; r++ ) {
+            const uint8_t *s = DIGEST_MSG_SCHEDULE[r];
+            G128(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            G128(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            G128(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            G128(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            G128(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            G128(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            G128(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            G128(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for( int i=0; i<8; i++ ) {
+            h[i] = veorq_u32(v[i], v[i+8]);
+        }
+    }
+
+    uint32_t words[8][4];
+    for( int i=0; i<8; i++ ) {
+        vst1q_u32(words[i], h[i]);
+    }
+    for( int j=0; j<4; j++ ) {
+        for( int i=0; i<8; i++ ) {
+            memcpy(out + j*DIGEST_CV_LEN + 4*i, &words[i][j], 4);
+        }
+    }
+}
+
+void digestHashManyNeon( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    while( count >= 4 ) {
+        hash4(input, stride, blocks, counter, incrementCounter, flags, flagsStart, flagsEnd, out);
+        input += 4*stride;
+        counter += incrementCounter ? 4 : 0;
+        out += 4*DIGEST_CV_LEN;
+        count -= 4;
+    }
+    digestHashManyPortable(input, stride, count, blocks, counter, incrementCounter,
+            flags, flagsStart, flagsEnd, out);
+}
+
+}
+
+#endif /* __aarch64__ */
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Vectorised BLAKE3 kernels for x86. Each lane of a vector holds the state
+ * for a different input, so a 256-bit vector hashes 8 inputs at once and a
+ * 512-bit vector 16. These are compiled for the target ISA per-function, and
+ * only called if the CPU supports it (see getDigestKernels).
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include "support/DigestKernel.h"
+
+#include <string.h>
+#include <immintrin.h>
+
+namespace fabr {
+
+/*************************** AVX2 ***************************/
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define ROTR256(x, c) _mm256_or_si256(_mm256_srli_epi32((x), (c)), _mm256_slli_epi32((x), 32 - (c)))
+
+#define G256(a, b, c, d, x, y) \
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (x)); \
+    v[d] = ROTR256(_mm256_xor_si256(v[d], v[a]), 16); \
+    v[c] = _mm256_add_epi32(v[c], v[d]); \
+    v[b] = ROTR256(_mm256_xor_si256(v[b], v[c]), 12); \
+    v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), (y)); \
+    v[d] = ROTR256(_mm256_xor_si256(v[d], v[a]), 8); \
+    v[c] = _mm256_add_epi32(v[c], v[d]); \
+    v[b] = ROTR256(_mm256_xor_si256(v[b], v[c]), 7)
+
+AVX2 static void hash8( const uint8_t *input, size_t stride, size_t blocks, uint64_t counter,
+        bool incrementCounter, uint8_t flags, uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    const __m256i index = _mm256_setr_epi32(0, stride, 2*stride, 3*stride,
+            4*stride, 5*stride, 6*stride, 7*stride);
+    uint32_t counterLow[8], counterHigh[8];
+    for( int j=0; j<8; j++ ) {
+        uint64_t c = counter + (incrementCounter ? j : 0);
+        counterLow[j] = (uint32_t)c;
+        counterHigh[j] = (uint32_t)(c >> 32);
+    }
+
+    __m256i h[8];
+    for( int i=0; i<8; i++ ) {
+        h[i] = _mm256_set1_epi32(DIGEST_IV[i]);
+    }
+    for( size_t b=0; b<blocks; b++ ) {
+        __m256i m[16];
+        const int *base = (const int *)(input + b*DIGEST_BLOCK_LEN);
+        for( int w=0; w<16; w++ ) {
+            m[w] = _mm256_i32gather_epi32(base + w, index, 1);
+        }
+        uint8_t blockFlags = flags | (b == 0 ? flagsStart : 0) | (b == blocks-1 ? flagsEnd : 0);
+        __m256i v[16] = {
+            h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+            _mm256_set1_epi32(DIGEST_IV[0]), _mm256_set1_epi32(DIGEST_IV[1]),
+            _mm256_set1_epi32(DIGEST_IV[2]), _mm256_set1_epi32(DIGEST_IV[3]),
+            _mm256_loadu_si256((const __m256i *)counterLow),
+            _mm256_loadu_si256((const __m256i *)counterHigh),
+            _mm256_set1_epi32(DIGEST_BLOCK_LEN), _mm256_set1_epi32(blockFlags)
+        };
+        for( int r=0; r<7; r++ ) {
+            const uint8_t *s = DIGEST_MSG_SCHEDULE[r];
+            G256(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            G256(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            G256(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            G256(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            G256(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            G256(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            G256(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            G256(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for( int i=0; i<8; i++ ) {
+            h[i] = _mm256_xor_si256(v[i], v[i+8]);
+        }
+    }
+
+    /* Transpose back out to one chaining value per input */
+    uint32_t words[8][8];
+    for( int i=0; i<8; i++ ) {
+        _mm256_storeu_si256((__m256i *)words[i], h[i]);
+    }
+    for( int j=0; j<8; j++ ) {
+        for( int i=0; i<8; i++ ) {
+            memcpy(out + j*DIGEST_CV_LEN + 4*i, &words[i][j], 4);
+        }
+    }
+}
+
+void digestHashManyAvx2( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    while( count >= 8 ) {
+        hash8(input, stride, blocks, counter, incrementCounter, flags, flagsStart, flagsEnd, out);
+        input += 8*stride;
+        counter += incrementCounter ? 8 : 0;
+        out += 8*DIGEST_CV_LEN;
+        count -= 8;
+    }
+    digestHashManyPortable(input, stride, count, blocks, counter, incrementCounter,
+            flags, flagsStart, flagsEnd, out);
+}
+
+/************************** AVX-512 *************************/
+
+#define AVX512 __attribute__((target("avx512f")))
+
+#define G512(a, b, c, d, x, y) \
+    v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), (x)); \
+    v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 16); \
+    v[c] = _mm512_add_epi32(v[c], v[d]); \
+    v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 12); \
+    v[a] = _mm512_add_epi32(_mm512_add_epi32(v[a], v[b]), (y)); \
+    v[d] = _mm512_ror_epi32(_mm512_xor_si512(v[d], v[a]), 8); \
+    v[c] = _mm512_add_epi32(v[c], v[d]); \
+    v[b] = _mm512_ror_epi32(_mm512_xor_si512(v[b], v[c]), 7)
+
+AVX512 static void hash16( const uint8_t *input, size_t stride, size_t blocks, uint64_t counter,
+        bool incrementCounter, uint8_t flags, uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    const __m512i index = _mm512_mullo_epi32(
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15),
+            _mm512_set1_epi32(stride));
+    uint32_t counterLow[16], counterHigh[16];
+    for( int j=0; j<16; j++ ) {
+        uint64_t c = counter + (incrementCounter ? j : 0);
+        counterLow[j] = (uint32_t)c;
+        counterHigh[j] = (uint32_t)(c >> 32);
+    }
+
+    __m512i h[8];
+    for( int i=0; i<8; i++ ) {
+        h[i] = _mm512_set1_epi32(DIGEST_IV[i]);
+    }
+    for( size_t b=0; b<blocks; b++ ) {
+        __m512i m[16];
+        const int *base = (const int *)(input + b*DIGEST_BLOCK_LEN);
+        for( int w=0; w<16; w++ ) {
+            m[w] = _mm512_i32gather_epi32(index, base + w, 1);
+        }
+        uint8_t blockFlags = flags | (b == 0 ? flagsStart : 0) | (b == blocks-1 ? flagsEnd : 0);
+        __m512i v[16] = {
+            h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+            _mm512_set1_epi32(DIGEST_IV[0]), _mm512_set1_epi32(DIGEST_IV[1]),
+            _mm512_set1_epi32(DIGEST_IV[2]), _mm512_set1_epi32(DIGEST_IV[3]),
+            _mm512_loadu_si512(counterLow), _mm512_loadu_si512(counterHigh),
+            _mm512_set1_epi32(DIGEST_BLOCK_LEN), _mm512_set1_epi32(blockFlags)
+        };
+        for( int r=0; r<7; r++ ) {
+            const uint8_t *s = DIGEST_MSG_SCHEDULE[r];
+            G512(0, 4, 8, 12, m[s[0]], m[s[1]]);
+            G512(1, 5, 9, 13, m[s[2]], m[s[3]]);
+            G512(2, 6, 10, 14, m[s[4]], m[s[5]]);
+            G512(3, 7, 11, 15, m[s[6]], m[s[7]]);
+            G512(0, 5, 10, 15, m[s[8]], m[s[9]]);
+            G512(1, 6, 11, 12, m[s[10]], m[s[11]]);
+            G512(2, 7, 8, 13, m[s[12]], m[s[13]]);
+            G512(3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+        for( int i=0; i<8; i++ ) {
+            h[i] = _mm512_xor_si512(v[i], v[i+8]);
+        }
+    }
+
+    uint32_t words[8][16];
+    for( int i=0; i<8; i++ ) {
+        _mm512_storeu_si512(words[i], h[i]);
+    }
+    for( int j=0; j<16; j++ ) {
+        for( int i=0; i<8; i++ ) {
+            memcpy(out + j*DIGEST_CV_LEN + 4*i, &words[i][j], 4);
+        }
+    }
+}
+
+void digestHashManyAvx512( const uint8_t *input, size_t stride, size_t count,
+        size_t blocks, uint64_t counter, bool incrementCounter, uint8_t flags,
+        uint8_t flagsStart, uint8_t flagsEnd, uint8_t *out ) {
+    while( count >= 16 ) {
+        hash16(input, stride, blocks, counter, incrementCounter, flags, flagsStart, flagsEnd, out);
+        input += 16*stride;
+        counter += incrementCounter ? 16 : 0;
+        out += 16*DIGEST_CV_LEN;
+        count -= 16;
+    }
+    /* Finish off with the narrower kernel (AVX-512F implies AVX2) */
+    digestHashManyAvx2(input, stride, count, blocks, counter, incrementCounter,
+            flags, flagsStart, flagsEnd, out);
+}
+
+}
+
+#endif /* x86 */
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/DirCache.h"
+#include "support/Metrics.h"
+#include "support/StatCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+
+/* The handles are only used to look up names, which needs search (execute)
+ * permission on the directory rather than read, where we can ask for that.
+ */
+#if defined(O_PATH)
+#define DIR_OPEN_FLAGS (O_PATH|O_DIRECTORY|O_CLOEXEC)
+#elif defined(O_SEARCH)
+#define DIR_OPEN_FLAGS (O_SEARCH|O_DIRECTORY|O_CLOEXEC)
+#else
+#define DIR_OPEN_FLAGS (O_RDONLY|O_DIRECTORY|O_CLOEXEC)
+#endif
+
+namespace fabr {
+
+/**
+ * @return a StatInfo for a non-existent path if the error indicates the path
+ * doesn't exist (consistent with Path::exists).
+ * @throws system_error for any other error.
+ */
+static StatInfo handleStatError( int err ) {
+    switch( err ) {
+    case EACCES:
+    case ELOOP:
+    case ENAMETOOLONG:
+    case ENOENT:
+    case ENOTDIR:
+        return StatInfo();
+    default:
+        throw std::system_error(err, std::system_category());
+    }
+}
+
+#if defined(__linux__) && defined(STATX_BASIC_STATS)
+
+#define STATX_WANTED (STATX_TYPE|STATX_MODE|STATX_INO|STATX_SIZE|STATX_MTIME|STATX_CTIME)
+
+/* statx lets us ask for only the fields we need, which saves work on some
+ * network filesystems.
+ */
+StatInfo DirCache::statAt( int dirfd, const char *name ) {
+    Metrics::add(Metrics::FS_STAT);
+    struct statx stx;
+    if( ::statx(dirfd, name, 0, STATX_WANTED, &stx) == -1 ) {
+        return handleStatError(errno);
+    }
+    StatInfo info;
+    info.mode = stx.stx_mode;
+    info.size = stx.stx_size;
+    info.mtime = (int64_t)stx.stx_mtime.tv_sec * 1000000000 + stx.stx_mtime.tv_nsec;
+    info.ctime = (int64_t)stx.stx_ctime.tv_sec * 1000000000 + stx.stx_ctime.tv_nsec;
+    info.ino = stx.stx_ino;
+    info.dev = ((uint64_t)stx.stx_dev_major << 32) | stx.stx_dev_minor;
+    return info;
+}
+
+#else
+
+StatInfo DirCache::statAt( int dirfd, const char *name ) {
+    Metrics::add(Metrics::FS_STAT);
+    struct stat st;
+    if( ::fstatat(dirfd, name, &st, 0) == -1 ) {
+        return handleStatError(errno);
+    }
+    StatInfo info;
+    info.mode = st.st_mode;
+    info.size = st.st_size;
+#ifdef __APPLE__
+    info.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+    info.ctime = (int64_t)st.st_ctimespec.tv_sec * 1000000000 + st.st_ctimespec.tv_nsec;
+#else
+    info.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    info.ctime = (int64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+#endif
+    info.ino = st.st_ino;
+    info.dev = st.st_dev;
+    return info;
+}
+
+#endif
+
+DirCache::Handle::~Handle() {
+    ::close(fd);
+}
+
+DirCache::DirCache( size_t maxOpen ) : maxPerShard((maxOpen + SHARDS - 1) / SHARDS) {
+}
+
+DirCache &DirCache::get() {
+    static DirCache cache;
+    return cache;
+}
+
+std::shared_ptr<DirCache::Handle> DirCache::getDirectory( PathRef dir ) {
+    if( dir.isEmpty() ) {
+        errno = 0;
+        return nullptr;
+    }
+    Shard &shard = getShard(dir);
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.dirs.find(dir);
+        if( it != shard.dirs.end() ) {
+            Metrics::add(Metrics::DIRCACHE_HITS);
+            return it->second;
+        }
+    }
+
+    Metrics::add(Metrics::DIRCACHE_MISSES);
+    Metrics::add(Metrics::FS_OPEN);
+    int fd;
+    if( !dir.hasComponents() ) {
+        fd = ::open(dir.str().c_str(), DIR_OPEN_FLAGS);
+    } else {
+        /* Open relative to the parent, so each open only walks one component */
+        std::shared_ptr<Handle> parent = getDirectory(dir.parent());
+        if( parent == nullptr && errno != 0 ) {
+            return nullptr;
+        }
+        fd = ::openat(parent == nullptr ? AT_FDCWD : parent->getFd(), dir.basename().data(), DIR_OPEN_FLAGS);
+    }
+    if( fd == -1 ) {
+        return nullptr;
+    }
+    std::shared_ptr<Handle> handle = std::make_shared<Handle>(fd);
+
+    std::lock_guard<std::mutex> guard(shard.lock);
+    auto result = shard.dirs.emplace(dir, handle);
+    if( !result.second ) {
+        /* Raced with another thread opening the same directory */
+        return result.first->second;
+    }
+    shard.order.push_back(dir);
+    while( shard.order.size() > maxPerShard ) {
+        shard.dirs.erase(shard.order.front());
+        shard.order.pop_front();
+    }
+    return handle;
+}
+
+StatInfo DirCache::stat( PathRef path ) {
+    if( path.hasComponents() ) {
+        std::shared_ptr<Handle> dir = getDirectory(path.parent());
+        if( dir != nullptr ) {
+            return statAt(dir->getFd(), path.basename().data());
+        } else if( errno != 0 && errno != EACCES ) {
+            return handleStatError(errno);
+        }
+    }
+    /* Also taken if we couldn't open the directory for lack of read
+     * permission (without O_PATH or O_SEARCH), which stat doesn't need.
+     */
+    return statAt(AT_FDCWD, path.str().c_str());
+}
+
+int DirCache::open( PathRef path, int flags, mode_t mode ) {
+    if( path.hasComponents() ) {
+        return open(path.parent(), path.basename().data(), flags, mode);
+    }
+    Metrics::add(Metrics::FS_OPEN);
+    return ::open(path.str().c_str(), flags, mode);
+}
+
+int DirCache::open( PathRef dir, const char *name, int flags, mode_t mode ) {
+    Metrics::add(Metrics::FS_OPEN);
+    std::shared_ptr<Handle> handle = getDirectory(dir);
+    if( handle != nullptr ) {
+        return ::openat(handle->getFd(), name, flags, mode);
+    }
+    /* Otherwise fall back to the full path, which also gives us the right
+     * error if the directory couldn't be opened.
+     */
+    std::string path = dir.str();
+    if( !path.empty() && path.back() != '/' ) {
+        path.push_back('/');
+    }
+    path.append(name);
+    return ::open(path.c_str(), flags, mode);
+}
+
+int DirCache::unlink( PathRef path, int flags ) {
+    if( flags & AT_REMOVEDIR ) {
+        invalidate(path);
+    }
+    if( path.hasComponents() ) {
+        std::shared_ptr<Handle> dir = getDirectory(path.parent());
+        if( dir != nullptr ) {
+            return ::unlinkat(dir->getFd(), path.basename().data(), flags);
+        }
+    }
+    return ::unlinkat(AT_FDCWD, path.str().c_str(), flags);
+}
+
+void DirCache::invalidate( PathRef dir ) {
+    for( auto &shard : shards ) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        for( auto it = shard.dirs.begin(); it != shard.dirs.end(); ) {
+            if( dir.contains(it->first) ) {
+                it = shard.dirs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        /* Otherwise a stale entry could later evict the directory if it's
+         * opened again.
+         */
+        shard.order.erase(std::remove_if(shard.order.begin(), shard.order.end(), [&]( PathRef path ) {
+            return dir.contains(path);
+        }), shard.order.end());
+    }
+}
+
+void DirCache::clear() {
+    for( auto &shard : shards ) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.dirs.clear();
+        shard.order.clear();
+    }
+}
+
+size_t DirCache::size() {
+    size_t total = 0;
+    for( auto &shard : shards ) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        total += shard.dirs.size();
+    }
+    return total;
+}
+
+}
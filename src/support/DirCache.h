@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_DIRCACHE_H
+#define FABR_SUPPORT_DIRCACHE_H
+
+#include <sys/types.h>
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "support/PathRef.h"
+
+namespace fabr {
+
+struct StatInfo;
+
+/**
+ * Cache of open handles on directories (O_PATH where available), so that
+ * filesystem operations can be performed relative to the containing
+ * directory with fstatat/openat/unlinkat instead of having the kernel walk
+ * the whole pathname each time. Missing directories are opened one
+ * component at a time relative to their (cached) parent.
+ *
+ * Handles are reference-counted, so an entry evicted while another thread
+ * is using it stays open until that thread is done. The number of cached
+ * handles is bounded.
+ *
+ * Handles refer to directories, not names: if a directory is renamed or
+ * replaced, or the working directory changes (which affects relative
+ * paths), the cache must be invalidated. The driver clears it at the start
+ * of each build.
+ */
+class DirCache {
+public:
+    /**
+     * An open directory.
+     */
+    class Handle {
+    private:
+        int fd;
+    public:
+        Handle( int fd ) : fd(fd) { }
+        ~Handle();
+        Handle( const Handle & ) = delete;
+
+        int getFd() const {
+            return fd;
+        }
+    };
+
+private:
+    static const int SHARDS = 16;
+
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<PathRef, std::shared_ptr<Handle>> dirs;
+        /* Insertion order, for eviction */
+        std::deque<PathRef> order;
+    };
+    Shard shards[SHARDS];
+    size_t maxPerShard;
+
+    Shard &getShard( PathRef path ) {
+        return shards[(path.hash() >> 4) % SHARDS];
+    }
+
+public:
+    DirCache( size_t maxOpen = 512 );
+    DirCache( const DirCache & ) = delete;
+
+    /**
+     * @return the process-wide cache.
+     */
+    static DirCache &get();
+
+    /**
+     * @return a handle on the given directory, or nullptr with errno set
+     * if it can't be opened. The empty path (i.e. the current directory)
+     * also returns nullptr, with errno 0; use AT_FDCWD.
+     */
+    std::shared_ptr<Handle> getDirectory( PathRef dir );
+
+    /**
+     * Stat the given path (following symlinks).
+     * @return the stat information, or a non-existent StatInfo if the path
+     * doesn't exist (consistent with Path::exists).
+     * @throws system_error for any other error.
+     */
+    StatInfo stat( PathRef path );
+
+    /**
+     * Open the given path, as per open(2).
+     * @return the new file descriptor, or -1 with errno set.
+     */
+    int open( PathRef path, int flags, mode_t mode = 0 );
+
+    /**
+     * Open the named entry of the given directory, as per openat(2). Unlike
+     * open(PathRef), the name isn't interned, which suits one-off names.
+     * @return the new file descriptor, or -1 with errno set.
+     */
+    int open( PathRef dir, const char *name, int flags, mode_t mode = 0 );
+
+    /**
+     * Remove the given path, as per unlinkat(2) (flags may include
+     * AT_REMOVEDIR).
+     * @return 0 on success, or -1 with errno set.
+     */
+    int unlink( PathRef path, int flags = 0 );
+
+    /**
+     * Drop the handles for the given directory and everything below it.
+     */
+    void invalidate( PathRef dir );
+
+    /**
+     * Drop all cached handles.
+     */
+    void clear();
+
+    /**
+     * @return the number of cached handles.
+     */
+    size_t size();
+
+    /**
+     * Stat name relative to dirfd (or AT_FDCWD), following symlinks, with
+     * the same error handling as stat().
+     */
+    static StatInfo statAt( int dirfd, const char *name );
+};
+
+}
+
+#endif /* !FABR_SUPPORT_DIRCACHE_H */
@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/DirCache.h"
+#include "support/DirWalker.h"
+#include "support/ThreadPool.h"
+#include "support/Trace.h"
+
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+/* Size of the buffer for reading directory entries */
+#define DIRENT_BUFFER_SIZE (32*1024)
+
+/* Largest .gitignore file we'll read */
+#define GITIGNORE_MAX_SIZE (1024*1024)
+
+namespace fabr {
+
+namespace {
+
+/**
+ * The .gitignore rules in effect for a directory: its own (if any) plus
+ * those of its ancestors. Each level's patterns are relative to the
+ * directory the file was found in.
+ */
+struct IgnoreLevel {
+    std::shared_ptr<const IgnoreLevel> parent;
+    /** Depth below the walk root of the directory holding the rules */
+    size_t depth;
+    IgnoreList rules;
+};
+
+struct DirTask {
+    PathRef path;
+    /** Path components relative to the walk root */
+    std::vector<SymbolRef> components;
+    std::shared_ptr<const IgnoreLevel> ignores;
+};
+
+struct WorkQueue {
+    std::mutex lock;
+    std::deque<DirTask> tasks;
+};
+
+struct Entry {
+    SymbolRef name;
+    DirWalker::EntryType type;
+};
+
+DirWalker::EntryType toEntryType( unsigned mode ) {
+    return S_ISREG(mode) ? DirWalker::FILE : S_ISDIR(mode) ? DirWalker::DIRECTORY :
+           S_ISLNK(mode) ? DirWalker::SYMLINK : DirWalker::OTHER;
+}
+
+/**
+ * Read all entries (other than "." and "..") from the open directory.
+ * @return false if the directory couldn't be read.
+ */
+bool readEntries( int fd, std::vector<Entry> &entries ) {
+    auto add = [&]( const char *name, unsigned char type ) {
+        if( name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) ) {
+            return;
+        }
+        DirWalker::EntryType entryType;
+        switch( type ) {
+        case DT_REG: entryType = DirWalker::FILE; break;
+        case DT_DIR: entryType = DirWalker::DIRECTORY; break;
+        case DT_LNK: entryType = DirWalker::SYMLINK; break;
+        case DT_UNKNOWN: {
+            /* Filesystem doesn't report types, so fall back to stat */
+            struct stat st;
+            if( ::fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ) {
+                return;
+            }
+            entryType = toEntryType(st.st_mode);
+            break;
+        }
+        default: entryType = DirWalker::OTHER; break;
+        }
+        entries.push_back(Entry{SymbolRef::get(name), entryType});
+    };
+
+#if defined(__linux__) && defined(SYS_getdents64)
+    struct LinuxDirent64 {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+    thread_local std::unique_ptr<char[]> buffer(new char[DIRENT_BUFFER_SIZE]);
+    for( ;; ) {
+        long n = ::syscall(SYS_getdents64, fd, buffer.get(), DIRENT_BUFFER_SIZE);
+        if( n == -1 ) {
+            return false;
+        } else if( n == 0 ) {
+            return true;
+        }
+        for( long offset = 0; offset < n; ) {
+            LinuxDirent64 *dirent = (LinuxDirent64 *)(buffer.get() + offset);
+            add(dirent->d_name, dirent->d_type);
+            offset += dirent->d_reclen;
+        }
+    }
+#else
+    int dupfd = ::dup(fd);
+    DIR *dir = dupfd == -1 ? nullptr : ::fdopendir(dupfd);
+    if( dir == nullptr ) {
+        if( dupfd != -1 ) {
+            ::close(dupfd);
+        }
+        return false;
+    }
+    while( struct dirent *dirent = ::readdir(dir) ) {
+        add(dirent->d_name, dirent->d_type);
+    }
+    ::closedir(dir);
+    return true;
+#endif
+}
+
+/**
+ * Read the .gitignore file in the directory, if it's reasonably sized.
+ */
+bool readGitIgnore( int dirfd, IgnoreList &rules ) {
+    int fd = ::openat(dirfd, ".gitignore", O_RDONLY|O_CLOEXEC);
+    if( fd == -1 ) {
+        return false;
+    }
+    std::string content;
+    char buf[4096];
+    ssize_t n;
+    while( (n = ::read(fd, buf, sizeof(buf))) > 0 && content.size() < GITIGNORE_MAX_SIZE ) {
+        content.append(buf, n);
+    }
+    ::close(fd);
+    rules.parse(content.data(), content.size());
+    return !rules.isEmpty();
+}
+
+/**
+ * State shared by the workers during one walk.
+ */
+class Walk {
+private:
+    const IgnoreList &excludes;
+    bool gitIgnore;
+    const DirWalker::Visitor &visit;
+
+    std::vector<WorkQueue> queues;
+    /** Directories queued or being processed */
+    std::atomic<size_t> pending;
+
+    /* Idle workers sleep on wake until there's work or the walk is over */
+    std::mutex waitLock;
+    std::condition_variable wake;
+    std::atomic<size_t> waiting;
+    std::atomic<bool> failed;
+    /** The first exception thrown while processing, if any */
+    std::exception_ptr error;
+
+    const SymbolRef gitDir = SymbolRef::get(".git");
+    const SymbolRef gitIgnoreFile = SymbolRef::get(".gitignore");
+
+    bool isExcluded( const DirTask &dir, SymbolRef name, bool isDirectory ) const;
+    void process( DirTask &task, size_t worker );
+
+    void push( size_t worker, DirTask &&task ) {
+        pending.fetch_add(1);
+        {
+            std::lock_guard<std::mutex> guard(queues[worker].lock);
+            queues[worker].tasks.push_back(std::move(task));
+        }
+        /* Pairs with the increment in run(): either the waiter sees the new
+         * task, or we see the waiter (and it's already waiting by the time
+         * we get the lock).
+         */
+        if( waiting.load() != 0 ) {
+            std::lock_guard<std::mutex> guard(waitLock);
+            wake.notify_one();
+        }
+    }
+    bool pop( size_t worker, DirTask &task );
+    void finish( std::exception_ptr failure );
+
+public:
+    Walk( const IgnoreList &excludes, bool gitIgnore, const DirWalker::Visitor &visit, size_t workers ) :
+        excludes(excludes), gitIgnore(gitIgnore), visit(visit), queues(workers), pending(0),
+        waiting(0), failed(false) { }
+
+    void start( DirTask &&task ) {
+        push(0, std::move(task));
+    }
+    void run( size_t worker );
+
+    /**
+     * Rethrow the first exception thrown by a worker, if any.
+     */
+    void check() {
+        if( error ) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+bool Walk::isExcluded( const DirTask &dir, SymbolRef name, bool isDirectory ) const {
+    if( excludes.isEmpty() && dir.ignores == nullptr ) {
+        return false;
+    }
+    std::vector<std::string_view> components;
+    components.reserve(dir.components.size() + 1);
+    for( SymbolRef component : dir.components ) {
+        components.emplace_back(component.data(), component.length());
+    }
+    components.emplace_back(name.data(), name.length());
+
+    /* The deepest .gitignore with an opinion wins, then the walker's own */
+    for( const IgnoreLevel *level = dir.ignores.get(); level != nullptr; level = level->parent.get() ) {
+        std::vector<std::string_view> relative(components.begin() + level->depth, components.end());
+        IgnoreList::Result result = level->rules.check(relative, isDirectory);
+        if( result != IgnoreList::NONE ) {
+            return result == IgnoreList::IGNORED;
+        }
+    }
+    return excludes.check(components, isDirectory) == IgnoreList::IGNORED;
+}
+
+void Walk::process( DirTask &task, size_t worker ) {
+    int fd = DirCache::get().open(task.path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if( fd == -1 ) {
+        return;
+    }
+    thread_local std::vector<Entry> entries;
+    entries.clear();
+    bool ok = readEntries(fd, entries);
+
+    std::shared_ptr<const IgnoreLevel> ignores = task.ignores;
+    if( ok && gitIgnore ) {
+        for( auto &entry : entries ) {
+            if( entry.name == gitIgnoreFile && entry.type == DirWalker::FILE ) {
+                auto level = std::make_shared<IgnoreLevel>();
+                level->parent = task.ignores;
+                level->depth = task.components.size();
+                if( readGitIgnore(fd, level->rules) ) {
+                    ignores = level;
+                }
+                break;
+            }
+        }
+    }
+    ::close(fd);
+    if( !ok ) {
+        return;
+    }
+
+    DirTask current{task.path, std::move(task.components), ignores};
+    std::vector<Entry> local;
+    local.swap(entries);
+    for( auto &entry : local ) {
+        bool isDirectory = entry.type == DirWalker::DIRECTORY;
+        if( (gitIgnore && isDirectory && entry.name == gitDir) ||
+                isExcluded(current, entry.name, isDirectory) ) {
+            continue;
+        }
+        PathRef path = current.path.child(entry.name);
+        visit(path, entry.type);
+        if( isDirectory ) {
+            DirTask child{path, current.components, ignores};
+            child.components.push_back(entry.name);
+            push(worker, std::move(child));
+        }
+    }
+    local.swap(entries);
+}
+
+bool Walk::pop( size_t worker, DirTask &task ) {
+    {
+        WorkQueue &own = queues[worker];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if( !own.tasks.empty() ) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for( size_t i = 1; i < queues.size(); i++ ) {
+        WorkQueue &victim = queues[(worker + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if( !victim.tasks.empty() ) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Walk::finish( std::exception_ptr failure ) {
+    if( failure ) {
+        std::lock_guard<std::mutex> guard(waitLock);
+        if( !error ) {
+            error = failure;
+        }
+        failed.store(true);
+        wake.notify_all();
+    }
+    if( pending.fetch_sub(1) == 1 ) {
+        std::lock_guard<std::mutex> guard(waitLock);
+        wake.notify_all();
+    }
+}
+
+void Walk::run( size_t worker ) {
+    Trace::Span span("walk", "io");
+    DirTask task;
+    while( !failed.load() ) {
+        if( !pop(worker, task) ) {
+            /* Look again once counted as waiting, so that a push either
+             * finds us waiting or its task is found here.
+             */
+            std::unique_lock<std::mutex> guard(waitLock);
+            waiting.fetch_add(1);
+            bool found = pop(worker, task);
+            while( !found && pending.load() != 0 && !failed.load() ) {
+                wake.wait(guard);
+                found = pop(worker, task);
+            }
+            waiting.fetch_sub(1);
+            if( !found ) {
+                return;
+            }
+        }
+        std::exception_ptr failure;
+        try {
+            process(task, worker);
+        } catch( ... ) {
+            failure = std::current_exception();
+        }
+        finish(failure);
+    }
+}
+
+void runWalk( const IgnoreList &excludes, bool gitIgnore, const DirWalker::Visitor &visit,
+              ThreadPool &pool, DirTask &&start ) {
+    size_t workers = std::max(1u, pool.getConcurrency());
+    Walk walk(excludes, gitIgnore, visit, workers);
+    walk.start(std::move(start));
+    pool.forEach(workers, [&]( size_t worker ) {
+        walk.run(worker);
+    });
+    walk.check();
+}
+
+}
+
+void DirWalker::walk( PathRef root, const Visitor &visit ) {
+    walk(root, visit, ThreadPool::getDefault());
+}
+
+void DirWalker::walk( PathRef root, const Visitor &visit, ThreadPool &pool ) {
+    runWalk(excludes, gitIgnore, visit, pool, DirTask{root, {}, nullptr});
+}
+
+std::vector<PathRef> DirWalker::glob( PathRef root, const std::vector<std::string> &patterns ) {
+    std::vector<Glob> globs;
+    std::vector<std::string> prefixes;
+    for( auto &pattern : patterns ) {
+        globs.emplace_back(pattern);
+        prefixes.push_back(globs.back().getLiteralPrefix());
+    }
+    /* Only walk the outermost prefixes; the others are inside them */
+    std::sort(prefixes.begin(), prefixes.end());
+    std::vector<std::string> starts;
+    for( auto &prefix : prefixes ) {
+        if( starts.empty() || !(starts.back().empty() || prefix == starts.back() ||
+                (prefix.compare(0, starts.back().size(), starts.back()) == 0 &&
+                 prefix[starts.back().size()] == '/')) ) {
+            starts.push_back(prefix);
+        }
+    }
+
+    size_t rootDepth = root.getDepth();
+    std::mutex lock;
+    std::vector<PathRef> results;
+    Visitor visit = [&]( PathRef path, EntryType type ) {
+        if( type != FILE ) {
+            return;
+        }
+        /* Collect the path relative to root */
+        std::vector<std::string_view> components(path.getDepth() - rootDepth);
+        PathRef p = path;
+        for( size_t i = components.size(); i > 0; i-- ) {
+            SymbolRef name = p.basename();
+            components[i-1] = std::string_view(name.data(), name.length());
+            p = p.parent();
+        }
+        for( auto &glob : globs ) {
+            if( glob.matches(components) ) {
+                std::lock_guard<std::mutex> guard(lock);
+                results.push_back(path);
+                return;
+            }
+        }
+    };
+    for( auto &start : starts ) {
+        DirTask task{root, {}, nullptr};
+        std::vector<std::string_view> components;
+        bool excluded = false;
+        for( size_t pos = 0; pos < start.size() && !excluded; ) {
+            size_t end = std::min(start.find('/', pos), start.size());
+            if( end > pos ) {
+                SymbolRef name = SymbolRef::get(std::string_view(start).substr(pos, end - pos));
+                components.emplace_back(name.data(), name.length());
+                excluded = excludes.check(components, true) == IgnoreList::IGNORED;
+                task.path = task.path.child(name);
+                task.components.push_back(name);
+            }
+            pos = end + 1;
+        }
+        if( !excluded ) {
+            runWalk(excludes, gitIgnore, visit, ThreadPool::getDefault(), std::move(task));
+        }
+    }
+
+    std::vector<std::pair<std::string, PathRef>> sorted;
+    sorted.reserve(results.size());
+    for( PathRef path : results ) {
+        sorted.emplace_back(path.str(), path);
+    }
+    std::sort(sorted.begin(), sorted.end());
+    results.clear();
+    for( auto &entry : sorted ) {
+        results.push_back(entry.second);
+    }
+    return results;
+}
+
+}
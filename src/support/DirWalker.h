@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_DIRWALKER_H
+#define FABR_SUPPORT_DIRWALKER_H
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "support/Glob.h"
+#include "support/PathRef.h"
+
+namespace fabr {
+
+class ThreadPool;
+
+/**
+ * Parallel directory tree walker. Directories are read with getdents64
+ * (using d_type to avoid stat calls where the filesystem provides it), and
+ * spread across the thread pool with a work-stealing queue: each worker
+ * takes the most recently found directory from its own queue (so it works
+ * depth-first, keeping the directory handles it needs hot), and steals the
+ * oldest from another worker's queue when its own is empty.
+ *
+ * Entries can be excluded with glob patterns relative to the walk root,
+ * and by default .gitignore files found in the tree are honoured (and .git
+ * directories skipped). Excluded directories are not descended into.
+ * Symbolic links are reported but never followed.
+ */
+class DirWalker {
+public:
+    enum EntryType { FILE, DIRECTORY, SYMLINK, OTHER };
+
+    /**
+     * Called for each entry found. Note this may be called concurrently
+     * from multiple threads.
+     */
+    typedef std::function<void(PathRef path, EntryType type)> Visitor;
+
+private:
+    IgnoreList excludes;
+    bool gitIgnore = true;
+
+public:
+    /**
+     * Exclude entries matching the given pattern (in .gitignore syntax,
+     * relative to the walk root).
+     */
+    void exclude( std::string_view pattern ) {
+        excludes.add(pattern);
+    }
+
+    /**
+     * Set whether to honour .gitignore files (default true).
+     */
+    void setGitIgnore( bool enable ) {
+        gitIgnore = enable;
+    }
+
+    /**
+     * Walk the tree under root, calling visit for each entry that isn't
+     * excluded. If root can't be read, nothing is visited; unreadable
+     * subdirectories are silently skipped. If visit throws, the walk is
+     * abandoned and the first exception thrown is rethrown here.
+     */
+    void walk( PathRef root, const Visitor &visit );
+    void walk( PathRef root, const Visitor &visit, ThreadPool &pool );
+
+    /**
+     * @return all files under root matching any of the given patterns
+     * (relative to root, see Glob), in lexical order. Only the subtrees
+     * under the patterns' literal prefixes are walked, so .gitignore files
+     * above those prefixes are not consulted (exclusions still apply).
+     */
+    std::vector<PathRef> glob( PathRef root, const std::vector<std::string> &patterns );
+};
+
+}
+
+#endif /* !FABR_SUPPORT_DIRWALKER_H */
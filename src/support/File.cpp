@@ -17,15 +17,21 @@
 
 #include "support/File.h"
 #include "support/Buffer.h"
+#include "support/DirCache.h"
+#include "support/Metrics.h"
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
-#define MMAP_THRESHOLD 8192
+/* Size of a transparent huge page on the platforms we care about */
+#define HUGE_PAGE_SIZE (2*1024*1024)
 
 namespace fabr {
 
@@ -33,8 +39,30 @@ namespace fabr {
 #define O_BINARY 0
 #endif
 
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/**
+ * Open the file relative to its cached directory. Only the directory is
+ * interned: file names are often one-offs (temporaries, unity batches) that
+ * would otherwise accumulate in the PathRef table of a long-lived server.
+ */
+static int openFile( const char *filename, int flags, mode_t mode = 0 ) {
+    const char *slash = strrchr(filename, '/');
+    if( slash == nullptr || slash[1] == '\0' ) {
+        return DirCache::get().open(PathRef(), filename, flags, mode);
+    }
+    PathRef dir(std::string_view(filename, slash == filename ? 1 : slash - filename));
+    return DirCache::get().open(dir, slash + 1, flags, mode);
+}
+
 File File::getForRead(const char *filename) {
-    int fd = ::open(filename, O_RDONLY|O_BINARY);
+    int fd = openFile(filename, O_RDONLY|O_BINARY|O_CLOEXEC);
     if( fd == -1 ) {
         throw std::system_error(errno, std::system_category());
     }
@@ -42,7 +70,7 @@ File File::getForRead(const char *filename) {
 }
 
 File File::create(const char *filename) {
-    int fd = ::open(filename, O_RDWR|O_BINARY|O_CREAT|O_EXCL);
+    int fd = openFile(filename, O_RDWR|O_BINARY|O_CREAT|O_EXCL|O_CLOEXEC, 0666);
     if( fd == -1 ) {
         throw std::system_error(errno, std::system_category());
     }
@@ -50,7 +78,7 @@ File File::create(const char *filename) {
 }
 
 File::~File() {
-    if( fd == -1 ) {
+    if( fd != -1 ) {
         /* Note: silently swallow errors here; nothing we can do if close fails */
         close(fd);
         fd = -1;
@@ -59,10 +87,12 @@ File::~File() {
 
 
 size_t File::read(char *buf, size_t length) {
+    Metrics::add(Metrics::FS_READ);
     ssize_t len = ::read(fd, buf, length);
     if( len == -1 ) {
         throw std::system_error(errno, std::system_category());
     }
+    Metrics::add(Metrics::FS_BYTES_READ, len);
     return (size_t)len;
 }
 
@@ -90,6 +120,24 @@ size_t File::size() {
     }
     return st.st_size;
 }
+static File::ReadPolicy readPolicy;
+
+const File::ReadPolicy &File::getReadPolicy() {
+    return readPolicy;
+}
+
+void File::setReadPolicy( const ReadPolicy &policy ) {
+    readPolicy = policy;
+}
+
+void File::readahead( off_t offset, size_t length ) {
+#if defined(__linux__)
+    ::readahead(fd, offset, length);
+#elif defined(POSIX_FADV_WILLNEED)
+    ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+}
+
 namespace {
 
 class MmapBuffer : public Buffer {
@@ -103,23 +151,84 @@ public:
     }
 };
 
+/**
+ * Map the file at a huge-page aligned address, by reserving enough address
+ * space to align within and then mapping over it.
+ * @return the mapping, or MAP_FAILED.
+ */
+void *mapAligned( int fd, size_t size, int flags ) {
+    size_t reserved = size + HUGE_PAGE_SIZE;
+    char *base = (char *)::mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if( base == MAP_FAILED ) {
+        return MAP_FAILED;
+    }
+    char *aligned = (char *)(((uintptr_t)base + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    void *p = ::mmap(aligned, size, PROT_READ, flags|MAP_FIXED, fd, 0);
+    if( p == MAP_FAILED ) {
+        int err = errno;
+        ::munmap(base, reserved);
+        errno = err;
+        return MAP_FAILED;
+    }
+    /* Release the unused space either side */
+    size_t mapped = (size + ::getpagesize() - 1) & ~(size_t)(::getpagesize() - 1);
+    if( aligned > base ) {
+        ::munmap(base, aligned - base);
+    }
+    if( aligned + mapped < base + reserved ) {
+        ::munmap(aligned + mapped, base + reserved - (aligned + mapped));
+    }
+    return p;
 }
 
-std::unique_ptr<Buffer> File::getBuffer() {
+}
+
+std::unique_ptr<Buffer> File::getBuffer( Access access ) {
     size_t sz = size();
-    if( sz <= MMAP_THRESHOLD ) {
+    Metrics::record(Metrics::FS_READ_SIZE, sz);
+    if( sz < readPolicy.mmapThreshold ) {
         std::unique_ptr<Buffer> buffer = Buffer::getBuffer(sz);
         seek(0);
-        read(buffer->data(), sz);
+        for( size_t done = 0; done < sz; ) {
+            size_t len = read(buffer->data() + done, sz - done);
+            if( len == 0 ) {
+                /* File was truncated underneath us */
+                throw std::system_error(EIO, std::system_category());
+            }
+            done += len;
+        }
         return buffer;
+    }
+
+    int flags = MAP_PRIVATE;
+    if( access == SEQUENTIAL && sz <= readPolicy.populateLimit ) {
+        flags |= MAP_POPULATE;
+    }
+    void *p;
+    if( sz >= readPolicy.hugePageThreshold ) {
+        p = mapAligned(fd, sz, flags);
     } else {
-        void *p = ::mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0 );
-        if( p == MAP_FAILED ) {
-            throw std::system_error(errno, std::system_category());
-        }
-        return std::make_unique<MmapBuffer>((char *)p, sz);
+        p = ::mmap(NULL, sz, PROT_READ, flags, fd, 0);
+    }
+    if( p == MAP_FAILED ) {
+        throw std::system_error(errno, std::system_category());
     }
+    Metrics::add(Metrics::FS_MMAP);
+    Metrics::add(Metrics::FS_BYTES_MAPPED, sz);
+
+    /* Advice is only a hint, so errors are ignored */
+    if( access == RANDOM ) {
+        ::madvise(p, sz, MADV_RANDOM);
+    } else if( (flags & MAP_POPULATE) == 0 ) {
+        ::madvise(p, sz, MADV_SEQUENTIAL);
+        ::madvise(p, sz, MADV_WILLNEED);
+    }
+#ifdef MADV_HUGEPAGE
+    if( sz >= readPolicy.hugePageThreshold ) {
+        ::madvise(p, sz, MADV_HUGEPAGE);
+    }
+#endif
+    return std::make_unique<MmapBuffer>((char *)p, sz);
 }
 
 }
-
@@ -34,6 +34,32 @@ class File {
     int fd;
 
 public:
+    /**
+     * How the caller intends to access a file buffer.
+     */
+    enum Access {
+        /** The whole buffer will be scanned from start to end */
+        SEQUENTIAL,
+        /** Only parts of the buffer will be accessed, in no particular order */
+        RANDOM
+    };
+
+    /**
+     * Thresholds used by getBuffer() to pick a read strategy.
+     */
+    struct ReadPolicy {
+        /** Files smaller than this are read() into a heap buffer rather than
+         * mapped, as the mapping and page faults cost more than the copy. */
+        size_t mmapThreshold = 128*1024;
+        /** Sequential mappings up to this size are prefaulted in one go
+         * (MAP_POPULATE); larger ones are just advised sequential, so the
+         * caller can start before the whole file is resident. */
+        size_t populateLimit = 64*1024*1024;
+        /** Mappings at least this large are aligned for, and advised to use,
+         * transparent huge pages. */
+        size_t hugePageThreshold = 32*1024*1024;
+    };
+
     /**
      * Construct a file on the given fd, taking ownership of the file
      * descriptor.
@@ -56,8 +82,11 @@ public:
         return fd != f.fd;
     }
     File &operator=( File &&f ) {
-        fd = f.fd;
-        f.fd = -1;
+        if( this != &f ) {
+            File old(fd);
+            fd = f.fd;
+            f.fd = -1;
+        }
         return *this;
     }
 
@@ -71,6 +100,13 @@ public:
         return isValid();
     }
 
+    /**
+     * Return the file descriptor, which remains owned by the File.
+     */
+    int getFd() const {
+        return fd;
+    }
+
     /**
      * Return the file descriptor and remove it from the File.
      */
@@ -111,25 +147,41 @@ public:
     size_t size();
 
     /**
-     * Return a Buffer containing the contents of the file.
+     * Return a Buffer containing the contents of the file. Small files are
+     * read into memory, and larger ones mapped, with the kernel advised of
+     * the expected access pattern (see ReadPolicy).
      * @throws system_error if the operation fails.
      */
-    std::unique_ptr<Buffer> getBuffer();
+    std::unique_ptr<Buffer> getBuffer( Access access = SEQUENTIAL );
 
     /**
      * Convenience function to get the file buffer from a filename.
      * @throws system_error if the operation fails.
      */
-    static std::unique_ptr<Buffer> getBuffer(const char *filename) {
-        return getForRead(filename).getBuffer();
+    static std::unique_ptr<Buffer> getBuffer(const char *filename, Access access = SEQUENTIAL) {
+        return getForRead(filename).getBuffer(access);
     }
-    static std::unique_ptr<Buffer> getBuffer(const std::string &filename) {
-        return getForRead(filename).getBuffer();
+    static std::unique_ptr<Buffer> getBuffer(const std::string &filename, Access access = SEQUENTIAL) {
+        return getForRead(filename).getBuffer(access);
     }
-    static std::unique_ptr<Buffer> getBuffer(std::string_view filename) {
-        return getForRead(filename).getBuffer();
+    static std::unique_ptr<Buffer> getBuffer(std::string_view filename, Access access = SEQUENTIAL) {
+        return getForRead(filename).getBuffer(access);
     }
 
+    /**
+     * Ask the kernel to start reading the given range of the file into the
+     * page cache, without waiting for it. Errors are ignored, as this is
+     * only a hint.
+     */
+    void readahead( off_t offset, size_t length );
+
+    /**
+     * Get/set the thresholds used by getBuffer(). Setting is not
+     * thread-safe, and is intended for benchmarking.
+     */
+    static const ReadPolicy &getReadPolicy();
+    static void setReadPolicy( const ReadPolicy &policy );
+
     /********************** File open ***********************/
 
     /**
@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Glob.h"
+
+namespace fabr {
+
+static bool hasWildcards( std::string_view text ) {
+    return text.find_first_of("*?[\\") != std::string_view::npos;
+}
+
+static void splitPath( std::string_view path, std::vector<std::string_view> &components ) {
+    size_t start = 0;
+    while( start <= path.size() ) {
+        size_t end = path.find('/', start);
+        if( end == std::string_view::npos ) {
+            end = path.size();
+        }
+        if( end > start ) {
+            components.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+}
+
+Glob::Glob( std::string_view pattern ) {
+    if( !pattern.empty() && pattern.back() == '/' ) {
+        directoryOnly = true;
+        pattern.remove_suffix(1);
+    }
+    if( pattern.find('/') != std::string_view::npos ) {
+        anchored = true;
+    }
+    std::vector<std::string_view> components;
+    splitPath(pattern, components);
+    if( !anchored ) {
+        segments.push_back(Segment{ANY_DIRS, std::string()});
+    }
+    for( auto &component : components ) {
+        if( component == "**" ) {
+            /* Consecutive "**" are equivalent to one */
+            if( segments.empty() || segments.back().type != ANY_DIRS ) {
+                segments.push_back(Segment{ANY_DIRS, std::string()});
+            }
+        } else {
+            segments.push_back(Segment{hasWildcards(component) ? WILDCARD : LITERAL, std::string(component)});
+        }
+    }
+}
+
+/**
+ * Match a character class starting just after the '['.
+ * @return true if c is in the class, and advance p past the closing ']'.
+ * An unterminated class matches a literal '['.
+ */
+static bool matchClass( std::string_view pattern, size_t &p, char c, bool &valid ) {
+    size_t i = p;
+    bool negated = false;
+    if( i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^') ) {
+        negated = true;
+        i++;
+    }
+    bool matched = false;
+    bool first = true;
+    while( i < pattern.size() && (first || pattern[i] != ']') ) {
+        first = false;
+        char lo = pattern[i];
+        if( lo == '\\' && i + 1 < pattern.size() ) {
+            lo = pattern[++i];
+        }
+        char hi = lo;
+        if( i + 2 < pattern.size() && pattern[i+1] == '-' && pattern[i+2] != ']' ) {
+            hi = pattern[i+2];
+            if( hi == '\\' && i + 3 < pattern.size() ) {
+                hi = pattern[++i + 2];
+            }
+            i += 2;
+        }
+        if( c >= lo && c <= hi ) {
+            matched = true;
+        }
+        i++;
+    }
+    if( i >= pattern.size() ) {
+        valid = false;
+        return c == '[';
+    }
+    valid = true;
+    p = i + 1;
+    return matched != negated;
+}
+
+bool Glob::matchComponent( std::string_view pattern, std::string_view name ) {
+    /* Standard wildcard match, backtracking to the most recent '*' on
+     * failure (which is sufficient as '*' can't cross components).
+     */
+    size_t p = 0, n = 0;
+    size_t starP = std::string_view::npos, starN = 0;
+    while( n < name.size() ) {
+        if( p < pattern.size() ) {
+            char pc = pattern[p];
+            if( pc == '*' ) {
+                starP = ++p;
+                starN = n;
+                continue;
+            } else if( pc == '?' ) {
+                p++;
+                n++;
+                continue;
+            } else if( pc == '[' ) {
+                size_t next = p + 1;
+                bool valid;
+                if( matchClass(pattern, next, name[n], valid) ) {
+                    p = valid ? next : p + 1;
+                    n++;
+                    continue;
+                }
+            } else {
+                if( pc == '\\' && p + 1 < pattern.size() ) {
+                    pc = pattern[++p];
+                }
+                if( pc == name[n] ) {
+                    p++;
+                    n++;
+                    continue;
+                }
+            }
+        }
+        if( starP == std::string_view::npos ) {
+            return false;
+        }
+        p = starP;
+        n = ++starN;
+    }
+    while( p < pattern.size() && pattern[p] == '*' ) {
+        p++;
+    }
+    return p == pattern.size();
+}
+
+bool Glob::matchFrom( size_t segment, const std::string_view *components, size_t count ) const {
+    for( ; segment < segments.size(); segment++ ) {
+        const Segment &seg = segments[segment];
+        if( seg.type == ANY_DIRS ) {
+            /* Try consuming each possible number of components. A trailing
+             * "**" matches everything inside, but not the directory itself.
+             */
+            for( size_t skip = segment + 1 == segments.size() ? 1 : 0; skip <= count; skip++ ) {
+                if( matchFrom(segment + 1, components + skip, count - skip) ) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if( count == 0 ) {
+            return false;
+        }
+        if( seg.type == LITERAL ? seg.text != *components : !matchComponent(seg.text, *components) ) {
+            return false;
+        }
+        components++;
+        count--;
+    }
+    return count == 0;
+}
+
+bool Glob::matches( const std::vector<std::string_view> &components, bool isDirectory ) const {
+    if( directoryOnly && !isDirectory ) {
+        return false;
+    }
+    return matchFrom(0, components.data(), components.size());
+}
+
+bool Glob::matches( std::string_view path, bool isDirectory ) const {
+    std::vector<std::string_view> components;
+    splitPath(path, components);
+    return matches(components, isDirectory);
+}
+
+std::string Glob::getLiteralPrefix() const {
+    std::string prefix;
+    /* The last segment names the match itself, so isn't part of the prefix */
+    for( size_t i = 0; i + 1 < segments.size() && segments[i].type == LITERAL; i++ ) {
+        if( !prefix.empty() ) {
+            prefix.push_back('/');
+        }
+        prefix += segments[i].text;
+    }
+    return prefix;
+}
+
+void IgnoreList::add( std::string_view line ) {
+    /* Trailing spaces are ignored unless escaped */
+    while( !line.empty() && (line.back() == ' ' || line.back() == '\r') &&
+            !(line.size() >= 2 && line[line.size()-2] == '\\') ) {
+        line.remove_suffix(1);
+    }
+    if( line.empty() || line[0] == '#' ) {
+        return;
+    }
+    bool negated = false;
+    if( line[0] == '!' ) {
+        negated = true;
+        line.remove_prefix(1);
+    } else if( line[0] == '\\' && line.size() > 1 && (line[1] == '!' || line[1] == '#') ) {
+        line.remove_prefix(1);
+    }
+    /* Note a leading '/' needs no special handling: any '/' anchors the
+     * pattern, and empty components are dropped.
+     */
+    if( line.empty() || line == "/" ) {
+        return;
+    }
+    rules.push_back(Rule{Glob(line), negated});
+}
+
+void IgnoreList::parse( const char *data, size_t length ) {
+    std::string_view text(data, length);
+    size_t start = 0;
+    while( start < text.size() ) {
+        size_t end = text.find('\n', start);
+        if( end == std::string_view::npos ) {
+            end = text.size();
+        }
+        add(text.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+IgnoreList::Result IgnoreList::check( const std::vector<std::string_view> &components, bool isDirectory ) const {
+    for( auto it = rules.rbegin(); it != rules.rend(); ++it ) {
+        if( it->glob.matches(components, isDirectory) ) {
+            return it->negated ? INCLUDED : IGNORED;
+        }
+    }
+    return NONE;
+}
+
+}
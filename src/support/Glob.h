@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_GLOB_H
+#define FABR_SUPPORT_GLOB_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fabr {
+
+/**
+ * Compiled glob pattern, matched against '/'-separated relative paths.
+ * The syntax follows .gitignore:
+ *   - '*' matches anything except '/', '?' matches any one character
+ *     except '/', and "[...]" matches a character class ("[!...]" or
+ *     "[^...]" to negate). '\' escapes the next character.
+ *   - A "**" component matches zero or more directories.
+ *   - A pattern containing a '/' (other than at the end) is anchored to the
+ *     base directory; otherwise it matches the final components of a path
+ *     at any depth (as if it started with a "**" component).
+ *   - A trailing '/' only matches directories.
+ */
+class Glob {
+private:
+    enum SegmentType { LITERAL, WILDCARD, ANY_DIRS };
+    struct Segment {
+        SegmentType type;
+        std::string text;
+    };
+
+    std::vector<Segment> segments;
+    bool anchored = false;
+    bool directoryOnly = false;
+
+    bool matchFrom( size_t segment, const std::string_view *components, size_t count ) const;
+
+public:
+    explicit Glob( std::string_view pattern );
+
+    /**
+     * @return true if the pattern matches the given relative path.
+     * @param isDirectory whether the path names a directory.
+     */
+    bool matches( std::string_view path, bool isDirectory = false ) const;
+    bool matches( const std::vector<std::string_view> &components, bool isDirectory = false ) const;
+
+    /**
+     * @return the leading components of the pattern that contain no
+     * wildcards (e.g. "src/lib" for "src/lib/x*.cpp"), which is the only
+     * part of the tree that can contain matches. Empty if not anchored.
+     */
+    std::string getLiteralPrefix() const;
+
+    bool isAnchored() const {
+        return anchored;
+    }
+    bool isDirectoryOnly() const {
+        return directoryOnly;
+    }
+
+    /**
+     * Match a single path component against a wildcard pattern.
+     */
+    static bool matchComponent( std::string_view pattern, std::string_view name );
+};
+
+/**
+ * An ordered list of include/exclude glob rules, as read from a .gitignore
+ * file. Later rules override earlier ones, and a rule prefixed with '!'
+ * re-includes a path excluded by an earlier rule.
+ */
+class IgnoreList {
+private:
+    struct Rule {
+        Glob glob;
+        bool negated;
+    };
+    std::vector<Rule> rules;
+
+public:
+    enum Result {
+        /** No rule matched */
+        NONE,
+        IGNORED,
+        /** Explicitly re-included by a negated rule */
+        INCLUDED
+    };
+
+    /**
+     * Add a rule, in .gitignore syntax. Blank lines and comments are
+     * ignored.
+     */
+    void add( std::string_view line );
+
+    /**
+     * Add all the rules in the given .gitignore file content.
+     */
+    void parse( const char *data, size_t length );
+
+    bool isEmpty() const {
+        return rules.empty();
+    }
+
+    /**
+     * @return the result of the last rule matching the relative path.
+     */
+    Result check( const std::vector<std::string_view> &components, bool isDirectory ) const;
+};
+
+}
+
+#endif /* !FABR_SUPPORT_GLOB_H */
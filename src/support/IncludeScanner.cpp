@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/DigestCache.h"
+#include "support/DirCache.h"
+#include "support/File.h"
+#include "support/IncludeScanner.h"
+#include "support/Metrics.h"
+#include "support/StatCache.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <unordered_set>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace fabr {
+
+IncludeScanner *IncludeScanner::current = nullptr;
+
+namespace {
+
+/**
+ * @return the first byte in [p, end) that is a, b or c, or end if none.
+ */
+const char *findAny( const char *p, const char *end, char a, char b, char c ) {
+#if defined(__SSE2__)
+    const __m128i va = _mm_set1_epi8(a), vb = _mm_set1_epi8(b), vc = _mm_set1_epi8(c);
+    while( end - p >= 16 ) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)),
+                _mm_cmpeq_epi8(v, vc));
+        int mask = _mm_movemask_epi8(match);
+        if( mask != 0 ) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#elif defined(__aarch64__)
+    const uint8x16_t va = vdupq_n_u8(a), vb = vdupq_n_u8(b), vc = vdupq_n_u8(c);
+    while( end - p >= 16 ) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)p);
+        uint8x16_t match = vorrq_u8(vorrq_u8(vceqq_u8(v, va), vceqq_u8(v, vb)), vceqq_u8(v, vc));
+        if( vmaxvq_u8(match) != 0 ) {
+            break;
+        }
+        p += 16;
+    }
+#endif
+    while( p < end && *p != a && *p != b && *p != c ) {
+        p++;
+    }
+    return p;
+}
+
+bool isSpace( char c ) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+bool isIdentifier( char c ) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+const char *skipSpace( const char *p, const char *end ) {
+    while( p < end && isSpace(*p) ) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @return the end of the identifier starting at p.
+ */
+const char *skipIdentifier( const char *p, const char *end ) {
+    while( p < end && isIdentifier(*p) ) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * @return the position just after the end of the block comment whose body
+ * starts at p.
+ */
+const char *skipBlockComment( const char *p, const char *end ) {
+    while( const char *star = (const char *)memchr(p, '*', end - p) ) {
+        if( star + 1 < end && star[1] == '/' ) {
+            return star + 2;
+        }
+        p = star + 1;
+    }
+    return end;
+}
+
+/**
+ * @return the position just after the string literal whose body starts at
+ * p, or of the end of the line if it isn't terminated there.
+ */
+const char *skipString( const char *p, const char *end ) {
+    while( p < end ) {
+        if( *p == '"' ) {
+            return p + 1;
+        } else if( *p == '\n' ) {
+            return p;
+        } else if( *p == '\\' && p + 1 < end ) {
+            p++;
+        }
+        p++;
+    }
+    return end;
+}
+
+/**
+ * @return the end of the line starting at p, less any trailing comment or
+ * whitespace.
+ */
+const char *findLineEnd( const char *p, const char *end ) {
+    const char *eol = (const char *)memchr(p, '\n', end - p);
+    if( eol == nullptr ) {
+        eol = end;
+    }
+    for( const char *q = p; q + 1 < eol; q++ ) {
+        if( q[0] == '/' && (q[1] == '/' || q[1] == '*') ) {
+            eol = q;
+            break;
+        }
+    }
+    while( eol > p && isSpace(eol[-1]) ) {
+        eol--;
+    }
+    return eol;
+}
+
+/**
+ * Lexes a source file for directives. Only the start of each line is
+ * examined closely; the rest is skipped with findAny, stopping only for
+ * newlines, comments and strings.
+ */
+class Lexer {
+private:
+    struct Conditional {
+        /** Everything inside is skipped (#if 0) */
+        bool dead;
+        /** Wraps the whole file to guard against multiple inclusion */
+        bool guard;
+        /** The condition is literally 0 or 1, or -1 if it isn't */
+        int literal;
+    };
+
+    const char *begin;
+    const char *end;
+    std::vector<IncludeDirective> &out;
+    std::vector<Conditional> conditionals;
+    unsigned directives = 0;
+    /** Macro tested by the first directive, if #ifndef: a possible include guard */
+    std::string_view guardName;
+    /** Line number at lineCounted */
+    uint32_t line = 1;
+    const char *lineCounted;
+
+    bool isDead() const {
+        return !conditionals.empty() && conditionals.back().dead;
+    }
+
+    bool isConditional() const {
+        for( const Conditional &cond : conditionals ) {
+            if( !cond.guard ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * @return 0 or 1 if the expression starting at p is just that literal,
+     * otherwise -1.
+     */
+    int getLiteral( const char *p ) const {
+        p = skipSpace(p, end);
+        if( p < end && (*p == '0' || *p == '1') && (p + 1 == end || !isIdentifier(p[1])) ) {
+            return *p - '0';
+        }
+        return -1;
+    }
+
+    void add( IncludeDirective::Kind kind, bool angled, bool computed, const char *name, const char *nameEnd,
+              const char *at, bool exported = false ) {
+        /* Line numbers are only needed here, so count lazily */
+        line += std::count(lineCounted, at, '\n');
+        lineCounted = at;
+        IncludeDirective directive;
+        directive.kind = kind;
+        directive.angled = angled;
+        directive.conditional = isConditional();
+        directive.computed = computed;
+        directive.exported = exported;
+        directive.name.assign(name, nameEnd - name);
+        directive.line = line;
+        out.push_back(std::move(directive));
+    }
+
+    /**
+     * Parse the operand of an include directive at p.
+     * @return the position to continue lexing from.
+     */
+    const char *include( IncludeDirective::Kind kind, const char *p, const char *at ) {
+        p = skipSpace(p, end);
+        if( p < end && (*p == '"' || *p == '<') ) {
+            char close = *p == '"' ? '"' : '>';
+            const char *name = p + 1;
+            const char *q = name;
+            while( q < end && *q != close && *q != '\n' ) {
+                q++;
+            }
+            if( q < end && *q == close ) {
+                add(kind, close == '>', false, name, q, at);
+                return q + 1;
+            }
+            return q;
+        }
+        const char *eol = findLineEnd(p, end);
+        if( eol > p ) {
+            add(kind, false, true, p, eol, at);
+        }
+        return eol;
+    }
+
+    /**
+     * Handle the directive whose name starts at p (just after the '#').
+     * @return the position to continue lexing from.
+     */
+    const char *directive( const char *p ) {
+        const char *at = p;
+        p = skipSpace(p, end);
+        const char *nameEnd = skipIdentifier(p, end);
+        std::string_view name(p, nameEnd - p);
+        p = nameEnd;
+        bool first = directives++ == 0;
+
+        if( name == "include" || name == "include_next" || name == "import" ) {
+            if( !isDead() ) {
+                IncludeDirective::Kind kind = name == "include" ? IncludeDirective::INCLUDE :
+                        name == "import" ? IncludeDirective::IMPORT : IncludeDirective::INCLUDE_NEXT;
+                return include(kind, p, at);
+            }
+        } else if( name == "if" || name == "ifdef" || name == "ifndef" ) {
+            int literal = name == "if" ? getLiteral(p) : -1;
+            conditionals.push_back(Conditional{ isDead() || literal == 0, false, literal });
+            if( first && name == "ifndef" ) {
+                const char *macro = skipSpace(p, end);
+                guardName = std::string_view(macro, skipIdentifier(macro, end) - macro);
+            }
+        } else if( name == "elif" || name == "else" ) {
+            if( !conditionals.empty() ) {
+                Conditional &cond = conditionals.back();
+                bool outerDead = conditionals.size() > 1 && conditionals[conditionals.size() - 2].dead;
+                int literal = name == "elif" ? getLiteral(p) : 1;
+                /* Once a branch is known to be taken, the rest are dead */
+                cond.dead = outerDead || cond.literal == 1 || literal == 0;
+                cond.guard = false;
+                if( cond.literal != 1 ) {
+                    cond.literal = literal == 1 ? 1 : -1;
+                }
+            }
+        } else if( name == "endif" ) {
+            if( !conditionals.empty() ) {
+                conditionals.pop_back();
+            }
+        } else if( name == "define" ) {
+            if( directives == 2 && !guardName.empty() && conditionals.size() == 1 ) {
+                const char *macro = skipSpace(p, end);
+                if( std::string_view(macro, skipIdentifier(macro, end) - macro) == guardName ) {
+                    conditionals.back().guard = true;
+                }
+            }
+        }
+        return p;
+    }
+
+    /**
+     * Handle a possible C++20 import or module declaration ("import x;",
+     * "module x;", either of them exported) starting at p.
+     * @return the position to continue lexing from.
+     */
+    const char *moduleLine( const char *p ) {
+        const char *at = p;
+        const char *word = skipIdentifier(p, end);
+        bool exported = std::string_view(p, word - p) == "export";
+        if( exported ) {
+            p = skipSpace(word, end);
+            word = skipIdentifier(p, end);
+        }
+        std::string_view keyword(p, word - p);
+        if( (keyword != "import" && keyword != "module") || word == end ||
+                !(isSpace(*word) || *word == '<' || *word == '"' || *word == ':' || *word == ';') ) {
+            return word;
+        }
+        p = skipSpace(word, end);
+        if( keyword == "import" && p < end && (*p == '<' || *p == '"') ) {
+            char close = *p == '"' ? '"' : '>';
+            const char *name = p + 1;
+            const char *q = name;
+            while( q < end && *q != close && *q != '\n' ) {
+                q++;
+            }
+            const char *semi = q < end ? skipSpace(q + 1, end) : end;
+            if( q < end && *q == close && semi < end && *semi == ';' ) {
+                add(IncludeDirective::HEADER_UNIT, close == '>', false, name, q, at, exported);
+                return q + 1;
+            }
+            return q;
+        }
+        const char *name = p;
+        while( p < end && (isIdentifier(*p) || *p == '.' || *p == ':') ) {
+            p++;
+        }
+        const char *semi = skipSpace(p, end);
+        /* Ignore the global and private module fragments */
+        if( p > name && semi < end && *semi == ';' && std::string_view(name, p - name) != ":private" ) {
+            add(keyword == "import" ? IncludeDirective::MODULE : IncludeDirective::MODULE_DECLARATION,
+                false, false, name, p, at, exported);
+        }
+        return p;
+    }
+
+public:
+    Lexer( const char *begin, const char *end, std::vector<IncludeDirective> &out ) :
+        begin(begin), end(end), out(out), lineCounted(begin) { }
+
+    void run() {
+        const char *p = begin;
+        /* Nothing but whitespace and comments so far on this line */
+        bool lineStart = true;
+        while( p < end ) {
+            if( lineStart ) {
+                p = skipSpace(p, end);
+                if( p == end ) {
+                    break;
+                }
+                lineStart = false;
+                if( *p == '#' ) {
+                    p = directive(p + 1);
+                    continue;
+                } else if( (*p == 'i' || *p == 'e' || *p == 'm') && !isDead() ) {
+                    p = moduleLine(p);
+                    continue;
+                } else if( *p == '/' && p + 1 < end && p[1] == '*' ) {
+                    p = skipBlockComment(p + 2, end);
+                    lineStart = true;
+                    continue;
+                }
+            }
+            const char *q = findAny(p, end, '\n', '/', '"');
+            if( q == end ) {
+                break;
+            }
+            if( *q == '\n' ) {
+                lineStart = true;
+                p = q + 1;
+            } else if( *q == '"' ) {
+                p = skipString(q + 1, end);
+            } else if( q + 1 < end && q[1] == '/' ) {
+                const char *eol = (const char *)memchr(q, '\n', end - q);
+                p = eol == nullptr ? end : eol;
+            } else if( q + 1 < end && q[1] == '*' ) {
+                p = skipBlockComment(q + 2, end);
+            } else {
+                p = q + 1;
+            }
+        }
+    }
+};
+
+}
+
+std::vector<IncludeDirective> IncludeScanner::scan( const char *data, size_t length ) {
+    std::vector<IncludeDirective> result;
+    Lexer(data, data + length, result).run();
+    Metrics::add(Metrics::INCLUDESCAN_FILES, 1);
+    Metrics::add(Metrics::INCLUDESCAN_BYTES, length);
+    return result;
+}
+
+std::vector<IncludeDirective> IncludeScanner::scan( const Buffer &buffer ) {
+    return scan(buffer.data(), buffer.size());
+}
+
+size_t IncludeScanner::FileKeyHash::operator()( const FileKey &k ) const {
+    return std::hash<uint64_t>()(k.ino * 0x9e3779b97f4a7c15ULL ^ k.dev ^ (uint64_t)k.mtime);
+}
+
+IncludeScanner::DirectiveList IncludeScanner::getDirectives( PathRef file ) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = byPath.find(file);
+        if( it != byPath.end() ) {
+            return it->second;
+        }
+    }
+
+    /* Stat before reading, so that a change racing with the read shows up
+     * as a different identity next time.
+     */
+    StatCache *cache = StatCache::getCurrent();
+    StatInfo info = cache != nullptr ? cache->get(file) : DirCache::get().stat(file);
+    FileKey key = { info.dev, info.ino, info.size, info.mtime, info.ctime };
+    if( info.isFile() ) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = byIdentity.find(key);
+        if( it != byIdentity.end() ) {
+            Metrics::add(Metrics::INCLUDECACHE_HITS, 1);
+            it->second.generation = generation;
+            byPath[file] = it->second.directives;
+            return it->second.directives;
+        }
+    }
+
+    Metrics::add(Metrics::INCLUDECACHE_MISSES, 1);
+    std::unique_ptr<Buffer> content = File::getBuffer(file.str());
+    DirectiveList list = std::make_shared<const std::vector<IncludeDirective>>(scan(*content));
+
+    /* A file modified very recently could change again without its
+     * timestamps moving, so only remember it for this build.
+     */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int64_t trusted = now.tv_sec * 1000000000LL + now.tv_nsec - DigestCache::RACY_WINDOW;
+    bool racy = info.mtime >= trusted || info.ctime >= trusted;
+
+    std::lock_guard<std::mutex> guard(lock);
+    if( info.isFile() && !racy ) {
+        /* Another thread may have beaten us to it */
+        Entry &entry = byIdentity.emplace(key, Entry{list, generation}).first->second;
+        list = entry.directives;
+    }
+    DirectiveList &entry = byPath.emplace(file, list).first->second;
+    return entry;
+}
+
+PathRef IncludeScanner::resolve( const IncludeDirective &directive, PathRef includer,
+                                 const IncludePath &paths ) const {
+    if( directive.computed || directive.kind == IncludeDirective::MODULE ||
+            directive.kind == IncludeDirective::MODULE_DECLARATION || directive.name.empty() ) {
+        return PathRef();
+    }
+    StatCache *cache = StatCache::getCurrent();
+    auto isFile = [&]( PathRef path ) {
+        return cache != nullptr ? cache->get(path).isFile() : path.toPath().isFile();
+    };
+
+    size_t first = 0;
+    if( directive.kind == IncludeDirective::INCLUDE_NEXT ) {
+        /* Carry on from after the directory the includer was found in */
+        for( size_t i = 0; i < paths.search.size(); i++ ) {
+            if( paths.search[i].contains(includer) ) {
+                first = i + 1;
+                break;
+            }
+        }
+    } else if( !directive.angled ) {
+        PathRef local = includer.parent() + directive.name;
+        if( isFile(local) ) {
+            return local;
+        }
+        for( PathRef dir : paths.quote ) {
+            PathRef path = dir + directive.name;
+            if( isFile(path) ) {
+                return path;
+            }
+        }
+    }
+    for( size_t i = first; i < paths.search.size(); i++ ) {
+        PathRef path = paths.search[i] + directive.name;
+        if( isFile(path) ) {
+            return path;
+        }
+    }
+    return PathRef();
+}
+
+IncludeScanner::Dependencies IncludeScanner::scan( PathRef source, const IncludePath &paths ) {
+    Dependencies result;
+    std::unordered_set<PathRef> seen;
+    std::unordered_set<std::string> missing, modules;
+    std::vector<PathRef> work;
+    seen.insert(source);
+    work.push_back(source);
+    for( size_t i = 0; i < work.size(); i++ ) {
+        DirectiveList directives;
+        try {
+            directives = getDirectives(work[i]);
+        } catch( const std::system_error & ) {
+            if( i == 0 ) {
+                throw;
+            }
+            /* Removed since we resolved it; the build will notice */
+            continue;
+        }
+        for( const IncludeDirective &directive : *directives ) {
+            if( directive.kind == IncludeDirective::MODULE_DECLARATION ) {
+                continue;
+            } else if( directive.kind == IncludeDirective::MODULE ) {
+                if( modules.insert(directive.name).second ) {
+                    result.modules.push_back(directive.name);
+                }
+            } else if( directive.computed ) {
+                result.complete = false;
+            } else {
+                PathRef path = resolve(directive, work[i], paths);
+                if( path.isEmpty() ) {
+                    if( missing.insert(directive.name).second ) {
+                        result.missing.push_back(directive.name);
+                    }
+                } else if( seen.insert(path).second ) {
+                    result.files.push_back(path);
+                    work.push_back(path);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+void IncludeScanner::reset() {
+    std::lock_guard<std::mutex> guard(lock);
+    byPath.clear();
+    for( auto it = byIdentity.begin(); it != byIdentity.end(); ) {
+        if( it->second.generation != generation ) {
+            it = byIdentity.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    generation++;
+}
+
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_INCLUDESCANNER_H
+#define FABR_SUPPORT_INCLUDESCANNER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "support/PathRef.h"
+
+namespace fabr {
+
+class Buffer;
+
+/**
+ * A dependency named by a C, C++ or Objective-C source file.
+ */
+struct IncludeDirective {
+    enum Kind {
+        INCLUDE,        /* #include */
+        INCLUDE_NEXT,   /* #include_next */
+        IMPORT,         /* #import (Objective-C) */
+        HEADER_UNIT,    /* import <header>; or import "header"; */
+        MODULE,         /* import name; (a named module or :partition) */
+        MODULE_DECLARATION  /* module name; or export module name; */
+    };
+    Kind kind;
+    /** Named in angle brackets rather than quotes */
+    bool angled = false;
+    /** Inside a conditional block (other than an include guard), so may not
+     *  actually be included */
+    bool conditional = false;
+    /** Named by a macro, so name is the unexpanded macro text */
+    bool computed = false;
+    /** Preceded by export (for imports and module declarations) */
+    bool exported = false;
+    std::string name;
+    uint32_t line = 0;
+};
+
+/**
+ * Directories to look for included files in, as given by -iquote, -I and
+ * -isystem.
+ */
+struct IncludePath {
+    /** Searched for quoted names only, after the including file's directory */
+    std::vector<PathRef> quote;
+    /** Searched for all names, in order */
+    std::vector<PathRef> search;
+};
+
+/**
+ * Finds the headers a source file depends on without running the
+ * preprocessor, so that dependencies are known before the first compile
+ * (when there's no depfile yet) and header units can be ordered.
+ *
+ * Files are lexed just enough to find directives at the start of lines,
+ * skipping comments and string literals; the byte search that drives this
+ * is vectorised (SSE2 or NEON), so scanning runs at close to memory speed.
+ * Conditionals aren't evaluated: everything inside them is assumed to be
+ * included (except for "#if 0" blocks), so the result is a superset of
+ * what the preprocessor would find. Includes named by macros can't be
+ * followed, and make the result incomplete.
+ *
+ * The directives found in each file are cached by its identity (device,
+ * inode, size and timestamps), across builds until a build passes without
+ * seeing that version (see reset()), and resolved against the include path
+ * through the current StatCache. Thread-safe.
+ *
+ * Module declarations are reported too (see ModuleDependencies), but not
+ * the global module fragment ("module;") or private fragment.
+ */
+class IncludeScanner {
+public:
+    typedef std::shared_ptr<const std::vector<IncludeDirective>> DirectiveList;
+
+    struct Dependencies {
+        /** Every file reached, excluding the source itself, in the order found */
+        std::vector<PathRef> files;
+        /** Names that couldn't be found on the include path */
+        std::vector<std::string> missing;
+        /** Named modules imported by any of the files */
+        std::vector<std::string> modules;
+        /** false if there were computed includes that couldn't be followed */
+        bool complete = true;
+    };
+
+private:
+    /**
+     * Identity of a version of a file, as per DigestCache.
+     */
+    struct FileKey {
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t size;
+        int64_t mtime;
+        int64_t ctime;
+
+        bool operator==( const FileKey &k ) const {
+            return dev == k.dev && ino == k.ino && size == k.size && mtime == k.mtime && ctime == k.ctime;
+        }
+    };
+    struct FileKeyHash {
+        size_t operator()( const FileKey &k ) const;
+    };
+    struct Entry {
+        DirectiveList directives;
+        /** The last generation (reset() interval) the entry was used in */
+        unsigned generation;
+    };
+
+    std::mutex lock;
+    /** Files scanned before, by identity, which survives reset() */
+    std::unordered_map<FileKey, Entry, FileKeyHash> byIdentity;
+    /** Files seen since the last reset() */
+    std::unordered_map<PathRef, DirectiveList> byPath;
+    unsigned generation = 0;
+
+    static IncludeScanner *current;
+
+public:
+    IncludeScanner() { }
+    IncludeScanner( const IncludeScanner & ) = delete;
+
+    /**
+     * @return the directives in the given file, in order.
+     * @throws system_error if the file can't be read.
+     */
+    DirectiveList getDirectives( PathRef file );
+
+    /**
+     * @return the file that the directive (in the file includer) refers to,
+     * or an empty path if it can't be found or isn't a file.
+     */
+    PathRef resolve( const IncludeDirective &directive, PathRef includer, const IncludePath &paths ) const;
+
+    /**
+     * Find everything the given source file includes, directly or
+     * indirectly.
+     * @throws system_error if the source can't be read.
+     */
+    Dependencies scan( PathRef source, const IncludePath &paths );
+
+    /**
+     * Forget which files have been scanned, but not what was found in them:
+     * files are remembered by identity (device, inode, size and
+     * timestamps), so unchanged ones needn't be read again. Versions not
+     * seen since the previous reset() are dropped. Call this between
+     * builds, as files may have changed.
+     */
+    void reset();
+
+    /**
+     * @return the directives in the given source text, in order.
+     */
+    static std::vector<IncludeDirective> scan( const char *data, size_t length );
+    static std::vector<IncludeDirective> scan( const Buffer &buffer );
+
+    /**
+     * @return the currently installed scanner, or nullptr if none.
+     */
+    static IncludeScanner *getCurrent() {
+        return current;
+    }
+
+    /**
+     * Installs a scanner as current for the lifetime of the Scope, for
+     * build rules to share. This should be done before any worker threads
+     * are started.
+     */
+    class Scope {
+    private:
+        IncludeScanner *previous;
+    public:
+        Scope( IncludeScanner &scanner ) : previous(current) {
+            current = &scanner;
+        }
+        ~Scope() {
+            current = previous;
+        }
+    };
+};
+
+}
+
+#endif /* !FABR_SUPPORT_INCLUDESCANNER_H */
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_JSON_H
+#define FABR_SUPPORT_JSON_H
+
+#include <string>
+#include <string_view>
+
+namespace fabr {
+
+/**
+ * Append str to out as a quoted JSON string. Bytes from 0x80 up are copied
+ * as-is, so UTF-8 input gives UTF-8 output.
+ */
+void appendJsonString( std::string &out, std::string_view str );
+
+}
+
+#endif /* !FABR_SUPPORT_JSON_H */
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Json.h"
+#include "support/Metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fabr {
+
+namespace {
+
+const char *const COUNTER_NAMES[Metrics::COUNTER_COUNT] = {
+    "fs.stat",
+    "fs.open",
+    "fs.read",
+    "fs.mmap",
+    "fs.bytes_read",
+    "fs.bytes_mapped",
+    "symbol.interned",
+    "symbol.arena_bytes",
+    "queue.queued",
+    "queue.dequeued",
+    "queue.completed",
+    "statcache.hits",
+    "statcache.misses",
+    "dircache.hits",
+    "dircache.misses",
+    "digestcache.hits",
+    "digestcache.misses",
+    "includescan.files",
+    "includescan.bytes",
+    "includecache.hits",
+    "includecache.misses",
+};
+
+const char *const HISTOGRAM_NAMES[Metrics::HISTOGRAM_COUNT] = {
+    "fs.read_size",
+    "exec.spawn_latency_us",
+};
+
+void add( std::atomic<uint64_t> &value, uint64_t amount ) {
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+struct ThreadHistogram {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> buckets[Metrics::BUCKETS] = {};
+};
+
+struct ThreadMetrics;
+
+/**
+ * All live threads' metrics, plus the totals of threads that have exited.
+ * Never destroyed, as threads may still be exiting during shutdown.
+ */
+struct Registry {
+    std::mutex lock;
+    std::vector<ThreadMetrics *> threads;
+    Metrics::Snapshot retired;
+
+    Registry() {
+        memset(&retired, 0, sizeof(retired));
+    }
+
+    static Registry &get() {
+        static Registry *registry = new Registry();
+        return *registry;
+    }
+};
+
+struct ThreadMetrics {
+    std::atomic<uint64_t> counters[Metrics::COUNTER_COUNT] = {};
+    ThreadHistogram histograms[Metrics::HISTOGRAM_COUNT];
+
+    ThreadMetrics() {
+        Registry &registry = Registry::get();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        registry.threads.push_back(this);
+    }
+
+    ~ThreadMetrics() {
+        Registry &registry = Registry::get();
+        std::lock_guard<std::mutex> guard(registry.lock);
+        addTo(registry.retired);
+        registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+    }
+
+    void addTo( Metrics::Snapshot &snapshot ) const {
+        for( unsigned i = 0; i < Metrics::COUNTER_COUNT; i++ ) {
+            snapshot.counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+        for( unsigned i = 0; i < Metrics::HISTOGRAM_COUNT; i++ ) {
+            Metrics::HistogramData &data = snapshot.histograms[i];
+            const ThreadHistogram &histogram = histograms[i];
+            data.count += histogram.count.load(std::memory_order_relaxed);
+            data.sum += histogram.sum.load(std::memory_order_relaxed);
+            for( unsigned b = 0; b < Metrics::BUCKETS; b++ ) {
+                data.buckets[b] += histogram.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+};
+
+thread_local ThreadMetrics threadMetrics;
+
+unsigned getBucket( uint64_t value ) {
+    return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+}
+
+void Metrics::add( Counter counter, uint64_t amount ) {
+    fabr::add(threadMetrics.counters[counter], amount);
+}
+
+void Metrics::record( Histogram histogram, uint64_t value ) {
+    ThreadHistogram &data = threadMetrics.histograms[histogram];
+    fabr::add(data.count, 1);
+    fabr::add(data.sum, value);
+    fabr::add(data.buckets[getBucket(value)], 1);
+}
+
+Metrics::Snapshot Metrics::snapshot() {
+    Registry &registry = Registry::get();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    Snapshot snapshot = registry.retired;
+    for( ThreadMetrics *thread : registry.threads ) {
+        thread->addTo(snapshot);
+    }
+    return snapshot;
+}
+
+Metrics::Snapshot Metrics::Snapshot::operator -( const Snapshot &earlier ) const {
+    Snapshot result;
+    for( unsigned i = 0; i < COUNTER_COUNT; i++ ) {
+        result.counters[i] = counters[i] - earlier.counters[i];
+    }
+    for( unsigned i = 0; i < HISTOGRAM_COUNT; i++ ) {
+        result.histograms[i].count = histograms[i].count - earlier.histograms[i].count;
+        result.histograms[i].sum = histograms[i].sum - earlier.histograms[i].sum;
+        for( unsigned b = 0; b < BUCKETS; b++ ) {
+            result.histograms[i].buckets[b] = histograms[i].buckets[b] - earlier.histograms[i].buckets[b];
+        }
+    }
+    return result;
+}
+
+uint64_t Metrics::HistogramData::getQuantile( double quantile ) const {
+    if( count == 0 ) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(quantile * (count - 1)) + 1;
+    uint64_t seen = 0;
+    for( unsigned b = 0; b < BUCKETS; b++ ) {
+        seen += buckets[b];
+        if( seen >= rank ) {
+            return b == 0 ? 0 : b == 64 ? UINT64_MAX : (1ull << b) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+const char *Metrics::getName( Counter counter ) {
+    return COUNTER_NAMES[counter];
+}
+
+const char *Metrics::getName( Histogram histogram ) {
+    return HISTOGRAM_NAMES[histogram];
+}
+
+void Metrics::writeText( std::ostream &out, const Snapshot &snapshot ) {
+    char line[160];
+    for( unsigned i = 0; i < COUNTER_COUNT; i++ ) {
+        snprintf(line, sizeof(line), "%-28s %14llu\n", COUNTER_NAMES[i],
+                 (unsigned long long)snapshot.counters[i]);
+        out << line;
+    }
+    for( unsigned i = 0; i < HISTOGRAM_COUNT; i++ ) {
+        const HistogramData &data = snapshot.histograms[i];
+        snprintf(line, sizeof(line), "%-28s %14llu  mean %llu  p50 %llu  p90 %llu  p99 %llu\n",
+                 HISTOGRAM_NAMES[i], (unsigned long long)data.count,
+                 (unsigned long long)(data.count == 0 ? 0 : data.sum / data.count),
+                 (unsigned long long)data.getQuantile(0.5), (unsigned long long)data.getQuantile(0.9),
+                 (unsigned long long)data.getQuantile(0.99));
+        out << line;
+    }
+}
+
+void Metrics::writeJson( std::ostream &out, const Snapshot &snapshot ) {
+    std::string json = "{";
+    char buf[128];
+    for( unsigned i = 0; i < COUNTER_COUNT; i++ ) {
+        json += i == 0 ? "\n  " : ",\n  ";
+        appendJsonString(json, COUNTER_NAMES[i]);
+        snprintf(buf, sizeof(buf), ": %llu", (unsigned long long)snapshot.counters[i]);
+        json += buf;
+    }
+    for( unsigned i = 0; i < HISTOGRAM_COUNT; i++ ) {
+        const HistogramData &data = snapshot.histograms[i];
+        json += ",\n  ";
+        appendJsonString(json, HISTOGRAM_NAMES[i]);
+        snprintf(buf, sizeof(buf), ": { \"count\": %llu, \"sum\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu }",
+                 (unsigned long long)data.count, (unsigned long long)data.sum,
+                 (unsigned long long)data.getQuantile(0.5), (unsigned long long)data.getQuantile(0.9),
+                 (unsigned long long)data.getQuantile(0.99));
+        json += buf;
+    }
+    json += "\n}\n";
+    out << json;
+}
+
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_METRICS_H
+#define FABR_SUPPORT_METRICS_H
+
+#include <stdint.h>
+
+#include <ostream>
+
+namespace fabr {
+
+/**
+ * Process-wide registry of counters and histograms for instrumenting the
+ * build system's own hot paths (reported by --stats).
+ *
+ * Each thread updates its own copy of every metric with relaxed atomic
+ * loads and stores (no read-modify-write, as there's only one writer), so
+ * recording costs about the same as a plain increment. snapshot() sums
+ * over all threads, including those that have exited.
+ */
+class Metrics {
+public:
+    enum Counter {
+        FS_STAT,            /* stat calls issued */
+        FS_OPEN,            /* files and directories opened */
+        FS_READ,            /* read calls issued */
+        FS_MMAP,            /* files mapped */
+        FS_BYTES_READ,
+        FS_BYTES_MAPPED,
+        SYMBOLS_INTERNED,
+        SYMBOL_ARENA_BYTES, /* bytes allocated for symbol storage */
+        QUEUE_QUEUED,       /* jobs added to a DependencyQueue */
+        QUEUE_DEQUEUED,
+        QUEUE_COMPLETED,
+        STATCACHE_HITS,
+        STATCACHE_MISSES,
+        DIRCACHE_HITS,
+        DIRCACHE_MISSES,
+        DIGESTCACHE_HITS,
+        DIGESTCACHE_MISSES,
+        INCLUDESCAN_FILES,  /* files scanned for includes */
+        INCLUDESCAN_BYTES,
+        INCLUDECACHE_HITS,  /* files whose includes were already known from their identity */
+        INCLUDECACHE_MISSES,
+        COUNTER_COUNT
+    };
+
+    enum Histogram {
+        FS_READ_SIZE,       /* size of files read into memory, in bytes */
+        SPAWN_LATENCY,      /* time from spawning a process to it running, in microseconds */
+        HISTOGRAM_COUNT
+    };
+
+    /**
+     * Histogram buckets are powers of two: bucket 0 counts zeros, and
+     * bucket i values in [2^(i-1), 2^i).
+     */
+    static const unsigned BUCKETS = 65;
+
+    struct HistogramData {
+        uint64_t count;
+        uint64_t sum;
+        uint64_t buckets[BUCKETS];
+
+        /**
+         * @return an upper bound on the given quantile (0-1) of the
+         * recorded values.
+         */
+        uint64_t getQuantile( double quantile ) const;
+    };
+
+    struct Snapshot {
+        uint64_t counters[COUNTER_COUNT];
+        HistogramData histograms[HISTOGRAM_COUNT];
+
+        /**
+         * @return the change from an earlier snapshot.
+         */
+        Snapshot operator -( const Snapshot &earlier ) const;
+    };
+
+    static void add( Counter counter, uint64_t amount = 1 );
+    static void record( Histogram histogram, uint64_t value );
+
+    static Snapshot snapshot();
+
+    static const char *getName( Counter counter );
+    static const char *getName( Histogram histogram );
+
+    /**
+     * Write the snapshot as an aligned table, or as a JSON object mapping
+     * metric names to values (histograms to their count, sum and
+     * quantiles).
+     */
+    static void writeText( std::ostream &out, const Snapshot &snapshot );
+    static void writeJson( std::ostream &out, const Snapshot &snapshot );
+};
+
+}
+
+#endif /* !FABR_SUPPORT_METRICS_H */
@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Json.h"
+#include "support/ModuleDependencies.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+
+#include <utility>
+
+/* Deepest nesting accepted in a P1689 document; the format only needs 4 */
+#define JSON_MAX_DEPTH 32
+
+namespace fabr {
+
+namespace {
+
+const char *getLookupMethodName( ModuleDependencies::LookupMethod method ) {
+    switch( method ) {
+    case ModuleDependencies::INCLUDE_ANGLE: return "include-angle";
+    case ModuleDependencies::INCLUDE_QUOTE: return "include-quote";
+    default: return "by-name";
+    }
+}
+
+/**
+ * Just enough of JSON to read P1689.
+ */
+struct JsonValue {
+    enum Type { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+    Type type = NUL;
+    bool boolean = false;
+    double number = 0;
+    std::string string;
+    std::vector<JsonValue> array;
+    std::vector<std::pair<std::string, JsonValue>> object;
+
+    const JsonValue *get( std::string_view key ) const {
+        for( auto &member : object ) {
+            if( member.first == key ) {
+                return &member.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class JsonParser {
+private:
+    const char *p;
+    const char *end;
+
+    void skipSpace() {
+        while( p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') ) {
+            p++;
+        }
+    }
+
+    bool expect( char c ) {
+        skipSpace();
+        if( p < end && *p == c ) {
+            p++;
+            return true;
+        }
+        return fail(std::string("expected '") + c + "'");
+    }
+
+    bool literal( std::string_view word ) {
+        if( (size_t)(end - p) >= word.size() && std::string_view(p, word.size()) == word ) {
+            p += word.size();
+            return true;
+        }
+        return fail("invalid literal");
+    }
+
+    void appendUtf8( std::string &out, unsigned code ) {
+        if( code < 0x80 ) {
+            out += (char)code;
+        } else if( code < 0x800 ) {
+            out += (char)(0xc0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3f));
+        } else if( code < 0x10000 ) {
+            out += (char)(0xe0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3f));
+            out += (char)(0x80 | (code & 0x3f));
+        } else {
+            out += (char)(0xf0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3f));
+            out += (char)(0x80 | ((code >> 6) & 0x3f));
+            out += (char)(0x80 | (code & 0x3f));
+        }
+    }
+
+    bool hex4( unsigned &code ) {
+        if( end - p < 4 ) {
+            return fail("truncated escape");
+        }
+        code = 0;
+        for( int i = 0; i < 4; i++ ) {
+            char c = *p++;
+            code <<= 4;
+            if( c >= '0' && c <= '9' ) {
+                code |= c - '0';
+            } else if( c >= 'a' && c <= 'f' ) {
+                code |= c - 'a' + 10;
+            } else if( c >= 'A' && c <= 'F' ) {
+                code |= c - 'A' + 10;
+            } else {
+                return fail("invalid escape");
+            }
+        }
+        return true;
+    }
+
+    bool parseString( std::string &out ) {
+        if( !expect('"') ) {
+            return false;
+        }
+        while( p < end && *p != '"' ) {
+            if( *p != '\\' ) {
+                out += *p++;
+                continue;
+            }
+            if( ++p == end ) {
+                break;
+            }
+            char c = *p++;
+            switch( c ) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned code, low;
+                if( !hex4(code) ) {
+                    return false;
+                }
+                if( code >= 0xd800 && code < 0xdc00 ) {
+                    /* Must be followed by the low half of the pair */
+                    if( end - p < 2 || p[0] != '\\' || p[1] != 'u' ) {
+                        return fail("unpaired surrogate in string");
+                    }
+                    p += 2;
+                    if( !hex4(low) ) {
+                        return false;
+                    }
+                    if( low < 0xdc00 || low >= 0xe000 ) {
+                        return fail("unpaired surrogate in string");
+                    }
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                } else if( code >= 0xdc00 && code < 0xe000 ) {
+                    return fail("unpaired surrogate in string");
+                }
+                appendUtf8(out, code);
+                break;
+            }
+            default:
+                out += c;
+            }
+        }
+        if( p == end ) {
+            return fail("unterminated string");
+        }
+        p++;
+        return true;
+    }
+
+public:
+    std::string error;
+
+    JsonParser( std::string_view json ) : p(json.data()), end(json.data() + json.size()) { }
+
+    bool fail( const std::string &message ) {
+        if( error.empty() ) {
+            error = message;
+        }
+        return false;
+    }
+
+    bool parse( JsonValue &value, unsigned depth = 0 ) {
+        if( depth > JSON_MAX_DEPTH ) {
+            return fail("nested too deeply");
+        }
+        skipSpace();
+        if( p == end ) {
+            return fail("unexpected end of input");
+        }
+        switch( *p ) {
+        case '{':
+            p++;
+            value.type = JsonValue::OBJECT;
+            skipSpace();
+            if( p < end && *p == '}' ) {
+                p++;
+                return true;
+            }
+            do {
+                value.object.emplace_back();
+                if( !parseString(value.object.back().first) || !expect(':') ||
+                        !parse(value.object.back().second, depth + 1) ) {
+                    return false;
+                }
+                skipSpace();
+            } while( p < end && *p == ',' && ++p );
+            return expect('}');
+        case '[':
+            p++;
+            value.type = JsonValue::ARRAY;
+            skipSpace();
+            if( p < end && *p == ']' ) {
+                p++;
+                return true;
+            }
+            do {
+                value.array.emplace_back();
+                if( !parse(value.array.back(), depth + 1) ) {
+                    return false;
+                }
+                skipSpace();
+            } while( p < end && *p == ',' && ++p );
+            return expect(']');
+        case '"':
+            value.type = JsonValue::STRING;
+            return parseString(value.string);
+        case 't':
+            value.type = JsonValue::BOOLEAN;
+            value.boolean = true;
+            return literal("true");
+        case 'f':
+            value.type = JsonValue::BOOLEAN;
+            return literal("false");
+        case 'n':
+            return literal("null");
+        default: {
+            std::string number;
+            while( p < end && (isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.' ||
+                               *p == 'e' || *p == 'E') ) {
+                number += *p++;
+            }
+            char *numberEnd;
+            value.type = JsonValue::NUMBER;
+            value.number = strtod(number.c_str(), &numberEnd);
+            return (number.empty() || *numberEnd != '\0') ? fail("invalid value") : true;
+        }
+        }
+    }
+
+    bool atEnd() {
+        skipSpace();
+        return p == end;
+    }
+};
+
+/**
+ * @return the string member of the object with the given key, or an empty
+ * string if there isn't one.
+ */
+std::string getString( const JsonValue &object, std::string_view key ) {
+    const JsonValue *value = object.get(key);
+    return value != nullptr && value->type == JsonValue::STRING ? value->string : std::string();
+}
+
+}
+
+ModuleDependencies ModuleDependencies::fromDirectives( const std::vector<IncludeDirective> &directives,
+                                                       const std::string &sourcePath ) {
+    ModuleDependencies result;
+    std::string module;
+    for( const IncludeDirective &directive : directives ) {
+        if( directive.kind != IncludeDirective::MODULE_DECLARATION || !module.empty() ) {
+            continue;
+        }
+        size_t colon = directive.name.find(':');
+        module = directive.name.substr(0, colon);
+        if( colon != std::string::npos || directive.exported ) {
+            result.provided.push_back(Provided{directive.name, sourcePath, directive.exported});
+        } else {
+            /* An implementation unit implicitly imports its interface */
+            result.required.push_back(Required{module, std::string(), BY_NAME});
+        }
+    }
+
+    for( const IncludeDirective &directive : directives ) {
+        Required required;
+        if( directive.kind == IncludeDirective::MODULE ) {
+            required.logicalName = directive.name[0] == ':' ? module + directive.name : directive.name;
+        } else if( directive.kind == IncludeDirective::HEADER_UNIT ) {
+            required.logicalName = directive.name;
+            required.lookupMethod = directive.angled ? INCLUDE_ANGLE : INCLUDE_QUOTE;
+        } else {
+            continue;
+        }
+        bool seen = false;
+        for( const Required &existing : result.required ) {
+            seen = seen || existing.logicalName == required.logicalName;
+        }
+        if( !seen ) {
+            result.required.push_back(std::move(required));
+        }
+    }
+    return result;
+}
+
+ModuleDependencies ModuleDependencies::scan( IncludeScanner &scanner, PathRef source ) {
+    return fromDirectives(*scanner.getDirectives(source), source.str());
+}
+
+void ModuleDependencies::writeP1689( std::ostream &out, const std::vector<ModuleDependencies> &rules ) {
+    std::string json = "{\n  \"version\": 1,\n  \"revision\": 0,\n  \"rules\": [";
+    for( size_t i = 0; i < rules.size(); i++ ) {
+        const ModuleDependencies &rule = rules[i];
+        json += i == 0 ? "\n    {" : ",\n    {";
+        const char *separator = "\n";
+        if( !rule.primaryOutput.empty() ) {
+            json += "\n      \"primary-output\": ";
+            appendJsonString(json, rule.primaryOutput);
+            separator = ",\n";
+        }
+        if( !rule.provided.empty() ) {
+            json += separator;
+            json += "      \"provides\": [";
+            for( size_t j = 0; j < rule.provided.size(); j++ ) {
+                const Provided &provided = rule.provided[j];
+                json += j == 0 ? "\n        { \"logical-name\": " : ",\n        { \"logical-name\": ";
+                appendJsonString(json, provided.logicalName);
+                json += ", \"is-interface\": ";
+                json += provided.isInterface ? "true" : "false";
+                if( !provided.sourcePath.empty() ) {
+                    json += ", \"source-path\": ";
+                    appendJsonString(json, provided.sourcePath);
+                }
+                json += " }";
+            }
+            json += "\n      ]";
+            separator = ",\n";
+        }
+        if( !rule.required.empty() ) {
+            json += separator;
+            json += "      \"requires\": [";
+            for( size_t j = 0; j < rule.required.size(); j++ ) {
+                const Required &required = rule.required[j];
+                json += j == 0 ? "\n        { \"logical-name\": " : ",\n        { \"logical-name\": ";
+                appendJsonString(json, required.logicalName);
+                if( required.lookupMethod != BY_NAME ) {
+                    json += ", \"lookup-method\": \"";
+                    json += getLookupMethodName(required.lookupMethod);
+                    json += "\"";
+                }
+                if( !required.sourcePath.empty() ) {
+                    json += ", \"source-path\": ";
+                    appendJsonString(json, required.sourcePath);
+                }
+                json += " }";
+            }
+            json += "\n      ]";
+        }
+        json += "\n    }";
+    }
+    json += rules.empty() ? "]\n}\n" : "\n  ]\n}\n";
+    out << json;
+}
+
+bool ModuleDependencies::readP1689( std::string_view json, std::vector<ModuleDependencies> &rules,
+                                    std::string &error ) {
+    JsonParser parser(json);
+    JsonValue document;
+    if( !parser.parse(document) || !parser.atEnd() ) {
+        error = parser.error.empty() ? "trailing garbage" : parser.error;
+        return false;
+    }
+    const JsonValue *version = document.get("version");
+    const JsonValue *list = document.get("rules");
+    if( document.type != JsonValue::OBJECT || version == nullptr || version->type != JsonValue::NUMBER ||
+            version->number != 1 || list == nullptr || list->type != JsonValue::ARRAY ) {
+        error = "not a P1689 version 1 document";
+        return false;
+    }
+
+    for( const JsonValue &entry : list->array ) {
+        if( entry.type != JsonValue::OBJECT ) {
+            error = "rule is not an object";
+            return false;
+        }
+        ModuleDependencies rule;
+        rule.primaryOutput = getString(entry, "primary-output");
+        if( const JsonValue *providedList = entry.get("provides") ) {
+            if( providedList->type != JsonValue::ARRAY ) {
+                error = "provides is not an array";
+                return false;
+            }
+            for( const JsonValue &item : providedList->array ) {
+                if( item.type != JsonValue::OBJECT ) {
+                    error = "provided module is not an object";
+                    return false;
+                }
+                Provided provided;
+                provided.logicalName = getString(item, "logical-name");
+                provided.sourcePath = getString(item, "source-path");
+                const JsonValue *isInterface = item.get("is-interface");
+                if( isInterface != nullptr && isInterface->type != JsonValue::BOOLEAN ) {
+                    error = "is-interface is not a boolean";
+                    return false;
+                }
+                provided.isInterface = isInterface == nullptr || isInterface->boolean;
+                if( provided.logicalName.empty() ) {
+                    error = "provided module has no logical-name";
+                    return false;
+                }
+                rule.provided.push_back(std::move(provided));
+            }
+        }
+        if( const JsonValue *requiredList = entry.get("requires") ) {
+            if( requiredList->type != JsonValue::ARRAY ) {
+                error = "requires is not an array";
+                return false;
+            }
+            for( const JsonValue &item : requiredList->array ) {
+                if( item.type != JsonValue::OBJECT ) {
+                    error = "required module is not an object";
+                    return false;
+                }
+                Required required;
+                required.logicalName = getString(item, "logical-name");
+                required.sourcePath = getString(item, "source-path");
+                std::string method = getString(item, "lookup-method");
+                required.lookupMethod = method == "include-angle" ? INCLUDE_ANGLE :
+                                        method == "include-quote" ? INCLUDE_QUOTE : BY_NAME;
+                if( required.logicalName.empty() ) {
+                    error = "required module has no logical-name";
+                    return false;
+                }
+                rule.required.push_back(std::move(required));
+            }
+        }
+        rules.push_back(std::move(rule));
+    }
+    return true;
+}
+
+}
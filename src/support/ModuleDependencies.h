@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_MODULEDEPENDENCIES_H
+#define FABR_SUPPORT_MODULEDEPENDENCIES_H
+
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "support/IncludeScanner.h"
+
+namespace fabr {
+
+/**
+ * The C++20 modules that a translation unit provides and requires, which
+ * determine the order units have to be compiled in: a module's interface
+ * must be compiled (producing its BMI) before anything that imports it.
+ *
+ * This is one "rule" of the P1689 format that compilers' dependency scan
+ * modes produce (clang-scan-deps -format=p1689, gcc -fdeps-format=p1689r5),
+ * and can be read from or written to it. It can also be derived from the
+ * directives found by IncludeScanner, which avoids running the compiler.
+ */
+struct ModuleDependencies {
+    enum LookupMethod { BY_NAME, INCLUDE_ANGLE, INCLUDE_QUOTE };
+
+    struct Provided {
+        /** Module name, with ":partition" if it's a partition */
+        std::string logicalName;
+        /** Source file, if known */
+        std::string sourcePath;
+        /** Exported (an interface unit), rather than an implementation partition */
+        bool isInterface = true;
+    };
+
+    struct Required {
+        /** Module name (with ":partition"), or header name for a header unit */
+        std::string logicalName;
+        /** Header file for a header unit, if resolved */
+        std::string sourcePath;
+        LookupMethod lookupMethod = BY_NAME;
+    };
+
+    /** Main output of compiling the unit (usually the object file) */
+    std::string primaryOutput;
+    std::vector<Provided> provided;
+    std::vector<Required> required;
+
+    /**
+     * @return true if the unit provides a module, and so produces a BMI.
+     */
+    bool isModuleUnit() const {
+        return !provided.empty();
+    }
+
+    /**
+     * @return the module dependencies declared by the directives of a
+     * source file. Partitions are qualified by the unit's module name, and
+     * an implementation unit requires its module's interface.
+     */
+    static ModuleDependencies fromDirectives( const std::vector<IncludeDirective> &directives,
+                                              const std::string &sourcePath = std::string() );
+
+    /**
+     * @return the module dependencies of the given source file, found with
+     * the scanner.
+     * @throws system_error if the source can't be read.
+     */
+    static ModuleDependencies scan( IncludeScanner &scanner, PathRef source );
+
+    /**
+     * Write the given rules out as a P1689 document.
+     */
+    static void writeP1689( std::ostream &out, const std::vector<ModuleDependencies> &rules );
+
+    /**
+     * Parse a P1689 document, appending its rules to rules.
+     * @return false, with a description in error, if it's malformed.
+     */
+    static bool readP1689( std::string_view json, std::vector<ModuleDependencies> &rules, std::string &error );
+};
+
+}
+
+#endif /* !FABR_SUPPORT_MODULEDEPENDENCIES_H */
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/BuildTimeline.h"
+#include "support/ModuleScheduler.h"
+
+namespace fabr {
+
+void ModuleScheduler::setTimeline( BuildTimeline *timeline ) {
+    queue.setTimeline(timeline, [this]( const Task &task ) {
+        static const char *const KIND_NAMES[] = { "scan ", "precompile ", "compile " };
+        return KIND_NAMES[task.kind] + units[task.unit].source;
+    });
+}
+
+unsigned ModuleScheduler::addUnit( const std::string &source ) {
+    unsigned unit = units.size();
+    units.emplace_back();
+    units.back().source = source;
+    unscanned.insert(unit);
+
+    Task scan = { Task::SCAN, unit };
+    queue.queueJob(scan);
+    queue.queueJob(Task{ Task::COMPILE, unit }, &scan, &scan + 1);
+    return unit;
+}
+
+ModuleScheduler::Task ModuleScheduler::getImporter( unsigned unit ) const {
+    return Task{ units[unit].dependencies.isModuleUnit() ? Task::PRECOMPILE : Task::COMPILE, unit };
+}
+
+void ModuleScheduler::placeImports( const Task &task ) {
+    bool unknown = false;
+    for( const ModuleDependencies::Required &required : units[task.unit].dependencies.required ) {
+        if( required.lookupMethod != ModuleDependencies::BY_NAME ) {
+            /* Header units are handled like headers for now */
+            continue;
+        }
+        auto provider = providers.find(required.logicalName);
+        if( provider == providers.end() ) {
+            unknown = true;
+        } else if( provider->second != task.unit ) {
+            /* Nothing to wait for if the BMI has already been built */
+            queue.addDependency(task, Task{ Task::PRECOMPILE, provider->second });
+        }
+    }
+    if( !unknown ) {
+        return;
+    }
+
+    if( unscanned.empty() ) {
+        /* Everything's been scanned, so nothing provides it */
+        for( const ModuleDependencies::Required &required : units[task.unit].dependencies.required ) {
+            if( required.lookupMethod == ModuleDependencies::BY_NAME &&
+                    providers.find(required.logicalName) == providers.end() ) {
+                errors.push_back(units[task.unit].source + ": no unit provides module '" +
+                                 required.logicalName + "'");
+            }
+        }
+    } else {
+        /* Wait for some unit that may turn out to provide it, and look again
+         * once that's been scanned.
+         */
+        unsigned blocker = *unscanned.begin();
+        queue.addDependency(task, Task{ Task::SCAN, blocker });
+        held[blocker].push_back(task);
+    }
+}
+
+void ModuleScheduler::scanned( unsigned unit, const ModuleDependencies &dependencies ) {
+    Unit &entry = units[unit];
+    entry.dependencies = dependencies;
+    entry.scanned = true;
+    unscanned.erase(unit);
+
+    for( const ModuleDependencies::Provided &provided : dependencies.provided ) {
+        auto result = providers.emplace(provided.logicalName, unit);
+        if( !result.second ) {
+            errors.push_back(entry.source + ": module '" + provided.logicalName + "' is also provided by " +
+                             units[result.first->second].source);
+        }
+    }
+    Task compile = { Task::COMPILE, unit };
+    if( dependencies.isModuleUnit() ) {
+        Task precompile = { Task::PRECOMPILE, unit };
+        queue.queueJob(precompile);
+        queue.addDependency(compile, precompile);
+    }
+    placeImports(getImporter(unit));
+
+    /* Anything held back for this unit can be placed now, or held back
+     * behind another.
+     */
+    auto it = held.find(unit);
+    if( it != held.end() ) {
+        std::vector<Task> tasks = std::move(it->second);
+        held.erase(it);
+        for( const Task &task : tasks ) {
+            placeImports(task);
+        }
+    }
+
+    queue.jobCompleted(Task{ Task::SCAN, unit });
+}
+
+}
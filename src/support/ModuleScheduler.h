@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_MODULESCHEDULER_H
+#define FABR_SUPPORT_MODULESCHEDULER_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "support/DependencyQueue.h"
+#include "support/ModuleDependencies.h"
+
+namespace fabr {
+
+class BuildTimeline;
+
+/**
+ * Orders the compilation of a set of C++ translation units that may
+ * provide and import modules. Which units depend on which is only known
+ * once they've been scanned, so each unit starts with a SCAN task, and the
+ * edges between the others are added to the queue as the scan results
+ * arrive.
+ *
+ * A unit that provides a module gets a PRECOMPILE task, producing its BMI,
+ * as well as its COMPILE task (which generates code from the BMI). Units
+ * importing the module only wait for the PRECOMPILE, so they compile in
+ * parallel with the provider's code generation. A unit whose imports can't
+ * all be placed yet (their providers haven't been scanned) is held back
+ * behind an outstanding scan, and checked again when that scan completes.
+ *
+ * Typical use: addUnit() every source; then repeatedly dequeue() runnable
+ * tasks, run them, and report them with scanned() (for SCAN) or
+ * completed(), until isFinished(). If isStalled(), the imports are cyclic.
+ * Not thread-safe, like DependencyQueue.
+ */
+class ModuleScheduler {
+public:
+    struct Task {
+        enum Kind { SCAN, PRECOMPILE, COMPILE };
+        Kind kind;
+        unsigned unit;
+
+        bool operator <( const Task &t ) const {
+            return unit < t.unit || (unit == t.unit && kind < t.kind);
+        }
+        bool operator ==( const Task &t ) const {
+            return unit == t.unit && kind == t.kind;
+        }
+    };
+
+private:
+    struct Unit {
+        std::string source;
+        ModuleDependencies dependencies;
+        bool scanned = false;
+    };
+
+    std::vector<Unit> units;
+    DependencyQueue<Task> queue;
+    /** Units not scanned yet */
+    std::set<unsigned> unscanned;
+    /** Unit providing each module, as far as we know so far */
+    std::unordered_map<std::string, unsigned> providers;
+    /** Tasks held back until the given unit has been scanned */
+    std::unordered_map<unsigned, std::vector<Task>> held;
+    std::vector<std::string> errors;
+
+    /**
+     * @return the task of the unit that needs the BMIs it imports.
+     */
+    Task getImporter( unsigned unit ) const;
+
+    /**
+     * Make the task wait for the providers of everything its unit imports,
+     * or hold it back if some aren't known yet.
+     */
+    void placeImports( const Task &task );
+
+public:
+    ModuleScheduler() { }
+    ModuleScheduler( const ModuleScheduler & ) = delete;
+
+    /**
+     * Record the timing of the tasks in the given timeline.
+     */
+    void setTimeline( BuildTimeline *timeline );
+
+    /**
+     * Add a translation unit to be scanned and compiled.
+     * @return the unit's number.
+     */
+    unsigned addUnit( const std::string &source );
+
+    const std::string &getSource( unsigned unit ) const {
+        return units[unit].source;
+    }
+    const ModuleDependencies &getDependencies( unsigned unit ) const {
+        return units[unit].dependencies;
+    }
+
+    bool hasRunnable() const {
+        return queue.hasRunnable();
+    }
+
+    /**
+     * Remove a runnable task from the queue. hasRunnable() should be
+     * checked first.
+     */
+    Task dequeue() {
+        return queue.dequeueJob();
+    }
+
+    /**
+     * Report that a unit's SCAN task has completed, with what it found.
+     */
+    void scanned( unsigned unit, const ModuleDependencies &dependencies );
+
+    /**
+     * Report that a PRECOMPILE or COMPILE task has completed.
+     */
+    void completed( const Task &task ) {
+        queue.jobCompleted(task);
+    }
+
+    /**
+     * @return true once every task has completed.
+     */
+    bool isFinished() const {
+        return queue.empty();
+    }
+
+    /**
+     * @return true if tasks remain but none can run, and none are running
+     * to change that: the units import each other in a cycle.
+     */
+    bool isStalled() const {
+        return !queue.empty() && !queue.hasRunnable() && queue.getRunningCount() == 0;
+    }
+
+    /**
+     * @return problems found in the scan results (modules provided more
+     * than once, or not at all).
+     */
+    const std::vector<std::string> &getErrors() const {
+        return errors;
+    }
+};
+
+}
+
+#endif /* !FABR_SUPPORT_MODULESCHEDULER_H */
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/DirCache.h"
+#include "support/OutputFile.h"
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <system_error>
+#include <vector>
+
+#if defined(__linux__)
+#include <linux/fs.h>
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 27)
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+
+/* Buffer size for the fallback copy */
+#define COPY_BUFFER_SIZE (1024*1024)
+
+/* Largest single copy_file_range request */
+#define COPY_CHUNK_SIZE (1024*1024*1024)
+
+namespace fabr {
+
+/**
+ * @return a name in the same directory as target, that won't clash with
+ * anything else we create.
+ */
+static std::string getTempName( PathRef target ) {
+    static std::atomic<unsigned> counter(0);
+    std::string name(".");
+    name += target.basename().data();
+    name += ".tmp.";
+    name += std::to_string(::getpid());
+    name += ".";
+    name += std::to_string(counter++);
+    return name;
+}
+
+/**
+ * Run fn with a directory fd for dir (which may be AT_FDCWD), keeping the
+ * handle alive for the duration.
+ */
+template<typename Fn>
+static int withDirectory( PathRef dir, Fn fn ) {
+    std::shared_ptr<DirCache::Handle> handle = DirCache::get().getDirectory(dir);
+    if( handle == nullptr && errno != 0 ) {
+        return -1;
+    }
+    return fn(handle == nullptr ? AT_FDCWD : handle->getFd());
+}
+
+OutputFile::OutputFile( const Path &path, mode_t mode ) : target(path) {
+    if( !target.hasComponents() ) {
+        throw std::system_error(EINVAL, std::system_category());
+    }
+    PathRef dir = target.parent();
+    int fd = -1;
+#ifdef O_TMPFILE
+    fd = ::open(dir.isEmpty() ? "." : dir.str().c_str(), O_TMPFILE|O_WRONLY|O_CLOEXEC, mode);
+    if( fd == -1 && errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL ) {
+        /* Genuine error, rather than lack of support */
+        throw std::system_error(errno, std::system_category());
+    }
+#endif
+    if( fd == -1 ) {
+        tmpName = getTempName(target);
+        fd = withDirectory(dir, [&]( int dirfd ) {
+            return ::openat(dirfd, tmpName.c_str(), O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, mode);
+        });
+        if( fd == -1 ) {
+            throw std::system_error(errno, std::system_category());
+        }
+    }
+    file = File(fd);
+}
+
+OutputFile::~OutputFile() {
+    if( !committed && !tmpName.empty() ) {
+        withDirectory(target.parent(), [&]( int dirfd ) {
+            return ::unlinkat(dirfd, tmpName.c_str(), 0);
+        });
+    }
+}
+
+void OutputFile::write( const char *data, size_t length ) {
+    while( length > 0 ) {
+        size_t n = file.write((char *)data, length);
+        data += n;
+        length -= n;
+    }
+}
+
+void OutputFile::commit() {
+    int status = withDirectory(target.parent(), [&]( int dirfd ) {
+        if( tmpName.empty() ) {
+            /* Give the anonymous file a temporary name. linkat can't replace
+             * an existing file, so the final step is always a rename.
+             */
+            std::string name = getTempName(target);
+            int result = -1;
+#ifdef AT_EMPTY_PATH
+            /* Needs CAP_DAC_READ_SEARCH, so usually fails for ordinary users */
+            result = ::linkat(file.getFd(), "", dirfd, name.c_str(), AT_EMPTY_PATH);
+#endif
+            if( result == -1 ) {
+                char procPath[64];
+                snprintf(procPath, sizeof(procPath), "/proc/self/fd/%d", file.getFd());
+                result = ::linkat(AT_FDCWD, procPath, dirfd, name.c_str(), AT_SYMLINK_FOLLOW);
+            }
+            if( result == -1 ) {
+                return -1;
+            }
+            tmpName = name;
+        }
+        return ::renameat(dirfd, tmpName.c_str(), dirfd, target.basename().data());
+    });
+    if( status == -1 ) {
+        throw std::system_error(errno, std::system_category());
+    }
+    committed = true;
+    file = File();
+}
+
+CopyMethod copyData( File &from, File &to, size_t length ) {
+#ifdef FICLONE
+    /* FICLONE always clones the whole source, so it's only right when
+     * that's what was asked for; otherwise clone just the range (which
+     * filesystems generally only allow block-aligned, except at EOF). Note
+     * a zero length means "to EOF" to FICLONERANGE.
+     */
+    struct stat st;
+    if( length > 0 && ::fstat(from.getFd(), &st) == 0 ) {
+        if( (size_t)st.st_size == length ) {
+            if( ::ioctl(to.getFd(), FICLONE, from.getFd()) == 0 ) {
+                return CopyMethod::CLONE;
+            }
+        } else if( (size_t)st.st_size > length ) {
+            struct file_clone_range range = { from.getFd(), 0, length, 0 };
+            if( ::ioctl(to.getFd(), FICLONERANGE, &range) == 0 ) {
+                return CopyMethod::CLONE;
+            }
+        }
+    }
+#endif
+
+    CopyMethod method = CopyMethod::BUFFERED;
+    off_t offset = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+    while( (size_t)offset < length ) {
+        off_t inOffset = offset, outOffset = offset;
+        size_t chunk = std::min(length - offset, (size_t)COPY_CHUNK_SIZE);
+        ssize_t n = ::copy_file_range(from.getFd(), &inOffset, to.getFd(), &outOffset, chunk, 0);
+        if( n == -1 ) {
+            if( errno == EINTR ) {
+                continue;
+            } else if( offset == 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                    errno == EOPNOTSUPP || errno == EBADF) ) {
+                /* Not supported for this pair of files, so fall back */
+                break;
+            }
+            throw std::system_error(errno, std::system_category());
+        } else if( n == 0 ) {
+            /* Some filesystems report EOF rather than an error; finish off
+             * with the buffered copy */
+            break;
+        }
+        offset += n;
+        method = CopyMethod::KERNEL;
+    }
+#endif
+
+    if( (size_t)offset < length ) {
+        std::vector<char> buffer(std::min(length - offset, (size_t)COPY_BUFFER_SIZE));
+        while( (size_t)offset < length ) {
+            ssize_t n = ::pread(from.getFd(), buffer.data(), std::min(buffer.size(), length - offset), offset);
+            if( n == -1 && errno == EINTR ) {
+                continue;
+            } else if( n == -1 ) {
+                throw std::system_error(errno, std::system_category());
+            } else if( n == 0 ) {
+                /* Source was truncated underneath us */
+                throw std::system_error(EIO, std::system_category());
+            }
+            for( ssize_t done = 0; done < n; ) {
+                ssize_t written = ::pwrite(to.getFd(), buffer.data() + done, n - done, offset + done);
+                if( written == -1 && errno != EINTR ) {
+                    throw std::system_error(errno, std::system_category());
+                }
+                done += written == -1 ? 0 : written;
+            }
+            offset += n;
+        }
+        method = CopyMethod::BUFFERED;
+    }
+    return method;
+}
+
+CopyMethod copyFile( const Path &from, const Path &to ) {
+    File source = File::getForRead(from.str());
+    struct stat st;
+    if( ::fstat(source.getFd(), &st) == -1 ) {
+        throw std::system_error(errno, std::system_category());
+    }
+    OutputFile output(to, st.st_mode & 07777);
+    /* The mode was subject to umask, so set it explicitly */
+    ::fchmod(output.getFile().getFd(), st.st_mode & 07777);
+    CopyMethod method = copyData(source, output.getFile(), st.st_size);
+    output.commit();
+    return method;
+}
+
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_OUTPUTFILE_H
+#define FABR_SUPPORT_OUTPUTFILE_H
+
+#include <sys/types.h>
+
+#include <string>
+
+#include "support/File.h"
+#include "support/Path.h"
+#include "support/PathRef.h"
+
+namespace fabr {
+
+/**
+ * A file being written as a build output. The content is written to an
+ * anonymous file (O_TMPFILE) in the target's directory, or a hidden
+ * temporary name where that isn't supported, and only appears at the target
+ * path when commit() is called, atomically replacing anything already
+ * there. If the OutputFile is destroyed without being committed, nothing is
+ * left behind (other than a temporary name after a crash, on systems
+ * without O_TMPFILE).
+ */
+class OutputFile {
+private:
+    File file;
+    PathRef target;
+    /** Temporary name in the target directory, if not anonymous */
+    std::string tmpName;
+    bool committed = false;
+
+public:
+    /**
+     * Start writing a new file to replace target.
+     * @param mode permission bits for the new file (subject to umask).
+     * @throws system_error if the file can't be created.
+     */
+    OutputFile( const Path &target, mode_t mode = 0666 );
+    ~OutputFile();
+    OutputFile( const OutputFile & ) = delete;
+
+    File &getFile() {
+        return file;
+    }
+
+    /**
+     * Write all of the given data to the file.
+     * @throws system_error if the write fails.
+     */
+    void write( const char *data, size_t length );
+
+    /**
+     * Publish the file at the target path, replacing any existing file.
+     * @throws system_error if the operation fails.
+     */
+    void commit();
+
+    /**
+     * @return true if the file is being written anonymously (O_TMPFILE).
+     */
+    bool isAnonymous() const {
+        return tmpName.empty();
+    }
+};
+
+/**
+ * How copyFile() ended up copying the data.
+ */
+enum class CopyMethod {
+    /** Shared extents (reflink), no data copied */
+    CLONE,
+    /** In-kernel copy (copy_file_range) */
+    KERNEL,
+    /** Read and written through a userspace buffer */
+    BUFFERED
+};
+
+/**
+ * Copy length bytes from the start of from to the start of to, using the
+ * cheapest method the filesystems support: cloning the extents, then an
+ * in-kernel copy, then a buffered copy.
+ * @throws system_error if the copy fails.
+ */
+CopyMethod copyData( File &from, File &to, size_t length );
+
+/**
+ * Copy the file from to the path to (atomically replacing any existing
+ * file), preserving its permissions.
+ * @throws system_error if the copy fails.
+ */
+CopyMethod copyFile( const Path &from, const Path &to );
+
+}
+
+#endif /* !FABR_SUPPORT_OUTPUTFILE_H */
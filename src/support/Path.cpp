@@ -15,7 +15,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include "support/DirCache.h"
 #include "support/Path.h"
+#include "support/StatCache.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -186,97 +188,47 @@ bool Path::isRoot() const {
 }
 
 /**
- * Handle failure of a path syscall. This is to distinguish between
- * errors representing non-existence of a pathname from those
- * representing some actual system error.
- * @return false if errno is due to pathname non-existence.
- * @throws system_error if errno has any other error code.
+ * @return the stat information for the path, from the current StatCache if
+ * there is one, or otherwise directly (relative to a cached handle on the
+ * parent directory).
  */
-static bool handlePathError(int err) {
-    switch(err) {
-    /* Note: EACCES is debatable, but from the point of view of
-     * the user of this function, we may as well treat it as !exists().
-     */
-    case EACCES:
-    case ELOOP:
-    case ENAMETOOLONG:
-    case ENOENT:
-    case ENOTDIR:
-        return false;
-    default:
-        /* Otherwise we have an unexpected IO error, so go ahead
-         * and throw it.
-         */
-        throw std::system_error(errno, std::system_category());
+static StatInfo getStatInfo(const Path &path) {
+    if( StatCache *cache = StatCache::getCurrent() ) {
+        return cache->get(path);
     }
+    return DirCache::get().stat(PathRef(path));
 }
 
 bool Path::exists( ) const {
-    int status = ::access(name.c_str(), F_OK);
-    if( status == -1 ) {
-        return handlePathError(errno);
-    } else {
-        return true;
-    }
+    return getStatInfo(*this).exists();
 }
 
 bool Path::isFile() const {
-    struct stat st;
-    int status = ::stat(name.c_str(), &st);
-    if( status == -1 ) {
-        return handlePathError(errno);
-    } else {
-        return (st.st_mode & S_IFREG) != 0;
-    }
+    return getStatInfo(*this).isFile();
 }
 
 bool Path::isDirectory() const {
-    struct stat st;
-    int status = ::stat(name.c_str(), &st);
-    if( status == -1 ) {
-        return handlePathError(errno);
-    } else {
-        return (st.st_mode & S_IFDIR) != 0;
-    }
+    return getStatInfo(*this).isDirectory();
+}
+
+int64_t Path::getModifiedTime() const {
+    StatInfo info = getStatInfo(*this);
+    return info.exists() ? info.mtime : -1;
 }
 
+/* Note: these build a new path rather than temporarily extending this one,
+ * so that a const Path can be safely shared between threads.
+ */
 bool Path::exists(std::string_view pathname) const {
-    size_t idx = name.size();
-    try {
-        appendNormalisedPath(name, pathname);
-        bool result = exists();
-        name.erase(idx);
-        return result;
-    } catch (...) {
-        name.erase(idx);
-        std::rethrow_exception(std::current_exception());
-    }
+    return (*this + pathname).exists();
 }
 
 bool Path::isFile(std::string_view pathname) const {
-    size_t idx = name.size();
-    try {
-        appendNormalisedPath(name, pathname);
-        bool result = isFile();
-        name.erase(idx);
-        return result;
-    } catch (...) {
-        name.erase(idx);
-        std::rethrow_exception(std::current_exception());
-    }
+    return (*this + pathname).isFile();
 }
 
 bool Path::isDirectory(std::string_view pathname) const {
-    size_t idx = name.size();
-    try {
-        appendNormalisedPath(name, pathname);
-        bool result = isDirectory();
-        name.erase(idx);
-        return result;
-    } catch (...) {
-        name.erase(idx);
-        std::rethrow_exception(std::current_exception());
-    }
+    return (*this + pathname).isDirectory();
 }
 
 
@@ -18,6 +18,8 @@
 #ifndef FABR_SUPPORT_PATH_H
 #define FABR_SUPPORT_PATH_H
 
+#include <stdint.h>
+
 #include <string>
 
 namespace fabr {
@@ -27,16 +29,18 @@ namespace fabr {
  * Note these only deal with the 'real' filesystem, and are expected
  * to be in host-native form.
  *
- * Not thread safe.
+ * Not thread safe (except that const Paths may be shared). For paths held
+ * in bulk, or shared between threads, see PathRef.
+ *
+ * The filesystem enquiry functions are answered from the current StatCache,
+ * if one is installed.
  */
 class Path {
 private:
     /**
-     * The underlying pathname string. Note this is mutable as some operations
-     * may temporarily modify the string before restoring its original state
-     * for performance reasons.
+     * The underlying pathname string.
      */
-    mutable std::string name;
+    std::string name;
 
 public:
     Path() { }
@@ -156,6 +160,12 @@ public:
      */
     bool isDirectory(std::string_view filename) const;
 
+    /**
+     * @return the modification time of the path in nanoseconds since the
+     * epoch, or -1 if the path does not exist.
+     */
+    int64_t getModifiedTime() const;
+
     /**
      * Character used to separate components in pathnames.
      */
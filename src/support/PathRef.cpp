@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/PathRef.h"
+#include "support/Path.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
+namespace fabr {
+
+/* Number of independently locked node tables */
+#define PATH_SHARDS 16
+
+namespace {
+
+struct NodeKey {
+    const PathNode *parent;
+    SymbolRef name;
+
+    bool operator==( const NodeKey &k ) const {
+        return parent == k.parent && name == k.name;
+    }
+};
+
+size_t hashNode( const PathNode *parent, SymbolRef name ) {
+    uint64_t h = (parent == nullptr ? 0 : parent->hash) * 0x9E3779B97F4A7C15ull;
+    h ^= std::hash<SymbolRef>()(name) + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+    return (size_t)(h ^ (h >> 31));
+}
+
+struct NodeKeyHash {
+    size_t operator()( const NodeKey &k ) const {
+        return hashNode(k.parent, k.name);
+    }
+};
+
+/**
+ * One shard of the node table. Nodes are never freed, and a deque never
+ * moves its elements, so node pointers remain valid forever.
+ */
+struct NodePool {
+    std::mutex lock;
+    std::unordered_map<NodeKey, const PathNode *, NodeKeyHash> nodes;
+    std::deque<PathNode> storage;
+};
+
+NodePool pools[PATH_SHARDS];
+
+const PathNode rootNode = { nullptr, SymbolRef(), 0, 1, 0x2F, true };
+
+bool isSeparator( char c ) {
+    return c == '/' || c == Path::Separator;
+}
+
+}
+
+PathRef::PathRef( const Path &path ) : node(append(nullptr, path.str())) {
+}
+
+PathRef PathRef::root() {
+    return PathRef(&rootNode);
+}
+
+const PathNode *PathRef::getChild( const PathNode *parent, SymbolRef name ) {
+    size_t hash = hashNode(parent, name);
+    NodePool &pool = pools[(hash >> 8) % PATH_SHARDS];
+
+    std::lock_guard<std::mutex> guard(pool.lock);
+    auto it = pool.nodes.find(NodeKey{parent, name});
+    if( it != pool.nodes.end() ) {
+        return it->second;
+    }
+    uint32_t length = name.length();
+    if( parent != nullptr ) {
+        length += parent->length + (parent->depth == 0 ? 0 : 1);
+    }
+    pool.storage.push_back(PathNode{parent, name, parent == nullptr ? 1 : parent->depth + 1,
+            length, hash, parent != nullptr && parent->absolute});
+    const PathNode *node = &pool.storage.back();
+    pool.nodes.emplace(NodeKey{parent, name}, node);
+    return node;
+}
+
+const PathNode *PathRef::append( const PathNode *parent, std::string_view path ) {
+    size_t i = 0;
+    if( !path.empty() && isSeparator(path[0]) ) {
+        parent = &rootNode;
+    }
+    while( i < path.size() ) {
+        while( i < path.size() && isSeparator(path[i]) ) {
+            i++;
+        }
+        size_t start = i;
+        while( i < path.size() && !isSeparator(path[i]) ) {
+            i++;
+        }
+        std::string_view component = path.substr(start, i - start);
+        if( !component.empty() && component != "." ) {
+            parent = getChild(parent, SymbolRef::get(component));
+        }
+    }
+    return parent;
+}
+
+PathRef PathRef::child( SymbolRef name ) const {
+    return PathRef(getChild(node, name));
+}
+
+bool PathRef::contains( PathRef path ) const {
+    if( path.getDepth() < getDepth() || path.isAbsolute() != isAbsolute() ) {
+        return false;
+    }
+    const PathNode *p = path.node;
+    for( unsigned i = path.getDepth(); i > getDepth(); i-- ) {
+        p = p->parent;
+    }
+    return p == node;
+}
+
+std::string PathRef::str() const {
+    std::string result;
+    appendTo(result);
+    return result;
+}
+
+void PathRef::appendTo( std::string &out ) const {
+    if( node == nullptr ) {
+        return;
+    }
+    size_t start = out.size();
+    out.resize(start + node->length);
+    char *p = &out[start] + node->length;
+    for( const PathNode *n = node; n != nullptr; n = n->parent ) {
+        if( n->depth == 0 ) {
+            *--p = Path::Separator;
+        } else {
+            p -= n->name.length();
+            memcpy(p, n->name.data(), n->name.length());
+            if( n->parent != nullptr && n->parent->depth != 0 ) {
+                *--p = Path::Separator;
+            }
+        }
+    }
+}
+
+Path PathRef::toPath() const {
+    return Path(str());
+}
+
+}
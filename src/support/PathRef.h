@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_PATHREF_H
+#define FABR_SUPPORT_PATHREF_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <string_view>
+
+#include "model/Symbol.h"
+
+namespace fabr {
+
+class Path;
+
+/**
+ * Interned node in the path tree. Like Symbol this is just a data
+ * container; everything goes through PathRef.
+ */
+struct PathNode {
+    /** Parent directory, or nullptr for a top-level component */
+    const PathNode *parent;
+    /** Final component (empty for the root directory) */
+    SymbolRef name;
+    /** Number of components below the root */
+    uint32_t depth;
+    /** Length of the path in string form */
+    uint32_t length;
+    size_t hash;
+    bool absolute;
+};
+
+/**
+ * Immutable, interned pathname. Each path is a node holding its parent and
+ * final component, so there is exactly one node per distinct path and
+ * paths sharing a prefix share its nodes.
+ *
+ * Equality, hashing, parent() and basename() are all O(1), and PathRefs
+ * can be shared freely between threads. The string form is only built when
+ * needed (i.e. for a syscall).
+ *
+ * Paths are normalised on construction: separators are collapsed and "."
+ * components dropped. ".." components are kept, as they can't be resolved
+ * correctly without looking at the filesystem.
+ */
+class PathRef {
+private:
+    const PathNode *node;
+
+    PathRef( const PathNode *node ) : node(node) { }
+
+    static const PathNode *getChild( const PathNode *parent, SymbolRef name );
+    static const PathNode *append( const PathNode *parent, std::string_view path );
+
+public:
+    /**
+     * Construct the empty (relative) path.
+     */
+    PathRef() : node(nullptr) { }
+    explicit PathRef( std::string_view pathname ) : node(append(nullptr, pathname)) { }
+    explicit PathRef( const Path &path );
+
+    /**
+     * @return the root directory "/".
+     */
+    static PathRef root();
+
+    /**
+     * @return the parent directory. The parent of a top-level relative
+     * path is the empty path, and the root is its own parent.
+     */
+    PathRef parent() const {
+        return isEmpty() || isRoot() ? *this : PathRef(node->parent);
+    }
+
+    /**
+     * @return the final component of the path, or the null symbol for the
+     * empty path and the root.
+     */
+    SymbolRef basename() const {
+        return node == nullptr ? SymbolRef() : node->name;
+    }
+
+    /**
+     * @return the path with the given (possibly multi-component) relative
+     * path appended.
+     */
+    PathRef operator +( std::string_view path ) const {
+        return PathRef(append(node, path));
+    }
+    PathRef child( SymbolRef name ) const;
+
+    bool isEmpty() const {
+        return node == nullptr;
+    }
+    bool isAbsolute() const {
+        return node != nullptr && node->absolute;
+    }
+    bool isRoot() const {
+        return node != nullptr && node->absolute && node->depth == 0;
+    }
+    bool hasComponents() const {
+        return node != nullptr && node->depth != 0;
+    }
+    /**
+     * @return the number of components (excluding the root).
+     */
+    unsigned getDepth() const {
+        return node == nullptr ? 0 : node->depth;
+    }
+
+    /**
+     * @return true if this path is the same as or a (lexical) ancestor of
+     * the given path.
+     */
+    bool contains( PathRef path ) const;
+
+    /**
+     * @return the path in string form.
+     */
+    std::string str() const;
+    /**
+     * Append the string form of the path to the given string.
+     */
+    void appendTo( std::string &out ) const;
+    Path toPath() const;
+
+    bool operator ==( const PathRef &p ) const {
+        return node == p.node;
+    }
+    bool operator !=( const PathRef &p ) const {
+        return node != p.node;
+    }
+    /* Note: ordering is by identity, not lexical */
+    bool operator <( const PathRef &p ) const {
+        return node < p.node;
+    }
+
+    size_t hash() const {
+        return node == nullptr ? 0 : node->hash;
+    }
+};
+
+}
+
+namespace std {
+template<>
+struct hash<fabr::PathRef> {
+    size_t operator()( const fabr::PathRef &path ) const {
+        return path.hash();
+    }
+};
+}
+
+#endif /* !FABR_SUPPORT_PATHREF_H */
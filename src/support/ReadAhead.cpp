@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/ReadAhead.h"
+
+#include <errno.h>
+#include <system_error>
+
+/* Amount of each file to request up-front. Most BUILD files and depfiles
+ * are smaller than this; the rest will get normal kernel readahead once we
+ * start reading them.
+ */
+#define READAHEAD_SIZE (128*1024)
+
+namespace fabr {
+
+ReadAhead::ReadAhead( std::vector<Path> paths, size_t window ) :
+        paths(std::move(paths)), window(window == 0 ? 1 : window) {
+    fill();
+}
+
+void ReadAhead::fill() {
+    while( pending.size() < window && nextOpen < paths.size() ) {
+        Pending next{File(), 0};
+        try {
+            next.file = File::getForRead(paths[nextOpen].str());
+            next.file.readahead(0, READAHEAD_SIZE);
+        } catch( const std::system_error &e ) {
+            next.error = e.code().value();
+        }
+        pending.push_back(std::move(next));
+        nextOpen++;
+    }
+}
+
+std::unique_ptr<Buffer> ReadAhead::next( File::Access access ) {
+    Pending current = std::move(pending.front());
+    pending.pop_front();
+    fill();
+    if( current.error != 0 ) {
+        throw std::system_error(current.error, std::system_category());
+    }
+    return current.file.getBuffer(access);
+}
+
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_READAHEAD_H
+#define FABR_SUPPORT_READAHEAD_H
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "support/File.h"
+#include "support/Path.h"
+
+namespace fabr {
+
+class Buffer;
+
+/**
+ * Reads a list of files in order, keeping the next few open with reads
+ * already requested from the kernel, so that I/O for upcoming files
+ * overlaps with processing the current one. Intended for e.g. parsing many
+ * small BUILD or depfiles, where the cost is otherwise dominated by waiting
+ * on each read in turn.
+ */
+class ReadAhead {
+private:
+    struct Pending {
+        File file;
+        /** errno if the file couldn't be opened, otherwise 0 */
+        int error;
+    };
+
+    std::vector<Path> paths;
+    size_t window;
+    size_t nextOpen = 0;
+    std::deque<Pending> pending;
+
+    void fill();
+
+public:
+    static const size_t DEFAULT_WINDOW = 16;
+
+    ReadAhead( std::vector<Path> paths, size_t window = DEFAULT_WINDOW );
+    ReadAhead( const ReadAhead & ) = delete;
+
+    /**
+     * @return true if there are more files to read.
+     */
+    bool hasNext() const {
+        return !pending.empty();
+    }
+
+    /**
+     * @return the path of the file that next() will return.
+     */
+    const Path &peek() const {
+        return paths[nextOpen - pending.size()];
+    }
+
+    /**
+     * @return the contents of the next file, and advance to the one after.
+     * @throws system_error if the file can't be opened or read (the reader
+     * still advances, so the caller may carry on).
+     */
+    std::unique_ptr<Buffer> next( File::Access access = File::SEQUENTIAL );
+};
+
+}
+
+#endif /* !FABR_SUPPORT_READAHEAD_H */
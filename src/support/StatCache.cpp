@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/DirCache.h"
+#include "support/Metrics.h"
+#include "support/Path.h"
+#include "support/StatCache.h"
+#include "support/ThreadPool.h"
+
+namespace fabr {
+
+StatCache *StatCache::current = nullptr;
+
+void StatCache::insert( PathRef path, const StatInfo &info ) {
+    Shard &shard = getShard(path);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.entries[path] = info;
+}
+
+StatInfo StatCache::get( PathRef path ) {
+    Shard &shard = getShard(path);
+    {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        auto it = shard.entries.find(path);
+        if( it != shard.entries.end() ) {
+            Metrics::add(Metrics::STATCACHE_HITS);
+            return it->second;
+        }
+    }
+    Metrics::add(Metrics::STATCACHE_MISSES);
+    /* Note: don't hold the lock over the syscall. If two threads race on the
+     * same path they'll both stat it, which is harmless.
+     */
+    syscalls.fetch_add(1, std::memory_order_relaxed);
+    StatInfo info = DirCache::get().stat(path);
+    insert(path, info);
+    return info;
+}
+
+StatInfo StatCache::get( const Path &path ) {
+    return get(PathRef(path));
+}
+
+void StatCache::prefetch( const std::vector<PathRef> &paths ) {
+    prefetch(paths, ThreadPool::getDefault());
+}
+
+void StatCache::prefetch( const std::vector<PathRef> &paths, ThreadPool &pool ) {
+    /* Group the uncached paths by directory, so each worker can open the
+     * directory once and stat everything in it relative to that.
+     */
+    std::unordered_map<PathRef, std::vector<PathRef>> dirs;
+    for( auto &path : paths ) {
+        Shard &shard = getShard(path);
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if( shard.entries.find(path) == shard.entries.end() ) {
+            dirs[path.parent()].push_back(path);
+            Metrics::add(Metrics::STATCACHE_MISSES);
+        } else {
+            Metrics::add(Metrics::STATCACHE_HITS);
+        }
+    }
+
+    std::vector<decltype(dirs)::iterator> groups;
+    for( auto it = dirs.begin(); it != dirs.end(); ++it ) {
+        groups.push_back(it);
+    }
+
+    pool.forEach(groups.size(), [&]( size_t i ) {
+        PathRef dir = groups[i]->first;
+        std::vector<PathRef> &names = groups[i]->second;
+
+        std::shared_ptr<DirCache::Handle> handle = DirCache::get().getDirectory(dir);
+        for( auto &path : names ) {
+            syscalls.fetch_add(1, std::memory_order_relaxed);
+            if( handle != nullptr && path.hasComponents() ) {
+                insert(path, DirCache::statAt(handle->getFd(), path.basename().data()));
+            } else {
+                /* Couldn't open the directory (or it's the root or cwd), so
+                 * take the slow path to get the right error handling.
+                 */
+                insert(path, DirCache::get().stat(path));
+            }
+        }
+    });
+}
+
+void StatCache::invalidate( PathRef path ) {
+    Shard &shard = getShard(path);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.entries.erase(path);
+}
+
+void StatCache::clear() {
+    for( auto &shard : shards ) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.entries.clear();
+    }
+}
+
+size_t StatCache::size() {
+    size_t total = 0;
+    for( auto &shard : shards ) {
+        std::lock_guard<std::mutex> guard(shard.lock);
+        total += shard.entries.size();
+    }
+    return total;
+}
+
+}
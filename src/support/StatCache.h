@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_STATCACHE_H
+#define FABR_SUPPORT_STATCACHE_H
+
+#include <sys/stat.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "support/PathRef.h"
+
+namespace fabr {
+
+class Path;
+class ThreadPool;
+
+/**
+ * The subset of stat information that the build cares about.
+ */
+struct StatInfo {
+    /** File type and permissions, or 0 if the path does not exist */
+    uint32_t mode = 0;
+    uint64_t size = 0;
+    /** Modification and status change times, in nanoseconds since the epoch */
+    int64_t mtime = 0;
+    int64_t ctime = 0;
+    uint64_t ino = 0;
+    uint64_t dev = 0;
+
+    bool exists() const {
+        return mode != 0;
+    }
+    bool isFile() const {
+        return S_ISREG(mode);
+    }
+    bool isDirectory() const {
+        return S_ISDIR(mode);
+    }
+};
+
+/**
+ * Per-build cache of stat results, keyed by interned path. The
+ * cache assumes the filesystem doesn't change underneath it for the duration
+ * of a build, except via paths that the build itself explicitly invalidates.
+ *
+ * Lookups are thread-safe. Where the set of paths of interest is known in
+ * advance, prefetch() fills the cache in bulk from a thread pool, statting
+ * relative to an open handle on each directory to avoid repeated path walks.
+ *
+ * While a cache is installed as current (see Scope), the Path enquiry
+ * functions are answered from it.
+ */
+class StatCache {
+private:
+    static const int SHARDS = 16;
+
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<PathRef, StatInfo> entries;
+    };
+    Shard shards[SHARDS];
+    std::atomic<size_t> syscalls;
+
+    Shard &getShard( PathRef path ) {
+        return shards[(path.hash() >> 4) % SHARDS];
+    }
+    void insert( PathRef path, const StatInfo &info );
+
+    static StatCache *current;
+
+public:
+    StatCache() : syscalls(0) { }
+    StatCache( const StatCache & ) = delete;
+
+    /**
+     * @return the stat information for the given path (following
+     * symlinks), from the cache if possible.
+     * @throws system_error if the stat fails for any reason other than the
+     * path not existing.
+     */
+    StatInfo get( PathRef path );
+    StatInfo get( const Path &path );
+
+    /**
+     * Stat all of the given paths that aren't already cached, in parallel.
+     */
+    void prefetch( const std::vector<PathRef> &paths );
+    void prefetch( const std::vector<PathRef> &paths, ThreadPool &pool );
+
+    /**
+     * Drop the cached entry for the path, e.g. after the build writes to it.
+     */
+    void invalidate( PathRef path );
+
+    void clear();
+
+    /**
+     * @return the number of paths currently cached.
+     */
+    size_t size();
+
+    /**
+     * @return the number of stat syscalls issued by the cache.
+     */
+    size_t getSyscallCount() const {
+        return syscalls.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @return the currently installed cache, or nullptr if none.
+     */
+    static StatCache *getCurrent() {
+        return current;
+    }
+
+    /**
+     * Installs a cache as current for the lifetime of the Scope. This should
+     * be done before any worker threads are started.
+     */
+    class Scope {
+    private:
+        StatCache *previous;
+    public:
+        Scope( StatCache &cache ) : previous(current) {
+            current = &cache;
+        }
+        ~Scope() {
+            current = previous;
+        }
+    };
+};
+
+}
+
+#endif /* !FABR_SUPPORT_STATCACHE_H */
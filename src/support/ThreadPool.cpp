@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "model/Symbol.h"
+#include "support/ThreadPool.h"
+#include "support/Trace.h"
+
+#include <string>
+
+namespace fabr {
+
+/**
+ * Set while the current thread is running a loop body, so that a nested
+ * forEach() runs inline rather than deadlocking.
+ */
+static thread_local bool inLoop = false;
+
+ThreadPool::ThreadPool( unsigned size ) : nextIndex(0) {
+    if( size == 0 ) {
+        unsigned hw = std::thread::hardware_concurrency();
+        size = hw > 1 ? hw - 1 : 0;
+    }
+    for( unsigned i=0; i<size; i++ ) {
+        threads.emplace_back(&ThreadPool::worker, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for( auto &thread : threads ) {
+        thread.join();
+    }
+}
+
+void ThreadPool::runTasks() {
+    size_t i;
+    while( (i = nextIndex.fetch_add(1, std::memory_order_relaxed)) < count ) {
+        try {
+            (*task)(i);
+        } catch(...) {
+            std::lock_guard<std::mutex> guard(lock);
+            if( !error ) {
+                error = std::current_exception();
+            }
+        }
+    }
+}
+
+void ThreadPool::worker( unsigned index ) {
+    inLoop = true;
+    Trace::setThreadName(SymbolRef::get("worker " + std::to_string(index + 1)).data());
+    unsigned seen = 0;
+    while( true ) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&]{ return stopping || generation != seen; });
+            if( stopping ) {
+                return;
+            }
+            seen = generation;
+        }
+        runTasks();
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if( --active == 0 ) {
+                done.notify_one();
+            }
+        }
+    }
+}
+
+void ThreadPool::forEach( size_t n, const std::function<void(size_t)> &fn ) {
+    if( threads.empty() || n <= 1 || inLoop ) {
+        for( size_t i=0; i<n; i++ ) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::lock_guard<std::mutex> run(runLock);
+    inLoop = true;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        task = &fn;
+        count = n;
+        nextIndex.store(0, std::memory_order_relaxed);
+        active = threads.size();
+        error = nullptr;
+        generation++;
+    }
+    wake.notify_all();
+    runTasks();
+
+    std::exception_ptr result;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]{ return active == 0; });
+        task = nullptr;
+        std::swap(result, error);
+    }
+    inLoop = false;
+    if( result ) {
+        std::rethrow_exception(result);
+    }
+}
+
+ThreadPool &ThreadPool::getDefault() {
+    static ThreadPool pool;
+    return pool;
+}
+
+}
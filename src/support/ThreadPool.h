@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_THREADPOOL_H
+#define FABR_SUPPORT_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fabr {
+
+/**
+ * Simple fixed-size pool of worker threads for data-parallel loops.
+ *
+ * Only one loop runs on the pool at a time; concurrent callers are
+ * serialized. A forEach() from within a loop body (on any pool) just runs
+ * inline on the calling thread.
+ */
+class ThreadPool {
+private:
+    std::vector<std::thread> threads;
+
+    std::mutex runLock;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    const std::function<void(size_t)> *task = nullptr;
+    size_t count = 0;
+    std::atomic<size_t> nextIndex;
+    size_t active = 0;
+    unsigned generation = 0;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    void worker( unsigned index );
+    void runTasks();
+
+public:
+    /**
+     * Create a pool with the given number of worker threads. If 0, uses one
+     * less than the number of hardware threads (the caller of forEach
+     * makes up the difference).
+     */
+    explicit ThreadPool( unsigned size = 0 );
+    ~ThreadPool();
+    ThreadPool( const ThreadPool & ) = delete;
+
+    /**
+     * @return the maximum number of loop iterations that can run
+     * concurrently (including the calling thread).
+     */
+    unsigned getConcurrency() const {
+        return threads.size() + 1;
+    }
+
+    /**
+     * Call fn(i) for every i in [0,count), spread across the pool and the
+     * calling thread, returning once all have completed. If any call throws,
+     * the first exception is rethrown here (after the loop has finished).
+     */
+    void forEach( size_t count, const std::function<void(size_t)> &fn );
+
+    /**
+     * @return the shared process-wide pool.
+     */
+    static ThreadPool &getDefault();
+};
+
+}
+
+#endif /* !FABR_SUPPORT_THREADPOOL_H */
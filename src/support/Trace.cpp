@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "support/Buffer.h"
+#include "support/Json.h"
+#include "support/OutputFile.h"
+#include "support/Path.h"
+#include "support/Trace.h"
+
+#include <unistd.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/* Number of events in each block of a thread's trace buffer */
+#define TRACE_CHUNK_SIZE 4096
+
+namespace fabr {
+
+namespace {
+
+struct TraceEvent {
+    const char *name;
+    const char *category;
+    const char *detail;
+    int64_t start;
+    /** Duration for a span, or the value of a counter */
+    int64_t value;
+    char phase;
+};
+
+struct TraceChunk {
+    TraceEvent events[TRACE_CHUNK_SIZE];
+    /** Number of valid events, published by the owning thread */
+    std::atomic<size_t> count{0};
+    std::atomic<TraceChunk *> next{nullptr};
+};
+
+/**
+ * One thread's events. Only the owning thread appends (or resets) the
+ * buffer; write() reads up to each chunk's published count, so never sees
+ * a partially written event. Chunks are only allocated once the thread
+ * records something, as many threads (e.g. the pool workers) are named but
+ * never record.
+ */
+struct TraceBuffer {
+    unsigned tid;
+    std::atomic<const char *> threadName{nullptr};
+    /** Trace generation the events belong to */
+    unsigned epoch = 0;
+    std::atomic<TraceChunk *> head{nullptr};
+    TraceChunk *tail = nullptr;
+
+    /**
+     * Discard the events, keeping the first chunk for reuse.
+     */
+    void reset( unsigned newEpoch ) {
+        TraceChunk *first = head.load(std::memory_order_relaxed);
+        if( first != nullptr ) {
+            TraceChunk *chunk = first->next.load(std::memory_order_relaxed);
+            while( chunk != nullptr ) {
+                TraceChunk *next = chunk->next.load(std::memory_order_relaxed);
+                delete chunk;
+                chunk = next;
+            }
+            first->next.store(nullptr, std::memory_order_relaxed);
+            first->count.store(0, std::memory_order_release);
+        }
+        tail = first;
+        epoch = newEpoch;
+    }
+};
+
+std::mutex registryLock;
+std::vector<TraceBuffer *> registry;
+std::atomic<unsigned> currentEpoch(0);
+int64_t startTime = 0;
+
+thread_local TraceBuffer *localBuffer = nullptr;
+
+TraceBuffer *getLocalBuffer() {
+    if( localBuffer == nullptr ) {
+        /* Buffers are never freed, so that a thread's events outlive it */
+        TraceBuffer *buffer = new TraceBuffer();
+        std::lock_guard<std::mutex> guard(registryLock);
+        buffer->tid = registry.size() + 1;
+        registry.push_back(buffer);
+        localBuffer = buffer;
+    }
+    return localBuffer;
+}
+
+void record( const TraceEvent &event ) {
+    TraceBuffer *buffer = getLocalBuffer();
+    unsigned epoch = currentEpoch.load(std::memory_order_acquire);
+    if( buffer->epoch != epoch ) {
+        buffer->reset(epoch);
+    }
+    TraceChunk *chunk = buffer->tail;
+    if( chunk == nullptr ) {
+        chunk = buffer->tail = new TraceChunk();
+        buffer->head.store(chunk, std::memory_order_release);
+    }
+    size_t count = chunk->count.load(std::memory_order_relaxed);
+    if( count == TRACE_CHUNK_SIZE ) {
+        TraceChunk *next = new TraceChunk();
+        chunk->next.store(next, std::memory_order_release);
+        buffer->tail = chunk = next;
+        count = 0;
+    }
+    chunk->events[count] = event;
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+/**
+ * Append a time in microseconds (the trace-event unit) from nanoseconds.
+ */
+void appendTime( std::string &out, int64_t ns ) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld.%03lld", (long long)(ns / 1000), (long long)(ns % 1000));
+    out += buf;
+}
+
+}
+
+std::atomic<bool> Trace::enabled(false);
+
+void Trace::start() {
+    startTime = now();
+    currentEpoch.fetch_add(1, std::memory_order_release);
+    enabled.store(true, std::memory_order_relaxed);
+}
+
+void Trace::stop() {
+    enabled.store(false, std::memory_order_relaxed);
+}
+
+int64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Trace::complete( const char *name, const char *category, int64_t start, int64_t end,
+                      const char *detail ) {
+    if( isEnabled() ) {
+        record(TraceEvent{name, category, detail, start, end - start, 'X'});
+    }
+}
+
+void Trace::counter( const char *name, int64_t value ) {
+    if( isEnabled() ) {
+        record(TraceEvent{name, nullptr, nullptr, now(), value, 'C'});
+    }
+}
+
+void Trace::setThreadName( const char *name ) {
+    getLocalBuffer()->threadName.store(name, std::memory_order_relaxed);
+}
+
+void Trace::write( const Path &file ) {
+    std::vector<TraceBuffer *> buffers;
+    {
+        std::lock_guard<std::mutex> guard(registryLock);
+        buffers = registry;
+    }
+    unsigned epoch = currentEpoch.load(std::memory_order_acquire);
+    std::string pid = std::to_string(::getpid());
+
+    OutputFile out(file);
+    std::string text = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    auto separator = [&]() {
+        if( !first ) {
+            text += ",\n";
+        }
+        first = false;
+    };
+    for( TraceBuffer *buffer : buffers ) {
+        if( const char *name = buffer->threadName.load(std::memory_order_relaxed) ) {
+            separator();
+            text += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" + pid +
+                    ",\"tid\":" + std::to_string(buffer->tid) + ",\"args\":{\"name\":";
+            appendJsonString(text, name);
+            text += "}}";
+        }
+        if( buffer->epoch != epoch ) {
+            continue;
+        }
+        for( TraceChunk *chunk = buffer->head.load(std::memory_order_acquire); chunk != nullptr;
+                chunk = chunk->next.load(std::memory_order_acquire) ) {
+            size_t count = chunk->count.load(std::memory_order_acquire);
+            for( size_t i = 0; i < count; i++ ) {
+                const TraceEvent &event = chunk->events[i];
+                separator();
+                text += "{\"ph\":\"";
+                text += event.phase;
+                text += "\",\"name\":";
+                appendJsonString(text, event.name);
+                if( event.category != nullptr ) {
+                    text += ",\"cat\":";
+                    appendJsonString(text, event.category);
+                }
+                text += ",\"pid\":" + pid + ",\"tid\":" + std::to_string(buffer->tid) + ",\"ts\":";
+                appendTime(text, event.start - startTime);
+                if( event.phase == 'X' ) {
+                    text += ",\"dur\":";
+                    appendTime(text, event.value);
+                    if( event.detail != nullptr ) {
+                        text += ",\"args\":{\"detail\":";
+                        appendJsonString(text, event.detail);
+                        text += "}";
+                    }
+                } else {
+                    text += ",\"args\":{\"value\":" + std::to_string(event.value) + "}";
+                }
+                text += "}";
+            }
+            if( text.size() >= 65536 ) {
+                out.write(text.data(), text.size());
+                text.clear();
+            }
+        }
+    }
+    text += "\n]}\n";
+    out.write(text.data(), text.size());
+    out.commit();
+}
+
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2020 Nathan Keynes
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FABR_SUPPORT_TRACE_H
+#define FABR_SUPPORT_TRACE_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+namespace fabr {
+
+class Path;
+
+/**
+ * Records a timeline of what the build was doing, for output as a
+ * Chrome/Perfetto trace-event JSON file (--profile).
+ *
+ * Each thread records into its own buffer without taking any locks, and
+ * appears as its own track in the trace. When tracing isn't enabled, the
+ * cost of a Span is a single relaxed load.
+ *
+ * All names, categories and details are stored by pointer, so must be
+ * either string literals or interned (SymbolRef::data()).
+ */
+class Trace {
+private:
+    static std::atomic<bool> enabled;
+
+public:
+    /**
+     * @return true if events are currently being recorded.
+     */
+    static bool isEnabled() {
+        return enabled.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Discard any previously recorded events and start recording.
+     */
+    static void start();
+
+    /**
+     * Stop recording. Events already recorded are kept until the next
+     * start().
+     */
+    static void stop();
+
+    /**
+     * Write the recorded events to the given file. This should only be
+     * called when no other thread is recording.
+     * @throw std::system_error if the file can't be written.
+     */
+    static void write( const Path &file );
+
+    /**
+     * @return the current time in nanoseconds on the trace clock.
+     */
+    static int64_t now();
+
+    /**
+     * Record a span of time on the calling thread's track.
+     * @param detail optional extra description, shown in the span's
+     * arguments (e.g. the file or command involved).
+     */
+    static void complete( const char *name, const char *category, int64_t start, int64_t end,
+                          const char *detail = nullptr );
+
+    /**
+     * Record the current value of a counter, which is shown as its own
+     * track.
+     */
+    static void counter( const char *name, int64_t value );
+
+    /**
+     * Set the name of the calling thread's track.
+     */
+    static void setThreadName( const char *name );
+
+    /**
+     * Records the lifetime of the Span as a span on the current thread's
+     * track, if tracing is enabled when the Span is created.
+     */
+    class Span {
+    private:
+        const char *name;
+        const char *category;
+        const char *detail;
+        int64_t start;
+
+    public:
+        Span( const char *name, const char *category, const char *detail = nullptr ) :
+            name(name), category(category), detail(detail), start(isEnabled() ? now() : -1) { }
+        ~Span() {
+            if( start != -1 ) {
+                complete(name, category, start, now(), detail);
+            }
+        }
+        Span( const Span & ) = delete;
+        Span &operator=( const Span & ) = delete;
+    };
+};
+
+}
+
+#endif /* !FABR_SUPPORT_TRACE_H */